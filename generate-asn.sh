@@ -0,0 +1,704 @@
+#!/usr/bin/env bash
+
+# Generates the packet codecs from the protocol description:
+#   include/asn_codec.h   packet types, one struct per described packet and the packet table
+#   src/asn_codec.c       a straight-line encoder and decoder for each described packet
+# Both are checked in, so only a change to protocol.def needs this run again.
+
+# Exit the script if any command fails
+set -e
+
+input_file="protocol.def"
+header_file="include/asn_codec.h"
+source_file="src/asn_codec.c"
+banner="/* Generated by generate-asn.sh from protocol.def: edit that file and rerun the script. */"
+
+awk -v header="$header_file" -v source="$source_file" -v banner="$banner" '
+function trim(s)
+{
+    sub(/^[ \t]+/, "", s)
+    sub(/[ \t]+$/, "", s)
+    return s
+}
+
+function fail(msg)
+{
+    printf("%s:%d: %s\n", FILENAME, FNR, msg) > "/dev/stderr"
+    failed = 1
+    exit 1
+}
+
+function pad(s, width)
+{
+    while(length(s) < width)
+    {
+        s = s " "
+    }
+    return s
+}
+
+function ctype(kind)
+{
+    if(kind == "int16")
+    {
+        return "uint16_t"
+    }
+    if(kind == "int32")
+    {
+        return "uint32_t"
+    }
+    if(kind == "str" || kind == "time")
+    {
+        return "asn_str"
+    }
+    return "uint8_t"
+}
+
+function lower(s)
+{
+    return tolower(s)
+}
+
+function described(p)
+{
+    return !praw[p] && nf[p] > 0
+}
+
+function uses(p, kind, k)
+{
+    for(k = 1; k <= nf[p]; k++)
+    {
+        if(fkind[p, k] == kind)
+        {
+            return 1
+        }
+    }
+    return 0
+}
+
+# Where field k of packet p lives in the message struct
+function path(p, k, idx)
+{
+    if(prep[p] && k >= prep[p])
+    {
+        return "msg->" prepname[p] "[" idx "]." fname[p, k]
+    }
+    return "msg->" fname[p, k]
+}
+
+function emit_enum(i, w, line, text, run_start, j, longest)
+{
+    print "enum Packet_Type" > header
+    print "{" > header
+    w = 0
+    for(i = 1; i <= np; i++)
+    {
+        if(length(pname[i]) > w)
+        {
+            w = length(pname[i])
+        }
+    }
+    for(i = 1; i <= np; i++)
+    {
+        text[i] = "    " pad(pname[i], w) " = " pid[i] (i < np ? "," : "")
+    }
+    # Trailing comments on consecutive lines line up, one space past the longest
+    i = 1
+    while(i <= np)
+    {
+        if(pcomment[i] == "")
+        {
+            print text[i] > header
+            i++
+            continue
+        }
+        run_start = i
+        longest   = 0
+        for(j = i; j <= np && pcomment[j] != ""; j++)
+        {
+            if(length(text[j]) > longest)
+            {
+                longest = length(text[j])
+            }
+        }
+        for(j = run_start; j <= np && pcomment[j] != ""; j++)
+        {
+            print pad(text[j], longest) " /* " pcomment[j] " */" > header
+        }
+        i = j
+    }
+    print "};" > header
+}
+
+function emit_struct(p, k, w, start, end_at, name)
+{
+    name = "asn_" lower(pname[p])
+    print "" > header
+    print "typedef struct " name > header
+    print "{" > header
+    end_at = prep[p] ? prep[p] - 1 : nf[p]
+    w      = 0
+    for(k = 1; k <= end_at; k++)
+    {
+        if(length(ctype(fkind[p, k])) > w)
+        {
+            w = length(ctype(fkind[p, k]))
+        }
+    }
+    if(popt[p] || prep[p])
+    {
+        w = (w < 3) ? 3 : w
+    }
+    for(k = 1; k <= end_at; k++)
+    {
+        if(popt[p] == k)
+        {
+            print "    " pad("int", w) " has_" fname[p, k] ";" > header
+        }
+        print "    " pad(ctype(fkind[p, k]), w) " " fname[p, k] ";" > header
+    }
+    if(prep[p])
+    {
+        print "    " pad("int", w) " " prepname[p] "_count;" > header
+        print "    struct" > header
+        print "    {" > header
+        w = 0
+        for(k = prep[p]; k <= nf[p]; k++)
+        {
+            if(length(ctype(fkind[p, k])) > w)
+            {
+                w = length(ctype(fkind[p, k]))
+            }
+        }
+        for(k = prep[p]; k <= nf[p]; k++)
+        {
+            print "        " pad(ctype(fkind[p, k]), w) " " fname[p, k] ";" > header
+        }
+        print "    } " prepname[p] "[" prepmax[p] "];" > header
+    }
+    print "} " name ";" > header
+}
+
+function emit_header(p)
+{
+    print banner > header
+    print "" > header
+    print "#ifndef ASN_CODEC_H" > header
+    print "#define ASN_CODEC_H" > header
+    print "" > header
+    print "/* Included by asn.h, after the limits the message structs use */" > header
+    print "" > header
+    print "#include <stddef.h>" > header
+    print "#include <stdint.h>" > header
+    print "" > header
+    print "#define ASN_RAW (1)               /* from asn_decode_fields: the fields of this type are not described */" > header
+    print "#define ASN_ACCEPTED (1 << 0)     /* may be received from a client */" > header
+    print "#define ASN_BATCHABLE (1 << 1)    /* may share a BATCH frame */" > header
+    print "#define ASN_COMPRESSIBLE (1 << 2) /* replies of this type are worth compressing */" > header
+    print "" > header
+    emit_enum()
+    print "" > header
+    print "/* An ASN_STR or ASN_TIME field where it lies in a packet; not NUL-terminated */" > header
+    print "typedef struct asn_str" > header
+    print "{" > header
+    print "    const uint8_t *text;" > header
+    print "    size_t         len; /* at most UINT8_MAX, but wide so the encoders call memcpy rather than inline a slow rep movs */" > header
+    print "} asn_str;" > header
+    print "" > header
+    print "/* What check_header needs to know about a packet type */" > header
+    print "typedef struct asn_packet_info" > header
+    print "{" > header
+    print "    uint8_t  flags;" > header
+    print "    uint8_t  since; /* oldest version that may send it */" > header
+    print "    uint16_t max_payload;" > header
+    print "} asn_packet_info;" > header
+    for(p = 1; p <= np; p++)
+    {
+        if(described(p))
+        {
+            emit_struct(p)
+        }
+    }
+    print "" > header
+    print "extern const asn_packet_info asn_packets[UINT8_MAX + 1];" > header
+    print "" > header
+    print "int asn_decode_fields(uint8_t packet_type, const uint8_t buf[], int pos, int len);" > header
+    for(p = 1; p <= np; p++)
+    {
+        if(described(p))
+        {
+            print "int asn_encode_" lower(pname[p]) "(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_" lower(pname[p]) " *msg);" > header
+            print "int asn_decode_" lower(pname[p]) "(const uint8_t buf[], int pos, int len, asn_" lower(pname[p]) " *msg);" > header
+        }
+    }
+    print "" > header
+    print "#endif    // ASN_CODEC_H" > header
+}
+
+function emit_table(p, w, flags, since)
+{
+    print "" > source
+    print "const asn_packet_info asn_packets[UINT8_MAX + 1] = {" > source
+    w = 0
+    for(p = 1; p <= np; p++)
+    {
+        if(length(pname[p]) + 2 > w)
+        {
+            w = length(pname[p]) + 2
+        }
+    }
+    for(p = 1; p <= np; p++)
+    {
+        flags = ""
+        if(!preserved[p])
+        {
+            flags = "ASN_ACCEPTED"
+        }
+        if(pbatch[p])
+        {
+            flags = flags (flags == "" ? "" : " | ") "ASN_BATCHABLE"
+        }
+        if(pcompress[p])
+        {
+            flags = flags (flags == "" ? "" : " | ") "ASN_COMPRESSIBLE"
+        }
+        if(flags == "")
+        {
+            flags = "0"
+        }
+        since = (psince[p] == "") ? "0" : psince[p]
+        print "    " pad("[" pname[p] "]", w) " = {" flags ", " since ", " pmax[p] "}," > source
+    }
+    print "};" > source
+}
+
+function emit_encode_field(p, k, ind, v)
+{
+    v = path(p, k, "i")
+    if(fkind[p, k] == "enum" || fkind[p, k] == "int8")
+    {
+        print ind "buf[pos]     = " (fkind[p, k] == "enum" ? "ASN_ENUM" : "ASN_INT") ";" > source
+        print ind "buf[pos + 1] = 1;" > source
+        print ind "buf[pos + 2] = " v ";" > source
+        print ind "pos += U8ENCODELEN;" > source
+    }
+    else if(fkind[p, k] == "int16" || fkind[p, k] == "int32")
+    {
+        u = (fkind[p, k] == "int16") ? "u16" : "u32"
+        print ind u "          = " (u == "u16" ? "htons" : "htonl") "(" v ");" > source
+        print ind "buf[pos]     = ASN_INT;" > source
+        print ind "buf[pos + 1] = sizeof(" u ");" > source
+        print ind "memcpy(buf + pos + ASN_TL, &" u ", sizeof(" u "));" > source
+        print ind "pos += ASN_TL + (int)sizeof(" u ");" > source
+    }
+    else if(fkind[p, k] == "str")
+    {
+        if(fmax[p, k] == "255")
+        {
+            print ind "len          = " v ".len;" > source
+        }
+        else
+        {
+            print ind "len          = (size_t)((" v ".len < " fmax[p, k] ") ? " v ".len : " fmax[p, k] ");" > source
+        }
+        print ind "buf[pos]     = ASN_STR;" > source
+        print ind "buf[pos + 1] = (uint8_t)len;" > source
+        print ind "memcpy(buf + pos + ASN_TL, " v ".text, len);" > source
+        print ind "pos += ASN_TL + (int)len;" > source
+    }
+    else
+    {
+        print ind "buf[pos]     = ASN_TIME;" > source
+        print ind "buf[pos + 1] = TIMESTRLEN;" > source
+        print ind "memcpy(buf + pos + ASN_TL, " v ".text, TIMESTRLEN);" > source
+        print ind "pos += ASN_TL + TIMESTRLEN;" > source
+    }
+}
+
+function emit_decode_field(p, k, ind, v, tag, u)
+{
+    v = path(p, k, "i")
+    if(fkind[p, k] == "enum" || fkind[p, k] == "int8")
+    {
+        tag = (fkind[p, k] == "enum") ? "ASN_ENUM" : "ASN_INT"
+        print ind "if(end - pos < U8ENCODELEN || buf[pos] != " tag " || buf[pos + 1] != 1)" > source
+        print ind "{" > source
+        print ind "    return asn_field_error(buf, pos, end, " tag ", 1);" > source
+        print ind "}" > source
+        print ind v " = buf[pos + ASN_TL];" > source
+        print ind "pos += U8ENCODELEN;" > source
+    }
+    else if(fkind[p, k] == "int16" || fkind[p, k] == "int32")
+    {
+        u = (fkind[p, k] == "int16") ? "u16" : "u32"
+        print ind "if(end - pos < ASN_TL + (int)sizeof(" u ") || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(" u "))" > source
+        print ind "{" > source
+        print ind "    return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(" u "));" > source
+        print ind "}" > source
+        print ind "memcpy(&" u ", buf + pos + ASN_TL, sizeof(" u "));" > source
+        print ind v " = " (u == "u16" ? "ntohs" : "ntohl") "(" u ");" > source
+        print ind "pos += ASN_TL + (int)sizeof(" u ");" > source
+    }
+    else if(fkind[p, k] == "str")
+    {
+        print ind "if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0" (fmax[p, k] == "255" ? "" : " || buf[pos + 1] > " fmax[p, k]) " || end - pos - ASN_TL < buf[pos + 1])" > source
+        print ind "{" > source
+        print ind "    return asn_field_error(buf, pos, end, ASN_STR, " fmax[p, k] ");" > source
+        print ind "}" > source
+        print ind "if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)" > source
+        print ind "{" > source
+        print ind "    return INVALIDSTRING;" > source
+        print ind "}" > source
+        print ind v ".text = buf + pos + ASN_TL;" > source
+        print ind pad(v ".len", length(v) + 5) " = buf[pos + 1];" > source
+        print ind "pos += ASN_TL + buf[pos + 1];" > source
+    }
+    else
+    {
+        print ind "if(end - pos < ASN_TL + TIMESTRLEN || buf[pos] != ASN_TIME || buf[pos + 1] != TIMESTRLEN)" > source
+        print ind "{" > source
+        print ind "    return asn_field_error(buf, pos, end, ASN_TIME, TIMESTRLEN);" > source
+        print ind "}" > source
+        print ind v ".text = buf + pos + ASN_TL;" > source
+        print ind pad(v ".len", length(v) + 5) " = TIMESTRLEN;" > source
+        print ind "pos += ASN_TL + TIMESTRLEN;" > source
+    }
+}
+
+# Blank lines between fields, none after the last one of a block
+function emit_fields(p, from, to, ind, encode, k)
+{
+    for(k = from; k <= to; k++)
+    {
+        if(k > from)
+        {
+            print "" > source
+        }
+        if(encode)
+        {
+            emit_encode_field(p, k, ind)
+        }
+        else
+        {
+            emit_decode_field(p, k, ind)
+        }
+    }
+}
+
+function group_start(p)
+{
+    return popt[p] ? popt[p] : (prep[p] ? prep[p] : nf[p] + 1)
+}
+
+function emit_encoder(p, name, first)
+{
+    name  = lower(pname[p])
+    first = group_start(p)
+    print "" > source
+    print "int asn_encode_" name "(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_" name " *msg)" > source
+    print "{" > source
+    print "    header_t header = {" pname[p] ", version, sender_id, 0};" > source
+    print "    int      pos    = HEADERLEN;" > source
+    if(uses(p, "int16"))
+    {
+        print "    uint16_t u16;" > source
+    }
+    if(uses(p, "int32"))
+    {
+        print "    uint32_t u32;" > source
+    }
+    if(uses(p, "str"))
+    {
+        print "    size_t   len;" > source
+    }
+    print "" > source
+    emit_fields(p, 1, first - 1, "    ", 1)
+    if(popt[p])
+    {
+        print "" > source
+        print "    if(msg->has_" fname[p, popt[p]] ")" > source
+        print "    {" > source
+        emit_fields(p, popt[p], nf[p], "        ", 1)
+        print "    }" > source
+    }
+    if(prep[p])
+    {
+        print "" > source
+        print "    for(int i = 0; i < msg->" prepname[p] "_count; i++)" > source
+        print "    {" > source
+        emit_fields(p, prep[p], nf[p], "        ", 1)
+        print "    }" > source
+    }
+    print "" > source
+    print "    header.payload_len = (uint16_t)(pos - HEADERLEN);" > source
+    print "    encode_header(buf, &header);" > source
+    print "    return pos;" > source
+    print "}" > source
+}
+
+function emit_decoder(p, name, first, w)
+{
+    name  = lower(pname[p])
+    first = group_start(p)
+    w     = (uses(p, "int16") || uses(p, "int32")) ? 8 : 3
+    print "" > source
+    print "int asn_decode_" name "(const uint8_t buf[], int pos, int len, asn_" name " *msg)" > source
+    print "{" > source
+    print "    " pad("int", w) " end = pos + len;" > source
+    if(uses(p, "int16"))
+    {
+        print "    uint16_t u16;" > source
+    }
+    if(uses(p, "int32"))
+    {
+        print "    uint32_t u32;" > source
+    }
+    print "" > source
+    emit_fields(p, 1, first - 1, "    ", 0)
+    if(popt[p])
+    {
+        print "" > source
+        print "    msg->has_" fname[p, popt[p]] " = (pos < end);" > source
+        print "    if(msg->has_" fname[p, popt[p]] ")" > source
+        print "    {" > source
+        emit_fields(p, popt[p], nf[p], "        ", 0)
+        print "    }" > source
+    }
+    if(prep[p])
+    {
+        print "" > source
+        print "    for(msg->" prepname[p] "_count = 0; pos < end; msg->" prepname[p] "_count++)" > source
+        print "    {" > source
+        print "        int i = msg->" prepname[p] "_count;" > source
+        print "" > source
+        print "        if(i == " prepmax[p] ")" > source
+        print "        {" > source
+        print "            return EXCEEDMAXPAYLOAD;" > source
+        print "        }" > source
+        emit_fields(p, prep[p], nf[p], "        ", 0)
+        print "    }" > source
+    }
+    print "    return (pos == end) ? 0 : FIELDLENGTHOFZERO;" > source
+    print "}" > source
+}
+
+function emit_dispatch(p, name)
+{
+    print "" > source
+    print "/*" > source
+    print " * Function: asn_decode_fields" > source
+    print " * Description: Checks the len bytes of fields at pos against the description" > source
+    print " *              of packet_type, as found in a packet or a BATCH message." > source
+    print " * Returns: 0 if they match, a negative error code if not, or ASN_RAW for a" > source
+    print " *          type whose fields are not described." > source
+    print " */" > source
+    print "int asn_decode_fields(uint8_t packet_type, const uint8_t buf[], int pos, int len)" > source
+    print "{" > source
+    print "    switch(packet_type)" > source
+    print "    {" > source
+    for(p = 1; p <= np; p++)
+    {
+        if(praw[p] || preserved[p])
+        {
+            continue
+        }
+        name = lower(pname[p])
+        print "        case " pname[p] ":" > source
+        if(nf[p] == 0)
+        {
+            print "            return (len == 0) ? 0 : FIELDLENGTHOFZERO;" > source
+            continue
+        }
+        print "        {" > source
+        print "            asn_" name " msg;" > source
+        print "            return asn_decode_" name "(buf, pos, len, &msg);" > source
+        print "        }" > source
+    }
+    print "        default:" > source
+    print "            return ASN_RAW;" > source
+    print "    }" > source
+    print "}" > source
+}
+
+function emit_source(p)
+{
+    print banner > source
+    print "" > source
+    print "#include \"../include/asn.h\"" > source
+    print "#include \"../include/utf8.h\"" > source
+    print "#include <netinet/in.h>" > source
+    print "#include <string.h>" > source
+    print "" > source
+    print "#define ASN_TL (2) /* tag and length octets ahead of every field */" > source
+    print "" > source
+    print "static int asn_field_error(const uint8_t buf[], int pos, int end, uint8_t tag, int size);" > source
+    emit_table()
+    emit_dispatch()
+    for(p = 1; p <= np; p++)
+    {
+        if(described(p))
+        {
+            emit_encoder(p)
+            emit_decoder(p)
+        }
+    }
+    print "" > source
+    print "/* Works out which error a field that failed its check gets; kept out of line so the checks stay short */" > source
+    print "static int asn_field_error(const uint8_t buf[], int pos, int end, uint8_t tag, int size)" > source
+    print "{" > source
+    print "    if(end - pos < ASN_TL || buf[pos + 1] == 0)" > source
+    print "    {" > source
+    print "        return FIELDLENGTHOFZERO;" > source
+    print "    }" > source
+    print "    if(buf[pos] != tag)" > source
+    print "    {" > source
+    print "        return UNRECOGNIZEDTAGTYPE;" > source
+    print "    }" > source
+    print "    if(tag == ASN_STR)" > source
+    print "    {" > source
+    print "        return (buf[pos + 1] > size) ? EXCEEDMAXPAYLOAD : FIELDLENGTHOFZERO;" > source
+    print "    }" > source
+    print "    return (buf[pos + 1] != size) ? INVALIDINTEGERLENGTH : FIELDLENGTHOFZERO;" > source
+    print "}" > source
+}
+
+BEGIN {
+    np     = 0
+    inside = 0
+    failed = 0
+}
+
+{
+    line    = $0
+    comment = ""
+    if(index(line, "#") > 0)
+    {
+        comment = trim(substr(line, index(line, "#") + 1))
+        line    = substr(line, 1, index(line, "#") - 1)
+    }
+    line = trim(line)
+    if(line == "")
+    {
+        next
+    }
+    n = split(line, w, /[ \t]+/)
+
+    if(w[1] == "packet")
+    {
+        if(inside)
+        {
+            fail("packet " pname[np] " has no end")
+        }
+        if(n < 3 || w[3] !~ /^[0-9]+$/)
+        {
+            fail("packet needs a name and a numeric id")
+        }
+        np++
+        inside       = 1
+        pname[np]    = w[2]
+        pid[np]      = w[3]
+        pcomment[np] = comment
+        psince[np]   = ""
+        pmax[np]     = "MAXPAYLOADLEN"
+        nf[np]       = 0
+        for(i = 4; i <= n; i++)
+        {
+            if(w[i] ~ /^since=/)
+            {
+                psince[np] = substr(w[i], 7)
+            }
+            else if(w[i] ~ /^max=/)
+            {
+                pmax[np] = substr(w[i], 5)
+            }
+            else if(w[i] == "batch")
+            {
+                pbatch[np] = 1
+            }
+            else if(w[i] == "compress")
+            {
+                pcompress[np] = 1
+            }
+            else if(w[i] == "reserved")
+            {
+                preserved[np] = 1
+            }
+            else if(w[i] == "raw")
+            {
+                praw[np] = 1
+            }
+            else
+            {
+                fail("unknown flag " w[i])
+            }
+        }
+        next
+    }
+    if(!inside)
+    {
+        fail("expected a packet line")
+    }
+    if(w[1] == "end")
+    {
+        if(popt[np] > nf[np] || prep[np] > nf[np])
+        {
+            fail("optional or repeat with no fields after it")
+        }
+        inside = 0
+        next
+    }
+    if(praw[np])
+    {
+        fail("a raw packet lists no fields")
+    }
+    if(w[1] == "optional" || w[1] == "repeat")
+    {
+        if(popt[np] || prep[np])
+        {
+            fail("one optional or repeat group per packet")
+        }
+        if(w[1] == "optional")
+        {
+            popt[np] = nf[np] + 1
+        }
+        else
+        {
+            if(n != 3)
+            {
+                fail("repeat needs a name and a maximum")
+            }
+            prep[np]     = nf[np] + 1
+            prepname[np] = w[2]
+            prepmax[np]  = w[3]
+        }
+        next
+    }
+    if(w[1] !~ /^(enum|int8|int16|int32|str|time)$/)
+    {
+        fail("unknown field type " w[1])
+    }
+    if(n < 2 || (n > 2 && w[1] != "str") || n > 3)
+    {
+        fail("a field is a type and a name, and a str may add its limit")
+    }
+    nf[np]++
+    fkind[np, nf[np]] = w[1]
+    fname[np, nf[np]] = w[2]
+    fmax[np, nf[np]]  = (n == 3) ? w[3] : "255"
+}
+
+END {
+    if(failed)
+    {
+        exit 1
+    }
+    if(inside)
+    {
+        fail("packet " pname[np] " has no end")
+    }
+    emit_header()
+    emit_source()
+}
+' "$input_file"
+
+echo "Generated $header_file and $source_file from $input_file"
@@ -0,0 +1,24 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define ADMISSION_REJECTED (-1)
+
+/* Connection caps chosen on the command line, 0 meaning unlimited */
+typedef struct admission_config
+{
+    unsigned int max_clients;    /* connections served at once */
+    unsigned int max_per_source; /* connections served at once from one address */
+    unsigned int accept_rate;    /* new connections per second */
+} admission_config;
+
+int      admission_init(const admission_config *config);
+int      admission_admit(const struct sockaddr_storage *addr);
+void     admission_release(int source);
+void     admission_reject(int client_fd);
+void     admission_report(void);
+uint32_t admission_source_id(int fd);
+
+#endif    // ADMISSION_H
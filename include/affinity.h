@@ -0,0 +1,12 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define AFFINITY_MAX_CPUS (256)
+
+int          affinity_init(const char *cpu_list);
+void         affinity_pin_listener(void);
+void         affinity_pin_worker(unsigned int worker);
+unsigned int affinity_claim_client(void);
+void         affinity_pin_client(unsigned int slot);
+
+#endif    // AFFINITY_H
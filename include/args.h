@@ -6,8 +6,31 @@
 // struct to hold the values for
 typedef struct Arguments
 {
-    const char *ip;
-    in_port_t   port;
+    const char  *ip;
+    in_port_t    port;
+    const char  *upgrade_path;
+    unsigned int drain_timeout_ms;
+    unsigned int workers;
+    unsigned int queue_depth;
+    const char  *store;
+    int          store_sync;
+    unsigned int shards;
+    unsigned int max_clients;
+    unsigned int max_per_source;
+    unsigned int accept_rate;
+    int          resolve_names;
+    const char  *cpu_list;
+    unsigned int busy_poll_us;
+    const char  *node;  /* this server's federation address, ip:port */
+    const char  *peers; /* federation addresses of the other nodes, comma separated */
+    const char  *replicate_on; /* address standbys follow this server's user store on */
+    const char  *follow;       /* primary this server is a read-only standby of */
+    const char  *repl_key;     /* file holding the secret replication links are authenticated with */
+    const char  *manager;      /* server manager address diagnostics are reported to */
+    unsigned int report_ms;    /* between diagnostic reports */
+    const char  *capture;      /* file client packets are recorded to for test/replay */
+    unsigned int span_every;   /* requests per sampled span, 0 for none */
+    unsigned int span_slow_us; /* requests at least this slow are kept as spans too, 0 for none */
 } Arguments;
 
 // prints usage message and exits
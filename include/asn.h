@@ -5,6 +5,7 @@
 #ifndef ASN_H
 #define ASN_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define HEADERLEN (6)
@@ -13,15 +14,33 @@
 #define MAXPAYLOADLEN (771) /* This is the size of 3 strings + taglen */
 #define SYSID (0)
 #define CURRVER (2)
+#define BATCHVER (3)              /* first version that understands BATCH frames */
+#define COMPRESSVER (4)           /* first version that accepts COMPRESSED replies */
+#define RESUMEVER (5)             /* first version with resume tokens and ACC_RESUME */
+#define MAXVER RESUMEVER
+#define MAXBATCHPAYLOADLEN (4096) /* a BATCH frame may exceed MAXPAYLOADLEN */
+#define BATCHPACKETLEN (HEADERLEN + MAXBATCHPAYLOADLEN)
+#define BATCH_MAX_MSGS (64)
+#define CMPPREFIXLEN (4) /* type, version and payload length of a COMPRESSED reply's contents */
 #define U8ENCODELEN (3)
-#define SYS_SUCCESS_LEN (3)
-#define ACC_LOGIN_SUCCESS_LEN (4)
 #define UNRECOGNIZEDTAGTYPE (-1)
 #define INVALIDINTEGERLENGTH (-2)
 #define FIELDLENGTHOFZERO (-3)
 #define UNRECOGNIZEDPACKETTYPE (-4)
 #define UNSUPPORTEDVERSION (-5)
 #define EXCEEDMAXPAYLOAD (-6)
+#define SERVERSHUTDOWN (-7)
+#define INVALIDUSERID (-8)
+#define USEREXISTS (-9)
+#define INVALIDAUTHINFO (-10)
+#define SERVERBUSY (-11)
+#define SERVERERROR (-12)
+#define NOUSERIDS (-13)
+#define RATELIMITED (-14)
+#define READONLY (-15)
+#define INVALIDSTRING (-16)
+#define SVR_ERROR_CODES (17) /* SVR_DIAGNOSTIC error counts, indexed by -code */
+#define SVR_LOG_MAX (200)    /* longest log line an SVR_LOG carries */
 
 enum ASNTag
 {
@@ -34,23 +53,7 @@ enum ASNTag
     ASN_SEQ  = 48
 };
 
-enum Packet_Type
-{
-    SYS_SUCCESS,
-    SYS_ERROR,
-    ACC_LOGIN = 10,
-    ACC_LOGIN_SUCCESS,
-    ACC_LOGOUT,
-    ACC_CREATE,
-    ACC_EDIT,
-    CHT_SEND = 20,
-    LST_GET  = 30,
-    LST_RESPONSE,
-    GRP_JOIN = 40,
-    GRP_EXIT,
-    GRP_CREATE,
-    HST_GET = 50
-};
+#include "../include/asn_codec.h"
 
 enum Error_Code
 {
@@ -62,6 +65,21 @@ enum Error_Code
     EC_REQTO
 };
 
+/*
+ * One SVR_DIAGNOSTIC report. Counts run from server start, so the manager
+ * gets rates from successive reports and loses nothing when one is dropped.
+ * On the wire: the four counters as 4 byte ASN_INTs, then an ASN_ENUM code
+ * and ASN_INT count for each error sent at least once.
+ */
+typedef struct svr_diagnostic
+{
+    uint32_t uptime_sec;
+    uint32_t users_online;
+    uint32_t messages; /* CHT_SENDs routed */
+    uint32_t logins;
+    uint32_t errors[SVR_ERROR_CODES];
+} svr_diagnostic;
+
 typedef struct header_t
 {
     uint8_t  packet_type;
@@ -70,11 +88,38 @@ typedef struct header_t
     uint16_t payload_len;
 } header_t;
 
+/*
+ * Messages found in a BATCH frame. Each one is an ASN_SEQ whose contents are
+ * the message's packet type followed by its usual fields, so it costs 3 bytes
+ * of framing instead of a 6 byte header. The version and sender_id are the
+ * frame's.
+ */
+typedef struct asn_batch
+{
+    int count;
+    struct
+    {
+        uint8_t  packet_type;
+        uint16_t offset; /* of the message's first field in the frame */
+        uint16_t len;    /* of its fields */
+    } msgs[BATCH_MAX_MSGS];
+} asn_batch;
+
 void decode_header(const uint8_t buf[], header_t *header);
-int  decode_packet(const uint8_t buf[], const header_t *header);
+void encode_header(uint8_t buf[], const header_t *header);
+int  decode_packet(const uint8_t buf[], const header_t *header, asn_batch *batch);
+int  decode_acc_req(const uint8_t buf[], const header_t *header, char username[], size_t username_size, char password[], size_t password_size);
 int  encode_sys_success_res(uint8_t buf[], uint8_t packet_type);
 int  encode_sys_error_res(uint8_t buf[], int err);
-int  encode_acc_login_success_res(uint8_t buf[], uint16_t user_id);
+int  decode_resume_req(const uint8_t buf[], const header_t *header, char token[], size_t token_size, uint32_t *received);
+int  encode_acc_login_success_res(uint8_t buf[], uint16_t user_id, const char *token, uint32_t first_seq);
 int  encode_cht_send(uint8_t buf[]);
+int  encode_batch_append(uint8_t batch[], int pos, const uint8_t packet[], int packet_len);
+int  encode_batch_header(uint8_t batch[], int pos);
+int  encode_compressed(uint8_t dst[], const uint8_t packet[], int packet_len);
+int  encode_svr_diagnostic(uint8_t buf[], const svr_diagnostic *diag);
+int  decode_svr_diagnostic(const uint8_t buf[], int pos, int len, svr_diagnostic *diag);
+int  encode_svr_log(uint8_t buf[], int level, const char *msg);
+int  decode_svr_log(const uint8_t buf[], int pos, int len, int *level, char msg[], size_t msg_size);
 
 #endif    // ASN_H
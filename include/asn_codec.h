@@ -0,0 +1,140 @@
+/* Generated by generate-asn.sh from protocol.def: edit that file and rerun the script. */
+
+#ifndef ASN_CODEC_H
+#define ASN_CODEC_H
+
+/* Included by asn.h, after the limits the message structs use */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ASN_RAW (1)               /* from asn_decode_fields: the fields of this type are not described */
+#define ASN_ACCEPTED (1 << 0)     /* may be received from a client */
+#define ASN_BATCHABLE (1 << 1)    /* may share a BATCH frame */
+#define ASN_COMPRESSIBLE (1 << 2) /* replies of this type are worth compressing */
+
+enum Packet_Type
+{
+    SYS_SUCCESS       = 0,
+    SYS_ERROR         = 1,
+    ACC_LOGIN         = 10,
+    ACC_LOGIN_SUCCESS = 11,
+    ACC_LOGOUT        = 12,
+    ACC_CREATE        = 13,
+    ACC_EDIT          = 14,
+    ACC_RESUME        = 15, /* a resume token from ACC_LOGIN_SUCCESS and the last sequence number received */
+    CHT_SEND          = 20,
+    LST_GET           = 30,
+    LST_RESPONSE      = 31,
+    GRP_JOIN          = 40,
+    GRP_EXIT          = 41,
+    GRP_CREATE        = 42,
+    HST_GET           = 50,
+    BATCH             = 60, /* ASN_SEQ per message, version BATCHVER and up */
+    COMPRESSED        = 61, /* a reply's header fields, then its payload through compress_block */
+    SVR_DIAGNOSTIC    = 70, /* counters reported to the server manager */
+    SVR_LOG           = 71  /* a log line forwarded to the server manager */
+};
+
+/* An ASN_STR or ASN_TIME field where it lies in a packet; not NUL-terminated */
+typedef struct asn_str
+{
+    const uint8_t *text;
+    size_t         len; /* at most UINT8_MAX, but wide so the encoders call memcpy rather than inline a slow rep movs */
+} asn_str;
+
+/* What check_header needs to know about a packet type */
+typedef struct asn_packet_info
+{
+    uint8_t  flags;
+    uint8_t  since; /* oldest version that may send it */
+    uint16_t max_payload;
+} asn_packet_info;
+
+typedef struct asn_sys_success
+{
+    uint8_t packet_type;
+} asn_sys_success;
+
+typedef struct asn_sys_error
+{
+    uint8_t code;
+    asn_str message;
+} asn_sys_error;
+
+typedef struct asn_acc_login
+{
+    asn_str username;
+    asn_str password;
+} asn_acc_login;
+
+typedef struct asn_acc_login_success
+{
+    uint16_t user_id;
+    int      has_token;
+    asn_str  token;
+    uint32_t first_seq;
+} asn_acc_login_success;
+
+typedef struct asn_acc_create
+{
+    asn_str username;
+    asn_str password;
+} asn_acc_create;
+
+typedef struct asn_acc_resume
+{
+    asn_str  token;
+    uint32_t received;
+} asn_acc_resume;
+
+typedef struct asn_cht_send
+{
+    asn_str timestamp;
+    asn_str content;
+    asn_str username;
+} asn_cht_send;
+
+typedef struct asn_svr_diagnostic
+{
+    uint32_t uptime_sec;
+    uint32_t users_online;
+    uint32_t messages;
+    uint32_t logins;
+    int      errors_count;
+    struct
+    {
+        uint8_t  code;
+        uint32_t count;
+    } errors[SVR_ERROR_CODES];
+} asn_svr_diagnostic;
+
+typedef struct asn_svr_log
+{
+    uint8_t level;
+    asn_str message;
+} asn_svr_log;
+
+extern const asn_packet_info asn_packets[UINT8_MAX + 1];
+
+int asn_decode_fields(uint8_t packet_type, const uint8_t buf[], int pos, int len);
+int asn_encode_sys_success(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_sys_success *msg);
+int asn_decode_sys_success(const uint8_t buf[], int pos, int len, asn_sys_success *msg);
+int asn_encode_sys_error(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_sys_error *msg);
+int asn_decode_sys_error(const uint8_t buf[], int pos, int len, asn_sys_error *msg);
+int asn_encode_acc_login(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_login *msg);
+int asn_decode_acc_login(const uint8_t buf[], int pos, int len, asn_acc_login *msg);
+int asn_encode_acc_login_success(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_login_success *msg);
+int asn_decode_acc_login_success(const uint8_t buf[], int pos, int len, asn_acc_login_success *msg);
+int asn_encode_acc_create(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_create *msg);
+int asn_decode_acc_create(const uint8_t buf[], int pos, int len, asn_acc_create *msg);
+int asn_encode_acc_resume(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_resume *msg);
+int asn_decode_acc_resume(const uint8_t buf[], int pos, int len, asn_acc_resume *msg);
+int asn_encode_cht_send(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_cht_send *msg);
+int asn_decode_cht_send(const uint8_t buf[], int pos, int len, asn_cht_send *msg);
+int asn_encode_svr_diagnostic(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_svr_diagnostic *msg);
+int asn_decode_svr_diagnostic(const uint8_t buf[], int pos, int len, asn_svr_diagnostic *msg);
+int asn_encode_svr_log(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_svr_log *msg);
+int asn_decode_svr_log(const uint8_t buf[], int pos, int len, asn_svr_log *msg);
+
+#endif    // ASN_CODEC_H
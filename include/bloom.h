@@ -0,0 +1,34 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOOM_MAGIC (0x424c4f4d) /* "BLOM" */
+#define BLOOM_VERSION (1)
+
+/* Layout of the start of the backing file, followed by the bit array */
+typedef struct bloom_header
+{
+    uint32_t         magic;
+    uint32_t         version;
+    uint32_t         bits_log2;
+    uint32_t         hashes;
+    _Atomic uint32_t clean;   /* set by the last close, cleared by the next open or add */
+    _Atomic uint32_t changes; /* bumped by every add, so a close can tell one raced its sync */
+} bloom_header;
+
+typedef struct bloom
+{
+    bloom_header     *header;
+    _Atomic uint64_t *words;
+    size_t            map_len;
+} bloom;
+
+int  bloom_open(bloom *filter, const char *path, uint32_t bits_log2, uint32_t hashes);
+void bloom_add(bloom *filter, const void *key, size_t len);
+int  bloom_may_contain(const bloom *filter, const void *key, size_t len);
+void bloom_close(bloom *filter);
+
+#endif    // BLOOM_H
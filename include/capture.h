@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A capture file is CAPTURE_MAGIC and then one record per event: the kind,
+ * the connection id (the pid of its process) and the microseconds since the
+ * capture began, as a byte, a network order uint32 and a network order
+ * uint64. A CAPTURE_PACKET record is followed by the frame as it was read,
+ * header first, so its header gives its length. Passwords are the exception:
+ * the password of an ACC_LOGIN or ACC_CREATE is recorded as CAPTURE_PASSWORD,
+ * with the payload length to match, and test/replay can put another back.
+ */
+#define CAPTURE_MAGIC "CHTCAP1\n"
+#define CAPTURE_MAGIC_LEN (8)
+#define CAPTURE_RECORD_LEN (13)
+#define CAPTURE_PASSWORD "********"
+#define CAPTURE_PASSWORD_LEN (8)
+
+enum Capture_Kind
+{
+    CAPTURE_OPEN = 1,
+    CAPTURE_PACKET,
+    CAPTURE_CLOSE
+};
+
+int  capture_init(const char *path);
+void capture_connect(void);
+void capture_packet(const uint8_t frame[], size_t len);
+void capture_disconnect(void);
+void capture_shutdown(void);
+
+#endif    // CAPTURE_H
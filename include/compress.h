@@ -0,0 +1,12 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#define COMPRESS_MIN_LEN (64)    /* smaller payloads are sent as they are */
+#define COMPRESS_MAX_LEN (8192)  /* largest block compress_block accepts */
+
+int compress_block(const uint8_t src[], int src_len, uint8_t dst[], int dst_cap);
+int decompress_block(const uint8_t src[], int src_len, uint8_t dst[], int dst_cap);
+
+#endif    // COMPRESS_H
@@ -0,0 +1,14 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <signal.h>
+
+/* Event loop tuning chosen on the command line */
+typedef struct connection_config
+{
+    unsigned int busy_poll_us; /* spin this long for input before sleeping, 0 to always sleep */
+} connection_config;
+
+void serve_client(int cfd, const volatile sig_atomic_t *running, const connection_config *config);
+
+#endif    // CONNECTION_H
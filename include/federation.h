@@ -0,0 +1,15 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "../include/asn.h"
+#include <stdint.h>
+
+#define FED_MAX_NODES (16)          /* this server and its peers */
+#define FED_RECONNECT_MS (500)      /* wait before redialling a peer that dropped */
+#define FED_SEND_TIMEOUT_SEC (1)    /* a peer that stops reading is dropped after this */
+
+int  federation_init(const char *node, const char *peers);
+void federation_relay(const header_t *header, const uint8_t fields[]);
+void federation_shutdown(void);
+
+#endif    // FEDERATION_H
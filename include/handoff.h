@@ -0,0 +1,23 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HANDOFF_MAGIC (0x48414e44) /* "HAND" */
+#define HANDOFF_VERSION (1)
+
+/* Sent alongside the listening socket so the new process can log what it took over */
+typedef struct handoff_info
+{
+    uint32_t magic;
+    uint32_t version;
+    int32_t  old_pid;
+    uint32_t live_clients;
+} handoff_info;
+
+int handoff_listen(const char *path);
+int handoff_take(const char *path, handoff_info *info);
+int handoff_give(int ctl_fd, int listen_fd, const handoff_info *info);
+
+#endif    // HANDOFF_H
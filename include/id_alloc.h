@@ -0,0 +1,34 @@
+#ifndef ID_ALLOC_H
+#define ID_ALLOC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ID_ALLOC_MAGIC (0x49444c53) /* "IDLS" */
+#define ID_ALLOC_VERSION (1)
+#define ID_ALLOC_FIRST (1)            /* 0 is the protocol's system id */
+#define ID_ALLOC_LIMIT (UINT16_MAX + 1) /* one past the last id sender_id can carry */
+#define ID_ALLOC_LEASE (8)            /* ids a process takes from the shared counter at once */
+
+/* Layout of the start of the backing file, followed by the free id bitmap */
+typedef struct id_alloc_header
+{
+    uint32_t         magic;
+    uint32_t         version;
+    _Atomic uint32_t next;       /* lowest id never leased, the central counter */
+    _Atomic uint32_t clean;      /* set by the last close, cleared by the next open or change */
+    _Atomic uint32_t free_count; /* ids waiting in the bitmap */
+    _Atomic uint32_t changes;    /* bumped by every change, so a close can tell one raced its sync */
+} id_alloc_header;
+
+int  id_alloc_open(const char *path, uint32_t max_id);
+void id_alloc_reset_free(void);
+void id_alloc_mark_used(uint32_t id);
+void id_alloc_claim(uint32_t id);
+int  id_alloc_take(void);
+void id_alloc_free(uint32_t id);
+void id_alloc_release_lease(void);
+void id_alloc_close(void);
+
+#endif    // ID_ALLOC_H
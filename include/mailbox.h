@@ -0,0 +1,32 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <stdint.h>
+
+#define MAILBOX_SLOTS (UINT16_MAX + 1)     /* one queue per possible user id */
+#define MAILBOX_MAX_BYTES (256 * 1024)     /* queued per user before enqueues are refused */
+#define MAILBOX_READ_CHUNK (64 * 1024)
+#define MAILBOX_MAGIC (0x584f424d) /* "MBOX" */
+
+/*
+ * Start of every spool file. Queued packets are numbered by their byte offset
+ * in the user's stream of queued packets, like TCP sequence numbers.
+ */
+typedef struct mailbox_head
+{
+    uint32_t magic;
+    uint32_t base;      /* sequence number of the first packet in the file */
+    uint32_t delivered; /* sequence number the last drain delivered up to */
+    uint32_t skip;      /* bytes of acknowledged packets left between the head and base */
+} mailbox_head;
+
+/* Receives each queued packet, header included, in the order it was queued */
+typedef void (*mailbox_deliver_fn)(const uint8_t packet[], int len, void *ctx);
+
+int      mailbox_init(void);
+int      mailbox_enqueue(uint16_t user_id, const uint8_t packet[], int len);
+uint32_t mailbox_resume_point(uint16_t user_id, const uint32_t *received);
+int      mailbox_drain(uint16_t user_id, uint32_t from, mailbox_deliver_fn deliver, void *ctx);
+void     mailbox_discard(uint16_t user_id);
+
+#endif    // MAILBOX_H
@@ -8,6 +8,7 @@
 int server_tcp_setup(const Arguments *args);
 
 int       socket_accept(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
+void      socket_describe(const struct sockaddr_storage *client_addr, socklen_t client_addr_len);
 in_port_t convert_port(const char *binary_name, const char *str);
 void      shutdown_socket(int sockfd, int how);
 void      socket_close(int sockfd);
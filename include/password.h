@@ -0,0 +1,16 @@
+#ifndef PASSWORD_H
+#define PASSWORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SALT_LEN (16)
+#define HASH_LEN (32)                /* SHA-256 output */
+#define PASSWORD_ITERATIONS (20000U) /* PBKDF2 rounds, the knob that makes hashing slow */
+
+int  password_salt(uint8_t salt[SALT_LEN]);
+void password_hash(const char *password, size_t password_len, const uint8_t salt[SALT_LEN], uint32_t iterations, uint8_t out[HASH_LEN]);
+void password_mac(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t msg_len, uint8_t out[HASH_LEN]);
+int  password_equal(const uint8_t a[HASH_LEN], const uint8_t b[HASH_LEN]);
+
+#endif    // PASSWORD_H
@@ -0,0 +1,45 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/* Limits, as a sustained rate per second and the burst allowed on top of an idle bucket */
+#define RATE_CONN_PER_SEC (50)     /* packets on one connection */
+#define RATE_CONN_BURST (100)
+#define RATE_USER_PER_SEC (20)     /* authenticated packets from one user, across connections */
+#define RATE_USER_BURST (40)
+#define RATE_LOGIN_PER_SEC (50)    /* ACC_LOGIN and ACC_CREATE server wide, each costs a hash */
+#define RATE_LOGIN_BURST (100)
+#define RATE_USER_LOGIN_PER_SEC (1) /* failed logins and resumes against one account from one address */
+#define RATE_USER_LOGIN_BURST (5)
+#define RATE_ACCEPT_PER_SEC (200)   /* new connections, see admission.c; set with -r */
+#define RATE_ACCEPT_BURST (200)
+#define RATE_LOGIN_FAILURE_SLOTS (64 * 1024) /* RATE_USER_LOGIN buckets, shared by account and address pairs that hash alike */
+
+typedef enum rate_class
+{
+    RATE_CONN,
+    RATE_USER,
+    RATE_LOGIN,
+    RATE_USER_LOGIN,
+    RATE_ACCEPT,
+    RATE_CLASSES
+} rate_class;
+
+/* One token bucket, kept as the time it will next be full so a take is a single CAS */
+typedef struct rate_bucket
+{
+    _Atomic uint64_t full_at; /* monotonic ns */
+} rate_bucket;
+
+int      ratelimit_init(void);
+void     ratelimit_set(rate_class cls, unsigned int per_sec, unsigned int burst);
+uint64_t ratelimit_now(void);
+int      ratelimit_take(rate_bucket *bucket, rate_class cls, uint64_t now);
+int      ratelimit_take_login(uint64_t now);
+int      ratelimit_login_allowed(uint16_t user_id, uint32_t source, uint64_t now);
+void     ratelimit_login_failed(uint16_t user_id, uint32_t source, uint64_t now);
+void     ratelimit_report(void);
+
+#endif    // RATELIMIT_H
@@ -0,0 +1,21 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "../include/user_db.h"
+#include <stdint.h>
+
+#define REPL_PUT (1)                  /* a user was stored or replaced */
+#define REPL_DEL (2)                  /* a user was removed */
+#define REPL_SHIP_RECORDS (256)       /* changes read from the journal and sent per write */
+#define REPL_MAX_STANDBYS (8)
+#define REPL_RETRY_MS (200)           /* wait before a standby redials its primary */
+#define REPL_SEND_TIMEOUT_SEC (1)     /* a standby that stops reading is dropped after this */
+#define REPL_JOURNAL_MAX (64 * 1024)  /* changes kept before the next start begins a new epoch */
+
+int  replication_init(const char *listen_addr, const char *primary_addr, const char *key_path, int sync_writes);
+int  replication_read_only(void);
+void replication_journal(uint16_t type, const user_obj *user);
+int  replication_promote(void);
+void replication_shutdown(void);
+
+#endif    // REPLICATION_H
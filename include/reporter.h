@@ -0,0 +1,18 @@
+#ifndef REPORTER_H
+#define REPORTER_H
+
+#include <stdint.h>
+
+#define REPORT_INTERVAL_MS (1000)    /* between SVR_DIAGNOSTIC reports */
+#define REPORT_QUEUE_FRAMES (16)     /* frames kept while the manager is unreachable */
+#define REPORT_RECONNECT_MS (1000)   /* wait before redialling the manager */
+#define REPORT_SEND_TIMEOUT_SEC (1)  /* a manager that stops reading loses the frame */
+
+int  reporter_init(const char *manager, unsigned int interval_ms);
+void reporter_count_message(void);
+void reporter_count_login(void);
+void reporter_count_error(int err);
+void reporter_log(int level, const char *msg);
+void reporter_shutdown(void);
+
+#endif    // REPORTER_H
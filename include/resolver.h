@@ -0,0 +1,14 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+
+#define RESOLVER_CACHE_SLOTS (256) /* addresses remembered by the resolver */
+#define RESOLVER_CACHE_TTL_SEC (300)
+
+int  resolver_init(void);
+void resolver_submit(const struct sockaddr_storage *addr, socklen_t addr_len);
+void resolver_detach(void);
+void resolver_shutdown(void);
+
+#endif    // RESOLVER_H
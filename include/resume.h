@@ -0,0 +1,30 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "../include/password.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define RESUME_MAGIC (0x454d5352) /* "RSME" */
+#define RESUME_VERSION (2) /* 2: locks hold the holder's pid */
+#define RESUME_SLOTS (UINT16_MAX + 1) /* one token per possible user id */
+#define RESUME_TOKEN_LEN (2 * SALT_LEN) /* hex characters of a token */
+#define RESUME_TTL_SEC (600)           /* how long a dropped client may resume for */
+
+/* A user's outstanding token, stored only as a hash of it */
+typedef struct resume_slot
+{
+    _Atomic uint32_t lock; /* pid of the process holding the slot, 0 when free */
+    uint32_t         reserved;
+    int64_t          expires; /* wall clock seconds, 0 when there is no token */
+    uint8_t          salt[SALT_LEN];
+    uint8_t          hash[HASH_LEN];
+} resume_slot;
+
+int  resume_open(void);
+int  resume_issue(uint16_t user_id, char token[RESUME_TOKEN_LEN + 1]);
+int  resume_redeem(uint16_t user_id, const char *token);
+void resume_revoke(uint16_t user_id);
+void resume_close(void);
+
+#endif    // RESUME_H
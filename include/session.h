@@ -0,0 +1,25 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#define SESSION_SLOTS (UINT16_MAX + 1) /* one slot per possible sender_id */
+
+/* Per-connection half of the session table, owned by the process serving the connection */
+typedef struct session
+{
+    int32_t  conn_id; /* pid of the child serving the connection */
+    uint16_t user_id;
+    int      authenticated;
+} session;
+
+int      session_table_init(void);
+void     session_open(session *sess, int32_t conn_id);
+void     session_login(session *sess, uint16_t user_id);
+void     session_logout(session *sess);
+int      session_validate(const session *sess, uint16_t sender_id);
+int      session_admit(uint16_t user_id, uint64_t now);
+int32_t  session_owner(uint16_t user_id);
+uint32_t session_count_online(void);
+
+#endif    // SESSION_H
@@ -0,0 +1,58 @@
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stdint.h>
+
+/*
+ * Sampled spans: the stages one request went through, as cycle counter ticks,
+ * for finding out why a particular request was slow. A connection times a
+ * request when it is its one in -t, or, with -l set, every request so the
+ * slow ones can be kept; the rest cost a branch at each mark. Kept spans go
+ * to a ring in shared memory, and SIGUSR2 to the listener prints them all.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define SPAN_NOW() __rdtsc()
+#else
+    #define SPAN_NOW() span_clock()
+#endif
+
+/* Points a request passes, in order; a mark it skipped stays 0 */
+enum Span_Mark
+{
+    SPAN_WAIT,    /* the connection began waiting on its socket */
+    SPAN_READY,   /* poll found it readable */
+    SPAN_READ,    /* the whole frame was read */
+    SPAN_DECODED, /* decode_packet checked its fields */
+    SPAN_SERVED,  /* served, and answered unless a password is being hashed */
+    SPAN_DONE,    /* answered; after SPAN_SERVED only for logins and account creation */
+    SPAN_MARKS
+};
+
+typedef struct span
+{
+    uint64_t at[SPAN_MARKS]; /* ticks each mark was passed at */
+    uint64_t db;             /* ticks spent in the user store */
+    uint64_t send;           /* ticks spent writing replies */
+    uint32_t conn_id;
+    uint16_t payload_len;
+    int16_t  result;  /* 0, or the code of the last SYS_ERROR it was answered with */
+    uint8_t  packet_type;
+    uint8_t  open;    /* between span_begin and span_end */
+    uint8_t  timed;   /* marks are being taken */
+    uint8_t  sampled; /* kept whatever its latency */
+} span;
+
+/* Cheap enough to leave in place: untimed requests only test sp->timed */
+#define SPAN_MARK(sp, mark) ((sp)->timed ? (void)((sp)->at[(mark)] = SPAN_NOW()) : (void)0)
+#define SPAN_START(sp) ((sp)->timed ? SPAN_NOW() : 0)
+#define SPAN_ADD(sp, field, start) ((sp)->timed ? (void)((sp)->field += SPAN_NOW() - (start)) : (void)0)
+
+int      span_init(unsigned int sample_every, unsigned int slow_us);
+void     span_attach(span *sp, uint32_t conn_id);
+void     span_begin(span *sp);
+void     span_end(span *sp);
+void     span_dump(void);
+uint64_t span_clock(void);
+
+#endif    // SPAN_H
@@ -0,0 +1,50 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Static tracepoints (USDT) on the request lifecycle, under the provider
+ * chat_server. With <sys/sdt.h> (systemtap-sdt-dev) they are built in: each
+ * is a nop plus an ELF note until bpftrace or perf attaches to it, so the
+ * server is traced as it runs without a rebuild. Without the header they
+ * compile to nothing. trace/ has bpftrace scripts that use them; for perf,
+ * `perf buildid-cache --add ./main` once, then `perf record -e
+ * sdt_chat_server:request -a` and so on.
+ *
+ * A connection is named by the pid of the process serving it, which the
+ * listener reports in spawn; probes fired in that process, including the
+ * user store's, have it as the tracer's pid too.
+ *
+ *   accept(client_fd, errno)               listener, once accept(2) returns
+ *   spawn(conn_id, client_fd)              listener, once the connection has its process
+ *   request(conn_id, type, sender_id, len) a frame, or one message of a BATCH, is to be served
+ *   decoded(conn_id, type, len, result)    decode_packet has checked its fields
+ *   request_done(conn_id, type, served)    served as dispatch_req returns it; logins answer later
+ *   error(conn_id, err)                    a SYS_ERROR for err, one of the codes in asn.h
+ *   reply(conn_id, type, len, written)     a packet or BATCH frame written; written < len on failure
+ *   db_start(op, user_id)                  a user store lookup or write begins; user_id -1 by name
+ *   db_done(op, result)                    lookups 1 found, 0 not, -1 failed; adds as add_user returns
+ */
+
+#if defined(__has_include)
+    #if __has_include(<sys/sdt.h>)
+        #include <sys/sdt.h>
+        #define TRACE_PROBES 1
+    #endif
+#endif
+
+#define TRACE_DB_FIND 1
+#define TRACE_DB_FIND_BY_NAME 2
+#define TRACE_DB_ADD 3
+
+#ifdef TRACE_PROBES
+    #define TRACE2(name, a, b) DTRACE_PROBE2(chat_server, name, a, b)
+    #define TRACE3(name, a, b, c) DTRACE_PROBE3(chat_server, name, a, b, c)
+    #define TRACE4(name, a, b, c, d) DTRACE_PROBE4(chat_server, name, a, b, c, d)
+#else
+    /* sizeof leaves the arguments unevaluated but still counts them as used */
+    #define TRACE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+    #define TRACE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+    #define TRACE4(name, a, b, c, d) ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
+#endif    // TRACE_H
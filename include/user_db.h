@@ -5,21 +5,45 @@
 #ifndef USER_DB_H
 #define USER_DB_H
 
+#include "../include/password.h"
 #include <stddef.h>
 
-#define MAX_USERS 100    // Define a reasonable max number of users
+#define MAX_USERS 100           // Define a reasonable max number of users
+#define USERNAME_MAX_LEN (32)
+#define USER_DB_NAME_TAKEN (1) /* add_user: the username belongs to another account */
 
 typedef struct
 {
-    int id;
+    int     id;
+    char    username[USERNAME_MAX_LEN + 1];
+    uint8_t salt[SALT_LEN];
+    uint8_t hash[HASH_LEN];
 } user_obj;
 
+/* Storage settings chosen on the command line */
+typedef struct user_db_config
+{
+    const char  *store;       /* backend name, see user_store.h */
+    int          sync_writes; /* reach stable storage before a write returns */
+    unsigned int shards;      /* partitions of the dbm backend */
+} user_db_config;
+
+typedef void (*user_visit_fn)(const user_obj *user, void *ctx);
+
 extern user_obj *user_arr[MAX_USERS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 user_obj *new_user(void);
-void      init_user_list(void);    // Function to initialize user list
+void      init_user_list(const user_db_config *config);    // Function to initialize user list
 int       add_user(user_obj *user);
 void      remove_user(int user_id);
 user_obj *find_user(int user_id);
+user_obj *find_user_by_name(const char *username);
+int       allocate_user_id(void);
+void      release_user_ids(void);
+void      list_all_users(void);
+int       scan_users(user_visit_fn visit, void *ctx);
+int       apply_user(const user_obj *user);
+void      apply_user_removal(int user_id);
+void      close_user_list(void);
 
 #endif    // USER_DB_H
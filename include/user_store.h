@@ -0,0 +1,28 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include "../include/user_db.h"
+
+/*
+ * Storage backend behind user_db.c. Lookups return 1 when the user was found
+ * and copied out, 0 when it does not exist and -1 on failure.
+ */
+typedef struct user_store
+{
+    const char *name;
+    int (*open)(const user_db_config *config); /* called once, before any fork */
+    void (*close)(void);
+    int (*insert)(const user_obj *user); /* 0, USER_DB_NAME_TAKEN or -1 */
+    int (*remove)(int user_id);          /* 0, or -1 if missing or on failure */
+    int (*find)(int user_id, user_obj *user);
+    int (*find_by_name)(const char *username, user_obj *user);
+    int (*scan)(user_visit_fn visit, void *ctx); /* number of users visited, or -1 */
+    int (*max_id)(void);                         /* highest stored user id, 0 if empty, or -1 */
+} user_store;
+
+extern const user_store user_store_dbm;
+extern const user_store user_store_log;
+
+const user_store *user_store_find(const char *name);
+
+#endif    // USER_STORE_H
@@ -0,0 +1,10 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int         utf8_check(const uint8_t text[], size_t len);
+const char *utf8_impl(void);
+
+#endif    // UTF8_H
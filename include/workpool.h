@@ -0,0 +1,20 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include "../include/password.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WORKPOOL_MAX_PASSWORD (255) /* longest ASN_STR */
+
+int  workpool_init(unsigned int workers, unsigned int depth);
+int  workpool_attach(void);
+int  workpool_submit(const char *password, size_t password_len, const uint8_t salt[SALT_LEN]);
+int  workpool_collect(int job, uint8_t hash[HASH_LEN]);
+void workpool_abandon(int job);
+void workpool_reclaim(pid_t owner);
+void workpool_drain_notify(int notify_fd);
+void workpool_shutdown(void);
+
+#endif    // WORKPOOL_H
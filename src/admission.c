@@ -0,0 +1,234 @@
+/*******************************************************************************
+ * Admission Control
+ *
+ * Decides, right after accept and before anything is spent on a connection,
+ * whether the server takes it on. Every admitted connection costs a fork and
+ * a process for as long as the client stays, so under a flood the cheapest
+ * answer is a refusal that costs neither.
+ *
+ * - Caps on connections served at once, overall and per source address.
+ * - A token bucket on the accept rate (RATE_ACCEPT in ratelimit.c).
+ * - A refused connection gets one prebuilt SYS_ERROR "Server Busy", written
+ *   without blocking, and is closed by the listening process itself.
+ *
+ * Only the listening process calls into this module, so its state is private
+ * to that process and needs no synchronisation. admission_source_id keeps no
+ * state, and is how a connection names its address to per-source limits.
+ ******************************************************************************/
+
+#include "../include/admission.h"
+#include "../include/asn.h"
+#include "../include/logging.h"
+#include "../include/ratelimit.h"
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define SOURCE_KEY_LEN 16 /* IPv4 is kept in its IPv4-mapped IPv6 form */
+#define REPORT_LEN 160
+#define FNV_OFFSET_BASIS 0x811c9dc5U
+#define FNV_PRIME 0x01000193U
+
+#ifdef MSG_NOSIGNAL
+    #define REJECT_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL)
+#else
+    #define REJECT_FLAGS MSG_DONTWAIT
+#endif
+
+/* Connections currently served from one address */
+typedef struct source_entry
+{
+    uint8_t      key[SOURCE_KEY_LEN];
+    unsigned int count;
+    int          used; /* ever held a key; ends a probe sequence when clear */
+} source_entry;
+
+static void     source_key(const struct sockaddr_storage *addr, uint8_t key[SOURCE_KEY_LEN]);
+static uint32_t source_hash(const uint8_t key[SOURCE_KEY_LEN]);
+static int      source_find(const uint8_t key[SOURCE_KEY_LEN]);
+
+static admission_config limits;                         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static source_entry    *sources        = NULL;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t           source_mask    = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned int     active         = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t         shed_total     = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t         shed_source    = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint8_t          busy_reply[PACKETLEN];          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t           busy_reply_len = 0;             // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static rate_bucket      accept_bucket  = {0};           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: admission_init
+ * Description: Sizes the per-source table for the connection cap, configures
+ *              the accept rate and builds the busy reply.
+ * Returns: 0 on success, -1 on failure.
+ */
+int admission_init(const admission_config *config)
+{
+    size_t slots = 2;
+
+    limits = *config;
+    if(limits.accept_rate > 0)
+    {
+        ratelimit_set(RATE_ACCEPT, limits.accept_rate, limits.accept_rate);
+    }
+
+    // Twice the cap keeps probes short; unlimited clients still get a table of a useful size
+    while(slots < (limits.max_clients > 0 ? (size_t)limits.max_clients * 2 : (size_t)UINT16_MAX + 1))
+    {
+        slots *= 2;
+    }
+    sources = (source_entry *)calloc(slots, sizeof(source_entry));
+    if(sources == NULL)
+    {
+        perror("admission_init::calloc");
+        return -1;
+    }
+    source_mask = slots - 1;
+
+    busy_reply_len = (size_t)encode_sys_error_res(busy_reply, SERVERBUSY);
+    return 0;
+}
+
+/*
+ * Function: admission_admit
+ * Description: Checks a just accepted connection from addr against the caps
+ *              and the accept rate, and counts it in if it fits.
+ * Returns: The source slot to hand to admission_release when the connection
+ *          ends, or ADMISSION_REJECTED.
+ */
+int admission_admit(const struct sockaddr_storage *addr)
+{
+    uint8_t key[SOURCE_KEY_LEN];
+    int     slot;
+
+    if(limits.max_clients > 0 && active >= limits.max_clients)
+    {
+        shed_total++;
+        return ADMISSION_REJECTED;
+    }
+    if(limits.accept_rate > 0 && !ratelimit_take(&accept_bucket, RATE_ACCEPT, ratelimit_now()))
+    {
+        return ADMISSION_REJECTED;
+    }
+
+    source_key(addr, key);
+    slot = source_find(key);
+    if(slot < 0 || (limits.max_per_source > 0 && sources[slot].count >= limits.max_per_source))
+    {
+        shed_source++;
+        return ADMISSION_REJECTED;
+    }
+    memcpy(sources[slot].key, key, SOURCE_KEY_LEN);
+    sources[slot].used = 1;
+    sources[slot].count++;
+    active++;
+    return slot;
+}
+
+/* Counts a connection admitted from the source slot out again */
+void admission_release(int source)
+{
+    if(source < 0 || sources[source].count == 0)
+    {
+        return;
+    }
+    sources[source].count--;
+    active--;
+}
+
+/* Tells a connection that was not admitted why, then drops it; never blocks */
+void admission_reject(int client_fd)
+{
+    send(client_fd, busy_reply, busy_reply_len, REJECT_FLAGS);
+    close(client_fd);
+}
+
+/* Logs how many connections the caps turned away */
+void admission_report(void)
+{
+    char msg[REPORT_LEN];
+
+    if(shed_total == 0 && shed_source == 0)
+    {
+        return;
+    }
+    snprintf(msg, sizeof(msg), "Connections shed: %llu over the client cap, %llu over the per-source cap", (unsigned long long)shed_total, (unsigned long long)shed_source);
+    printf("%s\n", msg);
+    server_log(1, msg, LOG_NOTICE);
+}
+
+/* Names the address of a connected socket's peer the way the per-source caps do; 0 if it has none */
+uint32_t admission_source_id(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len = sizeof(addr);
+    uint8_t                 key[SOURCE_KEY_LEN];
+
+    memset(&addr, 0, sizeof(addr));
+    if(getpeername(fd, (struct sockaddr *)&addr, &addr_len) == -1)
+    {
+        return 0;
+    }
+    source_key(&addr, key);
+    return source_hash(key);
+}
+
+static void source_key(const struct sockaddr_storage *addr, uint8_t key[SOURCE_KEY_LEN])
+{
+    memset(key, 0, SOURCE_KEY_LEN);
+    if(addr->ss_family == AF_INET6)
+    {
+        memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, SOURCE_KEY_LEN);
+    }
+    else if(addr->ss_family == AF_INET)
+    {
+        key[10] = 0xff;
+        key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, sizeof(struct in_addr));
+    }
+}
+
+static uint32_t source_hash(const uint8_t key[SOURCE_KEY_LEN])
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    for(size_t i = 0; i < SOURCE_KEY_LEN; i++)
+    {
+        hash ^= key[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Linear probe for the key's slot. A slot whose count dropped to zero keeps its
+ * key so later probe sequences stay intact, and is reused by the first new
+ * source that passes it.
+ * Returns the key's slot, a free one for a new key, or -1 if the table is full.
+ */
+static int source_find(const uint8_t key[SOURCE_KEY_LEN])
+{
+    size_t slot  = source_hash(key) & source_mask;
+    int    spare = -1;
+
+    for(size_t probes = 0; probes <= source_mask; probes++, slot = (slot + 1) & source_mask)
+    {
+        if(!sources[slot].used)
+        {
+            return spare >= 0 ? spare : (int)slot;
+        }
+        if(memcmp(sources[slot].key, key, SOURCE_KEY_LEN) == 0)
+        {
+            return (int)slot;
+        }
+        if(spare < 0 && sources[slot].count == 0)
+        {
+            spare = (int)slot;
+        }
+    }
+    return spare;
+}
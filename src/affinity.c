@@ -0,0 +1,143 @@
+/*******************************************************************************
+ * CPU Affinity
+ *
+ * Pins the server's processes to the cores given with -C, for deployments
+ * that reserve cores for it.
+ *
+ * - The listener takes the first core in the list.
+ * - Hashing workers and client processes are spread over the rest, workers
+ *   by index and clients round robin in accept order. With a single core in
+ *   the list everything shares it.
+ * - A process is pinned straight after fork, before it touches its
+ *   connection state and buffers. Linux places pages on the node of the core
+ *   that first touches them, so pinning first is what keeps that memory on
+ *   the local NUMA node; no explicit memory policy is needed.
+ *
+ * Pinning is only available where sched_setaffinity is (Linux); elsewhere -C
+ * is rejected at startup.
+ ******************************************************************************/
+
+#include "../include/affinity.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+    #include <sched.h>
+#endif
+
+#define BASE_TEN 10
+
+static void pin(unsigned int slot);
+
+static unsigned int cpus[AFFINITY_MAX_CPUS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned int cpu_count   = 0;            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned int next_client = 0;            // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: affinity_init
+ * Description: Parses a core list such as "0-3,8,10-11". A NULL list turns
+ *              pinning off.
+ * Returns: 0 on success, -1 if the list is malformed or pinning is not
+ *          supported here.
+ */
+int affinity_init(const char *cpu_list)
+{
+    const char *pos = cpu_list;
+
+    cpu_count = 0;
+    if(cpu_list == NULL)
+    {
+        return 0;
+    }
+#ifndef __linux__
+    fprintf(stderr, "CPU pinning is not supported on this platform\n");
+    return -1;
+#endif
+
+    while(*pos != '\0')
+    {
+        char         *end;
+        unsigned long first;
+        unsigned long last;
+
+        errno = 0;
+        first = strtoul(pos, &end, BASE_TEN);
+        if(errno != 0 || end == pos)
+        {
+            break;
+        }
+        last = first;
+        if(*end == '-')
+        {
+            pos  = end + 1;
+            last = strtoul(pos, &end, BASE_TEN);
+            if(errno != 0 || end == pos || last < first)
+            {
+                break;
+            }
+        }
+        for(unsigned long cpu = first; cpu <= last && cpu_count < AFFINITY_MAX_CPUS; cpu++)
+        {
+            cpus[cpu_count++] = (unsigned int)cpu;
+        }
+        if(*end == '\0')
+        {
+            return 0;
+        }
+        if(*end != ',')
+        {
+            break;
+        }
+        pos = end + 1;
+    }
+
+    fprintf(stderr, "Invalid CPU list '%s'\n", cpu_list);
+    cpu_count = 0;
+    return -1;
+}
+
+/* Pins the calling process, the listener, to the first listed core */
+void affinity_pin_listener(void)
+{
+    pin(0);
+}
+
+/* Pins a freshly forked hashing worker */
+void affinity_pin_worker(unsigned int worker)
+{
+    pin(cpu_count > 1 ? 1 + worker % (cpu_count - 1) : 0);
+}
+
+/* Called by the listener before each fork; returns the slot the client process pins itself to */
+unsigned int affinity_claim_client(void)
+{
+    return cpu_count > 1 ? 1 + next_client++ % (cpu_count - 1) : 0;
+}
+
+/* Pins a freshly forked client process to the slot claimed for it */
+void affinity_pin_client(unsigned int slot)
+{
+    pin(slot);
+}
+
+static void pin(unsigned int slot)
+{
+    if(cpu_count == 0)
+    {
+        return;
+    }
+#ifdef __linux__
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpus[slot], &set);
+        if(sched_setaffinity(0, sizeof(set), &set) == -1)
+        {
+            perror("affinity::sched_setaffinity");
+        }
+    }
+#else
+    (void)slot;
+#endif
+}
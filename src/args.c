@@ -1,12 +1,26 @@
 #include "../include/args.h"
 #include "../include/network.h"
+#include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define OPTION_MESSAGE_LEN 50
 #define IP_ADDRESS "0.0.0.0"
 #define PORT "8000"
+#define DRAIN_TIMEOUT_MS 5000
+#define WORKERS 4
+#define QUEUE_DEPTH 64
+#define USER_STORE "dbm"
+#define SHARDS 1
+#define MAX_CLIENTS 1024
+#define MAX_PER_SOURCE 32
+#define ACCEPT_RATE 200
+#define REPORT_MS 1000
+#define BASE_TEN 10
+
+static unsigned int convert_uint(const char *binary_name, const char *str);
 
 _Noreturn void usage(const char *app_name, int exit_code, const char *message)
 {
@@ -15,11 +29,34 @@ _Noreturn void usage(const char *app_name, int exit_code, const char *message)
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] -a <address> -p <port>\n", app_name);
+    fprintf(stderr, "Usage: %s [-h] -a <address> -p <port> [-u <path>] [-d <ms>] [-w <workers>] [-q <depth>] [-s <store>] [-F] [-S <shards>] [-c <n>] [-i <n>] [-r <n>] [-R] [-C <cpus>] [-B <us>] [-N <ip:port> -P <peers>] [-L <ip:port>] [-f <ip:port>] [-K <path>] [-m <ip:port>] [-T <ms>] [-k <path>] [-t <n>] [-l <us>]\n", app_name);
     fputs("Options:\n", stderr);
     fputs("  -h, --help                         Display this help message\n", stderr);
     fputs("  -a <address>, --address <address>  IP Address of the server.\n", stderr);
     fputs("  -p <port>,    --port <port>        PORT number of the server.\n", stderr);
+    fputs("  -u <path>,    --upgrade <path>     Unix socket used to hand the listener to a new binary.\n", stderr);
+    fputs("  -d <ms>,      --drain <ms>         Time allowed for clients to drain on shutdown (default 5000).\n", stderr);
+    fputs("  -w <n>,       --workers <n>        Password hashing worker processes (default 4).\n", stderr);
+    fputs("  -q <depth>,   --queue <depth>      Logins allowed to wait for a worker before rejecting (default 64).\n", stderr);
+    fputs("  -s <store>,   --store <store>      User storage backend, dbm or log (default dbm).\n", stderr);
+    fputs("  -F,           --fsync              Sync every user store write to disk before replying.\n", stderr);
+    fputs("  -S <n>,       --shards <n>         Partitions of the dbm store; changing it rebalances (default 1).\n", stderr);
+    fputs("  -c <n>,       --max-clients <n>    Clients served at once, 0 for no cap (default 1024).\n", stderr);
+    fputs("  -i <n>,       --per-source <n>     Clients served at once from one address, 0 for no cap (default 32).\n", stderr);
+    fputs("  -r <n>,       --accept-rate <n>    New connections accepted per second, 0 for no cap (default 200).\n", stderr);
+    fputs("  -R,           --resolve            Log client hostnames, looked up in the background.\n", stderr);
+    fputs("  -C <cpus>,    --cpus <cpus>        Pin the listener, workers and clients to these cores, e.g. 0-3,6.\n", stderr);
+    fputs("  -B <us>,      --busy-poll <us>     Spin this long for client input before sleeping (default 0, off).\n", stderr);
+    fputs("  -N <ip:port>, --node <ip:port>     Address this server takes links from other cluster nodes on.\n", stderr);
+    fputs("  -P <peers>,   --peers <peers>      The other nodes' -N addresses, e.g. 10.0.0.2:9300,10.0.0.3:9300.\n", stderr);
+    fputs("  -L <ip:port>, --replicate <addr>   Ship user store changes to standbys connecting here.\n", stderr);
+    fputs("  -f <ip:port>, --follow <addr>      Run as a read-only standby of this primary; SIGUSR1 promotes.\n", stderr);
+    fputs("  -K <path>,    --repl-key <path>    Secret file primary and standbys share; required with -L and -f.\n", stderr);
+    fputs("  -m <ip:port>, --manager <addr>     Report diagnostics and log lines to this server manager.\n", stderr);
+    fputs("  -T <ms>,      --report <ms>        Time between diagnostic reports (default 1000).\n", stderr);
+    fputs("  -k <path>,    --capture <path>     Record client packets to this file for test/replay; passwords are written as ********.\n", stderr);
+    fputs("  -t <n>,       --spans <n>          Time the stages of one request in n; SIGUSR2 prints them.\n", stderr);
+    fputs("  -l <us>,      --slow <us>          Time every request and keep those slower than this too.\n", stderr);
     exit(exit_code);
 }
 
@@ -28,13 +65,59 @@ void parse_args(int argc, char *argv[], Arguments *args)
     int opt;
 
     static struct option long_options[] = {
-        {"address", required_argument, NULL, 'a'},
-        {"port",    required_argument, NULL, 'p'},
-        {"help",    no_argument,       NULL, 'h'},
-        {NULL,      0,                 NULL, 0  }
+        {"address",     required_argument, NULL, 'a'},
+        {"port",        required_argument, NULL, 'p'},
+        {"upgrade",     required_argument, NULL, 'u'},
+        {"drain",       required_argument, NULL, 'd'},
+        {"workers",     required_argument, NULL, 'w'},
+        {"queue",       required_argument, NULL, 'q'},
+        {"store",       required_argument, NULL, 's'},
+        {"fsync",       no_argument,       NULL, 'F'},
+        {"shards",      required_argument, NULL, 'S'},
+        {"max-clients", required_argument, NULL, 'c'},
+        {"per-source",  required_argument, NULL, 'i'},
+        {"accept-rate", required_argument, NULL, 'r'},
+        {"resolve",     no_argument,       NULL, 'R'},
+        {"cpus",        required_argument, NULL, 'C'},
+        {"busy-poll",   required_argument, NULL, 'B'},
+        {"node",        required_argument, NULL, 'N'},
+        {"peers",       required_argument, NULL, 'P'},
+        {"replicate",   required_argument, NULL, 'L'},
+        {"follow",      required_argument, NULL, 'f'},
+        {"repl-key",    required_argument, NULL, 'K'},
+        {"manager",     required_argument, NULL, 'm'},
+        {"report",      required_argument, NULL, 'T'},
+        {"capture",     required_argument, NULL, 'k'},
+        {"spans",       required_argument, NULL, 't'},
+        {"slow",        required_argument, NULL, 'l'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL, 0  }
     };
 
-    while((opt = getopt_long(argc, argv, "ha:p:", long_options, NULL)) != -1)
+    args->drain_timeout_ms = DRAIN_TIMEOUT_MS;
+    args->workers          = WORKERS;
+    args->queue_depth      = QUEUE_DEPTH;
+    args->store            = USER_STORE;
+    args->store_sync       = 0;
+    args->shards           = SHARDS;
+    args->max_clients      = MAX_CLIENTS;
+    args->max_per_source   = MAX_PER_SOURCE;
+    args->accept_rate      = ACCEPT_RATE;
+    args->resolve_names    = 0;
+    args->cpu_list         = NULL;
+    args->busy_poll_us     = 0;
+    args->node             = NULL;
+    args->peers            = NULL;
+    args->replicate_on     = NULL;
+    args->follow           = NULL;
+    args->repl_key         = NULL;
+    args->manager          = NULL;
+    args->report_ms        = REPORT_MS;
+    args->capture          = NULL;
+    args->span_every       = 0;
+    args->span_slow_us     = 0;
+
+    while((opt = getopt_long(argc, argv, "ha:p:u:d:w:q:s:FS:c:i:r:RC:B:N:P:L:f:K:m:T:k:t:l:", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -44,10 +127,79 @@ void parse_args(int argc, char *argv[], Arguments *args)
             case 'p':
                 args->port = convert_port(argv[0], optarg);
                 break;
+            case 'u':
+                args->upgrade_path = optarg;
+                break;
+            case 'd':
+                args->drain_timeout_ms = convert_uint(argv[0], optarg);
+                break;
+            case 'w':
+                args->workers = convert_uint(argv[0], optarg);
+                break;
+            case 'q':
+                args->queue_depth = convert_uint(argv[0], optarg);
+                break;
+            case 's':
+                args->store = optarg;
+                break;
+            case 'F':
+                args->store_sync = 1;
+                break;
+            case 'S':
+                args->shards = convert_uint(argv[0], optarg);
+                break;
+            case 'c':
+                args->max_clients = convert_uint(argv[0], optarg);
+                break;
+            case 'i':
+                args->max_per_source = convert_uint(argv[0], optarg);
+                break;
+            case 'r':
+                args->accept_rate = convert_uint(argv[0], optarg);
+                break;
+            case 'R':
+                args->resolve_names = 1;
+                break;
+            case 'C':
+                args->cpu_list = optarg;
+                break;
+            case 'B':
+                args->busy_poll_us = convert_uint(argv[0], optarg);
+                break;
+            case 'N':
+                args->node = optarg;
+                break;
+            case 'P':
+                args->peers = optarg;
+                break;
+            case 'L':
+                args->replicate_on = optarg;
+                break;
+            case 'f':
+                args->follow = optarg;
+                break;
+            case 'K':
+                args->repl_key = optarg;
+                break;
+            case 'm':
+                args->manager = optarg;
+                break;
+            case 'T':
+                args->report_ms = convert_uint(argv[0], optarg);
+                break;
+            case 'k':
+                args->capture = optarg;
+                break;
+            case 't':
+                args->span_every = convert_uint(argv[0], optarg);
+                break;
+            case 'l':
+                args->span_slow_us = convert_uint(argv[0], optarg);
+                break;
             case 'h':
                 usage(argv[0], EXIT_SUCCESS, NULL);
             case '?':
-                if(optopt != 'a' && optopt != 'p')
+                if(optopt != 'a' && optopt != 'p' && optopt != 'u' && optopt != 'd' && optopt != 'w' && optopt != 'q' && optopt != 's' && optopt != 'S' && optopt != 'c' && optopt != 'i' && optopt != 'r' && optopt != 'C' && optopt != 'B' && optopt != 'N' && optopt != 'P' && optopt != 'L' && optopt != 'f' && optopt != 'K' && optopt != 'm' && optopt != 'T' && optopt != 'k' && optopt != 't' && optopt != 'l')
                 {
                     char message[OPTION_MESSAGE_LEN];
                     snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
@@ -80,4 +232,41 @@ void check_args(const char *program, const Arguments *args)
     {
         usage(program, EXIT_FAILURE, "Missing port number.");
     }
+    if((args->node == NULL) != (args->peers == NULL))
+    {
+        usage(program, EXIT_FAILURE, "Cluster mode needs both -N and -P.");
+    }
+    // A standby is sent every password hash, so only one holding the key may follow
+    if((args->replicate_on != NULL || args->follow != NULL) && args->repl_key == NULL)
+    {
+        usage(program, EXIT_FAILURE, "Replication (-L or -f) needs a shared key file, -K.");
+    }
+    if(args->report_ms == 0)
+    {
+        usage(program, EXIT_FAILURE, "The report interval must be at least 1 ms.");
+    }
+}
+
+/* Convert a non-negative decimal option value */
+static unsigned int convert_uint(const char *binary_name, const char *str)
+{
+    char     *endptr;
+    uintmax_t parsed_value;
+
+    errno        = 0;
+    parsed_value = strtoumax(str, &endptr, BASE_TEN);
+    if(errno != 0)
+    {
+        perror("Error parsing option value");
+        exit(EXIT_FAILURE);
+    }
+    if(*endptr != '\0' || *str == '-')
+    {
+        usage(binary_name, EXIT_FAILURE, "Invalid characters in input.");
+    }
+    if(parsed_value > UINT32_MAX)
+    {
+        usage(binary_name, EXIT_FAILURE, "Option value out of range.");
+    }
+    return (unsigned int)parsed_value;
 }
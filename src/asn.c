@@ -1,22 +1,31 @@
 #include "../include/asn.h"
+#include "../include/compress.h"
+#include "../include/utf8.h"
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define FIELD_TL 2 /* tag and length octets ahead of every field */
+
 static int  decode_uint8(const uint8_t buf[], int pos);
 static int  decode_uint16(const uint8_t buf[], int pos);
+static int  decode_uint32(const uint8_t buf[], int pos);
 static int  decode_int(const uint8_t buf[], int pos);
 static int  decode_enum(const uint8_t buf[], int pos);
 static int  decode_str(const uint8_t buf[], int pos);
 static int  decode_time(const uint8_t buf[], int pos);
 static int  check_header(const header_t *header);
 static void print_header(const header_t *header);
-static int  decode_field(const uint8_t buf[], int pos);
-static int  encode_uint8(uint8_t buf[], uint8_t i, int pos, int asntype);
-static int  encode_uint16(uint8_t buf[], uint16_t i, int pos, int asntype);
-static int  encode_str(uint8_t buf[], const char *str, int pos, int asntype);
-static void encode_header(uint8_t buf[], const header_t *header);
+static int  decode_field(const uint8_t buf[], int pos, int end);
+static int  decode_fields(const uint8_t buf[], int pos, int len);
+static int  decode_batch(const uint8_t buf[], const header_t *header, asn_batch *batch);
+static int  decode_seq_len(const uint8_t buf[], int pos, int end, int *len);
+static int  is_batchable(uint8_t packet_type);
+static int  is_compressible(uint8_t packet_type);
+static int  check_fields(uint8_t packet_type, const uint8_t buf[], int pos, int len);
+static void str_view(asn_str *view, const char *str);
+static int  copy_view(const asn_str *view, char out[], size_t out_size);
 
 /*
  * Errors
@@ -41,6 +50,14 @@ static int decode_uint16(const uint8_t buf[], int pos)
     return (int)sizeof(uint16_t);
 }
 
+static int decode_uint32(const uint8_t buf[], int pos)
+{
+    uint32_t copy;
+    memcpy(&copy, buf + pos, sizeof(uint32_t));
+    printf("uint32: %u\n", ntohl(copy));
+    return (int)sizeof(uint32_t);
+}
+
 /* following a ASN_INT tag, pos would land on len */
 static int decode_int(const uint8_t buf[], int pos)
 {
@@ -59,6 +76,9 @@ static int decode_int(const uint8_t buf[], int pos)
         case 2:
             res = decode_uint16(buf, pos + 1);
             break;
+        case 4:
+            res = decode_uint32(buf, pos + 1);
+            break;
         default:
             fprintf(stderr, "Invalid Integer Length: %d\n", len);
             return INVALIDINTEGERLENGTH;
@@ -82,6 +102,11 @@ static int decode_str(const uint8_t buf[], int pos)
         fprintf(stderr, "Field length of Zero\n");
         return FIELDLENGTHOFZERO;
     }
+    if(utf8_check(buf + pos + 1, (size_t)len) < 0)
+    {
+        fprintf(stderr, "Invalid string encoding\n");
+        return INVALIDSTRING;
+    }
     msg = (char *)malloc((size_t)len + 1);
     if(msg == NULL)
     {
@@ -137,27 +162,24 @@ void decode_header(const uint8_t buf[], header_t *header)
     header->payload_len = ntohs(payload_len);
 }
 
+/* The accepted types, their versions and their limits come from protocol.def */
 static int check_header(const header_t *header)
 {
-    uint8_t  h = header->packet_type;
-    uint16_t plen;
+    const asn_packet_info *info = &asn_packets[header->packet_type];
 
-    if(h != SYS_SUCCESS && h != SYS_ERROR && h != ACC_LOGIN && h != ACC_LOGIN_SUCCESS && h != ACC_LOGOUT && h != ACC_CREATE && h != ACC_EDIT && h != CHT_SEND && h != LST_GET && h != LST_RESPONSE)
+    if(!(info->flags & ASN_ACCEPTED))
     {
-        fprintf(stderr, "Unrecognized Packet Type: %u\n", h);
+        fprintf(stderr, "Unrecognized Packet Type: %u\n", header->packet_type);
         return UNRECOGNIZEDPACKETTYPE;
     }
 
-    h = header->version;
-
-    if(h > CURRVER)
+    if(header->version > MAXVER || header->version < info->since)
     {
-        fprintf(stderr, "Unsupported Version: %u\n", h);
+        fprintf(stderr, "Unsupported Version: %u\n", header->version);
         return UNSUPPORTEDVERSION;
     }
 
-    plen = header->payload_len;
-    if(plen > MAXPAYLOADLEN)
+    if(header->payload_len > info->max_payload)
     {
         fprintf(stderr, "Exceeded Max Payload Length\n");
         return EXCEEDMAXPAYLOAD;
@@ -171,11 +193,26 @@ static void print_header(const header_t *header)
     printf("***HEADER***\nPacket Type: %u\nVersion: %u\nSender ID: %u\nPayload Length: %u\n***PAYLOAD***\n", header->packet_type, header->version, header->sender_id, header->payload_len);
 }
 
-/* returns # of bytes decoded */
-static int decode_field(const uint8_t buf[], int pos)
+/* returns # of bytes decoded; the field must end by end */
+static int decode_field(const uint8_t buf[], int pos, int end)
 {
-    int     res  = 0;
-    uint8_t type = buf[pos];
+    int     res = 0;
+    int     value_len;
+    uint8_t type;
+
+    // The lengths in a raw message are the sender's; none may reach past the message
+    if(end - pos < FIELD_TL)
+    {
+        fprintf(stderr, "Field overruns its message\n");
+        return FIELDLENGTHOFZERO;
+    }
+    type      = buf[pos];
+    value_len = (type == ASN_ENUM) ? 1 : buf[pos + 1];
+    if(end - pos - FIELD_TL < value_len)
+    {
+        fprintf(stderr, "Field overruns its message\n");
+        return FIELDLENGTHOFZERO;
+    }
     switch(type)
     {
         case ASN_INT:
@@ -197,7 +234,34 @@ static int decode_field(const uint8_t buf[], int pos)
     return (res > 0) ? res + 1 : res;
 }
 
-int decode_packet(const uint8_t buf[], const header_t *header)
+/* Decodes the len bytes of fields starting at pos */
+static int decode_fields(const uint8_t buf[], int pos, int len)
+{
+    int end       = pos + len;
+    int remaining = len;
+    while(remaining > 0)
+    {
+        int decoded = decode_field(buf, pos, end);
+        if(decoded < 0)
+        {
+            return decoded;
+        }
+        remaining -= decoded;
+        pos += decoded;
+    }
+    return (remaining == 0) ? 0 : FIELDLENGTHOFZERO;
+}
+
+/* Checks a message against its generated decoder, walking the fields of a type protocol.def leaves raw */
+static int check_fields(uint8_t packet_type, const uint8_t buf[], int pos, int len)
+{
+    int res = asn_decode_fields(packet_type, buf, pos, len);
+
+    return (res == ASN_RAW) ? decode_fields(buf, pos, len) : res;
+}
+
+/* batch receives the messages of a BATCH frame and may be NULL for any other packet */
+int decode_packet(const uint8_t buf[], const header_t *header, asn_batch *batch)
 {
     int header_res;
     print_header(header);
@@ -206,54 +270,136 @@ int decode_packet(const uint8_t buf[], const header_t *header)
     {
         return header_res;
     }
-    if(header->payload_len > 0)
+    if(header->packet_type == BATCH)
     {
-        int remaining = header->payload_len;
-        int pos       = HEADERLEN;
-        while(remaining)
+        return (batch != NULL) ? decode_batch(buf, header, batch) : UNRECOGNIZEDPACKETTYPE;
+    }
+    return check_fields(header->packet_type, buf, HEADERLEN, header->payload_len);
+}
+
+/* Messages that may share a frame; login and account creation wait on a hash, so they travel alone */
+static int is_batchable(uint8_t packet_type)
+{
+    return asn_packets[packet_type].flags & ASN_BATCHABLE;
+}
+
+/* Reads a BER definite length at pos: one byte below 0x80, else 0x81 or 0x82 and that many bytes. Returns the position after it */
+static int decode_seq_len(const uint8_t buf[], int pos, int end, int *len)
+{
+    int octets;
+
+    if(pos >= end)
+    {
+        return FIELDLENGTHOFZERO;
+    }
+    if(buf[pos] < 0x80)
+    {
+        *len = buf[pos];
+        return pos + 1;
+    }
+    octets = buf[pos] & 0x7f;
+    if(octets < 1 || octets > 2 || pos + 1 + octets > end)
+    {
+        return INVALIDINTEGERLENGTH;
+    }
+    *len = (octets == 1) ? buf[pos + 1] : (buf[pos + 1] << 8) | buf[pos + 2];
+    return pos + 1 + octets;
+}
+
+/* Checks every message of a BATCH frame and records where each one is, in a single pass */
+static int decode_batch(const uint8_t buf[], const header_t *header, asn_batch *batch)
+{
+    int pos = HEADERLEN;
+    int end = HEADERLEN + header->payload_len;
+
+    batch->count = 0;
+    while(pos < end)
+    {
+        int len;
+        int res;
+
+        if(buf[pos] != ASN_SEQ)
         {
-            int decoded = decode_field(buf, pos);
-            if(decoded < 0)
-            {
-                return decoded;
-            }
-            remaining -= decoded;
-            pos += decoded;
+            fprintf(stderr, "Unrecognized tag type: %u\n", buf[pos]);
+            return UNRECOGNIZEDTAGTYPE;
         }
+        pos = decode_seq_len(buf, pos + 1, end, &len);
+        if(pos < 0)
+        {
+            return pos;
+        }
+        if(len < 1 || pos + len > end)
+        {
+            return FIELDLENGTHOFZERO;
+        }
+        if(!is_batchable(buf[pos]) || batch->count == BATCH_MAX_MSGS)
+        {
+            fprintf(stderr, "Unrecognized Packet Type in batch: %u\n", buf[pos]);
+            return UNRECOGNIZEDPACKETTYPE;
+        }
+
+        res = check_fields(buf[pos], buf, pos + 1, len - 1);
+        if(res < 0)
+        {
+            return res;
+        }
+        batch->msgs[batch->count].packet_type = buf[pos];
+        batch->msgs[batch->count].offset      = (uint16_t)(pos + 1);
+        batch->msgs[batch->count].len         = (uint16_t)(len - 1);
+        batch->count++;
+        pos += len;
     }
     return 0;
 }
 
-static int encode_uint8(uint8_t buf[], uint8_t i, int pos, int asntype)
+/* Points view at str, which the encoders copy without its terminator */
+static void str_view(asn_str *view, const char *str)
 {
-    buf[pos++] = (uint8_t)asntype;
-    buf[pos++] = 1;
-    buf[pos++] = i;
-    return pos;
+    view->text = (const uint8_t *)str;
+    view->len  = strnlen(str, UINT8_MAX);
 }
 
-static int encode_uint16(uint8_t buf[], uint16_t i, int pos, int asntype)
+/* Copies a decoded ASN_STR into out as a C string; fails if it does not fit */
+static int copy_view(const asn_str *view, char out[], size_t out_size)
 {
-    uint16_t copy = htons(i);
-    size_t   len  = sizeof(uint16_t);
-    buf[pos++]    = (uint8_t)asntype;
-    buf[pos++]    = (uint8_t)len;
-    memcpy(buf + pos, &copy, len);
-    return pos + (int)len;
+    if(view->len >= out_size)
+    {
+        return INVALIDAUTHINFO;
+    }
+    memcpy(out, view->text, view->len);
+    out[view->len] = '\0';
+    return 0;
 }
 
-/* returns new position */
-static int encode_str(uint8_t buf[], const char *str, int pos, int asntype)
+/* ACC_LOGIN and ACC_CREATE carry username then password; fails if either does not fit */
+int decode_acc_req(const uint8_t buf[], const header_t *header, char username[], size_t username_size, char password[], size_t password_size)
 {
-    size_t len = strlen(str);
-    buf[pos++] = (uint8_t)asntype;
-    buf[pos++] = (uint8_t)len;
-    // NOLINTNEXTLINE(bugprone-not-null-terminated-result)
-    memcpy(buf + pos, str, len);
-    return pos + (int)len;
+    asn_acc_login req;
+    int           res = asn_decode_acc_login(buf, HEADERLEN, header->payload_len, &req);
+
+    if(res < 0)
+    {
+        return res;
+    }
+    res = copy_view(&req.username, username, username_size);
+    return (res < 0) ? res : copy_view(&req.password, password, password_size);
 }
 
-static void encode_header(uint8_t buf[], const header_t *header)
+/* Reads the token and sequence number of an ACC_RESUME */
+int decode_resume_req(const uint8_t buf[], const header_t *header, char token[], size_t token_size, uint32_t *received)
+{
+    asn_acc_resume req;
+    int            res = asn_decode_acc_resume(buf, HEADERLEN, header->payload_len, &req);
+
+    if(res < 0)
+    {
+        return res;
+    }
+    *received = req.received;
+    return copy_view(&req.token, token, token_size);
+}
+
+void encode_header(uint8_t buf[], const header_t *header)
 {
     uint16_t copy;
     int      pos   = 1;
@@ -271,82 +417,273 @@ static void encode_header(uint8_t buf[], const header_t *header)
 /* returns total packet length */
 int encode_sys_success_res(uint8_t buf[], uint8_t packet_type)
 {
-    header_t header = {SYS_SUCCESS, CURRVER, SYSID, SYS_SUCCESS_LEN};
-    encode_header(buf, &header);
-    encode_uint8(buf, packet_type, HEADERLEN, ASN_ENUM);
+    asn_sys_success res = {packet_type};
 
-    return HEADERLEN + SYS_SUCCESS_LEN;
+    return asn_encode_sys_success(buf, CURRVER, SYSID, &res);
 }
 
 int encode_sys_error_res(uint8_t buf[], int err)
 {
-    uint8_t     errcode;
-    const char *msg;
-    int         pos = HEADERLEN;
-    int         len;
-    header_t    header = {SYS_ERROR, CURRVER, SYSID, 0};
+    uint8_t       errcode;
+    const char   *text;
+    asn_sys_error res;
     switch(err)
     {
         /* more added later */
         case UNRECOGNIZEDTAGTYPE:
             errcode = EC_GENSERVER;
-            msg     = "Unrecognized Tag Type";
+            text    = "Unrecognized Tag Type";
             break;
         case INVALIDINTEGERLENGTH:
             errcode = EC_GENSERVER;
-            msg     = "Invalid Integer Length";
+            text    = "Invalid Integer Length";
             break;
         case FIELDLENGTHOFZERO:
             errcode = EC_GENSERVER;
-            msg     = "Field Length of Zero";
+            text    = "Field Length of Zero";
             break;
         case UNRECOGNIZEDPACKETTYPE:
             errcode = EC_INVREQ;
-            msg     = "Unrecognized Packet Type";
+            text    = "Unrecognized Packet Type";
             break;
         case UNSUPPORTEDVERSION:
             errcode = EC_INVREQ;
-            msg     = "Unsupported Version";
+            text    = "Unsupported Version";
             break;
         case EXCEEDMAXPAYLOAD:
             errcode = EC_INVREQ;
-            msg     = "Exceeded Max Payload Length";
+            text    = "Exceeded Max Payload Length";
+            break;
+        case SERVERSHUTDOWN:
+            errcode = EC_GENSERVER;
+            text    = "Server Shutting Down";
+            break;
+        case INVALIDUSERID:
+            errcode = EC_INVUSERID;
+            text    = "Invalid User ID";
+            break;
+        case USEREXISTS:
+            errcode = EC_USEREXISTS;
+            text    = "User Already Exists";
+            break;
+        case INVALIDAUTHINFO:
+            errcode = EC_INVAUTHINFO;
+            text    = "Invalid Authentication Information";
+            break;
+        case SERVERBUSY:
+            errcode = EC_GENSERVER;
+            text    = "Server Busy";
+            break;
+        case NOUSERIDS:
+            errcode = EC_GENSERVER;
+            text    = "No User IDs Available";
+            break;
+        case RATELIMITED:
+            errcode = EC_GENSERVER;
+            text    = "Rate Limit Exceeded";
+            break;
+        case READONLY:
+            errcode = EC_GENSERVER;
+            text    = "Read-only Standby";
+            break;
+        case INVALIDSTRING:
+            errcode = EC_INVREQ;
+            text    = "Invalid String Encoding";
             break;
         default:
             errcode = EC_GENSERVER;
-            msg     = "Server Error";
+            text    = "Server Error";
     }
-    len                = (int)strlen(msg) + 2; /* plus tag & len */
-    header.payload_len = (uint16_t)(U8ENCODELEN + len);
-    encode_header(buf, &header);
-    pos = encode_uint8(buf, errcode, pos, ASN_ENUM);
-    encode_str(buf, msg, pos, ASN_STR);
-    return HEADERLEN + U8ENCODELEN + len;
+    res.code = errcode;
+    str_view(&res.message, text);
+    return asn_encode_sys_error(buf, CURRVER, SYSID, &res);
 }
 
-int encode_acc_login_success_res(uint8_t buf[], uint16_t user_id)
+/*
+ * A token (NULL for clients before RESUMEVER) adds the resume token and the
+ * sequence number of the first queued packet about to follow.
+ */
+int encode_acc_login_success_res(uint8_t buf[], uint16_t user_id, const char *token, uint32_t first_seq)
 {
-    header_t header = {ACC_LOGIN_SUCCESS, CURRVER, SYSID, ACC_LOGIN_SUCCESS_LEN};
-    encode_header(buf, &header);
-    encode_uint16(buf, user_id, HEADERLEN, ASN_INT);
-    return HEADERLEN + ACC_LOGIN_SUCCESS_LEN;
+    asn_acc_login_success res = {user_id, token != NULL, {NULL, 0}, first_seq};
+
+    if(token == NULL)
+    {
+        return asn_encode_acc_login_success(buf, CURRVER, SYSID, &res);
+    }
+    str_view(&res.token, token);
+    return asn_encode_acc_login_success(buf, RESUMEVER, SYSID, &res);
 }
 
-int encode_cht_send(uint8_t buf[])
+/*
+ * Adds a complete packet, as built by the encoders above, to the BATCH frame
+ * being built in batch, whose messages end at pos (HEADERLEN when empty).
+ * Returns the new end, or -1 if the packet does not fit.
+ */
+int encode_batch_append(uint8_t batch[], int pos, const uint8_t packet[], int packet_len)
 {
-    // hardcoded packet
-    int            pos       = HEADERLEN;
-    const uint16_t id        = (uint16_t)69420;
-    const char    *timestamp = "20250304160000Z";
-    const char    *content   = "Hello from the test server";
-    const char    *username  = "Banunu";
-    header_t       header    = {CHT_SEND, CURRVER, id, 0};
+    int len = packet_len - HEADERLEN + 1; /* packet type + fields */
+    int len_octets;
+
+    len_octets = (len < 0x80) ? 1 : (len <= UINT8_MAX) ? 2 : 3;
+    if(pos + 1 + len_octets + len > BATCHPACKETLEN)
+    {
+        return -1;
+    }
+    batch[pos++] = ASN_SEQ;
+    if(len_octets == 1)
+    {
+        batch[pos++] = (uint8_t)len;
+    }
+    else if(len_octets == 2)
+    {
+        batch[pos++] = 0x81;
+        batch[pos++] = (uint8_t)len;
+    }
+    else
+    {
+        batch[pos++] = 0x82;
+        batch[pos++] = (uint8_t)(len >> 8);
+        batch[pos++] = (uint8_t)len;
+    }
+    batch[pos++] = packet[0];
+    memcpy(batch + pos, packet + HEADERLEN, (size_t)(len - 1));
+    return pos + len - 1;
+}
 
-    pos = encode_str(buf, timestamp, pos, ASN_TIME);
-    pos = encode_str(buf, content, pos, ASN_STR);
-    pos = encode_str(buf, username, pos, ASN_STR);
+/* Writes the header of a BATCH frame whose messages end at pos; returns the frame length */
+int encode_batch_header(uint8_t batch[], int pos)
+{
+    header_t header = {BATCH, BATCHVER, SYSID, 0};
 
     header.payload_len = (uint16_t)(pos - HEADERLEN);
-    encode_header(buf, &header);
+    encode_header(batch, &header);
     return pos;
 }
+
+/* Replies large and repetitive enough to be worth compressing */
+static int is_compressible(uint8_t packet_type)
+{
+    return asn_packets[packet_type].flags & ASN_COMPRESSIBLE;
+}
+
+/*
+ * Function: encode_compressed
+ * Description: Wraps an encoded reply in a COMPRESSED packet for a client
+ *              speaking COMPRESSVER. The payload holds the reply's type,
+ *              version and payload length, then its payload compressed;
+ *              the sender id stays in the outer header. dst must hold
+ *              packet_len bytes.
+ * Returns: the length written to dst, or -1 if the reply is not a type that
+ *          is compressed, is too small, or would not shrink.
+ */
+int encode_compressed(uint8_t dst[], const uint8_t packet[], int packet_len)
+{
+    header_t inner;
+    header_t header;
+    int      pos = HEADERLEN + CMPPREFIXLEN;
+    int      len;
+
+    decode_header(packet, &inner);
+    if(!is_compressible(inner.packet_type) || packet_len - HEADERLEN < COMPRESS_MIN_LEN)
+    {
+        return -1;
+    }
+    len = compress_block(packet + HEADERLEN, packet_len - HEADERLEN, dst + pos, packet_len - pos - 1);
+    if(len < 0)
+    {
+        return -1;
+    }
+
+    dst[HEADERLEN]     = inner.packet_type;
+    dst[HEADERLEN + 1] = inner.version;
+    memcpy(dst + HEADERLEN + 2, packet + HEADERLEN - sizeof(uint16_t), sizeof(uint16_t));
+    header.packet_type = COMPRESSED;
+    header.version     = COMPRESSVER;
+    header.sender_id   = inner.sender_id;
+    header.payload_len = (uint16_t)(CMPPREFIXLEN + len);
+    encode_header(dst, &header);
+    return pos + len;
+}
+
+int encode_cht_send(uint8_t buf[])
+{
+    // hardcoded packet
+    const uint16_t id = (uint16_t)69420;
+    asn_cht_send   msg;
+
+    str_view(&msg.timestamp, "20250304160000Z");
+    str_view(&msg.content, "Hello from the test server");
+    str_view(&msg.username, "Banunu");
+    return asn_encode_cht_send(buf, CURRVER, id, &msg);
+}
+
+int encode_svr_diagnostic(uint8_t buf[], const svr_diagnostic *diag)
+{
+    asn_svr_diagnostic msg;
+
+    msg.uptime_sec   = diag->uptime_sec;
+    msg.users_online = diag->users_online;
+    msg.messages     = diag->messages;
+    msg.logins       = diag->logins;
+    msg.errors_count = 0;
+    for(int code = 1; code < SVR_ERROR_CODES; code++)
+    {
+        if(diag->errors[code] != 0)
+        {
+            msg.errors[msg.errors_count].code  = (uint8_t)code;
+            msg.errors[msg.errors_count].count = diag->errors[code];
+            msg.errors_count++;
+        }
+    }
+    return asn_encode_svr_diagnostic(buf, CURRVER, SYSID, &msg);
+}
+
+/* Reads the len bytes of SVR_DIAGNOSTIC fields at pos, as found alone or in a BATCH */
+int decode_svr_diagnostic(const uint8_t buf[], int pos, int len, svr_diagnostic *diag)
+{
+    asn_svr_diagnostic msg;
+    int                res = asn_decode_svr_diagnostic(buf, pos, len, &msg);
+
+    if(res < 0)
+    {
+        return res;
+    }
+    memset(diag, 0, sizeof(*diag));
+    diag->uptime_sec   = msg.uptime_sec;
+    diag->users_online = msg.users_online;
+    diag->messages     = msg.messages;
+    diag->logins       = msg.logins;
+    for(int i = 0; i < msg.errors_count; i++)
+    {
+        if(msg.errors[i].code < SVR_ERROR_CODES)
+        {
+            diag->errors[msg.errors[i].code] = msg.errors[i].count;
+        }
+    }
+    return 0;
+}
+
+/* Longer lines are cut at SVR_LOG_MAX bytes */
+int encode_svr_log(uint8_t buf[], int level, const char *msg)
+{
+    asn_svr_log log;
+
+    log.level = (uint8_t)level;
+    str_view(&log.message, msg);
+    return asn_encode_svr_log(buf, CURRVER, SYSID, &log);
+}
+
+/* Reads the len bytes of SVR_LOG fields at pos */
+int decode_svr_log(const uint8_t buf[], int pos, int len, int *level, char msg[], size_t msg_size)
+{
+    asn_svr_log log;
+    int         res = asn_decode_svr_log(buf, pos, len, &log);
+
+    if(res < 0)
+    {
+        return res;
+    }
+    *level = log.level;
+    return copy_view(&log.message, msg, msg_size);
+}
@@ -0,0 +1,644 @@
+/* Generated by generate-asn.sh from protocol.def: edit that file and rerun the script. */
+
+#include "../include/asn.h"
+#include "../include/utf8.h"
+#include <netinet/in.h>
+#include <string.h>
+
+#define ASN_TL (2) /* tag and length octets ahead of every field */
+
+static int asn_field_error(const uint8_t buf[], int pos, int end, uint8_t tag, int size);
+
+const asn_packet_info asn_packets[UINT8_MAX + 1] = {
+    [SYS_SUCCESS]       = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [SYS_ERROR]         = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [ACC_LOGIN]         = {ASN_ACCEPTED, 0, MAXPAYLOADLEN},
+    [ACC_LOGIN_SUCCESS] = {ASN_ACCEPTED, 0, MAXPAYLOADLEN},
+    [ACC_LOGOUT]        = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [ACC_CREATE]        = {ASN_ACCEPTED, 0, MAXPAYLOADLEN},
+    [ACC_EDIT]          = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [ACC_RESUME]        = {ASN_ACCEPTED, RESUMEVER, MAXPAYLOADLEN},
+    [CHT_SEND]          = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [LST_GET]           = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [LST_RESPONSE]      = {ASN_ACCEPTED | ASN_BATCHABLE | ASN_COMPRESSIBLE, 0, MAXPAYLOADLEN},
+    [GRP_JOIN]          = {0, 0, MAXPAYLOADLEN},
+    [GRP_EXIT]          = {0, 0, MAXPAYLOADLEN},
+    [GRP_CREATE]        = {0, 0, MAXPAYLOADLEN},
+    [HST_GET]           = {ASN_COMPRESSIBLE, 0, MAXPAYLOADLEN},
+    [BATCH]             = {ASN_ACCEPTED | ASN_COMPRESSIBLE, BATCHVER, MAXBATCHPAYLOADLEN},
+    [COMPRESSED]        = {0, 0, MAXPAYLOADLEN},
+    [SVR_DIAGNOSTIC]    = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+    [SVR_LOG]           = {ASN_ACCEPTED | ASN_BATCHABLE, 0, MAXPAYLOADLEN},
+};
+
+/*
+ * Function: asn_decode_fields
+ * Description: Checks the len bytes of fields at pos against the description
+ *              of packet_type, as found in a packet or a BATCH message.
+ * Returns: 0 if they match, a negative error code if not, or ASN_RAW for a
+ *          type whose fields are not described.
+ */
+int asn_decode_fields(uint8_t packet_type, const uint8_t buf[], int pos, int len)
+{
+    switch(packet_type)
+    {
+        case SYS_SUCCESS:
+        {
+            asn_sys_success msg;
+            return asn_decode_sys_success(buf, pos, len, &msg);
+        }
+        case SYS_ERROR:
+        {
+            asn_sys_error msg;
+            return asn_decode_sys_error(buf, pos, len, &msg);
+        }
+        case ACC_LOGIN:
+        {
+            asn_acc_login msg;
+            return asn_decode_acc_login(buf, pos, len, &msg);
+        }
+        case ACC_LOGIN_SUCCESS:
+        {
+            asn_acc_login_success msg;
+            return asn_decode_acc_login_success(buf, pos, len, &msg);
+        }
+        case ACC_LOGOUT:
+            return (len == 0) ? 0 : FIELDLENGTHOFZERO;
+        case ACC_CREATE:
+        {
+            asn_acc_create msg;
+            return asn_decode_acc_create(buf, pos, len, &msg);
+        }
+        case ACC_RESUME:
+        {
+            asn_acc_resume msg;
+            return asn_decode_acc_resume(buf, pos, len, &msg);
+        }
+        case CHT_SEND:
+        {
+            asn_cht_send msg;
+            return asn_decode_cht_send(buf, pos, len, &msg);
+        }
+        case SVR_DIAGNOSTIC:
+        {
+            asn_svr_diagnostic msg;
+            return asn_decode_svr_diagnostic(buf, pos, len, &msg);
+        }
+        case SVR_LOG:
+        {
+            asn_svr_log msg;
+            return asn_decode_svr_log(buf, pos, len, &msg);
+        }
+        default:
+            return ASN_RAW;
+    }
+}
+
+int asn_encode_sys_success(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_sys_success *msg)
+{
+    header_t header = {SYS_SUCCESS, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+
+    buf[pos]     = ASN_ENUM;
+    buf[pos + 1] = 1;
+    buf[pos + 2] = msg->packet_type;
+    pos += U8ENCODELEN;
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_sys_success(const uint8_t buf[], int pos, int len, asn_sys_success *msg)
+{
+    int end = pos + len;
+
+    if(end - pos < U8ENCODELEN || buf[pos] != ASN_ENUM || buf[pos + 1] != 1)
+    {
+        return asn_field_error(buf, pos, end, ASN_ENUM, 1);
+    }
+    msg->packet_type = buf[pos + ASN_TL];
+    pos += U8ENCODELEN;
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_sys_error(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_sys_error *msg)
+{
+    header_t header = {SYS_ERROR, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    size_t   len;
+
+    buf[pos]     = ASN_ENUM;
+    buf[pos + 1] = 1;
+    buf[pos + 2] = msg->code;
+    pos += U8ENCODELEN;
+
+    len          = msg->message.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->message.text, len);
+    pos += ASN_TL + (int)len;
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_sys_error(const uint8_t buf[], int pos, int len, asn_sys_error *msg)
+{
+    int end = pos + len;
+
+    if(end - pos < U8ENCODELEN || buf[pos] != ASN_ENUM || buf[pos + 1] != 1)
+    {
+        return asn_field_error(buf, pos, end, ASN_ENUM, 1);
+    }
+    msg->code = buf[pos + ASN_TL];
+    pos += U8ENCODELEN;
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->message.text = buf + pos + ASN_TL;
+    msg->message.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_acc_login(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_login *msg)
+{
+    header_t header = {ACC_LOGIN, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    size_t   len;
+
+    len          = msg->username.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->username.text, len);
+    pos += ASN_TL + (int)len;
+
+    len          = msg->password.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->password.text, len);
+    pos += ASN_TL + (int)len;
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_acc_login(const uint8_t buf[], int pos, int len, asn_acc_login *msg)
+{
+    int end = pos + len;
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->username.text = buf + pos + ASN_TL;
+    msg->username.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->password.text = buf + pos + ASN_TL;
+    msg->password.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_acc_login_success(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_login_success *msg)
+{
+    header_t header = {ACC_LOGIN_SUCCESS, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    uint16_t u16;
+    uint32_t u32;
+    size_t   len;
+
+    u16          = htons(msg->user_id);
+    buf[pos]     = ASN_INT;
+    buf[pos + 1] = sizeof(u16);
+    memcpy(buf + pos + ASN_TL, &u16, sizeof(u16));
+    pos += ASN_TL + (int)sizeof(u16);
+
+    if(msg->has_token)
+    {
+        len          = msg->token.len;
+        buf[pos]     = ASN_STR;
+        buf[pos + 1] = (uint8_t)len;
+        memcpy(buf + pos + ASN_TL, msg->token.text, len);
+        pos += ASN_TL + (int)len;
+
+        u32          = htonl(msg->first_seq);
+        buf[pos]     = ASN_INT;
+        buf[pos + 1] = sizeof(u32);
+        memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+        pos += ASN_TL + (int)sizeof(u32);
+    }
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_acc_login_success(const uint8_t buf[], int pos, int len, asn_acc_login_success *msg)
+{
+    int      end = pos + len;
+    uint16_t u16;
+    uint32_t u32;
+
+    if(end - pos < ASN_TL + (int)sizeof(u16) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u16))
+    {
+        return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u16));
+    }
+    memcpy(&u16, buf + pos + ASN_TL, sizeof(u16));
+    msg->user_id = ntohs(u16);
+    pos += ASN_TL + (int)sizeof(u16);
+
+    msg->has_token = (pos < end);
+    if(msg->has_token)
+    {
+        if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+        {
+            return asn_field_error(buf, pos, end, ASN_STR, 255);
+        }
+        if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+        {
+            return INVALIDSTRING;
+        }
+        msg->token.text = buf + pos + ASN_TL;
+        msg->token.len  = buf[pos + 1];
+        pos += ASN_TL + buf[pos + 1];
+
+        if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+        {
+            return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+        }
+        memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+        msg->first_seq = ntohl(u32);
+        pos += ASN_TL + (int)sizeof(u32);
+    }
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_acc_create(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_create *msg)
+{
+    header_t header = {ACC_CREATE, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    size_t   len;
+
+    len          = msg->username.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->username.text, len);
+    pos += ASN_TL + (int)len;
+
+    len          = msg->password.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->password.text, len);
+    pos += ASN_TL + (int)len;
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_acc_create(const uint8_t buf[], int pos, int len, asn_acc_create *msg)
+{
+    int end = pos + len;
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->username.text = buf + pos + ASN_TL;
+    msg->username.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->password.text = buf + pos + ASN_TL;
+    msg->password.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_acc_resume(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_acc_resume *msg)
+{
+    header_t header = {ACC_RESUME, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    uint32_t u32;
+    size_t   len;
+
+    len          = msg->token.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->token.text, len);
+    pos += ASN_TL + (int)len;
+
+    u32          = htonl(msg->received);
+    buf[pos]     = ASN_INT;
+    buf[pos + 1] = sizeof(u32);
+    memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+    pos += ASN_TL + (int)sizeof(u32);
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_acc_resume(const uint8_t buf[], int pos, int len, asn_acc_resume *msg)
+{
+    int      end = pos + len;
+    uint32_t u32;
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->token.text = buf + pos + ASN_TL;
+    msg->token.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+
+    if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+    {
+        return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+    }
+    memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+    msg->received = ntohl(u32);
+    pos += ASN_TL + (int)sizeof(u32);
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_cht_send(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_cht_send *msg)
+{
+    header_t header = {CHT_SEND, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    size_t   len;
+
+    buf[pos]     = ASN_TIME;
+    buf[pos + 1] = TIMESTRLEN;
+    memcpy(buf + pos + ASN_TL, msg->timestamp.text, TIMESTRLEN);
+    pos += ASN_TL + TIMESTRLEN;
+
+    len          = msg->content.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->content.text, len);
+    pos += ASN_TL + (int)len;
+
+    len          = msg->username.len;
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->username.text, len);
+    pos += ASN_TL + (int)len;
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_cht_send(const uint8_t buf[], int pos, int len, asn_cht_send *msg)
+{
+    int end = pos + len;
+
+    if(end - pos < ASN_TL + TIMESTRLEN || buf[pos] != ASN_TIME || buf[pos + 1] != TIMESTRLEN)
+    {
+        return asn_field_error(buf, pos, end, ASN_TIME, TIMESTRLEN);
+    }
+    msg->timestamp.text = buf + pos + ASN_TL;
+    msg->timestamp.len  = TIMESTRLEN;
+    pos += ASN_TL + TIMESTRLEN;
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->content.text = buf + pos + ASN_TL;
+    msg->content.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, 255);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->username.text = buf + pos + ASN_TL;
+    msg->username.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_svr_diagnostic(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_svr_diagnostic *msg)
+{
+    header_t header = {SVR_DIAGNOSTIC, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    uint32_t u32;
+
+    u32          = htonl(msg->uptime_sec);
+    buf[pos]     = ASN_INT;
+    buf[pos + 1] = sizeof(u32);
+    memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+    pos += ASN_TL + (int)sizeof(u32);
+
+    u32          = htonl(msg->users_online);
+    buf[pos]     = ASN_INT;
+    buf[pos + 1] = sizeof(u32);
+    memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+    pos += ASN_TL + (int)sizeof(u32);
+
+    u32          = htonl(msg->messages);
+    buf[pos]     = ASN_INT;
+    buf[pos + 1] = sizeof(u32);
+    memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+    pos += ASN_TL + (int)sizeof(u32);
+
+    u32          = htonl(msg->logins);
+    buf[pos]     = ASN_INT;
+    buf[pos + 1] = sizeof(u32);
+    memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+    pos += ASN_TL + (int)sizeof(u32);
+
+    for(int i = 0; i < msg->errors_count; i++)
+    {
+        buf[pos]     = ASN_ENUM;
+        buf[pos + 1] = 1;
+        buf[pos + 2] = msg->errors[i].code;
+        pos += U8ENCODELEN;
+
+        u32          = htonl(msg->errors[i].count);
+        buf[pos]     = ASN_INT;
+        buf[pos + 1] = sizeof(u32);
+        memcpy(buf + pos + ASN_TL, &u32, sizeof(u32));
+        pos += ASN_TL + (int)sizeof(u32);
+    }
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_svr_diagnostic(const uint8_t buf[], int pos, int len, asn_svr_diagnostic *msg)
+{
+    int      end = pos + len;
+    uint32_t u32;
+
+    if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+    {
+        return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+    }
+    memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+    msg->uptime_sec = ntohl(u32);
+    pos += ASN_TL + (int)sizeof(u32);
+
+    if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+    {
+        return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+    }
+    memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+    msg->users_online = ntohl(u32);
+    pos += ASN_TL + (int)sizeof(u32);
+
+    if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+    {
+        return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+    }
+    memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+    msg->messages = ntohl(u32);
+    pos += ASN_TL + (int)sizeof(u32);
+
+    if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+    {
+        return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+    }
+    memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+    msg->logins = ntohl(u32);
+    pos += ASN_TL + (int)sizeof(u32);
+
+    for(msg->errors_count = 0; pos < end; msg->errors_count++)
+    {
+        int i = msg->errors_count;
+
+        if(i == SVR_ERROR_CODES)
+        {
+            return EXCEEDMAXPAYLOAD;
+        }
+        if(end - pos < U8ENCODELEN || buf[pos] != ASN_ENUM || buf[pos + 1] != 1)
+        {
+            return asn_field_error(buf, pos, end, ASN_ENUM, 1);
+        }
+        msg->errors[i].code = buf[pos + ASN_TL];
+        pos += U8ENCODELEN;
+
+        if(end - pos < ASN_TL + (int)sizeof(u32) || buf[pos] != ASN_INT || buf[pos + 1] != sizeof(u32))
+        {
+            return asn_field_error(buf, pos, end, ASN_INT, (int)sizeof(u32));
+        }
+        memcpy(&u32, buf + pos + ASN_TL, sizeof(u32));
+        msg->errors[i].count = ntohl(u32);
+        pos += ASN_TL + (int)sizeof(u32);
+    }
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+int asn_encode_svr_log(uint8_t buf[], uint8_t version, uint16_t sender_id, const asn_svr_log *msg)
+{
+    header_t header = {SVR_LOG, version, sender_id, 0};
+    int      pos    = HEADERLEN;
+    size_t   len;
+
+    buf[pos]     = ASN_ENUM;
+    buf[pos + 1] = 1;
+    buf[pos + 2] = msg->level;
+    pos += U8ENCODELEN;
+
+    len          = (size_t)((msg->message.len < SVR_LOG_MAX) ? msg->message.len : SVR_LOG_MAX);
+    buf[pos]     = ASN_STR;
+    buf[pos + 1] = (uint8_t)len;
+    memcpy(buf + pos + ASN_TL, msg->message.text, len);
+    pos += ASN_TL + (int)len;
+
+    header.payload_len = (uint16_t)(pos - HEADERLEN);
+    encode_header(buf, &header);
+    return pos;
+}
+
+int asn_decode_svr_log(const uint8_t buf[], int pos, int len, asn_svr_log *msg)
+{
+    int end = pos + len;
+
+    if(end - pos < U8ENCODELEN || buf[pos] != ASN_ENUM || buf[pos + 1] != 1)
+    {
+        return asn_field_error(buf, pos, end, ASN_ENUM, 1);
+    }
+    msg->level = buf[pos + ASN_TL];
+    pos += U8ENCODELEN;
+
+    if(end - pos < ASN_TL || buf[pos] != ASN_STR || buf[pos + 1] == 0 || buf[pos + 1] > SVR_LOG_MAX || end - pos - ASN_TL < buf[pos + 1])
+    {
+        return asn_field_error(buf, pos, end, ASN_STR, SVR_LOG_MAX);
+    }
+    if(utf8_check(buf + pos + ASN_TL, buf[pos + 1]) < 0)
+    {
+        return INVALIDSTRING;
+    }
+    msg->message.text = buf + pos + ASN_TL;
+    msg->message.len  = buf[pos + 1];
+    pos += ASN_TL + buf[pos + 1];
+    return (pos == end) ? 0 : FIELDLENGTHOFZERO;
+}
+
+/* Works out which error a field that failed its check gets; kept out of line so the checks stay short */
+static int asn_field_error(const uint8_t buf[], int pos, int end, uint8_t tag, int size)
+{
+    if(end - pos < ASN_TL || buf[pos + 1] == 0)
+    {
+        return FIELDLENGTHOFZERO;
+    }
+    if(buf[pos] != tag)
+    {
+        return UNRECOGNIZEDTAGTYPE;
+    }
+    if(tag == ASN_STR)
+    {
+        return (buf[pos + 1] > size) ? EXCEEDMAXPAYLOAD : FIELDLENGTHOFZERO;
+    }
+    return (buf[pos + 1] != size) ? INVALIDINTEGERLENGTH : FIELDLENGTHOFZERO;
+}
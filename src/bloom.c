@@ -0,0 +1,208 @@
+/*******************************************************************************
+ * Bloom Filter
+ *
+ * A fixed size set membership filter used to answer "definitely not present"
+ * without touching the database. False positives are possible, false
+ * negatives are not, and keys cannot be removed.
+ *
+ * - The bit array lives in a file mapped MAP_SHARED, so every forked child
+ *   sets bits in the same pages and the filter survives a restart as is.
+ * - Bits are set with atomic OR, so concurrent adds from several processes
+ *   need no lock.
+ * - The header's clean flag is cleared while the filter is open and set again
+ *   by bloom_close after the bits are synced. A filter that was not closed
+ *   cleanly may be missing keys and is reported as needing a rebuild.
+ * - Another server may go on adding after one closes (the new generation of
+ *   a hot upgrade), so an add clears a set flag again, as the log store's
+ *   writers do. Adds also bump a count, and a close that sees it move while
+ *   it synced clears the flag it just set.
+ * - Probe positions use double hashing over one FNV-1a pass:
+ *   h1 + i * h2 for i in [0, hashes).
+ ******************************************************************************/
+
+#include "../include/bloom.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BLOOM_FILE_MODE 0644
+#define BLOOM_HEADER_SPACE 64 /* keeps the bit array cache line aligned */
+#define BLOOM_WORD_BITS 64
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t bloom_hash(const void *key, size_t len);
+static uint64_t bloom_mix(uint64_t x);
+static void     bloom_changed(bloom *filter);
+
+/*
+ * Function: bloom_open
+ * Description: Maps the filter stored at path, creating or resetting it when
+ *              the file is missing or was built with other parameters.
+ * Returns: 0 if the stored filter can be trusted, 1 if it is new or was not
+ *          closed cleanly and the caller must add every key again, -1 on
+ *          failure.
+ */
+int bloom_open(bloom *filter, const char *path, uint32_t bits_log2, uint32_t hashes)
+{
+    struct stat   st;
+    bloom_header *header;
+    size_t        map_len;
+    void         *mem;
+    int           fd;
+    int           stale;
+    int           rebuild;
+
+    map_len = BLOOM_HEADER_SPACE + ((size_t)1 << bits_log2) / BLOOM_WORD_BITS * sizeof(uint64_t);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, BLOOM_FILE_MODE);
+    if(fd == -1)
+    {
+        perror("bloom_open::open");
+        return -1;
+    }
+    if(fstat(fd, &st) == -1)
+    {
+        perror("bloom_open::fstat");
+        close(fd);
+        return -1;
+    }
+
+    stale = (size_t)st.st_size != map_len;
+    if(stale && (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)map_len) == -1))
+    {
+        perror("bloom_open::ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    mem = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+    {
+        perror("bloom_open::mmap");
+        return -1;
+    }
+
+    header = (bloom_header *)mem;
+    if(!stale && (header->magic != BLOOM_MAGIC || header->version != BLOOM_VERSION || header->bits_log2 != bits_log2 || header->hashes != hashes))
+    {
+        memset(mem, 0, map_len);
+        stale = 1;
+    }
+    if(stale)
+    {
+        header->magic     = BLOOM_MAGIC;
+        header->version   = BLOOM_VERSION;
+        header->bits_log2 = bits_log2;
+        header->hashes    = hashes;
+    }
+
+    rebuild = stale || !atomic_load(&header->clean);
+    atomic_store(&header->clean, 0);
+
+    filter->header  = header;
+    filter->words   = (_Atomic uint64_t *)((char *)mem + BLOOM_HEADER_SPACE);
+    filter->map_len = map_len;
+    return rebuild;
+}
+
+/* Sets the key's bits */
+void bloom_add(bloom *filter, const void *key, size_t len)
+{
+    uint64_t h1   = bloom_hash(key, len);
+    uint64_t h2   = bloom_mix(h1) | 1U;
+    uint64_t mask = ((uint64_t)1 << filter->header->bits_log2) - 1;
+
+    for(uint32_t i = 0; i < filter->header->hashes; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & mask;
+        atomic_fetch_or_explicit(&filter->words[bit / BLOOM_WORD_BITS], (uint64_t)1 << (bit % BLOOM_WORD_BITS), memory_order_relaxed);
+    }
+    bloom_changed(filter);
+}
+
+/*
+ * Function: bloom_may_contain
+ * Description: Checks every bit the key would have set.
+ * Returns: 0 if the key was never added, 1 if it may have been.
+ */
+int bloom_may_contain(const bloom *filter, const void *key, size_t len)
+{
+    uint64_t h1   = bloom_hash(key, len);
+    uint64_t h2   = bloom_mix(h1) | 1U;
+    uint64_t mask = ((uint64_t)1 << filter->header->bits_log2) - 1;
+
+    for(uint32_t i = 0; i < filter->header->hashes; i++)
+    {
+        uint64_t bit  = (h1 + i * h2) & mask;
+        uint64_t word = atomic_load_explicit(&filter->words[bit / BLOOM_WORD_BITS], memory_order_relaxed);
+        if((word & ((uint64_t)1 << (bit % BLOOM_WORD_BITS))) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Flushes the bits, then marks the filter clean so the next open can trust it, unless an add raced the flush */
+void bloom_close(bloom *filter)
+{
+    uint32_t changes;
+
+    if(filter->header == NULL)
+    {
+        return;
+    }
+    changes = atomic_load(&filter->header->changes);
+    if(msync(filter->header, filter->map_len, MS_SYNC) == 0)
+    {
+        atomic_store(&filter->header->clean, 1);
+        if(atomic_load(&filter->header->changes) != changes)
+        {
+            atomic_store(&filter->header->clean, 0);
+        }
+        msync(filter->header, BLOOM_HEADER_SPACE, MS_SYNC);
+    }
+    munmap(filter->header, filter->map_len);
+    filter->header = NULL;
+    filter->words  = NULL;
+}
+
+static uint64_t bloom_hash(const void *key, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)key;
+    uint64_t       hash  = FNV_OFFSET_BASIS;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* After bits are set: counted for a close in progress, and no longer clean if a close already finished */
+static void bloom_changed(bloom *filter)
+{
+    atomic_fetch_add(&filter->header->changes, 1);
+    if(atomic_load(&filter->header->clean))
+    {
+        atomic_store(&filter->header->clean, 0);
+        msync(filter->header, BLOOM_HEADER_SPACE, MS_SYNC);
+    }
+}
+
+/* splitmix64 finalizer, derives an independent second hash from the first */
+static uint64_t bloom_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
@@ -0,0 +1,177 @@
+/*******************************************************************************
+ * Traffic Capture
+ *
+ * Records the frames clients send (-k) so test/replay can drive a test build
+ * with the same traffic, interleaved as it arrived.
+ *
+ * - The listener opens the file before forking any client, and every client
+ *   process appends to it through that descriptor. O_APPEND makes each
+ *   record one atomic append, so records from different connections never
+ *   tear, and their order in the file is the order they were read in.
+ * - Each record costs one write(2) in the client that read the frame; with
+ *   capture off it costs a branch.
+ * - Timestamps come from CLOCK_MONOTONIC against the listener's start time,
+ *   which every client inherits, so they share one timeline.
+ * - Passwords never reach the file. Logins and account creation are recorded
+ *   with CAPTURE_PASSWORD in place of theirs; one too malformed to find the
+ *   password in is recorded without its payload.
+ ******************************************************************************/
+
+#include "../include/capture.h"
+#include "../include/asn.h"
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USEC_PER_SEC 1000000L
+#define NSEC_PER_USEC 1000L
+#define FILE_MODE 0600
+
+static size_t redact_password(uint8_t out[], const uint8_t frame[], size_t len);
+static void   capture_write(uint8_t kind, const uint8_t frame[], size_t len);
+
+static int             capture_fd = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static struct timespec capture_start;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Client process only */
+static uint32_t capture_conn = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: capture_init
+ * Description: Creates the capture file at path, replacing any earlier one.
+ *              Must run after the helper processes are forked, so only the
+ *              listener and its clients hold the file.
+ * Returns: 0 on success, -1 on failure.
+ */
+int capture_init(const char *path)
+{
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, FILE_MODE);
+    if(capture_fd == -1)
+    {
+        perror("capture_init::open");
+        return -1;
+    }
+    if(write(capture_fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN)
+    {
+        perror("capture_init::write");
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &capture_start);
+    printf("Capturing client packets to %s\n", path);
+    return 0;
+}
+
+/* Starts the connection this process serves */
+void capture_connect(void)
+{
+    capture_conn = (uint32_t)getpid();
+    capture_write(CAPTURE_OPEN, NULL, 0);
+}
+
+/* Records a frame as read: its header and len - HEADERLEN bytes of payload */
+void capture_packet(const uint8_t frame[], size_t len)
+{
+    uint8_t redacted[PACKETLEN + CAPTURE_PASSWORD_LEN];
+
+    if(capture_fd < 0)
+    {
+        return;
+    }
+    if(frame[0] == ACC_LOGIN || frame[0] == ACC_CREATE)
+    {
+        len   = redact_password(redacted, frame, len);
+        frame = redacted;
+    }
+    capture_write(CAPTURE_PACKET, frame, len);
+}
+
+/* Ends the connection; test/replay closes its socket here */
+void capture_disconnect(void)
+{
+    capture_write(CAPTURE_CLOSE, NULL, 0);
+}
+
+/* Listener only; clients close their copy when they exit */
+void capture_shutdown(void)
+{
+    if(capture_fd >= 0)
+    {
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
+
+/*
+ * Copies a login or account creation with CAPTURE_PASSWORD for the password
+ * field, which follows the username, and drops anything after it.
+ * Returns: the length of the copy.
+ */
+static size_t redact_password(uint8_t out[], const uint8_t frame[], size_t len)
+{
+    header_t header;
+    size_t   pass_pos = 0;
+
+    decode_header(frame, &header);
+    if(len >= HEADERLEN + 2)
+    {
+        pass_pos = HEADERLEN + 2 + (size_t)frame[HEADERLEN + 1];
+    }
+    // Neither is accepted over MAXPAYLOADLEN, and only the header is kept of one that cannot be parsed
+    if(len > PACKETLEN || pass_pos == 0 || pass_pos + 2 > len || pass_pos + 2 + frame[pass_pos + 1] > len)
+    {
+        header.payload_len = 0;
+        encode_header(out, &header);
+        return HEADERLEN;
+    }
+
+    memcpy(out, frame, pass_pos);
+    out[pass_pos]     = ASN_STR;
+    out[pass_pos + 1] = CAPTURE_PASSWORD_LEN;
+    memcpy(out + pass_pos + 2, CAPTURE_PASSWORD, CAPTURE_PASSWORD_LEN);
+    header.payload_len = (uint16_t)(pass_pos + 2 + CAPTURE_PASSWORD_LEN - HEADERLEN);
+    encode_header(out, &header);
+    return HEADERLEN + header.payload_len;
+}
+
+/* Builds the whole record first, since only a single write is appended atomically */
+static void capture_write(uint8_t kind, const uint8_t frame[], size_t len)
+{
+    uint8_t         record[CAPTURE_RECORD_LEN + BATCHPACKETLEN];
+    struct timespec now;
+    uint64_t        usec;
+    uint32_t        conn;
+    uint32_t        half;
+    size_t          total = CAPTURE_RECORD_LEN + len;
+
+    if(capture_fd < 0)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    usec = (uint64_t)((now.tv_sec - capture_start.tv_sec) * USEC_PER_SEC + (now.tv_nsec - capture_start.tv_nsec) / NSEC_PER_USEC);
+
+    record[0] = kind;
+    conn      = htonl(capture_conn);
+    memcpy(record + 1, &conn, sizeof(conn));
+    half = htonl((uint32_t)(usec >> 32));
+    memcpy(record + 1 + sizeof(conn), &half, sizeof(half));
+    half = htonl((uint32_t)usec);
+    memcpy(record + 1 + sizeof(conn) + sizeof(half), &half, sizeof(half));
+    if(len > 0)
+    {
+        memcpy(record + CAPTURE_RECORD_LEN, frame, len);
+    }
+
+    if(write(capture_fd, record, total) != (ssize_t)total)
+    {
+        // Most likely a full disk; the rest of this connection goes unrecorded rather than torn
+        perror("capture_write::write");
+        close(capture_fd);
+        capture_fd = -1;
+    }
+}
@@ -0,0 +1,261 @@
+/*******************************************************************************
+ * Payload Compression
+ *
+ * A small LZ77 block coder for large, repetitive replies: user lists, chat
+ * history and BATCH frames of similar messages. Each block is compressed on
+ * its own, so a reply or a stored segment can be decoded without any other.
+ *
+ * - Blocks are a run of sequences: a token byte holding the literal count
+ *   (high nibble) and the match length minus MIN_MATCH (low nibble), longer
+ *   counts continued in bytes of 255, the literals, then a 2 byte big endian
+ *   offset back to the match. The last sequence is literals only.
+ * - Both sides start from the same preset dictionary of protocol strings, so
+ *   even a short block can match error texts, tags and the canned chat
+ *   message on first sight. Changing the dictionary changes the format.
+ * - Matches are found through a hash of the next 4 bytes that keeps only the
+ *   latest position per bucket: one probe per byte, no chains.
+ ******************************************************************************/
+
+#include "../include/compress.h"
+#include <string.h>
+
+#define MIN_MATCH 4
+#define NIBBLE_MAX 15
+#define EXT_BYTE_MAX 255
+#define OFFSET_MAX 0xFFFF
+#define HASH_BITS 12
+#define HASH_MULT 2654435761U
+#define NO_POS 0xFFFF
+
+static uint32_t hash4(const uint8_t *p);
+static int      put_len(uint8_t dst[], int pos, int dst_cap, int len);
+static int      put_seq(uint8_t dst[], int pos, int dst_cap, const uint8_t lit[], int lit_len, int offset, int match_len);
+static int      get_len(const uint8_t src[], int *pos, int src_len, int len);
+
+/* ASN tags and lengths are kept with the strings so matches run across them */
+static const char dictionary[] = "\x18\x0f"
+                                 "20250304160000Z"
+                                 "\x0c\x1a"
+                                 "Hello from the test server"
+                                 "\x0c\x06"
+                                 "Banunu"
+                                 "0\x04\x00\x0a\x01\x14"
+                                 "0\x04\x00\x0a\x01\x0e"
+                                 "Unrecognized Tag Type"
+                                 "Invalid Integer Length"
+                                 "Field Length of Zero"
+                                 "Unrecognized Packet Type"
+                                 "Unsupported Version"
+                                 "Exceeded Max Payload Length"
+                                 "Server Shutting Down"
+                                 "Invalid User ID"
+                                 "User Already Exists"
+                                 "Invalid Authentication Information"
+                                 "Server Busy"
+                                 "No User IDs Available"
+                                 "Rate Limit Exceeded"
+                                 "Server Error";
+
+#define DICT_LEN ((int)sizeof(dictionary) - 1)
+
+/*
+ * Function: compress_block
+ * Description: Compresses src_len bytes of src into dst. Passing a dst_cap
+ *              below src_len makes the call fail rather than expand data
+ *              that does not compress.
+ * Returns: the compressed length, or -1 if it does not fit in dst_cap or
+ *          src_len exceeds COMPRESS_MAX_LEN.
+ */
+int compress_block(const uint8_t src[], int src_len, uint8_t dst[], int dst_cap)
+{
+    uint8_t  window[DICT_LEN + COMPRESS_MAX_LEN];
+    uint16_t table[1 << HASH_BITS];
+    int      end;
+    int      ip;
+    int      anchor;
+    int      pos = 0;
+
+    if(src_len < 0 || src_len > COMPRESS_MAX_LEN)
+    {
+        return -1;
+    }
+    memcpy(window, dictionary, DICT_LEN);
+    memcpy(window + DICT_LEN, src, (size_t)src_len);
+    memset(table, 0xFF, sizeof(table));
+    for(int i = 0; i + MIN_MATCH <= DICT_LEN; i++)
+    {
+        table[hash4(window + i)] = (uint16_t)i;
+    }
+
+    end    = DICT_LEN + src_len;
+    ip     = DICT_LEN;
+    anchor = ip;
+    while(ip + MIN_MATCH <= end)
+    {
+        uint32_t h    = hash4(window + ip);
+        int      cand = table[h];
+        int      len  = MIN_MATCH;
+
+        table[h] = (uint16_t)ip;
+        if(cand == NO_POS || ip - cand > OFFSET_MAX || memcmp(window + cand, window + ip, MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+        while(ip + len < end && window[cand + len] == window[ip + len])
+        {
+            len++;
+        }
+        pos = put_seq(dst, pos, dst_cap, window + anchor, ip - anchor, ip - cand, len);
+        if(pos < 0)
+        {
+            return -1;
+        }
+        for(int i = ip + 1; i < ip + len && i + MIN_MATCH <= end; i++)
+        {
+            table[hash4(window + i)] = (uint16_t)i;
+        }
+        ip += len;
+        anchor = ip;
+    }
+    return put_seq(dst, pos, dst_cap, window + anchor, end - anchor, 0, 0);
+}
+
+/*
+ * Function: decompress_block
+ * Description: Expands a block made by compress_block into dst. Every length
+ *              and offset is checked, so hostile input cannot read or write
+ *              out of bounds.
+ * Returns: the decompressed length, or -1 if the block is malformed or does
+ *          not fit in dst_cap.
+ */
+int decompress_block(const uint8_t src[], int src_len, uint8_t dst[], int dst_cap)
+{
+    int pos = 0;
+    int out = 0;
+
+    while(pos < src_len)
+    {
+        uint8_t token = src[pos++];
+        int     lit   = get_len(src, &pos, src_len, token >> 4);
+        int     offset;
+        int     len;
+
+        if(lit < 0 || lit > src_len - pos || lit > dst_cap - out)
+        {
+            return -1;
+        }
+        memcpy(dst + out, src + pos, (size_t)lit);
+        pos += lit;
+        out += lit;
+        if(pos == src_len)
+        {
+            break;
+        }
+
+        if(pos + 2 > src_len)
+        {
+            return -1;
+        }
+        offset = (src[pos] << 8) | src[pos + 1];
+        pos += 2;
+        len = get_len(src, &pos, src_len, token & NIBBLE_MAX);
+        if(len < 0 || offset == 0 || offset > out + DICT_LEN || len + MIN_MATCH > dst_cap - out)
+        {
+            return -1;
+        }
+        // Byte by byte: a match may overlap its own output or start in the dictionary
+        for(int i = 0; i < len + MIN_MATCH; i++, out++)
+        {
+            int from = out - offset;
+            dst[out] = (from < 0) ? (uint8_t)dictionary[DICT_LEN + from] : dst[from];
+        }
+    }
+    return out;
+}
+
+static uint32_t hash4(const uint8_t *p)
+{
+    uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;    // NOLINT(readability-magic-numbers)
+    return (v * HASH_MULT) >> (32 - HASH_BITS);
+}
+
+/* Writes the continuation bytes of a length whose nibble is saturated */
+static int put_len(uint8_t dst[], int pos, int dst_cap, int len)
+{
+    len -= NIBBLE_MAX;
+    while(len >= EXT_BYTE_MAX)
+    {
+        if(pos >= dst_cap)
+        {
+            return -1;
+        }
+        dst[pos++] = EXT_BYTE_MAX;
+        len -= EXT_BYTE_MAX;
+    }
+    if(pos >= dst_cap)
+    {
+        return -1;
+    }
+    dst[pos++] = (uint8_t)len;
+    return pos;
+}
+
+/* Writes one sequence; a match_len of 0 marks the final, literals only sequence */
+static int put_seq(uint8_t dst[], int pos, int dst_cap, const uint8_t lit[], int lit_len, int offset, int match_len)
+{
+    int ml = (match_len > 0) ? match_len - MIN_MATCH : 0;
+
+    if(pos >= dst_cap)
+    {
+        return -1;
+    }
+    dst[pos++] = (uint8_t)(((lit_len < NIBBLE_MAX) ? lit_len : NIBBLE_MAX) << 4 | ((ml < NIBBLE_MAX) ? ml : NIBBLE_MAX));
+    if(lit_len >= NIBBLE_MAX && (pos = put_len(dst, pos, dst_cap, lit_len)) < 0)
+    {
+        return -1;
+    }
+    if(lit_len > dst_cap - pos)
+    {
+        return -1;
+    }
+    memcpy(dst + pos, lit, (size_t)lit_len);
+    pos += lit_len;
+    if(match_len == 0)
+    {
+        return pos;
+    }
+
+    if(pos + 2 > dst_cap)
+    {
+        return -1;
+    }
+    dst[pos++] = (uint8_t)(offset >> 8);
+    dst[pos++] = (uint8_t)offset;
+    if(ml >= NIBBLE_MAX && (pos = put_len(dst, pos, dst_cap, ml)) < 0)
+    {
+        return -1;
+    }
+    return pos;
+}
+
+/* Returns the full length for a nibble, reading continuation bytes when it is saturated */
+static int get_len(const uint8_t src[], int *pos, int src_len, int len)
+{
+    if(len < NIBBLE_MAX)
+    {
+        return len;
+    }
+    for(;;)
+    {
+        if(*pos >= src_len)
+        {
+            return -1;
+        }
+        len += src[*pos];
+        if(src[(*pos)++] != EXT_BYTE_MAX)
+        {
+            return len;
+        }
+    }
+}
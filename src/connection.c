@@ -0,0 +1,732 @@
+/* connection.c */
+
+#include "../include/connection.h"
+#include "../include/admission.h"
+#include "../include/asn.h"
+#include "../include/capture.h"
+#include "../include/federation.h"
+#include "../include/logging.h"
+#include "../include/mailbox.h"
+#include "../include/ratelimit.h"
+#include "../include/replication.h"
+#include "../include/reporter.h"
+#include "../include/resume.h"
+#include "../include/session.h"
+#include "../include/span.h"
+#include "../include/trace.h"
+#include "../include/user_db.h"
+#include "../include/workpool.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NO_JOB (-1)
+#define SPIN_BACKOFF_MAX 64 /* most waits skipped without spinning after repeated misses */
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_SEC 1000000000L
+
+/* State of the one connection served by this process */
+typedef struct connection
+{
+    int          fd;
+    int          notify_fd; /* becomes readable when a hash job finishes */
+    session      sess;
+    uint32_t     source;       /* peer address, as admission_source_id names it */
+    rate_bucket  limit;        /* every packet on the connection */
+    int          job;          /* outstanding hash job, NO_JOB if none */
+    uint8_t      job_type;     /* ACC_LOGIN or ACC_CREATE waiting on the job */
+    user_obj     job_user;     /* account being created or logged into */
+    uint8_t     *reply_batch;  /* BATCH frame collecting replies, NULL to write each one */
+    int          reply_pos;    /* end of the messages in reply_batch */
+    int          reply_count;  /* messages in reply_batch, at most BATCH_MAX_MSGS */
+    uint8_t      version;      /* of the client's last request, decides batching and compression */
+    long         spin_ns;      /* busy poll budget per wait, 0 when off */
+    unsigned int spin_skip;    /* waits left to sleep through before spinning again */
+    unsigned int spin_backoff; /* waits skipped after the last spin that found nothing */
+    span         span;         /* stages of the request being served, when it is timed */
+} connection;
+
+static int  wait_events(connection *conn, struct pollfd fds[], nfds_t nfds);
+static int  process_req(connection *conn);
+static int  process_batch(connection *conn, uint8_t buf[], const header_t *header);
+static int  dispatch_req(connection *conn, const uint8_t buf[], const header_t *header, int decoded);
+static int  serve_req(connection *conn, const uint8_t buf[], const header_t *header, int decoded);
+static int  read_full(int fd, uint8_t buf[], size_t len);
+static int  is_unauthenticated_req(uint8_t packet_type);
+static int  admit_req(connection *conn, const header_t *header);
+static int  handle_acc_login(connection *conn, const uint8_t buf[], const header_t *header);
+static int  handle_acc_create(connection *conn, const uint8_t buf[], const header_t *header);
+static int  handle_acc_resume(connection *conn, const uint8_t buf[], const header_t *header);
+static void finish_login(connection *conn, uint16_t user_id, const uint32_t *received);
+static void complete_job(connection *conn);
+static int  create_account(connection *conn, const uint8_t hash[HASH_LEN]);
+static void send_sys_success(connection *conn, uint8_t buf[], uint8_t packet_type);
+static void send_sys_error(connection *conn, uint8_t buf[], int err);
+static void send_acc_login_success(connection *conn, uint8_t buf[], uint16_t user_id, const char *token, uint32_t first_seq);
+static void send_cht_send(connection *conn, uint8_t buf[]);
+static void send_packet(connection *conn, const uint8_t packet[], int len);
+static void flush_replies(connection *conn);
+static void write_reply(connection *conn, const uint8_t packet[], int len);
+static void deliver_offline(connection *conn, uint16_t user_id, uint32_t from);
+static void deliver_queued(const uint8_t packet[], int len, void *ctx);
+
+/*
+ * Function: serve_client
+ * Description: Serves requests on one connection until the client leaves or
+ *              running is cleared by a shutdown.
+ */
+void serve_client(int cfd, const volatile sig_atomic_t *running, const connection_config *config)
+{
+    connection conn;
+    uint8_t    buf[PACKETLEN];
+
+    memset(&conn, 0, sizeof(conn));
+    conn.fd        = cfd;
+    conn.job       = NO_JOB;
+    conn.spin_ns   = (long)config->busy_poll_us * NSEC_PER_USEC;
+#ifdef SO_BUSY_POLL
+    if(config->busy_poll_us > 0)
+    {
+        // Lets reads spin on the device queue too; refused without CAP_NET_ADMIN, which only costs that part
+        int busy_poll_us = (int)config->busy_poll_us;
+        setsockopt(cfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+    }
+#endif
+    conn.source    = admission_source_id(cfd);
+    conn.notify_fd = workpool_attach();
+    if(conn.notify_fd < 0)
+    {
+        server_log(1, "Unable to receive password hash results", LOG_ERR);
+        return;
+    }
+    session_open(&conn.sess, (int32_t)getpid());
+    capture_connect();
+    span_attach(&conn.span, (uint32_t)conn.sess.conn_id);
+
+    while(*running)
+    {
+        struct pollfd fds[2];
+
+        // Requests are answered in order, so the socket is left alone while a hash is outstanding
+        fds[0].fd      = (conn.job == NO_JOB) ? cfd : -1;
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd      = conn.notify_fd;
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+        span_begin(&conn.span);
+        if(wait_events(&conn, fds, 2) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("serve_client::poll");
+            break;
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            workpool_drain_notify(conn.notify_fd);
+            complete_job(&conn);
+        }
+
+        if(fds[0].revents != 0 && process_req(&conn) < 0)
+        {
+            break;
+        }
+    }
+
+    if(!*running)
+    {
+        // Responses are written synchronously, so all that is left is telling the client why it is dropped
+        memset(buf, 0, PACKETLEN);
+        send_sys_error(&conn, buf, SERVERSHUTDOWN);
+        shutdown(cfd, SHUT_WR);
+    }
+
+    if(conn.job != NO_JOB)
+    {
+        workpool_abandon(conn.job);
+    }
+    session_logout(&conn.sess);
+    release_user_ids();
+    close(conn.notify_fd);
+    capture_disconnect();
+}
+
+/*
+ * Waits for any of fds to become ready. With busy polling on, first spins on
+ * non-blocking polls for up to spin_ns, which skips the sleep and wakeup when
+ * the client answers quickly. Spins that keep finding nothing back off
+ * exponentially, so an idle connection soon stops burning its core.
+ */
+static int wait_events(connection *conn, struct pollfd fds[], nfds_t nfds)
+{
+    struct timespec start;
+    struct timespec now;
+    int             ready;
+
+    if(conn->spin_ns > 0 && conn->spin_skip == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do
+        {
+            ready = poll(fds, nfds, 0);
+            if(ready != 0)
+            {
+                conn->spin_backoff = 0;
+                return ready;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while((now.tv_sec - start.tv_sec) * NSEC_PER_SEC + (now.tv_nsec - start.tv_nsec) < conn->spin_ns);
+
+        conn->spin_backoff = (conn->spin_backoff < SPIN_BACKOFF_MAX / 2) ? conn->spin_backoff * 2 + 1 : SPIN_BACKOFF_MAX;
+        conn->spin_skip    = conn->spin_backoff;
+    }
+    else if(conn->spin_skip > 0)
+    {
+        conn->spin_skip--;
+    }
+    return poll(fds, nfds, -1);
+}
+
+/* Packets that may arrive before the connection has logged in */
+static int is_unauthenticated_req(uint8_t packet_type)
+{
+    return packet_type == ACC_LOGIN || packet_type == ACC_CREATE || packet_type == ACC_RESUME;
+}
+
+static int process_req(connection *conn)
+{
+    header_t header = {0};
+    uint8_t  buf[BATCHPACKETLEN];
+    int      cfd = conn->fd;
+    int      served;
+
+    SPAN_MARK(&conn->span, SPAN_READY);
+    memset(buf, 0, PACKETLEN);
+    if(read_full(cfd, buf, HEADERLEN) < 0)
+    {
+        return -1;
+    }
+    decode_header(buf, &header);
+    conn->version = header.version;
+
+    // Nothing can be trusted to frame the next packet after an oversized one
+    if(header.payload_len > MAXBATCHPAYLOADLEN)
+    {
+        send_sys_error(conn, buf, EXCEEDMAXPAYLOAD);
+        return -1;
+    }
+    if(read_full(cfd, buf + HEADERLEN, header.payload_len) < 0)
+    {
+        return -1;
+    }
+    capture_packet(buf, HEADERLEN + (size_t)header.payload_len);
+    SPAN_MARK(&conn->span, SPAN_READ);
+    conn->span.packet_type = header.packet_type;
+    conn->span.payload_len = header.payload_len;
+
+    if(header.packet_type == BATCH)
+    {
+        served = process_batch(conn, buf, &header);
+    }
+    else
+    {
+        served = dispatch_req(conn, buf, &header, 0);
+    }
+    SPAN_MARK(&conn->span, SPAN_SERVED);
+
+    // A login's span stays open through its hash, until complete_job answers it
+    if(conn->job == NO_JOB)
+    {
+        span_end(&conn->span);
+    }
+    return served;
+}
+
+/*
+ * Serves every message of a BATCH frame in order and answers them all in one
+ * BATCH frame. The frame is decoded in one pass before any message runs, and
+ * messages are dispatched where they lie in buf, without copying.
+ */
+static int process_batch(connection *conn, uint8_t buf[], const header_t *header)
+{
+    asn_batch batch;
+    uint8_t   replies[BATCHPACKETLEN];
+    int       result;
+
+    // Batches never carry a login, so the sender must already own its id; spoofers cost no parsing
+    if(!session_validate(&conn->sess, header->sender_id))
+    {
+        send_sys_error(conn, replies, INVALIDUSERID);
+        return SYS_ERROR;
+    }
+    result = decode_packet(buf, header, &batch);
+    SPAN_MARK(&conn->span, SPAN_DECODED);
+    TRACE4(decoded, conn->sess.conn_id, header->packet_type, header->payload_len, result);
+    if(result < 0)
+    {
+        send_sys_error(conn, replies, result);
+        return SYS_ERROR;
+    }
+
+    conn->reply_batch = replies;
+    conn->reply_pos   = HEADERLEN;
+    for(int i = 0; i < batch.count; i++)
+    {
+        // Each message reads its fields at HEADERLEN, so it is handed the frame from HEADERLEN before them
+        header_t msg = {batch.msgs[i].packet_type, header->version, header->sender_id, batch.msgs[i].len};
+        dispatch_req(conn, buf + batch.msgs[i].offset - HEADERLEN, &msg, 1);
+    }
+    flush_replies(conn);
+    conn->reply_batch = NULL;
+    return BATCH;
+}
+
+/* Serves one message between the request and request_done tracepoints */
+static int dispatch_req(connection *conn, const uint8_t buf[], const header_t *header, int decoded)
+{
+    int served;
+
+    TRACE4(request, conn->sess.conn_id, header->packet_type, header->sender_id, header->payload_len);
+    served = serve_req(conn, buf, header, decoded);
+    TRACE3(request_done, conn->sess.conn_id, header->packet_type, served);
+    return served;
+}
+
+/* Serves one message; decoded is set when decode_packet has already checked it as part of a batch */
+static int serve_req(connection *conn, const uint8_t buf[], const header_t *header, int decoded)
+{
+    uint8_t reply[PACKETLEN];
+    int     result;
+
+    // Checked before decoding so spoofed, stale or flooding senders cost no parsing
+    result = admit_req(conn, header);
+    if(result == 0 && !decoded)
+    {
+        result = decode_packet(buf, header, NULL);
+        SPAN_MARK(&conn->span, SPAN_DECODED);
+        TRACE4(decoded, conn->sess.conn_id, header->packet_type, header->payload_len, result);
+    }
+
+    // Login and account creation finish once the worker pool has hashed the password
+    if(result == 0 && header->packet_type == ACC_LOGIN)
+    {
+        result = handle_acc_login(conn, buf, header);
+    }
+    else if(result == 0 && header->packet_type == ACC_CREATE)
+    {
+        result = handle_acc_create(conn, buf, header);
+    }
+    else if(result == 0 && header->packet_type == ACC_RESUME)
+    {
+        result = handle_acc_resume(conn, buf, header);
+    }
+
+    memset(reply, 0, PACKETLEN);
+    if(result < 0)
+    {
+        send_sys_error(conn, reply, result);
+        return SYS_ERROR;
+    }
+
+    if(header->packet_type == ACC_LOGIN || header->packet_type == ACC_CREATE || header->packet_type == ACC_RESUME)
+    {
+        return header->packet_type;
+    }
+
+    if(header->packet_type == ACC_EDIT)
+    {
+        send_sys_success(conn, reply, header->packet_type);
+        return SYS_SUCCESS;
+    }
+
+    if(header->packet_type == ACC_LOGOUT)
+    {
+        // no response; a client that logs out on purpose has nothing to resume
+        resume_revoke(conn->sess.user_id);
+        session_logout(&conn->sess);
+        return ACC_LOGOUT;
+    }
+
+    if(header->packet_type == CHT_SEND)
+    {
+        federation_relay(header, buf + HEADERLEN);
+        reporter_count_message();
+        send_sys_success(conn, reply, header->packet_type);
+
+        // send an example of a chat message from another user.
+        send_cht_send(conn, reply);
+        return CHT_SEND;
+    }
+
+    // Valid but not served yet, keep the connection open
+    return header->packet_type;
+}
+
+/* Reads exactly len bytes; a payload may arrive in more than one segment */
+static int read_full(int fd, uint8_t buf[], size_t len)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t nread = read(fd, buf + done, len - done);
+        if(nread < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)nread;
+    }
+    return 0;
+}
+
+/* Applies the connection, login and per-user limits and checks the sender id, from the header alone */
+static int admit_req(connection *conn, const header_t *header)
+{
+    uint64_t now = ratelimit_now();
+
+    if(!ratelimit_take(&conn->limit, RATE_CONN, now))
+    {
+        return RATELIMITED;
+    }
+    if(is_unauthenticated_req(header->packet_type))
+    {
+        // The shared login budget is for password hashes; a resume costs none, so a reconnect storm is not held back
+        return (header->packet_type == ACC_RESUME || ratelimit_take_login(now)) ? 0 : RATELIMITED;
+    }
+    if(!session_validate(&conn->sess, header->sender_id))
+    {
+        return INVALIDUSERID;
+    }
+    return session_admit(header->sender_id, now) ? 0 : RATELIMITED;
+}
+
+/* Looks the account up and queues the password for verification against its stored hash */
+static int handle_acc_login(connection *conn, const uint8_t buf[], const header_t *header)
+{
+    char      username[USERNAME_MAX_LEN + 1];
+    char      password[WORKPOOL_MAX_PASSWORD + 1];
+    user_obj *user;
+    uint64_t  db_start;
+    int       result;
+
+    result = decode_acc_req(buf, header, username, sizeof(username), password, sizeof(password));
+    if(result < 0)
+    {
+        return INVALIDAUTHINFO;
+    }
+
+    db_start = SPAN_START(&conn->span);
+    user     = find_user_by_name(username);
+    SPAN_ADD(&conn->span, db, db_start);
+    if(user == NULL)
+    {
+        return INVALIDAUTHINFO;
+    }
+    memcpy(&conn->job_user, user, sizeof(user_obj));
+    free(user);
+
+    // Only failures are charged, and per address, so strangers cannot lock the owner out
+    if(!ratelimit_login_allowed((uint16_t)conn->job_user.id, conn->source, ratelimit_now()))
+    {
+        memset(password, 0, sizeof(password));
+        return RATELIMITED;
+    }
+
+    conn->job = workpool_submit(password, strlen(password), conn->job_user.salt);
+    memset(password, 0, sizeof(password));
+    if(conn->job == NO_JOB)
+    {
+        return SERVERBUSY;
+    }
+    conn->job_type = ACC_LOGIN;
+    return 0;
+}
+
+/* Rejects taken usernames up front, then queues the password to be hashed with a fresh salt */
+static int handle_acc_create(connection *conn, const uint8_t buf[], const header_t *header)
+{
+    char      password[WORKPOOL_MAX_PASSWORD + 1];
+    user_obj *existing;
+    uint64_t  db_start;
+    int       result;
+
+    memset(&conn->job_user, 0, sizeof(user_obj));
+    result = decode_acc_req(buf, header, conn->job_user.username, sizeof(conn->job_user.username), password, sizeof(password));
+    if(result < 0)
+    {
+        return INVALIDAUTHINFO;
+    }
+
+    // A standby's store is a copy of its primary's; accounts are made there
+    if(replication_read_only())
+    {
+        return READONLY;
+    }
+
+    db_start = SPAN_START(&conn->span);
+    existing = find_user_by_name(conn->job_user.username);
+    SPAN_ADD(&conn->span, db, db_start);
+    if(existing != NULL)
+    {
+        free(existing);
+        return USEREXISTS;
+    }
+
+    if(password_salt(conn->job_user.salt) < 0)
+    {
+        return SERVERERROR;
+    }
+
+    conn->job = workpool_submit(password, strlen(password), conn->job_user.salt);
+    memset(password, 0, sizeof(password));
+    if(conn->job == NO_JOB)
+    {
+        return SERVERBUSY;
+    }
+    conn->job_type = ACC_CREATE;
+    return 0;
+}
+
+/* Restores the session of a client presenting the resume token it was last given */
+static int handle_acc_resume(connection *conn, const uint8_t buf[], const header_t *header)
+{
+    char     token[RESUME_TOKEN_LEN + 1];
+    uint32_t received;
+
+    if(decode_resume_req(buf, header, token, sizeof(token), &received) < 0)
+    {
+        return INVALIDAUTHINFO;
+    }
+    // Shares the failed login limit, so tokens cannot be guessed faster than passwords
+    if(!ratelimit_login_allowed(header->sender_id, conn->source, ratelimit_now()))
+    {
+        return RATELIMITED;
+    }
+    if(!resume_redeem(header->sender_id, token))
+    {
+        ratelimit_login_failed(header->sender_id, conn->source, ratelimit_now());
+        return INVALIDAUTHINFO;
+    }
+    finish_login(conn, header->sender_id, &received);
+    return 0;
+}
+
+/*
+ * Binds the connection to the user, answers with ACC_LOGIN_SUCCESS and sends
+ * what was queued while the user was away. received is the last sequence
+ * number a resuming client got, NULL for a password login.
+ */
+static void finish_login(connection *conn, uint16_t user_id, const uint32_t *received)
+{
+    uint8_t     buf[PACKETLEN];
+    char        token[RESUME_TOKEN_LEN + 1];
+    const char *issued = NULL;
+    uint32_t    from   = mailbox_resume_point(user_id, received);
+
+    session_login(&conn->sess, user_id);
+    reporter_count_login();
+    if(conn->version >= RESUMEVER && resume_issue(user_id, token) == 0)
+    {
+        issued = token;
+    }
+    memset(buf, 0, PACKETLEN);
+    send_acc_login_success(conn, buf, user_id, issued, from);
+    deliver_offline(conn, user_id, from);
+}
+
+/* Finishes the login or account creation waiting on the worker pool, if its hash is ready */
+static void complete_job(connection *conn)
+{
+    uint8_t buf[PACKETLEN];
+    uint8_t hash[HASH_LEN];
+    int     result;
+
+    if(conn->job == NO_JOB || !workpool_collect(conn->job, hash))
+    {
+        return;
+    }
+    conn->job = NO_JOB;
+    memset(buf, 0, PACKETLEN);
+
+    if(conn->job_type == ACC_LOGIN)
+    {
+        if(password_equal(hash, conn->job_user.hash))
+        {
+            finish_login(conn, (uint16_t)conn->job_user.id, NULL);
+        }
+        else
+        {
+            ratelimit_login_failed((uint16_t)conn->job_user.id, conn->source, ratelimit_now());
+            send_sys_error(conn, buf, INVALIDAUTHINFO);
+        }
+    }
+    else
+    {
+        result = create_account(conn, hash);
+        if(result < 0)
+        {
+            send_sys_error(conn, buf, result);
+        }
+        else
+        {
+            send_sys_success(conn, buf, ACC_CREATE);
+        }
+    }
+    memset(&conn->job_user, 0, sizeof(user_obj));
+    span_end(&conn->span);
+}
+
+/* Stores the account whose password has just been hashed */
+static int create_account(connection *conn, const uint8_t hash[HASH_LEN])
+{
+    uint64_t db_start;
+    int      user_id;
+    int      result;
+
+    user_id = allocate_user_id();
+    if(user_id < 0)
+    {
+        return NOUSERIDS;
+    }
+
+    conn->job_user.id = user_id;
+    memcpy(conn->job_user.hash, hash, HASH_LEN);
+    db_start = SPAN_START(&conn->span);
+    result   = add_user(&conn->job_user);
+    SPAN_ADD(&conn->span, db, db_start);
+    if(result == USER_DB_NAME_TAKEN)
+    {
+        // Another connection took the name while the hash was running
+        return USEREXISTS;
+    }
+    if(result == -1)
+    {
+        return SERVERERROR;
+    }
+    return 0;
+}
+
+static void send_sys_success(connection *conn, uint8_t buf[], uint8_t packet_type)
+{
+    int len = encode_sys_success_res(buf, packet_type);
+    send_packet(conn, buf, len);
+}
+
+static void send_sys_error(connection *conn, uint8_t buf[], int err)
+{
+    int len = encode_sys_error_res(buf, err);
+    TRACE2(error, conn->sess.conn_id, err);
+    conn->span.result = (int16_t)err;
+    reporter_count_error(err);
+    send_packet(conn, buf, len);
+}
+
+static void send_acc_login_success(connection *conn, uint8_t buf[], uint16_t user_id, const char *token, uint32_t first_seq)
+{
+    int len = encode_acc_login_success_res(buf, user_id, token, first_seq);
+    send_packet(conn, buf, len);
+}
+
+static void send_cht_send(connection *conn, uint8_t buf[])
+{
+    int len = encode_cht_send(buf);
+    send_packet(conn, buf, len);
+}
+
+/* Writes a packet, or adds it to the BATCH frame being collected */
+static void send_packet(connection *conn, const uint8_t packet[], int len)
+{
+    int pos;
+
+    if(conn->reply_batch == NULL)
+    {
+        write_reply(conn, packet, len);
+        return;
+    }
+    // The client rejects a frame with more than BATCH_MAX_MSGS messages as well as an oversized one
+    pos = (conn->reply_count < BATCH_MAX_MSGS) ? encode_batch_append(conn->reply_batch, conn->reply_pos, packet, len) : -1;
+    if(pos < 0)
+    {
+        flush_replies(conn);
+        pos = encode_batch_append(conn->reply_batch, conn->reply_pos, packet, len);
+    }
+    conn->reply_pos = pos;
+    conn->reply_count++;
+}
+
+/* Writes the replies collected so far as one BATCH frame */
+static void flush_replies(connection *conn)
+{
+    int len;
+
+    if(conn->reply_pos == HEADERLEN)
+    {
+        return;
+    }
+    len = encode_batch_header(conn->reply_batch, conn->reply_pos);
+    write_reply(conn, conn->reply_batch, len);
+    conn->reply_pos   = HEADERLEN;
+    conn->reply_count = 0;
+}
+
+/* Writes a finished packet, compressed when the client accepts it and it shrinks */
+static void write_reply(connection *conn, const uint8_t packet[], int len)
+{
+    uint8_t  compressed[BATCHPACKETLEN];
+    int      compressed_len = -1;
+    ssize_t  written;
+    uint64_t send_start;
+
+    if(conn->version >= COMPRESSVER)
+    {
+        compressed_len = encode_compressed(compressed, packet, len);
+    }
+    send_start = SPAN_START(&conn->span);
+    if(compressed_len > 0)
+    {
+        written = write(conn->fd, compressed, (size_t)compressed_len);
+        SPAN_ADD(&conn->span, send, send_start);
+        TRACE4(reply, conn->sess.conn_id, packet[0], compressed_len, written);
+        return;
+    }
+    written = write(conn->fd, packet, (size_t)len);
+    SPAN_ADD(&conn->span, send, send_start);
+    TRACE4(reply, conn->sess.conn_id, packet[0], len, written);
+}
+
+/* Sends what was queued for the user from sequence number from on, batched when the client understands BATCH */
+static void deliver_offline(connection *conn, uint16_t user_id, uint32_t from)
+{
+    uint8_t replies[BATCHPACKETLEN];
+
+    if(conn->version >= BATCHVER)
+    {
+        conn->reply_batch = replies;
+        conn->reply_pos   = HEADERLEN;
+    }
+    mailbox_drain(user_id, from, deliver_queued, conn);
+    if(conn->reply_batch != NULL)
+    {
+        flush_replies(conn);
+        conn->reply_batch = NULL;
+    }
+}
+
+static void deliver_queued(const uint8_t packet[], int len, void *ctx)
+{
+    send_packet((connection *)ctx, packet, len);
+}
@@ -0,0 +1,700 @@
+/*******************************************************************************
+ * Cluster Federation
+ *
+ * Joins several servers into one chat: a CHT_SEND accepted by any node is
+ * relayed to every other node. CHT_SEND names no recipients, so there is no
+ * node to route it to and it is broadcast. Receiving nodes count what
+ * arrives; there is no path to hand it to their clients yet.
+ *
+ * Membership:
+ * - Each node is started with its own federation address (-N) and its
+ *   peers' (-P). Nodes are numbered by sorting the addresses, so every node
+ *   agrees on the numbering.
+ *
+ * Links:
+ * - A federation process, forked at startup, keeps one persistent TCP link
+ *   to every peer and accepts theirs. All traffic to a peer is multiplexed
+ *   over that one link, and a dropped link is redialled after
+ *   FED_RECONNECT_MS.
+ * - A link is dialled from the node's own IP and opens with a hello holding
+ *   the node's address as given to -N. The accepting node takes the link as
+ *   that peer's only if both agree with its peer list, so nodes sharing an
+ *   IP, as on loopback, are told apart. A peer's newest link replaces any
+ *   earlier one, which it stopped using when it redialled; a link that sends
+ *   no hello within FED_HELLO_MS is closed.
+ * - Client processes hand accepted messages over a pipe, without blocking.
+ *   The federation process reads everything waiting, appends each message to
+ *   the BATCH frame of every connected peer, then writes one frame per peer.
+ *   Under load many messages share a frame, when idle a message goes out
+ *   alone without waiting, and each message crosses a link once per node
+ *   however many of its users are there.
+ * - Messages that arrive from a peer are never relayed again, so there are
+ *   no loops. Messages for a peer whose link is down are dropped and counted.
+ ******************************************************************************/
+
+#include "../include/federation.h"
+#include "../include/logging.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FED_ADDR_LEN 32
+#define FED_PIPE_CHUNK (64 * 1024)
+#define FED_BACKLOG 16
+#define FED_LOG_LEN 128
+#define FED_HELLO_MS 2000
+#define MSEC_PER_SEC 1000
+#define NSEC_PER_MSEC 1000000
+#define BASE_TEN 10
+
+typedef struct fed_node
+{
+    char               name[FED_ADDR_LEN]; /* ip:port as given */
+    struct sockaddr_in addr;
+} fed_node;
+
+/* The federation process's link to one peer, and the frame being built for it */
+typedef struct fed_link
+{
+    int     out;         /* link we dialled, -1 when down */
+    int     connecting;  /* out is waiting on a non-blocking connect */
+    long    retry_at_ms; /* when to dial again while down */
+    int     in;          /* link the peer dialled, -1 when down */
+    size_t  in_held;
+    uint8_t in_buf[BATCHPACKETLEN];
+    int     out_pos; /* end of the messages in out_frame, HEADERLEN when empty */
+    int     out_count;
+    uint8_t out_frame[BATCHPACKETLEN];
+} fed_link;
+
+/* An accepted link whose hello has not all arrived */
+typedef struct fed_pending
+{
+    int    fd; /* -1 when the slot is free */
+    size_t held;
+    long   deadline_ms;
+    char   hello[FED_ADDR_LEN];
+} fed_pending;
+
+static int      parse_node(const char *text, size_t len, fed_node *node);
+static int      compare_nodes(const void *a, const void *b);
+static void     federation_run(void);
+static int      open_listener(void);
+static void     dial(fed_link *link, unsigned int node, long now_ms);
+static int      send_hello(fed_link *link);
+static void     accept_peer(int listener, fed_pending pending[], long now_ms);
+static void     read_hello(fed_pending *peer, fed_link links[]);
+static void     link_down(fed_link *link, long now_ms);
+static void     queue_relay(fed_link links[], const uint8_t packet[], int len);
+static void     flush_link(fed_link *link);
+static void     read_peer(fed_link *link, unsigned int node);
+static void     read_relays(fed_link links[], uint8_t chunk[], size_t *held);
+static long     now_ms(void);
+static void     fed_stop(int signum);
+
+static fed_node  nodes[FED_MAX_NODES];                  // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned  node_count = 0;                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned  self       = 0;                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int       relays[2]  = {-1, -1};                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t     fed_pid    = 0;                        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Federation process only */
+static volatile sig_atomic_t fed_running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         sent_msgs   = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         sent_frames = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         recv_msgs   = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         recv_frames = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         dropped     = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: federation_init
+ * Description: Numbers this node and its peers and forks the federation
+ *              process. A NULL node leaves clustering off.
+ *              Must run before the listener exists.
+ * Returns: 0 on success, -1 if an address is malformed or the process could
+ *          not be started.
+ */
+int federation_init(const char *node, const char *peers)
+{
+    fed_node    me;
+    const char *pos = peers;
+
+    node_count = 0;
+    if(node == NULL)
+    {
+        return 0;
+    }
+    if(parse_node(node, strlen(node), &me) < 0)
+    {
+        return -1;
+    }
+    nodes[node_count++] = me;
+    while(*pos != '\0')
+    {
+        size_t len = strcspn(pos, ",");
+
+        if(node_count == FED_MAX_NODES)
+        {
+            fprintf(stderr, "At most %d cluster nodes are supported\n", FED_MAX_NODES);
+            return -1;
+        }
+        if(parse_node(pos, len, &nodes[node_count++]) < 0)
+        {
+            return -1;
+        }
+        pos += len + (pos[len] == ',');
+    }
+
+    qsort(nodes, node_count, sizeof(nodes[0]), compare_nodes);
+    for(unsigned int i = 0; i < node_count; i++)
+    {
+        if(strcmp(nodes[i].name, me.name) == 0)
+        {
+            self = i;
+        }
+    }
+
+    if(pipe(relays) == -1)
+    {
+        perror("federation_init::pipe");
+        return -1;
+    }
+    fcntl(relays[1], F_SETFL, O_NONBLOCK);
+    fcntl(relays[0], F_SETFL, O_NONBLOCK);
+    fcntl(relays[1], F_SETFD, FD_CLOEXEC);
+
+    fed_pid = fork();
+    if(fed_pid == -1)
+    {
+        perror("federation_init::fork");
+        return -1;
+    }
+    if(fed_pid == 0)
+    {
+        federation_run();
+        _exit(EXIT_SUCCESS);
+    }
+    close(relays[0]);
+    relays[0] = -1;
+    return 0;
+}
+
+/* Hands a message accepted from a local client to the federation process; drops it rather than block */
+void federation_relay(const header_t *header, const uint8_t fields[])
+{
+    uint8_t packet[PACKETLEN];
+
+    if(relays[1] < 0 || header->payload_len > MAXPAYLOADLEN)
+    {
+        return;
+    }
+    encode_header(packet, header);
+    memcpy(packet + HEADERLEN, fields, header->payload_len);
+    // At most PACKETLEN bytes, below PIPE_BUF, so messages from different clients never interleave
+    write(relays[1], packet, (size_t)HEADERLEN + header->payload_len);
+}
+
+/* Stops the federation process; its links close with it */
+void federation_shutdown(void)
+{
+    if(fed_pid <= 0)
+    {
+        return;
+    }
+    close(relays[1]);
+    relays[1] = -1;
+    kill(fed_pid, SIGTERM);
+    while(waitpid(fed_pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+    fed_pid = 0;
+}
+
+static int parse_node(const char *text, size_t len, fed_node *node)
+{
+    char          *colon;
+    char          *end;
+    unsigned long  port;
+
+    memset(node, 0, sizeof(*node));
+    if(len == 0 || len >= sizeof(node->name))
+    {
+        fprintf(stderr, "Invalid cluster node address '%.*s'\n", (int)len, text);
+        return -1;
+    }
+    memcpy(node->name, text, len);
+    colon = strrchr(node->name, ':');
+    if(colon == NULL)
+    {
+        fprintf(stderr, "Invalid cluster node address '%s'\n", node->name);
+        return -1;
+    }
+    *colon = '\0';
+    port   = strtoul(colon + 1, &end, BASE_TEN);
+    if(inet_pton(AF_INET, node->name, &node->addr.sin_addr) != 1 || *end != '\0' || port == 0 || port > UINT16_MAX)
+    {
+        *colon = ':';
+        fprintf(stderr, "Invalid cluster node address '%s'\n", node->name);
+        return -1;
+    }
+    *colon                = ':';
+    node->addr.sin_family = AF_INET;
+    node->addr.sin_port   = htons((uint16_t)port);
+    return 0;
+}
+
+static int compare_nodes(const void *a, const void *b)
+{
+    return strcmp(((const fed_node *)a)->name, ((const fed_node *)b)->name);
+}
+
+static void federation_run(void)
+{
+    static fed_link    links[FED_MAX_NODES];
+    static fed_pending pending[FED_MAX_NODES];
+    static uint8_t     chunk[FED_PIPE_CHUNK];
+    struct pollfd      fds[2 + 3 * FED_MAX_NODES];
+    size_t             held = 0;
+    int                listener;
+    char               line[FED_LOG_LEN];
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, fed_stop);
+    signal(SIGPIPE, SIG_IGN);
+    close(relays[1]);
+
+    listener = open_listener();
+    if(listener < 0)
+    {
+        return;
+    }
+    for(unsigned int i = 0; i < node_count; i++)
+    {
+        links[i].out     = -1;
+        links[i].in      = -1;
+        links[i].out_pos = HEADERLEN;
+        pending[i].fd    = -1;
+        if(i != self)
+        {
+            dial(&links[i], i, now_ms());
+        }
+    }
+
+    while(fed_running)
+    {
+        nfds_t nfds    = 0;
+        nfds_t waiting = 0;
+        long   timeout = -1;
+        long   now     = now_ms();
+
+        fds[nfds].fd       = relays[0];
+        fds[nfds++].events = POLLIN;
+        fds[nfds].fd       = listener;
+        fds[nfds++].events = POLLIN;
+        for(unsigned int i = 0; i < node_count; i++)
+        {
+            if(i == self)
+            {
+                continue;
+            }
+            if(links[i].out < 0)
+            {
+                long wait = links[i].retry_at_ms - now;
+                timeout   = (timeout < 0 || wait < timeout) ? (wait > 0 ? wait : 0) : timeout;
+            }
+            // Slots are fixed per node so results map back without a lookup
+            fds[nfds].fd       = links[i].out;
+            fds[nfds++].events = (short)(links[i].connecting ? POLLOUT : POLLIN);
+            fds[nfds].fd       = links[i].in;
+            fds[nfds++].events = POLLIN;
+        }
+        waiting = nfds;
+        for(unsigned int i = 0; i < node_count; i++)
+        {
+            if(pending[i].fd >= 0)
+            {
+                long wait = pending[i].deadline_ms - now;
+                timeout   = (timeout < 0 || wait < timeout) ? (wait > 0 ? wait : 0) : timeout;
+            }
+            fds[nfds].fd       = pending[i].fd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        if(poll(fds, nfds, (int)timeout) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("federation::poll");
+            break;
+        }
+
+        now = now_ms();
+        for(unsigned int i = 0, slot = 2; i < node_count; i++)
+        {
+            if(i == self)
+            {
+                continue;
+            }
+            if(links[i].out >= 0 && links[i].connecting && (fds[slot].revents & (POLLOUT | POLLERR | POLLHUP)))
+            {
+                int       err = 0;
+                socklen_t len = sizeof(err);
+
+                getsockopt(links[i].out, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err != 0)
+                {
+                    link_down(&links[i], now);
+                }
+                else
+                {
+                    // Writes block from here on, bounded by the send timeout, so a frame is never left half sent
+                    struct timeval send_timeout = {FED_SEND_TIMEOUT_SEC, 0};
+                    fcntl(links[i].out, F_SETFL, fcntl(links[i].out, F_GETFL) & ~O_NONBLOCK);
+                    setsockopt(links[i].out, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                    links[i].connecting = 0;
+                    if(send_hello(&links[i]) == -1)
+                    {
+                        link_down(&links[i], now);
+                    }
+                    else
+                    {
+                        snprintf(line, sizeof(line), "Linked to cluster node %s", nodes[i].name);
+                        server_log(1, line, LOG_INFO);
+                    }
+                }
+            }
+            else if(links[i].out >= 0 && !links[i].connecting && (fds[slot].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                // Peers never write on our link, so readable means closed
+                link_down(&links[i], now);
+            }
+            else if(links[i].out < 0 && now >= links[i].retry_at_ms)
+            {
+                dial(&links[i], i, now);
+            }
+            if(links[i].in >= 0 && (fds[slot + 1].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                read_peer(&links[i], i);
+            }
+            slot += 2;
+        }
+
+        for(unsigned int i = 0; i < node_count; i++)
+        {
+            if(pending[i].fd >= 0 && (fds[waiting + i].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                read_hello(&pending[i], links);
+            }
+            else if(pending[i].fd >= 0 && now >= pending[i].deadline_ms)
+            {
+                close(pending[i].fd);
+                pending[i].fd = -1;
+            }
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            accept_peer(listener, pending, now);
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP))
+        {
+            read_relays(links, chunk, &held);
+        }
+    }
+
+    snprintf(line, sizeof(line), "Federation: relayed %lu messages in %lu frames, received %lu in %lu, dropped %lu", sent_msgs, sent_frames, recv_msgs, recv_frames, dropped);
+    printf("%s\n", line);
+    fflush(stdout);
+    server_log(1, line, LOG_INFO);
+}
+
+static int open_listener(void)
+{
+    int optval = 1;
+    int fd     = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if(fd == -1)
+    {
+        perror("federation::socket");
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if(bind(fd, (const struct sockaddr *)&nodes[self].addr, sizeof(nodes[self].addr)) == -1 || listen(fd, FED_BACKLOG) == -1)
+    {
+        perror("federation::bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Starts a non-blocking connect to the peer from this node's IP; completion is picked up by poll */
+static void dial(fed_link *link, unsigned int node, long now_ms)
+{
+    struct sockaddr_in local  = nodes[self].addr;
+    int                optval = 1;
+
+    link->out = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(link->out == -1)
+    {
+        link->retry_at_ms = now_ms + FED_RECONNECT_MS;
+        return;
+    }
+    // Frames are already batched, so Nagle would only add delay
+    setsockopt(link->out, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    link->connecting = 1;
+    local.sin_port   = 0;
+    if(bind(link->out, (const struct sockaddr *)&local, sizeof(local)) == -1 || (connect(link->out, (const struct sockaddr *)&nodes[node].addr, sizeof(nodes[node].addr)) == -1 && errno != EINPROGRESS))
+    {
+        link_down(link, now_ms);
+    }
+}
+
+/* Names this node on a link it has just dialled: its address, NUL padded to FED_ADDR_LEN */
+static int send_hello(fed_link *link)
+{
+    char hello[FED_ADDR_LEN];
+
+    memset(hello, 0, sizeof(hello));
+    memcpy(hello, nodes[self].name, strlen(nodes[self].name));
+    return (write(link->out, hello, sizeof(hello)) == (ssize_t)sizeof(hello)) ? 0 : -1;
+}
+
+/* Holds an accepted link until its hello says which peer it is; refused when every slot waits already */
+static void accept_peer(int listener, fed_pending pending[], long now_ms)
+{
+    int fd = accept(listener, NULL, NULL);
+
+    if(fd < 0)
+    {
+        return;
+    }
+    for(unsigned int i = 0; i < node_count; i++)
+    {
+        if(pending[i].fd < 0)
+        {
+            pending[i].fd          = fd;
+            pending[i].held        = 0;
+            pending[i].deadline_ms = now_ms + FED_HELLO_MS;
+            return;
+        }
+    }
+    close(fd);
+}
+
+/* Reads what has arrived of a hello and, once it is whole, makes the link its peer's */
+static void read_hello(fed_pending *peer, fed_link links[])
+{
+    struct sockaddr_in from;
+    socklen_t          from_len = sizeof(from);
+    ssize_t            nread    = read(peer->fd, peer->hello + peer->held, sizeof(peer->hello) - peer->held);
+
+    if(nread <= 0)
+    {
+        close(peer->fd);
+        peer->fd = -1;
+        return;
+    }
+    peer->held += (size_t)nread;
+    if(peer->held < sizeof(peer->hello))
+    {
+        return;
+    }
+
+    if(peer->hello[sizeof(peer->hello) - 1] == '\0' && getpeername(peer->fd, (struct sockaddr *)&from, &from_len) == 0)
+    {
+        for(unsigned int i = 0; i < node_count; i++)
+        {
+            if(i != self && strcmp(nodes[i].name, peer->hello) == 0 && nodes[i].addr.sin_addr.s_addr == from.sin_addr.s_addr)
+            {
+                // The peer redialled, so it has stopped writing on any earlier link
+                if(links[i].in >= 0)
+                {
+                    close(links[i].in);
+                }
+                links[i].in      = peer->fd;
+                links[i].in_held = 0;
+                peer->fd         = -1;
+                return;
+            }
+        }
+    }
+    fprintf(stderr, "Refusing a cluster link that did not name a peer from its address\n");
+    close(peer->fd);
+    peer->fd = -1;
+}
+
+static void link_down(fed_link *link, long now_ms)
+{
+    close(link->out);
+    link->out         = -1;
+    link->connecting  = 0;
+    link->retry_at_ms = now_ms + FED_RECONNECT_MS;
+    dropped += (unsigned long)link->out_count;
+    link->out_pos   = HEADERLEN;
+    link->out_count = 0;
+}
+
+/* Reads what clients have handed over and sends it on, one frame per peer per read */
+static void read_relays(fed_link links[], uint8_t chunk[], size_t *held)
+{
+    ssize_t nread;
+    size_t  pos = 0;
+
+    nread = read(relays[0], chunk + *held, FED_PIPE_CHUNK - *held);
+    if(nread <= 0)
+    {
+        if(nread == 0)
+        {
+            fed_running = 0;
+        }
+        return;
+    }
+    *held += (size_t)nread;
+
+    while(*held - pos >= HEADERLEN)
+    {
+        header_t header;
+        size_t   len;
+
+        decode_header(chunk + pos, &header);
+        len = HEADERLEN + (size_t)header.payload_len;
+        if(*held - pos < len)
+        {
+            break;
+        }
+        queue_relay(links, chunk + pos, (int)len);
+        pos += len;
+    }
+    memmove(chunk, chunk + pos, *held - pos);
+    *held -= pos;
+
+    for(unsigned int i = 0; i < node_count; i++)
+    {
+        flush_link(&links[i]);
+    }
+}
+
+static void queue_relay(fed_link links[], const uint8_t packet[], int len)
+{
+    for(unsigned int i = 0; i < node_count; i++)
+    {
+        fed_link *link = &links[i];
+        int       pos;
+
+        if(i == self)
+        {
+            continue;
+        }
+        if(link->out < 0 || link->connecting)
+        {
+            dropped++;
+            continue;
+        }
+        pos = (link->out_count < BATCH_MAX_MSGS) ? encode_batch_append(link->out_frame, link->out_pos, packet, len) : -1;
+        if(pos < 0)
+        {
+            flush_link(link);
+            pos = encode_batch_append(link->out_frame, link->out_pos, packet, len);
+        }
+        link->out_pos = pos;
+        link->out_count++;
+    }
+}
+
+static void flush_link(fed_link *link)
+{
+    int len;
+
+    if(link->out_count == 0)
+    {
+        return;
+    }
+    len = encode_batch_header(link->out_frame, link->out_pos);
+    // Frames carry the sending node's number where a client packet carries its user id
+    link->out_frame[2] = 0;
+    link->out_frame[3] = (uint8_t)self;
+    if(write(link->out, link->out_frame, (size_t)len) != len)
+    {
+        link_down(link, now_ms());
+        return;
+    }
+    sent_msgs += (unsigned long)link->out_count;
+    sent_frames++;
+    link->out_pos   = HEADERLEN;
+    link->out_count = 0;
+}
+
+/* Reads relay frames from a peer and counts the chat messages in them */
+static void read_peer(fed_link *link, unsigned int node)
+{
+    ssize_t nread = read(link->in, link->in_buf + link->in_held, sizeof(link->in_buf) - link->in_held);
+    size_t  pos   = 0;
+
+    if(nread <= 0)
+    {
+        close(link->in);
+        link->in = -1;
+        return;
+    }
+    link->in_held += (size_t)nread;
+
+    while(link->in_held - pos >= HEADERLEN)
+    {
+        header_t  header;
+        asn_batch batch;
+        size_t    len;
+
+        decode_header(link->in_buf + pos, &header);
+        len = HEADERLEN + (size_t)header.payload_len;
+        if(header.packet_type != BATCH || len > sizeof(link->in_buf))
+        {
+            fprintf(stderr, "Dropping the link from cluster node %s: not a relay frame\n", nodes[node].name);
+            close(link->in);
+            link->in = -1;
+            return;
+        }
+        if(link->in_held - pos < len)
+        {
+            break;
+        }
+        if(decode_packet(link->in_buf + pos, &header, &batch) == 0)
+        {
+            // Local fan-out is the delivery path CHT_SEND does not have yet; until then the relay is counted
+            recv_msgs += (unsigned long)batch.count;
+            recv_frames++;
+        }
+        pos += len;
+    }
+    memmove(link->in_buf, link->in_buf + pos, link->in_held - pos);
+    link->in_held -= pos;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / NSEC_PER_MSEC;
+}
+
+static void fed_stop(int signum)
+{
+    (void)signum;
+    fed_running = 0;
+}
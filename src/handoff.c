@@ -0,0 +1,191 @@
+/* handoff.c */
+
+#include "../include/handoff.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr);
+
+#define HANDOFF_BACKLOG 1
+
+/*
+ * Function: handoff_listen
+ * Description: Binds the upgrade control socket at path so that a newer binary
+ *              can later connect and take over the listening socket.
+ * Returns: The control socket descriptor on success or -1 on failure.
+ */
+int handoff_listen(const char *path)
+{
+    int                ctl_fd;
+    struct sockaddr_un addr;
+
+    if(handoff_addr(path, &addr) < 0)
+    {
+        return -1;
+    }
+
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(ctl_fd == -1)
+    {
+        perror("handoff_listen::socket");
+        return -1;
+    }
+
+    /* A stale path is either ours from a crash or the previous process we just took over from */
+    if(unlink(path) == -1 && errno != ENOENT)
+    {
+        perror("handoff_listen::unlink");
+        close(ctl_fd);
+        return -1;
+    }
+
+    if(bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(ctl_fd, HANDOFF_BACKLOG) == -1)
+    {
+        perror("handoff_listen::bind");
+        close(ctl_fd);
+        return -1;
+    }
+
+    return ctl_fd;
+}
+
+/*
+ * Function: handoff_take
+ * Description: Connects to the control socket of a running server and receives
+ *              its listening socket over SCM_RIGHTS.
+ * Returns: The inherited listening socket, or -1 if no server is running at path
+ *          or the handoff failed.
+ */
+int handoff_take(const char *path, handoff_info *info)
+{
+    int                ctl_fd;
+    int                listen_fd;
+    ssize_t            nread;
+    struct sockaddr_un addr;
+    struct msghdr      msg;
+    struct iovec       iov;
+    struct cmsghdr    *cmsg;
+    char               control[CMSG_SPACE(sizeof(int))];
+
+    if(handoff_addr(path, &addr) < 0)
+    {
+        return -1;
+    }
+
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(ctl_fd == -1)
+    {
+        perror("handoff_take::socket");
+        return -1;
+    }
+
+    if(connect(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        /* Nothing to take over; the caller sets up a fresh listener */
+        close(ctl_fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base       = info;
+    iov.iov_len        = sizeof(*info);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    do
+    {
+        nread = recvmsg(ctl_fd, &msg, 0);
+    } while(nread == -1 && errno == EINTR);
+    close(ctl_fd);
+
+    if(nread != (ssize_t)sizeof(*info) || info->magic != HANDOFF_MAGIC || info->version != HANDOFF_VERSION)
+    {
+        fprintf(stderr, "handoff_take: malformed handoff message\n");
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+    {
+        fprintf(stderr, "handoff_take: no listening socket received\n");
+        return -1;
+    }
+
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    return listen_fd;
+}
+
+/*
+ * Function: handoff_give
+ * Description: Accepts the pending upgrade connection on ctl_fd and passes
+ *              listen_fd to the new process. The caller keeps its own copy of
+ *              listen_fd and is expected to stop accepting on it.
+ * Returns: 0 on success, -1 on failure.
+ */
+int handoff_give(int ctl_fd, int listen_fd, const handoff_info *info)
+{
+    int             peer_fd;
+    ssize_t         nwritten;
+    struct msghdr   msg;
+    struct iovec    iov;
+    struct cmsghdr *cmsg;
+    handoff_info    copy;
+    char            control[CMSG_SPACE(sizeof(int))];
+
+    peer_fd = accept(ctl_fd, NULL, NULL);
+    if(peer_fd == -1)
+    {
+        perror("handoff_give::accept");
+        return -1;
+    }
+
+    memcpy(&copy, info, sizeof(copy));
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base       = &copy;
+    iov.iov_len        = sizeof(copy);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg             = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    do
+    {
+        nwritten = sendmsg(peer_fd, &msg, 0);
+    } while(nwritten == -1 && errno == EINTR);
+    close(peer_fd);
+
+    if(nwritten != (ssize_t)sizeof(copy))
+    {
+        perror("handoff_give::sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+/* Fill in a unix socket address, rejecting paths that do not fit */
+static int handoff_addr(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if(strlen(path) >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "Upgrade socket path too long: %s\n", path);
+        return -1;
+    }
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
@@ -0,0 +1,341 @@
+/*******************************************************************************
+ * User ID Allocator
+ *
+ * Hands out the 16-bit user ids carried in every packet's sender_id.
+ *
+ * - Ids come from a monotonic counter persisted in a file mapped MAP_SHARED,
+ *   so they are never reused across a restart while fresh ones remain.
+ * - Each process leases ID_ALLOC_LEASE ids from the counter at a time and
+ *   hands them out locally, so only one in every ID_ALLOC_LEASE accounts
+ *   touches the shared cache line. Ids left in a lease go back to the
+ *   counter when nobody has leased since, otherwise to the free bitmap.
+ * - Removed users put their id in a free bitmap that follows the header. It
+ *   is only drawn from once the counter runs out, so a freed id is not handed
+ *   to a new account while clients may still remember the old one.
+ * - The header's clean flag works like the Bloom filter's: an allocator that
+ *   was not closed cleanly may have lost leases, and the caller is asked to
+ *   rebuild the free bitmap from the ids that are actually stored. Every
+ *   change clears it again, for a server still running after another closed.
+ ******************************************************************************/
+
+#include "../include/id_alloc.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ID_ALLOC_FILE_MODE 0644
+#define ID_ALLOC_HEADER_SPACE 64 /* keeps the bitmap cache line aligned */
+#define ID_ALLOC_WORD_BITS 64
+#define ID_ALLOC_WORDS (ID_ALLOC_LIMIT / ID_ALLOC_WORD_BITS)
+
+static int  lease_refill(void);
+static int  lease_from_counter(void);
+static int  lease_from_bitmap(void);
+static void bitmap_set(uint32_t id);
+static void ids_changed(void);
+
+static id_alloc_header  *ids_header = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static _Atomic uint64_t *ids_free   = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* This process's lease; a forked child starts with none of its parent's */
+static uint32_t lease[ID_ALLOC_LEASE];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t   lease_len   = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint32_t lease_end   = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t    lease_owner = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: id_alloc_open
+ * Description: Maps the allocator stored at path, creating it when missing,
+ *              and moves the counter past max_id, the highest stored id.
+ * Returns: 0 if the stored state can be trusted, 1 if it is new or was not
+ *          closed cleanly and the caller must rebuild the free bitmap with
+ *          id_alloc_reset_free and id_alloc_mark_used, -1 on failure.
+ */
+int id_alloc_open(const char *path, uint32_t max_id)
+{
+    struct stat st;
+    size_t      map_len = ID_ALLOC_HEADER_SPACE + ID_ALLOC_WORDS * sizeof(uint64_t);
+    void       *mem;
+    int         fd;
+    int         stale;
+    int         rebuild;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, ID_ALLOC_FILE_MODE);
+    if(fd == -1)
+    {
+        perror("id_alloc_open::open");
+        return -1;
+    }
+    if(fstat(fd, &st) == -1)
+    {
+        perror("id_alloc_open::fstat");
+        close(fd);
+        return -1;
+    }
+
+    stale = (size_t)st.st_size != map_len;
+    if(stale && (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)map_len) == -1))
+    {
+        perror("id_alloc_open::ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    mem = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+    {
+        perror("id_alloc_open::mmap");
+        return -1;
+    }
+
+    ids_header = (id_alloc_header *)mem;
+    ids_free   = (_Atomic uint64_t *)((char *)mem + ID_ALLOC_HEADER_SPACE);
+    if(!stale && (ids_header->magic != ID_ALLOC_MAGIC || ids_header->version != ID_ALLOC_VERSION))
+    {
+        memset(mem, 0, map_len);
+        stale = 1;
+    }
+    if(stale)
+    {
+        ids_header->magic   = ID_ALLOC_MAGIC;
+        ids_header->version = ID_ALLOC_VERSION;
+        atomic_store(&ids_header->next, ID_ALLOC_FIRST);
+    }
+
+    // The store is the authority on which ids exist, whatever the file says
+    if(atomic_load(&ids_header->next) <= max_id)
+    {
+        atomic_store(&ids_header->next, max_id + 1);
+        stale = 1;
+    }
+
+    rebuild = stale || !atomic_load(&ids_header->clean);
+    atomic_store(&ids_header->clean, 0);
+    lease_len = 0;
+    lease_end = 0;
+    return rebuild;
+}
+
+/* Marks every id below the counter free, ahead of id_alloc_mark_used for each stored user */
+void id_alloc_reset_free(void)
+{
+    uint32_t next = atomic_load(&ids_header->next);
+
+    for(size_t word = 0; word < ID_ALLOC_WORDS; word++)
+    {
+        atomic_store_explicit(&ids_free[word], 0, memory_order_relaxed);
+    }
+    atomic_store(&ids_header->free_count, 0);
+    for(uint32_t id = ID_ALLOC_FIRST; id < next && id < ID_ALLOC_LIMIT; id++)
+    {
+        bitmap_set(id);
+    }
+    ids_changed();
+}
+
+/* Takes a stored user's id out of the free bitmap */
+void id_alloc_mark_used(uint32_t id)
+{
+    uint64_t bit = (uint64_t)1 << (id % ID_ALLOC_WORD_BITS);
+
+    if(id < ID_ALLOC_LIMIT && (atomic_fetch_and(&ids_free[id / ID_ALLOC_WORD_BITS], ~bit) & bit) != 0)
+    {
+        atomic_fetch_sub(&ids_header->free_count, 1);
+        ids_changed();
+    }
+}
+
+/*
+ * Function: id_alloc_claim
+ * Description: Marks an id used that was allocated elsewhere, as by a
+ *              replication primary. The counter moves past it and any ids it
+ *              skips go to the free bitmap.
+ */
+void id_alloc_claim(uint32_t id)
+{
+    uint32_t next = atomic_load(&ids_header->next);
+
+    if(id >= ID_ALLOC_LIMIT)
+    {
+        return;
+    }
+    while(next <= id && !atomic_compare_exchange_weak(&ids_header->next, &next, id + 1))
+    {
+    }
+    for(uint32_t skipped = next; skipped < id; skipped++)
+    {
+        bitmap_set(skipped);
+    }
+    id_alloc_mark_used(id);
+    ids_changed();
+}
+
+/*
+ * Function: id_alloc_take
+ * Description: Hands out an id from this process's lease, leasing more from
+ *              the counter, or once that is spent from the free bitmap.
+ * Returns: The id, or -1 when every id is in use.
+ */
+int id_alloc_take(void)
+{
+    if(lease_owner != getpid())
+    {
+        lease_owner = getpid();
+        lease_len   = 0;
+        lease_end   = 0;
+    }
+    if(lease_len == 0)
+    {
+        if(lease_refill() == 0)
+        {
+            return -1;
+        }
+        ids_changed();
+    }
+    lease_len--;
+    return (int)lease[lease_len];
+}
+
+/* Returns a removed user's id for reuse */
+void id_alloc_free(uint32_t id)
+{
+    if(id >= ID_ALLOC_FIRST && id < ID_ALLOC_LIMIT)
+    {
+        bitmap_set(id);
+        ids_changed();
+    }
+}
+
+/* Gives back the ids this process leased but never handed out */
+void id_alloc_release_lease(void)
+{
+    uint32_t end = lease_end;
+
+    if(lease_owner != getpid() || lease_len == 0)
+    {
+        return;
+    }
+    // Most clients create at most one account, so rewinding the counter keeps the id space dense
+    if(end != 0 && atomic_compare_exchange_strong(&ids_header->next, &end, lease[lease_len - 1]))
+    {
+        lease_len = 0;
+        ids_changed();
+        return;
+    }
+    while(lease_len > 0)
+    {
+        lease_len--;
+        bitmap_set(lease[lease_len]);
+    }
+    ids_changed();
+}
+
+/* Flushes the counter and bitmap, then marks the allocator clean so the next open can trust it, unless a change raced the flush */
+void id_alloc_close(void)
+{
+    size_t   map_len = ID_ALLOC_HEADER_SPACE + ID_ALLOC_WORDS * sizeof(uint64_t);
+    uint32_t changes;
+
+    if(ids_header == NULL)
+    {
+        return;
+    }
+    id_alloc_release_lease();
+    changes = atomic_load(&ids_header->changes);
+    if(msync(ids_header, map_len, MS_SYNC) == 0)
+    {
+        atomic_store(&ids_header->clean, 1);
+        if(atomic_load(&ids_header->changes) != changes)
+        {
+            atomic_store(&ids_header->clean, 0);
+        }
+        msync(ids_header, ID_ALLOC_HEADER_SPACE, MS_SYNC);
+    }
+    munmap(ids_header, map_len);
+    ids_header = NULL;
+    ids_free   = NULL;
+}
+
+/* Fills the empty lease, returns how many ids it now holds */
+static int lease_refill(void)
+{
+    if(lease_from_counter() > 0)
+    {
+        return (int)lease_len;
+    }
+    lease_end = 0;
+    return lease_from_bitmap();
+}
+
+static int lease_from_counter(void)
+{
+    uint32_t base;
+    uint32_t end;
+
+    // Bounded by a CAS rather than a plain add so the counter never runs past the id space
+    base = atomic_load(&ids_header->next);
+    do
+    {
+        if(base >= ID_ALLOC_LIMIT)
+        {
+            return 0;
+        }
+        end = base + ID_ALLOC_LEASE < ID_ALLOC_LIMIT ? base + ID_ALLOC_LEASE : ID_ALLOC_LIMIT;
+    } while(!atomic_compare_exchange_weak(&ids_header->next, &base, end));
+
+    // Handed out from the top, so store ids in reverse to give them out in order
+    lease_end = end;
+    for(uint32_t id = end; id > base; id--)
+    {
+        lease[lease_len++] = id - 1;
+    }
+    return (int)lease_len;
+}
+
+static int lease_from_bitmap(void)
+{
+    if(atomic_load(&ids_header->free_count) == 0)
+    {
+        return 0;
+    }
+    for(uint32_t word = 0; word < ID_ALLOC_WORDS && lease_len < ID_ALLOC_LEASE; word++)
+    {
+        uint64_t bits = atomic_load_explicit(&ids_free[word], memory_order_relaxed);
+        while(bits != 0 && lease_len < ID_ALLOC_LEASE)
+        {
+            uint64_t bit = bits & (~bits + 1);    // lowest set bit
+            if((atomic_fetch_and(&ids_free[word], ~bit) & bit) != 0)
+            {
+                atomic_fetch_sub(&ids_header->free_count, 1);
+                lease[lease_len++] = word * ID_ALLOC_WORD_BITS + (uint32_t)__builtin_ctzll(bit);
+            }
+            bits &= ~bit;
+        }
+    }
+    return (int)lease_len;
+}
+
+static void bitmap_set(uint32_t id)
+{
+    uint64_t bit = (uint64_t)1 << (id % ID_ALLOC_WORD_BITS);
+
+    if((atomic_fetch_or(&ids_free[id / ID_ALLOC_WORD_BITS], bit) & bit) == 0)
+    {
+        atomic_fetch_add(&ids_header->free_count, 1);
+    }
+}
+
+/* After the counter or bitmap changed: counted for a close in progress, and no longer clean if a close already finished */
+static void ids_changed(void)
+{
+    atomic_fetch_add(&ids_header->changes, 1);
+    if(atomic_load(&ids_header->clean))
+    {
+        atomic_store(&ids_header->clean, 0);
+        msync(ids_header, ID_ALLOC_HEADER_SPACE, MS_SYNC);
+    }
+}
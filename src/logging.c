@@ -1,12 +1,14 @@
 #include "logging.h"
+#include "reporter.h"
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
-// current server_log calls have stdout as the fd until proper implementation with the server manager is done
+// fd is unused: lines reach the server manager through the reporter process, which owns that connection
 void server_log(int fd, char const *msg, int lvl)
 {
+    reporter_log(lvl, msg);
     switch(lvl)
     {
         case LOG_INFO:
@@ -22,5 +24,4 @@ void server_log(int fd, char const *msg, int lvl)
             syslog(LOG_INFO, "[UNIMPLEMENTED]: %s", msg);
             printf("Unhandled log type, attempting to send to server manager at FD: %d?", fd);
     }
-    //    write(fd, msg, strlen(msg)); this needs to be ASN and following the protocol rules
 }
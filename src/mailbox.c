@@ -0,0 +1,469 @@
+/*******************************************************************************
+ * Offline Message Queues
+ *
+ * Store-and-forward for users who are not connected: packets addressed to
+ * them are queued here and handed over in one burst when they next log in.
+ *
+ * Data Storage:
+ * - One spool file per user id in user_db.mbox/: a mailbox_head, then the
+ *   queued packets back to back exactly as they will be sent. Packets carry
+ *   their own length in the header, so records need no framing of their own
+ *   and a drain is a few large sequential reads.
+ * - Enqueue is one O_APPEND write under an exclusive flock. A drain takes the
+ *   same lock and streams the file from the requested sequence number.
+ * - A record cut short by a crash is dropped at the next drain.
+ *
+ * Sequence Numbers:
+ * - Packets are numbered by byte offset in the user's stream, so a client
+ *   told where a burst starts can number what it receives by adding up
+ *   packet lengths, and resume by presenting the number it got up to.
+ * - A drain keeps what it delivered until the next drain acknowledges it:
+ *   ACC_RESUME acknowledges up to the client's number, and a fresh login
+ *   acknowledges everything delivered before. Acknowledged packets are
+ *   skipped by advancing the head and only copied out once they outweigh
+ *   the live ones, or cut off when nothing live is left.
+ *
+ * In-Memory Index:
+ * - Base, live bytes and delivered mark per user id, in user_db.mbox/index
+ *   mapped MAP_SHARED before any fork. Logins with nothing queued, the common
+ *   case, are answered from it without touching the file system, and it
+ *   enforces MAILBOX_MAX_BYTES without a stat.
+ * - Every server holds a shared flock on the index until its last process
+ *   exits. One that locks it alone at startup rebuilds it from the spool
+ *   heads; one started while another runs (a hot upgrade) maps the same
+ *   copy, so either generation sees what the other queued and drained.
+ ******************************************************************************/
+
+#include "../include/mailbox.h"
+#include "../include/asn.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAILBOX_DIR "user_db.mbox"
+#define MAILBOX_INDEX MAILBOX_DIR "/index"
+#define MAILBOX_DIR_MODE 0755
+#define MAILBOX_FILE_MODE 0644
+#define MAILBOX_PATH_LEN 32
+#define BASE_TEN 10
+
+/* The shared copy of a spool head, readable without the file lock */
+typedef struct mailbox_index
+{
+    _Atomic uint32_t base;
+    _Atomic uint32_t bytes; /* live packets, from base to the end of the file */
+    _Atomic uint32_t delivered;
+} mailbox_index;
+
+static void mailbox_path(char path[], uint16_t user_id);
+static int  mailbox_lock(uint16_t user_id, int flags);
+static void mailbox_unlock(int fd);
+static int  mailbox_stream(int fd, uint16_t user_id, mailbox_deliver_fn deliver, void *ctx, uint32_t *live);
+static int  mailbox_compact(int fd, mailbox_head *head, uint32_t live);
+static void mailbox_publish(uint16_t user_id, const mailbox_head *head, uint32_t live);
+static void mailbox_rebuild(void);
+
+static mailbox_index *mailbox_idx      = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int            mailbox_index_fd = -1;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: mailbox_init
+ * Description: Creates the spool directory if needed and maps the shared
+ *              index: the one a running server is using, or else one
+ *              filled from the spool files left by an earlier run. Must run
+ *              before the first fork.
+ * Returns: 0 on success, -1 on failure.
+ */
+int mailbox_init(void)
+{
+    struct stat st;
+    size_t      size = MAILBOX_SLOTS * sizeof(*mailbox_idx);
+    void       *mem;
+    int         in_use;
+
+    if(mkdir(MAILBOX_DIR, MAILBOX_DIR_MODE) == -1 && errno != EEXIST)
+    {
+        perror("mailbox_init::mkdir");
+        return -1;
+    }
+    mailbox_index_fd = open(MAILBOX_INDEX, O_RDWR | O_CREAT | O_CLOEXEC, MAILBOX_FILE_MODE);
+    if(mailbox_index_fd == -1)
+    {
+        perror("mailbox_init::open");
+        return -1;
+    }
+
+    // Alone, it is rebuilt from zero; otherwise wait for whoever is rebuilding it to finish
+    in_use = flock(mailbox_index_fd, LOCK_EX | LOCK_NB) == -1;
+    if((in_use && (errno != EWOULDBLOCK || flock(mailbox_index_fd, LOCK_SH) == -1)) || fstat(mailbox_index_fd, &st) == -1)
+    {
+        perror("mailbox_init::flock");
+        goto fail;
+    }
+    if(in_use ? (size_t)st.st_size != size : (ftruncate(mailbox_index_fd, 0) == -1 || ftruncate(mailbox_index_fd, (off_t)size) == -1))
+    {
+        fprintf(stderr, "Cannot size %s\n", MAILBOX_INDEX);
+        goto fail;
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mailbox_index_fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("mailbox_init::mmap");
+        goto fail;
+    }
+    mailbox_idx = (mailbox_index *)mem;
+    if(!in_use)
+    {
+        mailbox_rebuild();
+        // Inherited by every child, so it is held until the last of them exits
+        flock(mailbox_index_fd, LOCK_SH);
+    }
+    return 0;
+
+fail:
+    close(mailbox_index_fd);
+    mailbox_index_fd = -1;
+    return -1;
+}
+
+/*
+ * Function: mailbox_enqueue
+ * Description: Appends an encoded packet to the user's queue. The packet is
+ *              stored as is and must fit in PACKETLEN.
+ * Returns: 0 on success, -1 if the packet is malformed, the queue is full or
+ *          the write failed.
+ */
+int mailbox_enqueue(uint16_t user_id, const uint8_t packet[], int len)
+{
+    header_t    header;
+    struct stat st;
+    int         fd;
+    int         result = 0;
+
+    decode_header(packet, &header);
+    if(len < HEADERLEN || len > PACKETLEN || header.payload_len != len - HEADERLEN)
+    {
+        return -1;
+    }
+    if(atomic_load_explicit(&mailbox_idx[user_id].bytes, memory_order_relaxed) + (uint32_t)len > MAILBOX_MAX_BYTES)
+    {
+        return -1;
+    }
+
+    fd = mailbox_lock(user_id, O_WRONLY | O_APPEND | O_CREAT);
+    if(fd == -1)
+    {
+        return -1;
+    }
+    if(fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        mailbox_head head = {MAILBOX_MAGIC, 0, 0, 0};
+        if(write(fd, &head, sizeof(head)) != (ssize_t)sizeof(head))
+        {
+            perror("mailbox_enqueue::write");
+            mailbox_unlock(fd);
+            return -1;
+        }
+    }
+    if(write(fd, packet, (size_t)len) != len)
+    {
+        perror("mailbox_enqueue::write");
+        result = -1;
+    }
+    else
+    {
+        // Counted under the lock, so a drain never misses bytes the index claims
+        atomic_fetch_add_explicit(&mailbox_idx[user_id].bytes, (uint32_t)len, memory_order_relaxed);
+    }
+    mailbox_unlock(fd);
+    return result;
+}
+
+/*
+ * Function: mailbox_resume_point
+ * Description: Where a drain for a connecting client starts: just after the
+ *              sequence number in received for a resumed session, or after
+ *              everything delivered before when received is NULL.
+ * Returns: the sequence number of the first packet the client will get.
+ */
+uint32_t mailbox_resume_point(uint16_t user_id, const uint32_t *received)
+{
+    uint32_t base = atomic_load_explicit(&mailbox_idx[user_id].base, memory_order_relaxed);
+    uint32_t end  = base + atomic_load_explicit(&mailbox_idx[user_id].bytes, memory_order_relaxed);
+
+    if(received == NULL)
+    {
+        return atomic_load_explicit(&mailbox_idx[user_id].delivered, memory_order_relaxed);
+    }
+    if(*received < base)
+    {
+        return base;
+    }
+    return (*received > end) ? end : *received;
+}
+
+/*
+ * Function: mailbox_drain
+ * Description: Hands every packet queued for user_id from sequence number
+ *              from onwards to deliver, oldest first. Packets before from are
+ *              acknowledged and dropped; the ones delivered are kept until
+ *              the next drain. Enqueues for the user wait until the drain is
+ *              done, so none are lost or reordered.
+ * Returns: the number of packets delivered, or -1 on failure.
+ */
+int mailbox_drain(uint16_t user_id, uint32_t from, mailbox_deliver_fn deliver, void *ctx)
+{
+    mailbox_head head;
+    uint32_t     base = atomic_load_explicit(&mailbox_idx[user_id].base, memory_order_relaxed);
+    uint32_t     live = atomic_load_explicit(&mailbox_idx[user_id].bytes, memory_order_relaxed);
+    uint32_t     acked;
+    int          delivered;
+    int          fd;
+
+    if(from == base && live == 0)
+    {
+        return 0;
+    }
+    fd = mailbox_lock(user_id, O_RDWR);
+    if(fd == -1)
+    {
+        return -1;
+    }
+    if(pread(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head) || head.magic != MAILBOX_MAGIC)
+    {
+        fprintf(stderr, "Discarding the damaged queue of user %u\n", user_id);
+        ftruncate(fd, 0);
+        memset(&mailbox_idx[user_id], 0, sizeof(mailbox_idx[user_id]));
+        mailbox_unlock(fd);
+        return -1;
+    }
+
+    live  = atomic_load_explicit(&mailbox_idx[user_id].bytes, memory_order_relaxed);
+    acked = (from < head.base) ? 0 : from - head.base;
+    acked = (acked > live) ? live : acked;
+    head.base += acked;
+    head.skip += acked;
+    live -= acked;
+
+    lseek(fd, (off_t)(sizeof(head) + head.skip), SEEK_SET);
+    delivered      = mailbox_stream(fd, user_id, deliver, ctx, &live);
+    head.delivered = head.base + live;
+
+    if(mailbox_compact(fd, &head, live) < 0 || pwrite(fd, &head, sizeof(head), 0) != (ssize_t)sizeof(head))
+    {
+        perror("mailbox_drain::pwrite");
+    }
+    mailbox_publish(user_id, &head, live);
+    mailbox_unlock(fd);
+    return delivered;
+}
+
+/* Drops the queue of a removed user, so an account that reuses the id starts empty */
+void mailbox_discard(uint16_t user_id)
+{
+    char path[MAILBOX_PATH_LEN];
+    int  fd;
+
+    fd = mailbox_lock(user_id, O_WRONLY);
+    if(fd == -1)
+    {
+        return;
+    }
+    mailbox_path(path, user_id);
+    unlink(path);
+    memset(&mailbox_idx[user_id], 0, sizeof(mailbox_idx[user_id]));
+    mailbox_unlock(fd);
+}
+
+/* Delivers the packets from the file position to the end; *live shrinks if the tail is damaged */
+static int mailbox_stream(int fd, uint16_t user_id, mailbox_deliver_fn deliver, void *ctx, uint32_t *live)
+{
+    uint8_t chunk[MAILBOX_READ_CHUNK];
+    size_t  held      = 0;
+    int     delivered = 0;
+
+    for(;;)
+    {
+        size_t  pos = 0;
+        ssize_t nread;
+
+        nread = read(fd, chunk + held, sizeof(chunk) - held);
+        if(nread < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread <= 0)
+        {
+            break;
+        }
+        held += (size_t)nread;
+
+        // Packets are delivered straight out of the chunk; one cut by the chunk's end waits for the next read
+        while(held - pos >= HEADERLEN)
+        {
+            header_t header;
+            size_t   len;
+
+            decode_header(chunk + pos, &header);
+            len = HEADERLEN + (size_t)header.payload_len;
+            if(len > PACKETLEN || held - pos < len)
+            {
+                break;
+            }
+            deliver(chunk + pos, (int)len, ctx);
+            delivered++;
+            pos += len;
+        }
+        memmove(chunk, chunk + pos, held - pos);
+        held -= pos;
+    }
+    if(held > 0)
+    {
+        fprintf(stderr, "Dropped %zu bytes of a damaged record queued for user %u\n", held, user_id);
+        *live = (held < *live) ? *live - (uint32_t)held : 0;
+    }
+    return delivered;
+}
+
+/* Cuts the file to the head and live packets, copying them forward only once the skipped ones outweigh them */
+static int mailbox_compact(int fd, mailbox_head *head, uint32_t live)
+{
+    uint8_t chunk[MAILBOX_READ_CHUNK];
+    off_t   from = (off_t)(sizeof(*head) + head->skip);
+    off_t   to   = (off_t)sizeof(*head);
+
+    if(live > 0 && head->skip <= live)
+    {
+        return ftruncate(fd, from + live);
+    }
+    for(uint32_t left = live; left > 0;)
+    {
+        size_t  want = (left < sizeof(chunk)) ? left : sizeof(chunk);
+        ssize_t n    = pread(fd, chunk, want, from);
+
+        if(n <= 0 || pwrite(fd, chunk, (size_t)n, to) != n)
+        {
+            return -1;
+        }
+        from += n;
+        to += n;
+        left -= (uint32_t)n;
+    }
+    head->skip = 0;
+    return ftruncate(fd, to);
+}
+
+static void mailbox_publish(uint16_t user_id, const mailbox_head *head, uint32_t live)
+{
+    atomic_store_explicit(&mailbox_idx[user_id].base, head->base, memory_order_relaxed);
+    atomic_store_explicit(&mailbox_idx[user_id].bytes, live, memory_order_relaxed);
+    atomic_store_explicit(&mailbox_idx[user_id].delivered, head->delivered, memory_order_relaxed);
+}
+
+static void mailbox_path(char path[], uint16_t user_id)
+{
+    snprintf(path, MAILBOX_PATH_LEN, MAILBOX_DIR "/%u", user_id);
+}
+
+/*
+ * Opens the user's spool file and locks it exclusively; returns the fd or -1.
+ * A file unlinked by mailbox_discard while this waited for the lock is let go
+ * and the path opened again, so nothing is written to an orphaned file and
+ * counted against the user's queue.
+ */
+static int mailbox_lock(uint16_t user_id, int flags)
+{
+    char        path[MAILBOX_PATH_LEN];
+    struct stat st;
+    int         fd;
+
+    mailbox_path(path, user_id);
+    for(;;)
+    {
+        fd = open(path, flags | O_CLOEXEC, MAILBOX_FILE_MODE);
+        if(fd == -1)
+        {
+            if(errno != ENOENT)
+            {
+                perror("mailbox::open");
+            }
+            return -1;
+        }
+        while(flock(fd, LOCK_EX) == -1)
+        {
+            if(errno != EINTR)
+            {
+                perror("mailbox::flock");
+                close(fd);
+                return -1;
+            }
+        }
+        if(fstat(fd, &st) == -1)
+        {
+            perror("mailbox::fstat");
+            mailbox_unlock(fd);
+            return -1;
+        }
+        if(st.st_nlink > 0)
+        {
+            return fd;
+        }
+        mailbox_unlock(fd);
+    }
+}
+
+static void mailbox_unlock(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* Fills the index from the heads and sizes of the spool files */
+static void mailbox_rebuild(void)
+{
+    DIR           *dir;
+    struct dirent *entry;
+
+    dir = opendir(MAILBOX_DIR);
+    if(dir == NULL)
+    {
+        perror("mailbox_init::opendir");
+        return;
+    }
+    while((entry = readdir(dir)) != NULL)
+    {
+        char         *end;
+        unsigned long user_id;
+        struct stat   st;
+        mailbox_head  head;
+        char          path[MAILBOX_PATH_LEN];
+        int           fd;
+
+        user_id = strtoul(entry->d_name, &end, BASE_TEN);
+        if(end == entry->d_name || *end != '\0' || user_id >= MAILBOX_SLOTS)
+        {
+            continue;
+        }
+        mailbox_path(path, (uint16_t)user_id);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+        {
+            continue;
+        }
+        if(fstat(fd, &st) == 0 && pread(fd, &head, sizeof(head), 0) == (ssize_t)sizeof(head) && head.magic == MAILBOX_MAGIC && (size_t)st.st_size >= sizeof(head) + head.skip)
+        {
+            mailbox_publish((uint16_t)user_id, &head, (uint32_t)((size_t)st.st_size - sizeof(head) - head.skip));
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
@@ -1,40 +1,96 @@
+#include "../include/admission.h"
+#include "../include/affinity.h"
 #include "../include/args.h"
 #include "../include/asn.h"
+#include "../include/capture.h"
+#include "../include/connection.h"
+#include "../include/federation.h"
+#include "../include/handoff.h"
 #include "../include/logging.h"
+#include "../include/mailbox.h"
 #include "../include/network.h"
+#include "../include/ratelimit.h"
+#include "../include/replication.h"
+#include "../include/reporter.h"
+#include "../include/resolver.h"
+#include "../include/resume.h"
+#include "../include/session.h"
+#include "../include/span.h"
+#include "../include/trace.h"
 #include "../include/user_db.h"    // Include user database header
+#include "../include/utf8.h"
+#include "../include/workpool.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <memory.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#define LOG_MSG_LEN 128
+#define DRAIN_POLL_MS 10
+#define WAKE_BUF_LEN 64
+
+/* pids of the forked children that are still serving a client */
+typedef struct child_table
+{
+    pid_t *pids;
+    int   *sources; /* admission slot of each child's client, same index as pids */
+    size_t count;
+    size_t capacity;
+} child_table;
+
 static void setup_signal_handler(void);
+static void wake_listener(void);
+static void drain_wakeups(void);
 static void sigint_handler(int signum);
-static int  process_req(int cfd);
-static void send_sys_success(uint8_t buf[], int fd, uint8_t packet_type);
-static void send_sys_error(uint8_t buf[], int fd, int err);
-static void send_acc_login_success(uint8_t buf[], int fd, uint16_t user_id);
-static void send_cht_send(uint8_t buf[], int fd);
-
-static volatile sig_atomic_t server_running;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static void sigchld_handler(int signum);
+static void sigusr1_handler(int signum);
+static void sigusr2_handler(int signum);
+static int  track_child(child_table *children, pid_t pid, int source);
+static void untrack_child(child_table *children, pid_t pid);
+static void reap_children(child_table *children);
+static void wait_children(child_table *children);
+static void drain_children(child_table *children, unsigned int timeout_ms);
+static long elapsed_ms(const struct timespec *start);
+
+static volatile sig_atomic_t server_running;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t promote_requested;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t spans_requested;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Written by the signal handlers and polled by the listener, so a signal between its checks and poll is not lost */
+static int wake_pipe[2] = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 int main(int argc, char *argv[])
 {
-    Arguments args;
-    pid_t     pid;
-    int       retval;
-    int       sockfd;
-
+    Arguments         args;
+    admission_config  admission;
+    connection_config conn_config;
+    pid_t             pid;
+    int               retval;
+    int               sockfd;
+    int               ctl_fd;
+    int               handed_off;
+    child_table       children;
+    user_db_config    db_config;
+    struct timespec   started; /* startup cost grows with the user store, so time to first client is reported */
+    int               served_first;
+    char              msg[LOG_MSG_LEN];
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
     openlog("Server C", LOG_PID, LOG_USER);
     memset(&args, 0, sizeof(Arguments));
-    args.ip   = NULL;    // Must be set via command-line args
-    args.port = 0;
+    args.ip           = NULL;    // Must be set via command-line args
+    args.port         = 0;
+    args.upgrade_path = NULL;
 
     server_log(1, "Parsing arguments...", LOG_INFO);
     parse_args(argc, argv, &args);
@@ -42,16 +98,128 @@ int main(int argc, char *argv[])
     check_args(argv[0], &args);    // Ensures args are valid
     server_log(1, "Arguments validated", LOG_INFO);
 
+    // Pinned first so everything the listener allocates lands on its node
+    if(affinity_init(args.cpu_list) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    affinity_pin_listener();
+    conn_config.busy_poll_us = args.busy_poll_us;
+
     server_log(1, "Initializing user list...", LOG_INFO);
     // Initialize user list
-    init_user_list();
+    db_config.store       = args.store;
+    db_config.sync_writes = args.store_sync;
+    db_config.shards      = args.shards;
+    init_user_list(&db_config);
     server_log(1, "User list initialized!", LOG_INFO);
 
+    if(session_table_init() < 0)
+    {
+        server_log(1, "Error initializing session table...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    if(mailbox_init() < 0)
+    {
+        server_log(1, "Error initializing offline message queues...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    if(resume_open() < 0)
+    {
+        server_log(1, "Error opening session resumption tokens...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    if(ratelimit_init() < 0)
+    {
+        server_log(1, "Error initializing rate limits...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    admission.max_clients    = args.max_clients;
+    admission.max_per_source = args.max_per_source;
+    admission.accept_rate    = args.accept_rate;
+    if(admission_init(&admission) < 0)
+    {
+        server_log(1, "Error initializing admission control...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    // Forked ahead of the other helpers so it holds none of their pipes and outlives them at shutdown
+    if(args.manager != NULL && reporter_init(args.manager, args.report_ms) < 0)
+    {
+        server_log(1, "Error starting server manager reports...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    // Forked before the listener exists so the workers never hold client-facing sockets
+    if(workpool_init(args.workers, args.queue_depth) < 0)
+    {
+        server_log(1, "Error starting password hashing workers...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    if(args.resolve_names && resolver_init() < 0)
+    {
+        server_log(1, "Error starting hostname resolver...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    if(args.node != NULL && federation_init(args.node, args.peers) < 0)
+    {
+        server_log(1, "Error joining the cluster...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    // After the user store is open: the shipper snapshots it and the applier writes to it
+    if((args.replicate_on != NULL || args.follow != NULL) && replication_init(args.replicate_on, args.follow, args.repl_key, args.store_sync) < 0)
+    {
+        server_log(1, "Error starting user store replication...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    // Opened after the helpers are forked, so only the listener and its clients hold it
+    if(args.capture != NULL && capture_init(args.capture) < 0)
+    {
+        server_log(1, "Error opening the capture file...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    if(span_init(args.span_every, args.span_slow_us) < 0)
+    {
+        server_log(1, "Error initializing request spans...", LOG_ERR);
+        return EXIT_FAILURE;
+    }
+
+    // Resolved once here rather than in every client process
+    printf("Validating strings with %s\n", utf8_impl());
     printf("Listening on %s:%d\n", args.ip, args.port);    // Confirm correct values
 
-    retval = EXIT_SUCCESS;
+    retval     = EXIT_SUCCESS;
+    sockfd     = -1;
+    ctl_fd     = -1;
+    handed_off = 0;
+    memset(&children, 0, sizeof(children));
 
-    sockfd = server_tcp_setup(&args);
+    // Take the listener over from a running server instead of rebinding, so no client is refused mid-deploy
+    if(args.upgrade_path != NULL)
+    {
+        handoff_info info;
+
+        sockfd = handoff_take(args.upgrade_path, &info);
+        if(sockfd >= 0)
+        {
+            printf("Took over listener from pid %d (%u clients still served there)\n", (int)info.old_pid, (unsigned int)info.live_clients);
+            server_log(1, "Listener taken over from previous server", LOG_NOTICE);
+        }
+    }
+
+    if(sockfd < 0)
+    {
+        sockfd = server_tcp_setup(&args);
+    }
     if(sockfd < 0)
     {
         server_log(1, "Error initializing user list...", LOG_ERR);
@@ -60,14 +228,98 @@ int main(int argc, char *argv[])
         goto exit;
     }
 
+    if(args.upgrade_path != NULL)
+    {
+        ctl_fd = handoff_listen(args.upgrade_path);
+        if(ctl_fd < 0)
+        {
+            server_log(1, "Upgrade socket unavailable, hot upgrade disabled", LOG_ERR);
+        }
+    }
+
     setup_signal_handler();
     server_running = 1;
+    served_first   = 0;
+
+    snprintf(msg, sizeof(msg), "Ready to accept clients %ld ms after start", elapsed_ms(&started));
+    printf("%s\n", msg);
+    server_log(1, msg, LOG_NOTICE);
 
     while(server_running)
     {
         int                     client_fd;
+        int                     source;
+        unsigned int            core;
         struct sockaddr_storage client_addr;
         socklen_t               client_addr_len;
+        struct pollfd           fds[3];
+        nfds_t                  nfds;
+
+        reap_children(&children);
+        if(promote_requested)
+        {
+            promote_requested = 0;
+            if(replication_promote() < 0)
+            {
+                server_log(1, "SIGUSR1 ignored: not a replication standby", LOG_NOTICE);
+            }
+        }
+        if(spans_requested)
+        {
+            spans_requested = 0;
+            span_dump();
+        }
+
+        fds[0].fd      = sockfd;
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd      = wake_pipe[0];
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+        fds[2].fd      = ctl_fd;
+        fds[2].events  = POLLIN;
+        fds[2].revents = 0;
+        nfds           = (ctl_fd >= 0) ? 3 : 2;
+
+        if(poll(fds, nfds, -1) == -1)
+        {
+            if(errno != EINTR)
+            {
+                perror("main::poll");
+                retval = EXIT_FAILURE;
+                break;
+            }
+            continue;
+        }
+
+        // Only wakes the loop; the flags it was woken for are read at the top
+        if(fds[1].revents & POLLIN)
+        {
+            drain_wakeups();
+            continue;
+        }
+
+        if(fds[2].revents & POLLIN)
+        {
+            handoff_info info;
+
+            info.magic        = HANDOFF_MAGIC;
+            info.version      = HANDOFF_VERSION;
+            info.old_pid      = (int32_t)getpid();
+            info.live_clients = (uint32_t)children.count;
+            if(handoff_give(ctl_fd, sockfd, &info) == 0)
+            {
+                server_log(1, "Listener handed off to new server", LOG_NOTICE);
+                handed_off = 1;
+                break;
+            }
+            continue;
+        }
+
+        if(!(fds[0].revents & POLLIN))
+        {
+            continue;
+        }
 
         client_addr_len = sizeof(struct sockaddr_storage);
         memset(&client_addr, 0, client_addr_len);
@@ -77,45 +329,119 @@ int main(int argc, char *argv[])
         {
             if(!server_running)
             {
-                server_log(1, "Shutting down server...", LOG_NOTICE);
                 break;
             }
             continue;
         }
 
+        // Shed before the connection costs a fork; admitted clients keep their share of the machine
+        source = admission_admit(&client_addr);
+        if(source == ADMISSION_REJECTED)
+        {
+            admission_reject(client_fd);
+            continue;
+        }
+        socket_describe(&client_addr, client_addr_len);
+        resolver_submit(&client_addr, client_addr_len);
+
+        if(!served_first)
+        {
+            snprintf(msg, sizeof(msg), "First client accepted %ld ms after start", elapsed_ms(&started));
+            printf("%s\n", msg);
+            server_log(1, msg, LOG_NOTICE);
+            served_first = 1;
+        }
+
         // Fork the process
-        pid = fork();
+        core = affinity_claim_client();
+        pid  = fork();
         if(pid < 0)
         {
             perror("main::fork");
-            remove_user(client_fd);    // Remove user on fork failure
             close(client_fd);
             continue;
         }
 
         if(pid == 0)    // Child process
         {
-            char buffer[1];
-            process_req(client_fd);
-
-            // Wait for client to disconnect before cleanup
-            while(recv(client_fd, buffer, sizeof(buffer), 0) > 0)
+            // Before the connection's state and buffers are first touched, so they are allocated on this core's node
+            affinity_pin_client(core);
+            free(children.pids);
+            free(children.sources);
+            resolver_detach();
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+            wake_pipe[0] = -1;
+            wake_pipe[1] = -1;
+            // Held open here, the port would stay bound after the listener exits or hands it off
+            close(sockfd);
+            sockfd = -1;
+            if(ctl_fd >= 0)
             {
-                // Keep reading until the client disconnects
+                close(ctl_fd);
+                ctl_fd = -1;
             }
 
-            printf("Client %d disconnected, removing from list.\n", client_fd);
-            remove_user(client_fd);
+            serve_client(client_fd, &server_running, &conn_config);
+
+            printf("Client %d disconnected.\n", client_fd);
             close(client_fd);
             server_log(1, "User disconnected", LOG_NOTICE);
             goto exit;
         }
 
+        TRACE2(spawn, pid, client_fd);
+        if(track_child(&children, pid, source) == -1)
+        {
+            admission_release(source);
+            // Still served, just not drained on shutdown; better than dropping the client
+            server_log(1, "Unable to track client process", LOG_ERR);
+        }
         close(client_fd);
     }
 
-exit:
+    // Stop accepting before anything else so the drain deadline is not eaten by new clients
     close(sockfd);
+    sockfd = -1;
+
+    // The new process owns the control path now; only clean it up if we are the last server
+    if(ctl_fd >= 0)
+    {
+        close(ctl_fd);
+        if(!handed_off)
+        {
+            unlink(args.upgrade_path);
+        }
+    }
+
+    if(handed_off)
+    {
+        printf("Listener handed off, waiting for %zu clients before exit\n", children.count);
+        wait_children(&children);
+    }
+
+    if(children.count > 0 || !handed_off)
+    {
+        drain_children(&children, args.drain_timeout_ms);
+    }
+    free(children.pids);
+    free(children.sources);
+    admission_report();
+    federation_shutdown();
+    replication_shutdown();
+    resolver_shutdown();
+    workpool_shutdown();
+    ratelimit_report();
+    reporter_shutdown();
+    capture_shutdown();
+    resume_close();
+    close_user_list();
+
+exit:
+    if(sockfd >= 0)
+    {
+        close(sockfd);
+    }
     server_log(1, "Server shutdown successfully!", LOG_NOTICE);
     return retval;
 }
@@ -124,6 +450,17 @@ static void setup_signal_handler(void)
 {
     struct sigaction sa;
 
+    if(pipe(wake_pipe) == -1)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < 2; i++)
+    {
+        fcntl(wake_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
     memset(&sa, 0, sizeof(sa));
 #if defined(__clang__)
     #pragma clang diagnostic push
@@ -136,7 +473,52 @@ static void setup_signal_handler(void)
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
 
-    if(sigaction(SIGINT, &sa, NULL) == -1)
+    if(sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGTERM, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only here to wake the listener so finished children are reaped promptly
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigchld_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    if(sigaction(SIGCHLD, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // Promotes a replication standby
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigusr1_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    if(sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    // Prints the request spans
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = sigusr2_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    if(sigaction(SIGUSR2, &sa, NULL) == -1)
     {
         perror("sigaction");
         exit(EXIT_FAILURE);
@@ -149,85 +531,191 @@ static void setup_signal_handler(void)
 static void sigint_handler(int signum)
 {
     server_running = 0;
+    wake_listener();
+}
+
+static void sigchld_handler(int signum)
+{
+    wake_listener();
+}
+
+static void sigusr1_handler(int signum)
+{
+    promote_requested = 1;
+    wake_listener();
+}
+
+static void sigusr2_handler(int signum)
+{
+    spans_requested = 1;
+    wake_listener();
 }
 
 #pragma GCC diagnostic pop
 
-static int process_req(int cfd)
+/* Signal handlers only; a client process has closed the pipe and relies on EINTR */
+static void wake_listener(void)
 {
-    header_t header = {0};
-    uint8_t  buf[PACKETLEN];
-    int      result;
+    int saved_errno = errno;
 
-    memset(buf, 0, PACKETLEN);
-    if(read(cfd, buf, HEADERLEN) < HEADERLEN)
+    if(wake_pipe[1] >= 0 && write(wake_pipe[1], "", 1) == -1)
     {
-        return -1;
+        /* Pipe already has a wakeup pending */
     }
-    decode_header(buf, &header);
+    errno = saved_errno;
+}
 
-    if(read(cfd, buf + HEADERLEN, header.payload_len) < header.payload_len)
-    {
-        return -1;
-    }
-    result = decode_packet(buf, &header);
+/* Empty the wake pipe once the loop has been woken */
+static void drain_wakeups(void)
+{
+    char buf[WAKE_BUF_LEN];
 
-    memset(buf, 0, PACKETLEN);
-    if(result < 0)
+    while(read(wake_pipe[0], buf, sizeof(buf)) > 0)
     {
-        send_sys_error(buf, cfd, result);
-        return SYS_ERROR;
     }
+}
 
-    if(header.packet_type == ACC_LOGIN)
+/* Remember a child so it can be told to drain on shutdown */
+static int track_child(child_table *children, pid_t pid, int source)
+{
+    if(children->count == children->capacity)
     {
-        send_acc_login_success(buf, cfd, 1); /* 1 for testing only */
-        return ACC_LOGIN_SUCCESS;
-    }
+        size_t capacity;
+        pid_t *pids;
+        int   *sources;
 
-    if(header.packet_type == ACC_CREATE || header.packet_type == ACC_EDIT)
-    {
-        send_sys_success(buf, cfd, header.packet_type);
-        return SYS_SUCCESS;
+        capacity = (children->capacity == 0) ? (size_t)MAX_USERS : children->capacity * 2;
+        pids     = (pid_t *)realloc(children->pids, capacity * sizeof(pid_t));
+        if(pids == NULL)
+        {
+            return -1;
+        }
+        children->pids = pids;
+        sources        = (int *)realloc(children->sources, capacity * sizeof(int));
+        if(sources == NULL)
+        {
+            return -1;
+        }
+        children->sources  = sources;
+        children->capacity = capacity;
     }
+    children->pids[children->count]    = pid;
+    children->sources[children->count] = source;
+    children->count++;
+    return 0;
+}
 
-    if(header.packet_type == ACC_LOGOUT)
+static void untrack_child(child_table *children, pid_t pid)
+{
+    for(size_t i = 0; i < children->count; i++)
     {
-        // no response
-        return ACC_LOGOUT;
+        if(children->pids[i] == pid)
+        {
+            admission_release(children->sources[i]);
+            children->count--;
+            children->pids[i]    = children->pids[children->count];
+            children->sources[i] = children->sources[children->count];
+            return;
+        }
     }
+}
+
+/*
+ * Collect exited clients without blocking. Only tracked pids are waited for:
+ * the helpers (workers, resolver, federation, replication, reporter, log
+ * compactor) are children too, and each is waited for by the module that
+ * forked it. A client's password jobs are reclaimed while it is still a
+ * zombie, before its pid can be reused.
+ */
+static void reap_children(child_table *children)
+{
+    size_t i = 0;
 
-    if(header.packet_type == CHT_SEND)
+    while(i < children->count)
     {
-        send_sys_success(buf, cfd, header.packet_type);
+        pid_t     pid = children->pids[i];
+        siginfo_t info;
+        int       result;
 
-        // send an example of a chat message from another user.
-        send_cht_send(buf, cfd);
-        return CHT_SEND;
+        info.si_pid = 0;
+        result      = waitid(P_PID, (id_t)pid, &info, WEXITED | WNOHANG | WNOWAIT);
+
+        // ECHILD: already collected, so it will never be reported again
+        if(result == -1 && errno == ECHILD)
+        {
+            untrack_child(children, pid);
+            continue;
+        }
+        if(result == 0 && info.si_pid == pid)
+        {
+            workpool_reclaim(pid);
+            waitpid(pid, NULL, 0);
+            untrack_child(children, pid);
+            continue;
+        }
+        i++;
     }
-    return -1;
 }
 
-static void send_sys_success(uint8_t buf[], int fd, uint8_t packet_type)
+/* Block until every client has exited or a shutdown is requested; SIGCHLD cuts each wait short */
+static void wait_children(child_table *children)
 {
-    int len = encode_sys_success_res(buf, packet_type);
-    write(fd, buf, (size_t)len);
+    reap_children(children);
+    while(children->count > 0 && server_running)
+    {
+        poll(NULL, 0, DRAIN_POLL_MS);
+        reap_children(children);
+    }
 }
 
-static void send_sys_error(uint8_t buf[], int fd, int err)
+/* Tell every child to notify its client and exit, then kill whatever is left at the deadline */
+static void drain_children(child_table *children, unsigned int timeout_ms)
 {
-    int len = encode_sys_error_res(buf, err);
-    write(fd, buf, (size_t)len);
-}
+    struct timespec start;
+    size_t          total;
+    size_t          dropped;
+    char            msg[LOG_MSG_LEN];
+
+    server_log(1, "Shutting down server...", LOG_NOTICE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    total = children->count;
+    for(size_t i = 0; i < children->count; i++)
+    {
+        kill(children->pids[i], SIGTERM);
+    }
 
-static void send_acc_login_success(uint8_t buf[], int fd, uint16_t user_id)
-{
-    int len = encode_acc_login_success_res(buf, user_id);
-    write(fd, buf, (size_t)len);
+    while(children->count > 0 && elapsed_ms(&start) < (long)timeout_ms)
+    {
+        reap_children(children);
+        if(children->count > 0)
+        {
+            poll(NULL, 0, DRAIN_POLL_MS);
+        }
+    }
+
+    dropped = children->count;
+    for(size_t i = 0; i < children->count; i++)
+    {
+        kill(children->pids[i], SIGKILL);
+    }
+    while(children->count > 0)
+    {
+        reap_children(children);
+        if(children->count > 0)
+        {
+            poll(NULL, 0, DRAIN_POLL_MS);
+        }
+    }
+
+    snprintf(msg, sizeof(msg), "Drained %zu of %zu clients in %ld ms, dropped %zu", total - dropped, total, elapsed_ms(&start), dropped);
+    printf("%s\n", msg);
+    server_log(1, msg, dropped > 0 ? LOG_ERR : LOG_NOTICE);
 }
 
-static void send_cht_send(uint8_t buf[], int fd)
+static long elapsed_ms(const struct timespec *start)
 {
-    int len = encode_cht_send(buf);
-    write(fd, buf, (size_t)len);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((long)(now.tv_sec - start->tv_sec) * 1000L) + ((now.tv_nsec - start->tv_nsec) / 1000000L);
 }
@@ -1,6 +1,7 @@
 /* network.c */
 
 #include "../include/network.h"
+#include "../include/trace.h"
 #include "../include/user_db.h"
 #include <arpa/inet.h>
 #include <errno.h>
@@ -206,12 +207,11 @@ static void start_listen(int server_fd, int backlog)
 /* Accept a client connection */
 int socket_accept(int server_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len)
 {
-    int  client_fd;
-    char client_host[NI_MAXHOST];
-    char client_service[NI_MAXSERV];
+    int client_fd;
 
     errno     = 0;
     client_fd = accept(server_fd, (struct sockaddr *)client_addr, client_addr_len);
+    TRACE2(accept, client_fd, errno);
     if(client_fd == -1)
     {
         if(errno != EINTR)
@@ -220,30 +220,23 @@ int socket_accept(int server_fd, struct sockaddr_storage *client_addr, socklen_t
         }
         return -1;
     }
+    return client_fd;
+}
 
-    if(getnameinfo((struct sockaddr *)client_addr, *client_addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, 0) == 0)
+/* Print where an admitted client connected from; numeric only, so it never waits on DNS */
+void socket_describe(const struct sockaddr_storage *client_addr, socklen_t client_addr_len)
+{
+    char client_host[NI_MAXHOST];
+    char client_service[NI_MAXSERV];
+
+    if(getnameinfo((const struct sockaddr *)client_addr, client_addr_len, client_host, NI_MAXHOST, client_service, NI_MAXSERV, NI_NUMERICHOST | NI_NUMERICSERV) == 0)
     {
-        user_obj *user;
         printf("Accepted a new connection from %s:%s\n", client_host, client_service);
-        user = new_user();
-        if(!user)
-        {
-            close(client_fd);
-            return -1;
-        }
-        user->id = client_fd; /* Assign socket FD as user ID for now */
-        if(add_user(user) == -1)
-        {
-            free(user);
-            close(client_fd);
-            return -1;
-        }
     }
     else
     {
         printf("Unable to get client information\n");
     }
-    return client_fd;
 }
 
 #pragma GCC diagnostic push
@@ -0,0 +1,265 @@
+/*******************************************************************************
+ * Password Hashing
+ *
+ * Salted PBKDF2-HMAC-SHA256 (RFC 8018) with a self-contained SHA-256, so the
+ * server needs no crypto library. Hashing is deliberately slow and is run on
+ * the worker pool, never on a connection's own loop.
+ ******************************************************************************/
+
+#include "../include/password.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHA256_BLOCK_LEN 64
+#define SHA256_STATE_WORDS 8
+#define SHA256_ROUNDS 64
+#define SHA256_LEN_BYTES 8
+#define HMAC_IPAD 0x36
+#define HMAC_OPAD 0x5c
+
+typedef struct sha256_ctx
+{
+    uint32_t state[SHA256_STATE_WORDS];
+    uint64_t total;
+    uint8_t  block[SHA256_BLOCK_LEN];
+    size_t   used;
+} sha256_ctx;
+
+static void     sha256_init(sha256_ctx *ctx);
+static void     sha256_update(sha256_ctx *ctx, const uint8_t *data, size_t len);
+static void     sha256_final(sha256_ctx *ctx, uint8_t out[HASH_LEN]);
+static void     sha256_compress(uint32_t state[SHA256_STATE_WORDS], const uint8_t block[SHA256_BLOCK_LEN]);
+static uint32_t rotr(uint32_t x, unsigned int n);
+static void     hmac_init(sha256_ctx *inner, sha256_ctx *outer, const uint8_t *key, size_t key_len);
+static void     hmac_final(const sha256_ctx *inner, const sha256_ctx *outer, const uint8_t *msg, size_t msg_len, uint8_t out[HASH_LEN]);
+
+static const uint32_t sha256_k[SHA256_ROUNDS] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_iv[SHA256_STATE_WORDS] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+/*
+ * Function: password_salt
+ * Description: Fills salt with random bytes from the system RNG.
+ * Returns: 0 on success, -1 on failure.
+ */
+int password_salt(uint8_t salt[SALT_LEN])
+{
+    int     fd;
+    ssize_t nread;
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        return -1;
+    }
+    nread = read(fd, salt, SALT_LEN);
+    close(fd);
+    return (nread == SALT_LEN) ? 0 : -1;
+}
+
+/*
+ * Function: password_hash
+ * Description: PBKDF2-HMAC-SHA256 of password with salt, producing one 32-byte block.
+ */
+void password_hash(const char *password, size_t password_len, const uint8_t salt[SALT_LEN], uint32_t iterations, uint8_t out[HASH_LEN])
+{
+    sha256_ctx    inner;
+    sha256_ctx    outer;
+    uint8_t       u[HASH_LEN];
+    uint8_t       first[SALT_LEN + sizeof(uint32_t)];
+    const uint8_t block_index[sizeof(uint32_t)] = {0, 0, 0, 1};
+
+    /* The keyed pads are computed once and copied for every round */
+    hmac_init(&inner, &outer, (const uint8_t *)password, password_len);
+
+    memcpy(first, salt, SALT_LEN);
+    memcpy(first + SALT_LEN, block_index, sizeof(block_index));
+    hmac_final(&inner, &outer, first, sizeof(first), u);
+    memcpy(out, u, HASH_LEN);
+
+    for(uint32_t i = 1; i < iterations; i++)
+    {
+        hmac_final(&inner, &outer, u, HASH_LEN, u);
+        for(size_t j = 0; j < HASH_LEN; j++)
+        {
+            out[j] ^= u[j];
+        }
+    }
+}
+
+/*
+ * Function: password_mac
+ * Description: HMAC-SHA256 of msg under key, for proving knowledge of a
+ *              shared secret without sending it.
+ */
+void password_mac(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t msg_len, uint8_t out[HASH_LEN])
+{
+    sha256_ctx inner;
+    sha256_ctx outer;
+
+    hmac_init(&inner, &outer, key, key_len);
+    hmac_final(&inner, &outer, msg, msg_len, out);
+}
+
+/* Constant time comparison so verification does not leak how many bytes matched */
+int password_equal(const uint8_t a[HASH_LEN], const uint8_t b[HASH_LEN])
+{
+    uint8_t diff = 0;
+
+    for(size_t i = 0; i < HASH_LEN; i++)
+    {
+        diff |= (uint8_t)(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+static void hmac_init(sha256_ctx *inner, sha256_ctx *outer, const uint8_t *key, size_t key_len)
+{
+    uint8_t pad[SHA256_BLOCK_LEN];
+    uint8_t key_hash[HASH_LEN];
+
+    if(key_len > SHA256_BLOCK_LEN)
+    {
+        sha256_init(inner);
+        sha256_update(inner, key, key_len);
+        sha256_final(inner, key_hash);
+        key     = key_hash;
+        key_len = HASH_LEN;
+    }
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, key_len);
+    for(size_t i = 0; i < SHA256_BLOCK_LEN; i++)
+    {
+        pad[i] ^= HMAC_IPAD;
+    }
+    sha256_init(inner);
+    sha256_update(inner, pad, SHA256_BLOCK_LEN);
+
+    for(size_t i = 0; i < SHA256_BLOCK_LEN; i++)
+    {
+        pad[i] ^= HMAC_IPAD ^ HMAC_OPAD;
+    }
+    sha256_init(outer);
+    sha256_update(outer, pad, SHA256_BLOCK_LEN);
+}
+
+/* out may alias msg */
+static void hmac_final(const sha256_ctx *inner, const sha256_ctx *outer, const uint8_t *msg, size_t msg_len, uint8_t out[HASH_LEN])
+{
+    sha256_ctx ctx;
+    uint8_t    digest[HASH_LEN];
+
+    ctx = *inner;
+    sha256_update(&ctx, msg, msg_len);
+    sha256_final(&ctx, digest);
+
+    ctx = *outer;
+    sha256_update(&ctx, digest, HASH_LEN);
+    sha256_final(&ctx, out);
+}
+
+static void sha256_init(sha256_ctx *ctx)
+{
+    memcpy(ctx->state, sha256_iv, sizeof(sha256_iv));
+    ctx->total = 0;
+    ctx->used  = 0;
+}
+
+static void sha256_update(sha256_ctx *ctx, const uint8_t *data, size_t len)
+{
+    ctx->total += len;
+    while(len > 0)
+    {
+        size_t take = SHA256_BLOCK_LEN - ctx->used;
+        if(take > len)
+        {
+            take = len;
+        }
+        memcpy(ctx->block + ctx->used, data, take);
+        ctx->used += take;
+        data += take;
+        len -= take;
+        if(ctx->used == SHA256_BLOCK_LEN)
+        {
+            sha256_compress(ctx->state, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_ctx *ctx, uint8_t out[HASH_LEN])
+{
+    uint64_t bits = ctx->total * 8;
+
+    ctx->block[ctx->used++] = 0x80;
+    if(ctx->used > SHA256_BLOCK_LEN - SHA256_LEN_BYTES)
+    {
+        memset(ctx->block + ctx->used, 0, SHA256_BLOCK_LEN - ctx->used);
+        sha256_compress(ctx->state, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, SHA256_BLOCK_LEN - SHA256_LEN_BYTES - ctx->used);
+    for(size_t i = 0; i < SHA256_LEN_BYTES; i++)
+    {
+        ctx->block[SHA256_BLOCK_LEN - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    sha256_compress(ctx->state, ctx->block);
+
+    for(size_t i = 0; i < SHA256_STATE_WORDS; i++)
+    {
+        out[(4 * i)]     = (uint8_t)(ctx->state[i] >> 24);
+        out[(4 * i) + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[(4 * i) + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[(4 * i) + 3] = (uint8_t)(ctx->state[i]);
+    }
+}
+
+static uint32_t rotr(uint32_t x, unsigned int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_compress(uint32_t state[SHA256_STATE_WORDS], const uint8_t block[SHA256_BLOCK_LEN])
+{
+    uint32_t w[SHA256_ROUNDS];
+    uint32_t s[SHA256_STATE_WORDS];
+
+    for(size_t i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[(4 * i) + 1] << 16) | ((uint32_t)block[(4 * i) + 2] << 8) | (uint32_t)block[(4 * i) + 3];
+    }
+    for(size_t i = 16; i < SHA256_ROUNDS; i++)
+    {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i]        = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, state, sizeof(s));
+    for(size_t i = 0; i < SHA256_ROUNDS; i++)
+    {
+        uint32_t ch    = (s[4] & s[5]) ^ (~s[4] & s[6]);
+        uint32_t maj   = (s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]);
+        uint32_t t1    = s[7] + (rotr(s[4], 6) ^ rotr(s[4], 11) ^ rotr(s[4], 25)) + ch + sha256_k[i] + w[i];
+        uint32_t t2    = (rotr(s[0], 2) ^ rotr(s[0], 13) ^ rotr(s[0], 22)) + maj;
+        s[7]           = s[6];
+        s[6]           = s[5];
+        s[5]           = s[4];
+        s[4]           = s[3] + t1;
+        s[3]           = s[2];
+        s[2]           = s[1];
+        s[1]           = s[0];
+        s[0]           = t1 + t2;
+    }
+    for(size_t i = 0; i < SHA256_STATE_WORDS; i++)
+    {
+        state[i] += s[i];
+    }
+}
@@ -0,0 +1,196 @@
+/*******************************************************************************
+ * Rate Limiting
+ *
+ * Token buckets checked before a request is decoded or queued for hashing, so
+ * a flooding client costs a header read and a compare-and-swap per packet.
+ *
+ * - A bucket stores the single time at which it will be full again. Taking a
+ *   token pushes that time one interval (1 / rate) further out, and is refused
+ *   when it would land more than a burst of intervals past now. This is the
+ *   token bucket expressed as one word, so shared buckets need no lock.
+ * - Per-connection buckets live in the connection, per-user buckets in the
+ *   session table's slots (session.c) and the server wide login bucket, the
+ *   failed login buckets and the throttle counters in a mapping shared by
+ *   every child.
+ * - Failed logins are limited per account and source address, and only
+ *   failures are charged, so guessing one account's password is slow while
+ *   a stranger who sends bad passwords or resume tokens for an account only
+ *   locks their own address out of it.
+ * - Time comes from the coarse monotonic clock where there is one; a few
+ *   milliseconds of resolution is plenty at these rates and it is read without
+ *   a system call.
+ ******************************************************************************/
+
+#include "../include/ratelimit.h"
+#include "../include/logging.h"
+#include <stdio.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define REPORT_LEN 192
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    #define RATE_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+    #define RATE_CLOCK CLOCK_MONOTONIC
+#endif
+
+typedef struct rate_limit
+{
+    uint64_t interval_ns; /* time to earn one token */
+    uint64_t burst_ns;    /* how far ahead of now a bucket may be drawn */
+} rate_limit;
+
+#define RATE_LIMIT(per_sec, burst) {NSEC_PER_SEC / (per_sec), NSEC_PER_SEC / (per_sec) * (burst)}
+
+/* Written only before the first fork */
+static rate_limit limits[RATE_CLASSES] = {    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+    [RATE_CONN]       = RATE_LIMIT(RATE_CONN_PER_SEC, RATE_CONN_BURST),
+    [RATE_USER]       = RATE_LIMIT(RATE_USER_PER_SEC, RATE_USER_BURST),
+    [RATE_LOGIN]      = RATE_LIMIT(RATE_LOGIN_PER_SEC, RATE_LOGIN_BURST),
+    [RATE_USER_LOGIN] = RATE_LIMIT(RATE_USER_LOGIN_PER_SEC, RATE_USER_LOGIN_BURST),
+    [RATE_ACCEPT]     = RATE_LIMIT(RATE_ACCEPT_PER_SEC, RATE_ACCEPT_BURST),
+};
+
+/* State every child shares */
+typedef struct rate_shared
+{
+    rate_bucket      login;
+    rate_bucket      login_failures[RATE_LOGIN_FAILURE_SLOTS];
+    _Atomic uint64_t throttled[RATE_CLASSES];
+} rate_shared;
+
+static rate_bucket *login_failures(uint16_t user_id, uint32_t source);
+
+static rate_shared *shared = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: ratelimit_init
+ * Description: Maps the server wide bucket and counters. Must run before the
+ *              first fork.
+ * Returns: 0 on success, -1 on failure.
+ */
+int ratelimit_init(void)
+{
+    void *mem;
+
+    mem = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("ratelimit_init::mmap");
+        return -1;
+    }
+    /* Zero filled: every bucket starts full and nothing has been throttled */
+    shared = (rate_shared *)mem;
+    return 0;
+}
+
+/* Replaces the default limits of cls; per_sec must not be 0 */
+void ratelimit_set(rate_class cls, unsigned int per_sec, unsigned int burst)
+{
+    limits[cls].interval_ns = NSEC_PER_SEC / per_sec;
+    limits[cls].burst_ns    = limits[cls].interval_ns * burst;
+}
+
+/* Current time on the limiter's clock, in ns */
+uint64_t ratelimit_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(RATE_CLOCK, &ts);
+    return ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Function: ratelimit_take
+ * Description: Takes one token from bucket under the limits of cls, counting
+ *              the refusal if it is empty.
+ * Returns: 1 if the request may proceed, 0 if it is over the limit.
+ */
+int ratelimit_take(rate_bucket *bucket, rate_class cls, uint64_t now)
+{
+    const rate_limit *limit = &limits[cls];
+    uint64_t          full_at;
+    uint64_t          next;
+
+    full_at = atomic_load_explicit(&bucket->full_at, memory_order_relaxed);
+    do
+    {
+        next = (full_at > now ? full_at : now) + limit->interval_ns;
+        if(next - now > limit->burst_ns)
+        {
+            atomic_fetch_add_explicit(&shared->throttled[cls], 1, memory_order_relaxed);
+            return 0;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&bucket->full_at, &full_at, next, memory_order_relaxed, memory_order_relaxed));
+    return 1;
+}
+
+/* Takes a token from the server wide login bucket */
+int ratelimit_take_login(uint64_t now)
+{
+    return ratelimit_take(&shared->login, RATE_LOGIN, now);
+}
+
+/*
+ * Function: ratelimit_login_allowed
+ * Description: Checks, without charging it, that the address source has
+ *              failures left against user_id; source is from
+ *              admission_source_id.
+ * Returns: 1 if the login or resume may be tried, 0 if it is over the limit.
+ */
+int ratelimit_login_allowed(uint16_t user_id, uint32_t source, uint64_t now)
+{
+    const rate_limit *limit   = &limits[RATE_USER_LOGIN];
+    uint64_t          full_at = atomic_load_explicit(&login_failures(user_id, source)->full_at, memory_order_relaxed);
+    uint64_t          next    = (full_at > now ? full_at : now) + limit->interval_ns;
+
+    if(next - now > limit->burst_ns)
+    {
+        atomic_fetch_add_explicit(&shared->throttled[RATE_USER_LOGIN], 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+/* Charges a wrong password or resume token to the account and address it came from */
+void ratelimit_login_failed(uint16_t user_id, uint32_t source, uint64_t now)
+{
+    ratelimit_take(login_failures(user_id, source), RATE_USER_LOGIN, now);
+}
+
+/* Logs how many requests each limit turned away */
+void ratelimit_report(void)
+{
+    char     msg[REPORT_LEN];
+    uint64_t total = 0;
+
+    for(int cls = 0; cls < RATE_CLASSES; cls++)
+    {
+        total += atomic_load(&shared->throttled[cls]);
+    }
+    if(total == 0)
+    {
+        return;
+    }
+    snprintf(msg,
+             sizeof(msg),
+             "Throttled requests: %llu per connection, %llu per user, %llu logins, %llu failed logins per account and address, %llu accepts",
+             (unsigned long long)atomic_load(&shared->throttled[RATE_CONN]),
+             (unsigned long long)atomic_load(&shared->throttled[RATE_USER]),
+             (unsigned long long)atomic_load(&shared->throttled[RATE_LOGIN]),
+             (unsigned long long)atomic_load(&shared->throttled[RATE_USER_LOGIN]),
+             (unsigned long long)atomic_load(&shared->throttled[RATE_ACCEPT]));
+    printf("%s\n", msg);
+    server_log(1, msg, LOG_NOTICE);
+}
+
+/* Pairs that collide share a bucket, which only ever makes the limit stricter for both */
+static rate_bucket *login_failures(uint16_t user_id, uint32_t source)
+{
+    uint32_t slot = (source ^ ((uint32_t)user_id * 0x9e3779b1U)) % RATE_LOGIN_FAILURE_SLOTS;
+
+    return &shared->login_failures[slot];
+}
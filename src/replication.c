@@ -0,0 +1,1115 @@
+/*******************************************************************************
+ * User Store Replication
+ *
+ * Keeps a hot standby's user store a copy of the primary's by shipping every
+ * change to it as it happens, so failing over is a promotion rather than a
+ * cold start.
+ *
+ * Journal:
+ * - On a primary (-L), add_user and remove_user append a fixed size record
+ *   to user_db.repl: the change, the whole user_obj and the time it was made.
+ *   A change's sequence number is its position in the file.
+ * - The journal header carries a random epoch. A new one is started when the
+ *   file is damaged, has grown past REPL_JOURNAL_MAX changes at startup, or
+ *   the server is promoted, and standbys of an older epoch resynchronise.
+ *
+ * Shipping:
+ * - A shipper process forked at startup accepts standbys on the -L address.
+ *   A snapshot is every user's salt and password hash, so a standby must
+ *   first prove it holds the key file both were started with (-K): the
+ *   shipper sends a random challenge and the hello has to carry its
+ *   HMAC-SHA256 under the key. The key never crosses the wire, but the
+ *   stream after it is not encrypted, so links should stay on a trusted
+ *   network or in a tunnel.
+ * - Each standby says which epoch and sequence number it has applied up to. If the
+ *   journal still holds that point, the shipper streams from there;
+ *   otherwise it sends a snapshot of every stored user, then the journal
+ *   from where it stood when the snapshot began.
+ * - Writers ring a doorbell after appending, and the shipper sends everything
+ *   new to every standby in one write per REPL_SHIP_RECORDS changes.
+ *
+ * Standby:
+ * - Started with -f <primary>, the server serves logins from its own store
+ *   but refuses account changes. An applier process follows the primary,
+ *   applies each change with apply_user or apply_user_removal and records
+ *   how far it got in user_db.repl.pos, so a restart resumes rather than
+ *   resynchronising. Applying is idempotent, so replaying a few changes
+ *   after a crash is harmless.
+ * - SIGUSR1 promotes: the applier stops, a new journal epoch begins and the
+ *   server takes writes. Nothing has to be loaded, so this takes
+ *   milliseconds.
+ * - Records carry the primary's wall clock time. The standby reports how long
+ *   changes took to arrive, which is meaningful when both run on one machine
+ *   or on synchronised clocks.
+ ******************************************************************************/
+
+#include "../include/replication.h"
+#include "../include/logging.h"
+#include "../include/password.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPL_FILE_MODE 0644
+#define REPL_JOURNAL_MAGIC 0x4a4c5052 /* "RPLJ" */
+#define REPL_RECORD_MAGIC 0x434c5052  /* "RPLC" */
+#define REPL_POS_MAGIC 0x504c5052     /* "RPLP" */
+#define REPL_HELLO_MAGIC 0x484c5052   /* "RPLH" */
+#define REPL_VERSION 2
+#define REPL_BEGIN 3 /* snapshot follows; seq carries the epoch */
+#define REPL_END 4   /* snapshot done; seq is the change streaming resumes from */
+#define REPL_HELLO_FIELDS 24
+#define REPL_HELLO_LEN (REPL_HELLO_FIELDS + HASH_LEN) /* the fields, then their MAC */
+#define REPL_CHALLENGE_LEN SALT_LEN
+#define REPL_KEY_MAX 256
+#define REPL_WIRE_LEN (24 + USERNAME_MAX_LEN + 1 + SALT_LEN + HASH_LEN)
+#define REPL_ADDR_LEN 32
+#define REPL_BACKLOG 8
+#define REPL_LOG_LEN 192
+#define REPL_ID_WORDS ((UINT16_MAX + 1) / 64)
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_USEC 1000
+#define NSEC_PER_MSEC 1000000
+#define MSEC_PER_SEC 1000
+#define BASE_TEN 10
+
+typedef struct repl_journal_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t epoch;
+} repl_journal_header;
+
+/* Journal records are local state, so host byte order; the wire format is not */
+typedef struct repl_record
+{
+    uint32_t magic;
+    uint16_t type;
+    uint16_t reserved;
+    int64_t  stamp_ns; /* CLOCK_REALTIME when the change was made */
+    user_obj user;
+} repl_record;
+
+/* How far a standby has applied, kept across restarts */
+typedef struct repl_pos
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t epoch;
+    uint64_t next;
+} repl_pos;
+
+/* Shared with every process so children see a promotion */
+typedef struct repl_shared
+{
+    _Atomic uint32_t read_only;
+} repl_shared;
+
+typedef struct repl_standby
+{
+    int      fd;
+    size_t   hello_len;
+    uint8_t  hello[REPL_HELLO_LEN];
+    uint8_t  challenge[REPL_CHALLENGE_LEN];
+    int      streaming; /* hello received, next is valid */
+    uint64_t next;
+} repl_standby;
+
+/* Wire messages collected before one write */
+typedef struct repl_out
+{
+    int     fd;
+    int     failed;
+    size_t  len;
+    uint8_t buf[REPL_SHIP_RECORDS * REPL_WIRE_LEN];
+} repl_out;
+
+/* The applier's progress through a snapshot and its statistics */
+typedef struct repl_applier
+{
+    repl_pos  pos;
+    int       pos_fd;
+    int       in_snapshot;
+    uint64_t  snapshot_epoch;
+    uint64_t  seen[REPL_ID_WORDS]; /* ids the snapshot carried */
+    uint64_t  applied;
+    uint64_t  snapshot_users;
+    long long lag_sum_us;
+    long long lag_max_us;
+    long long first_ns;
+    long long last_ns;
+} repl_applier;
+
+static int       parse_addr(const char *text, struct sockaddr_in *addr);
+static int       load_key(const char *path);
+static void      hello_mac(const uint8_t challenge[], const uint8_t hello[], uint8_t out[HASH_LEN]);
+static int       read_full(int fd, uint8_t buf[], size_t len);
+static int       journal_open(int fresh);
+static int       journal_attach(void);
+static uint64_t  journal_count(int fd);
+static void      shipper_run(const struct sockaddr_in *addr);
+static void      ship(repl_standby *standby, int journal_fd_ro);
+static void      snapshot(repl_standby *standby, uint64_t epoch, int journal_fd_ro);
+static void      visit_snapshot(const user_obj *user, void *ctx);
+static void      out_add(repl_out *out, uint8_t type, uint64_t seq, int64_t stamp_ns, const user_obj *user);
+static void      out_flush(repl_out *out);
+static void      drop_standby(repl_standby *standby);
+static void      applier_run(const struct sockaddr_in *addr);
+static int       follow(int fd, repl_applier *applier);
+static int       apply_message(repl_applier *applier, const uint8_t msg[]);
+static void      visit_sweep(const user_obj *user, void *ctx);
+static void      save_pos(repl_applier *applier);
+static void      put_u32(uint8_t buf[], uint32_t value);
+static void      put_u64(uint8_t buf[], uint64_t value);
+static uint32_t  get_u32(const uint8_t buf[]);
+static uint64_t  get_u64(const uint8_t buf[]);
+static long long now_ns(clockid_t clock);
+static void      repl_stop(int signum);
+
+static const char journal_path[] = "user_db.repl";
+static const char journal_tmp[]  = "user_db.repl.new";
+static const char pos_path[]     = "user_db.repl.pos";
+
+/* Set before the first fork */
+static repl_shared *shared      = NULL;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int          journal_on  = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int          repl_sync   = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int          bell[2]     = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t        shipper_pid = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t        applier_pid = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint8_t      repl_key[REPL_KEY_MAX];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t       repl_key_len = 0;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Per process: an inherited append descriptor would keep writing to a replaced journal */
+static pid_t journal_owner = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int   journal_fd    = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static ino_t journal_ino   = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Shipper and applier processes only */
+static volatile sig_atomic_t repl_running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: replication_init
+ * Description: Starts shipping changes to standbys on listen_addr, following
+ *              the primary at primary_addr as a read-only standby, or both.
+ *              Either may be NULL. Links are authenticated with the secret
+ *              in key_path, which primary and standbys must share. Must run
+ *              after the user store is open and before the listener exists.
+ * Returns: 0 on success, -1 if an address is malformed, the key cannot be
+ *          read or a process could not be started.
+ */
+int replication_init(const char *listen_addr, const char *primary_addr, const char *key_path, int sync_writes)
+{
+    struct sockaddr_in listen_sa;
+    struct sockaddr_in primary_sa;
+    void              *mem;
+
+    if((listen_addr != NULL && parse_addr(listen_addr, &listen_sa) < 0) || (primary_addr != NULL && parse_addr(primary_addr, &primary_sa) < 0))
+    {
+        return -1;
+    }
+    if(load_key(key_path) < 0)
+    {
+        return -1;
+    }
+    mem = mmap(NULL, sizeof(repl_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("replication_init::mmap");
+        return -1;
+    }
+    shared    = (repl_shared *)mem;
+    repl_sync = sync_writes;
+    atomic_store(&shared->read_only, primary_addr != NULL);
+
+    if(listen_addr != NULL)
+    {
+        if(journal_open(0) < 0 || pipe(bell) == -1)
+        {
+            perror("replication_init::journal");
+            return -1;
+        }
+        fcntl(bell[1], F_SETFL, O_NONBLOCK);
+        fcntl(bell[0], F_SETFL, O_NONBLOCK);
+        journal_on = 1;
+
+        fflush(stdout);
+        shipper_pid = fork();
+        if(shipper_pid == -1)
+        {
+            perror("replication_init::fork");
+            return -1;
+        }
+        if(shipper_pid == 0)
+        {
+            shipper_run(&listen_sa);
+            _exit(EXIT_SUCCESS);
+        }
+        close(bell[0]);
+        bell[0] = -1;
+    }
+
+    if(primary_addr != NULL)
+    {
+        fflush(stdout);
+        applier_pid = fork();
+        if(applier_pid == -1)
+        {
+            perror("replication_init::fork");
+            return -1;
+        }
+        if(applier_pid == 0)
+        {
+            applier_run(&primary_sa);
+            _exit(EXIT_SUCCESS);
+        }
+        printf("Following replication primary %s; account changes are refused until promoted.\n", primary_addr);
+    }
+    return 0;
+}
+
+/* Whether this server is a standby that must not change the user store */
+int replication_read_only(void)
+{
+    return shared != NULL && atomic_load_explicit(&shared->read_only, memory_order_relaxed) != 0;
+}
+
+/* Records a change that has just been made to the store, for the standbys */
+void replication_journal(uint16_t type, const user_obj *user)
+{
+    repl_record rec;
+
+    if(!journal_on || journal_attach() == -1)
+    {
+        return;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.magic    = REPL_RECORD_MAGIC;
+    rec.type     = type;
+    rec.stamp_ns = now_ns(CLOCK_REALTIME);
+    rec.user     = *user;
+
+    // One O_APPEND write per record, so records from different processes never interleave
+    if(write(journal_fd, &rec, sizeof(rec)) != (ssize_t)sizeof(rec))
+    {
+        perror("replication_journal::write");
+        return;
+    }
+    if(repl_sync)
+    {
+        fdatasync(journal_fd);
+    }
+    // A full pipe means the shipper already has a wake-up pending
+    write(bell[1], "j", 1);
+}
+
+/*
+ * Function: replication_promote
+ * Description: Turns a standby into a primary: stops following, starts a new
+ *              journal epoch and lets clients change accounts again.
+ * Returns: 0 on success, -1 if this server is not a standby.
+ */
+int replication_promote(void)
+{
+    long long start = now_ns(CLOCK_MONOTONIC);
+    char      line[REPL_LOG_LEN];
+
+    if(applier_pid <= 0)
+    {
+        return -1;
+    }
+    kill(applier_pid, SIGTERM);
+    while(waitpid(applier_pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+    applier_pid = 0;
+
+    // Standbys of ours must not mistake changes made from here on for the old primary's
+    if(journal_on && journal_open(1) == 0)
+    {
+        write(bell[1], "p", 1);
+    }
+    atomic_store(&shared->read_only, 0);
+
+    snprintf(line, sizeof(line), "Promoted to replication primary in %.2f ms", (double)(now_ns(CLOCK_MONOTONIC) - start) / NSEC_PER_MSEC);
+    printf("%s\n", line);
+    fflush(stdout);
+    server_log(1, line, LOG_NOTICE);
+    return 0;
+}
+
+/* Stops the shipper and applier; a standby's position is saved as the applier exits */
+void replication_shutdown(void)
+{
+    pid_t *pids[] = {&applier_pid, &shipper_pid};
+
+    if(bell[1] >= 0)
+    {
+        close(bell[1]);
+        bell[1] = -1;
+    }
+    for(size_t i = 0; i < sizeof(pids) / sizeof(pids[0]); i++)
+    {
+        if(*pids[i] > 0)
+        {
+            kill(*pids[i], SIGTERM);
+            while(waitpid(*pids[i], NULL, 0) == -1 && errno == EINTR)
+            {
+            }
+            *pids[i] = 0;
+        }
+    }
+    if(journal_fd >= 0)
+    {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+}
+
+static int parse_addr(const char *text, struct sockaddr_in *addr)
+{
+    char          host[REPL_ADDR_LEN];
+    const char   *colon = strrchr(text, ':');
+    char         *end;
+    unsigned long port;
+
+    memset(addr, 0, sizeof(*addr));
+    if(colon == NULL || (size_t)(colon - text) >= sizeof(host))
+    {
+        fprintf(stderr, "Invalid replication address '%s'\n", text);
+        return -1;
+    }
+    memcpy(host, text, (size_t)(colon - text));
+    host[colon - text] = '\0';
+    port               = strtoul(colon + 1, &end, BASE_TEN);
+    if(inet_pton(AF_INET, host, &addr->sin_addr) != 1 || *end != '\0' || port == 0 || port > UINT16_MAX)
+    {
+        fprintf(stderr, "Invalid replication address '%s'\n", text);
+        return -1;
+    }
+    addr->sin_family = AF_INET;
+    addr->sin_port   = htons((uint16_t)port);
+    return 0;
+}
+
+/* Reads the shared secret; a trailing newline is not part of it */
+static int load_key(const char *path)
+{
+    struct stat st;
+    ssize_t     nread;
+    int         fd;
+
+    if(path == NULL)
+    {
+        fprintf(stderr, "Replication needs a key file (-K) shared by the primary and its standbys\n");
+        return -1;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        perror("replication::key");
+        return -1;
+    }
+    nread = read(fd, repl_key, sizeof(repl_key));
+    if(fstat(fd, &st) == 0 && (st.st_mode & (S_IRWXG | S_IRWXO)))
+    {
+        fprintf(stderr, "Warning: replication key %s is readable by other users\n", path);
+    }
+    close(fd);
+    while(nread > 0 && (repl_key[nread - 1] == '\n' || repl_key[nread - 1] == '\r'))
+    {
+        nread--;
+    }
+    if(nread <= 0)
+    {
+        fprintf(stderr, "Replication key %s is empty or unreadable\n", path);
+        return -1;
+    }
+    repl_key_len = (size_t)nread;
+    return 0;
+}
+
+/* What a hello's fields must be sent with to prove the key: HMAC(key, challenge || fields) */
+static void hello_mac(const uint8_t challenge[], const uint8_t hello[], uint8_t out[HASH_LEN])
+{
+    uint8_t msg[REPL_CHALLENGE_LEN + REPL_HELLO_FIELDS];
+
+    memcpy(msg, challenge, REPL_CHALLENGE_LEN);
+    memcpy(msg + REPL_CHALLENGE_LEN, hello, REPL_HELLO_FIELDS);
+    password_mac(repl_key, repl_key_len, msg, sizeof(msg), out);
+}
+
+static int read_full(int fd, uint8_t buf[], size_t len)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t nread = read(fd, buf + done, len - done);
+        if(nread <= 0)
+        {
+            return -1;
+        }
+        done += (size_t)nread;
+    }
+    return 0;
+}
+
+/*
+ * Checks the journal and cuts off a torn last record, or replaces it with an
+ * empty one under a new epoch when fresh is set, it is damaged or it is full.
+ */
+static int journal_open(int fresh)
+{
+    repl_journal_header header;
+    struct stat         st;
+    uint8_t             epoch[SALT_LEN];
+    int                 fd;
+
+    fd = open(journal_path, O_RDWR | O_CREAT | O_CLOEXEC, REPL_FILE_MODE);
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror("journal_open::open");
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    if(!fresh && pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && header.magic == REPL_JOURNAL_MAGIC && header.version == REPL_VERSION &&
+       journal_count(fd) < REPL_JOURNAL_MAX)
+    {
+        off_t whole = (off_t)(sizeof(header) + journal_count(fd) * sizeof(repl_record));
+        if(st.st_size != whole && ftruncate(fd, whole) == -1)
+        {
+            perror("journal_open::ftruncate");
+        }
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    // Written aside and renamed in, so the shipper never sees a half made journal
+    if(password_salt(epoch) < 0)
+    {
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic   = REPL_JOURNAL_MAGIC;
+    header.version = REPL_VERSION;
+    memcpy(&header.epoch, epoch, sizeof(header.epoch));
+    fd = open(journal_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, REPL_FILE_MODE);
+    if(fd == -1 || write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) || fsync(fd) == -1 || rename(journal_tmp, journal_path) == -1)
+    {
+        perror("journal_open::write");
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Opens this process's append descriptor, again whenever the journal was replaced */
+static int journal_attach(void)
+{
+    struct stat st;
+
+    if(stat(journal_path, &st) == -1)
+    {
+        perror("journal_attach::stat");
+        return -1;
+    }
+    if(journal_owner == getpid() && st.st_ino == journal_ino && journal_fd >= 0)
+    {
+        return 0;
+    }
+    if(journal_fd >= 0)
+    {
+        close(journal_fd);
+    }
+    journal_fd = open(journal_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(journal_fd == -1)
+    {
+        perror("journal_attach::open");
+        return -1;
+    }
+    journal_owner = getpid();
+    journal_ino   = st.st_ino;
+    return 0;
+}
+
+/* Complete records in the journal, which is also the next sequence number */
+static uint64_t journal_count(int fd)
+{
+    struct stat st;
+
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(repl_journal_header))
+    {
+        return 0;
+    }
+    return ((uint64_t)st.st_size - sizeof(repl_journal_header)) / sizeof(repl_record);
+}
+
+static void shipper_run(const struct sockaddr_in *addr)
+{
+    repl_standby        standbys[REPL_MAX_STANDBYS];
+    struct pollfd       fds[2 + REPL_MAX_STANDBYS];
+    repl_journal_header header;
+    struct stat         st;
+    ino_t               shipping = 0; /* journal the read descriptor is on */
+    int                 listener;
+    int                 fd     = -1;
+    int                 optval = 1;
+    char                drain[REPL_SHIP_RECORDS];
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, repl_stop);
+    signal(SIGPIPE, SIG_IGN);
+    close(bell[1]);
+    memset(&header, 0, sizeof(header));
+    for(size_t i = 0; i < REPL_MAX_STANDBYS; i++)
+    {
+        standbys[i].fd = -1;
+    }
+
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listener == -1)
+    {
+        perror("replication::socket");
+        return;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if(bind(listener, (const struct sockaddr *)addr, sizeof(*addr)) == -1 || listen(listener, REPL_BACKLOG) == -1)
+    {
+        perror("replication::bind");
+        close(listener);
+        return;
+    }
+
+    while(repl_running)
+    {
+        nfds_t nfds = 0;
+
+        // Promotion replaces the journal; standbys of the old one have to start over
+        if(fd < 0 || stat(journal_path, &st) == -1 || st.st_ino != shipping)
+        {
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+            fd = open(journal_path, O_RDONLY | O_CLOEXEC);
+            if(fd < 0 || fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+            {
+                perror("replication::journal");
+                break;
+            }
+            shipping = st.st_ino;
+            for(size_t i = 0; i < REPL_MAX_STANDBYS; i++)
+            {
+                drop_standby(&standbys[i]);
+            }
+        }
+
+        fds[nfds].fd       = bell[0];
+        fds[nfds++].events = POLLIN;
+        fds[nfds].fd       = listener;
+        fds[nfds++].events = POLLIN;
+        for(size_t i = 0; i < REPL_MAX_STANDBYS; i++)
+        {
+            fds[nfds].fd       = standbys[i].fd;
+            fds[nfds++].events = POLLIN;
+        }
+        if(poll(fds, nfds, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("replication::poll");
+            break;
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP))
+        {
+            if(read(bell[0], drain, sizeof(drain)) == 0)
+            {
+                break;
+            }
+        }
+
+        if(fds[1].revents & POLLIN)
+        {
+            int client = accept(listener, NULL, NULL);
+            int placed = 0;
+
+            for(size_t i = 0; client >= 0 && i < REPL_MAX_STANDBYS && !placed; i++)
+            {
+                if(standbys[i].fd < 0 && !replication_read_only())
+                {
+                    struct timeval send_timeout = {REPL_SEND_TIMEOUT_SEC, 0};
+
+                    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+                    memset(&standbys[i], 0, sizeof(standbys[i]));
+                    // Nothing is shipped until the hello answers this
+                    if(password_salt(standbys[i].challenge) < 0 || write(client, standbys[i].challenge, REPL_CHALLENGE_LEN) != REPL_CHALLENGE_LEN)
+                    {
+                        standbys[i].fd = -1;
+                        break;
+                    }
+                    standbys[i].fd = client;
+                    placed         = 1;
+                }
+            }
+            // Full, or a standby ourselves: a standby of a standby would never hear of later changes
+            if(client >= 0 && !placed)
+            {
+                close(client);
+            }
+        }
+
+        for(size_t i = 0; i < REPL_MAX_STANDBYS; i++)
+        {
+            repl_standby *standby = &standbys[i];
+            uint8_t       mac[HASH_LEN];
+            ssize_t       nread;
+
+            if(standby->fd < 0 || !(fds[2 + i].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                continue;
+            }
+            nread = standby->streaming ? -1 : read(standby->fd, standby->hello + standby->hello_len, REPL_HELLO_LEN - standby->hello_len);
+            if(nread <= 0)
+            {
+                // Standbys only speak first, so anything later is a close
+                drop_standby(standby);
+                continue;
+            }
+            standby->hello_len += (size_t)nread;
+            if(standby->hello_len < REPL_HELLO_LEN)
+            {
+                continue;
+            }
+            if(get_u32(standby->hello) != REPL_HELLO_MAGIC || get_u32(standby->hello + 4) != REPL_VERSION)
+            {
+                drop_standby(standby);
+                continue;
+            }
+            hello_mac(standby->challenge, standby->hello, mac);
+            if(!password_equal(mac, standby->hello + REPL_HELLO_FIELDS))
+            {
+                server_log(1, "Replication: refused a standby that does not hold the key", LOG_WARNING);
+                drop_standby(standby);
+                continue;
+            }
+            standby->streaming = 1;
+            standby->next      = get_u64(standby->hello + 16);
+            if(get_u64(standby->hello + 8) != header.epoch || standby->next > journal_count(fd))
+            {
+                snapshot(standby, header.epoch, fd);
+            }
+        }
+
+        for(size_t i = 0; i < REPL_MAX_STANDBYS; i++)
+        {
+            if(standbys[i].fd >= 0 && standbys[i].streaming)
+            {
+                ship(&standbys[i], fd);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < REPL_MAX_STANDBYS; i++)
+    {
+        drop_standby(&standbys[i]);
+    }
+    close(listener);
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/* Sends a standby every journal record it has not had */
+static void ship(repl_standby *standby, int journal_fd_ro)
+{
+    static repl_out    out;
+    static repl_record recs[REPL_SHIP_RECORDS];
+    uint64_t           end = journal_count(journal_fd_ro);
+
+    out.fd     = standby->fd;
+    out.failed = 0;
+    out.len    = 0;
+    while(standby->next < end && !out.failed)
+    {
+        uint64_t count = end - standby->next < REPL_SHIP_RECORDS ? end - standby->next : REPL_SHIP_RECORDS;
+        off_t    at    = (off_t)(sizeof(repl_journal_header) + standby->next * sizeof(repl_record));
+        ssize_t  got   = pread(journal_fd_ro, recs, (size_t)count * sizeof(repl_record), at);
+
+        if(got != (ssize_t)(count * sizeof(repl_record)))
+        {
+            break;
+        }
+        for(uint64_t i = 0; i < count; i++)
+        {
+            out_add(&out, (uint8_t)recs[i].type, standby->next + i, recs[i].stamp_ns, &recs[i].user);
+        }
+        out_flush(&out);
+        standby->next += count;
+    }
+    if(out.failed)
+    {
+        drop_standby(standby);
+    }
+}
+
+/* Sends every stored user, then resumes the standby from where the journal stood beforehand */
+static void snapshot(repl_standby *standby, uint64_t epoch, int journal_fd_ro)
+{
+    static repl_out out;
+    uint64_t        from = journal_count(journal_fd_ro);
+    int             users;
+    char            line[REPL_LOG_LEN];
+
+    out.fd     = standby->fd;
+    out.failed = 0;
+    out.len    = 0;
+    out_add(&out, REPL_BEGIN, epoch, 0, NULL);
+    users = scan_users(visit_snapshot, &out);
+    out_add(&out, REPL_END, from, 0, NULL);
+    out_flush(&out);
+    if(out.failed || users < 0)
+    {
+        drop_standby(standby);
+        return;
+    }
+    standby->next = from;
+    snprintf(line, sizeof(line), "Sent a standby a snapshot of %d users", users);
+    server_log(1, line, LOG_INFO);
+}
+
+static void visit_snapshot(const user_obj *user, void *ctx)
+{
+    out_add((repl_out *)ctx, REPL_PUT, 0, 0, user);
+}
+
+/* Encodes one message in network byte order, writing the batch out when it is full */
+static void out_add(repl_out *out, uint8_t type, uint64_t seq, int64_t stamp_ns, const user_obj *user)
+{
+    uint8_t *msg;
+
+    if(out->len + REPL_WIRE_LEN > sizeof(out->buf))
+    {
+        out_flush(out);
+    }
+    msg = out->buf + out->len;
+    memset(msg, 0, REPL_WIRE_LEN);
+    msg[0] = type;
+    put_u64(msg + 8, seq);
+    put_u64(msg + 16, (uint64_t)stamp_ns);
+    if(user != NULL)
+    {
+        put_u32(msg + 4, (uint32_t)user->id);
+        memcpy(msg + 24, user->username, USERNAME_MAX_LEN + 1);
+        memcpy(msg + 24 + USERNAME_MAX_LEN + 1, user->salt, SALT_LEN);
+        memcpy(msg + 24 + USERNAME_MAX_LEN + 1 + SALT_LEN, user->hash, HASH_LEN);
+    }
+    out->len += REPL_WIRE_LEN;
+}
+
+static void out_flush(repl_out *out)
+{
+    size_t sent = 0;
+
+    while(!out->failed && sent < out->len)
+    {
+        ssize_t n = write(out->fd, out->buf + sent, out->len - sent);
+        if(n <= 0)
+        {
+            out->failed = 1;
+            break;
+        }
+        sent += (size_t)n;
+    }
+    out->len = 0;
+}
+
+static void drop_standby(repl_standby *standby)
+{
+    if(standby->fd >= 0)
+    {
+        close(standby->fd);
+    }
+    standby->fd        = -1;
+    standby->streaming = 0;
+    standby->hello_len = 0;
+}
+
+static void applier_run(const struct sockaddr_in *addr)
+{
+    static repl_applier applier;
+    struct sigaction    sa;
+    char                line[REPL_LOG_LEN];
+    long long           active_ns;
+
+    // No SA_RESTART, so a blocked read or connect returns when we are told to stop
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = repl_stop;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGINT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    applier.pos_fd = open(pos_path, O_RDWR | O_CREAT | O_CLOEXEC, REPL_FILE_MODE);
+    if(applier.pos_fd == -1)
+    {
+        perror("replication::pos");
+        return;
+    }
+    if(pread(applier.pos_fd, &applier.pos, sizeof(applier.pos), 0) != (ssize_t)sizeof(applier.pos) || applier.pos.magic != REPL_POS_MAGIC || applier.pos.version != REPL_VERSION)
+    {
+        memset(&applier.pos, 0, sizeof(applier.pos));
+    }
+
+    while(repl_running)
+    {
+        struct timespec retry = {0, (long)REPL_RETRY_MS * NSEC_PER_MSEC};
+        int             fd    = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if(fd >= 0 && connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0)
+        {
+            follow(fd, &applier);
+        }
+        if(fd >= 0)
+        {
+            close(fd);
+        }
+        if(repl_running)
+        {
+            nanosleep(&retry, NULL);
+        }
+    }
+    save_pos(&applier);
+    close(applier.pos_fd);
+
+    active_ns = applier.last_ns - applier.first_ns;
+    snprintf(line,
+             sizeof(line),
+             "Replication: applied %llu changes and %llu snapshot users, lag avg %lld us max %lld us, %.0f changes/s while busy",
+             (unsigned long long)applier.applied,
+             (unsigned long long)applier.snapshot_users,
+             applier.applied > 0 ? applier.lag_sum_us / (long long)applier.applied : 0,
+             applier.lag_max_us,
+             active_ns > 0 ? (double)applier.applied * (double)NSEC_PER_SEC / (double)active_ns : 0.0);
+    printf("%s\n", line);
+    fflush(stdout);
+    server_log(1, line, LOG_INFO);
+}
+
+/* Streams from the primary until the link drops or we are stopped */
+static int follow(int fd, repl_applier *applier)
+{
+    static uint8_t buf[REPL_SHIP_RECORDS * REPL_WIRE_LEN];
+    uint8_t        hello[REPL_HELLO_LEN];
+    uint8_t        challenge[REPL_CHALLENGE_LEN];
+    size_t         held = 0;
+
+    if(read_full(fd, challenge, sizeof(challenge)) < 0)
+    {
+        return -1;
+    }
+    put_u32(hello, REPL_HELLO_MAGIC);
+    put_u32(hello + 4, REPL_VERSION);
+    put_u64(hello + 8, applier->pos.epoch);
+    put_u64(hello + 16, applier->pos.next);
+    hello_mac(challenge, hello, hello + REPL_HELLO_FIELDS);
+    if(write(fd, hello, sizeof(hello)) != (ssize_t)sizeof(hello))
+    {
+        return -1;
+    }
+    applier->in_snapshot = 0;
+
+    while(repl_running)
+    {
+        ssize_t nread = read(fd, buf + held, sizeof(buf) - held);
+        size_t  pos   = 0;
+
+        if(nread <= 0)
+        {
+            break;
+        }
+        held += (size_t)nread;
+        for(; held - pos >= REPL_WIRE_LEN; pos += REPL_WIRE_LEN)
+        {
+            if(apply_message(applier, buf + pos) < 0)
+            {
+                save_pos(applier);
+                return -1;
+            }
+        }
+        memmove(buf, buf + pos, held - pos);
+        held -= pos;
+        // Once per read rather than per change; a replayed change is harmless
+        if(!applier->in_snapshot)
+        {
+            save_pos(applier);
+        }
+    }
+    return 0;
+}
+
+static int apply_message(repl_applier *applier, const uint8_t msg[])
+{
+    user_obj  user;
+    uint8_t   type = msg[0];
+    uint64_t  seq  = get_u64(msg + 8);
+    long long now;
+
+    memset(&user, 0, sizeof(user));
+    user.id = (int)get_u32(msg + 4);
+    memcpy(user.username, msg + 24, USERNAME_MAX_LEN);
+    memcpy(user.salt, msg + 24 + USERNAME_MAX_LEN + 1, SALT_LEN);
+    memcpy(user.hash, msg + 24 + USERNAME_MAX_LEN + 1 + SALT_LEN, HASH_LEN);
+
+    if(type == REPL_BEGIN)
+    {
+        applier->in_snapshot    = 1;
+        applier->snapshot_epoch = seq;
+        memset(applier->seen, 0, sizeof(applier->seen));
+        return 0;
+    }
+    if(type == REPL_END && applier->in_snapshot)
+    {
+        // Users the snapshot did not carry were removed while we were away
+        scan_users(visit_sweep, applier);
+        applier->in_snapshot = 0;
+        applier->pos.epoch   = applier->snapshot_epoch;
+        applier->pos.next    = seq;
+        save_pos(applier);
+        printf("Replication snapshot applied: %llu users.\n", (unsigned long long)applier->snapshot_users);
+        fflush(stdout);
+        return 0;
+    }
+    if(applier->in_snapshot && type == REPL_PUT)
+    {
+        applier->seen[(uint32_t)user.id / 64 % REPL_ID_WORDS] |= (uint64_t)1 << ((uint32_t)user.id % 64);
+        applier->snapshot_users++;
+        return apply_user(&user);
+    }
+    if(applier->in_snapshot || seq != applier->pos.next || (type != REPL_PUT && type != REPL_DEL))
+    {
+        // A gap or a garbled stream: start over from a snapshot rather than diverge
+        fprintf(stderr, "Replication stream out of step at change %llu, resynchronising\n", (unsigned long long)seq);
+        applier->pos.epoch = 0;
+        return -1;
+    }
+
+    if(type == REPL_PUT)
+    {
+        apply_user(&user);
+    }
+    else
+    {
+        apply_user_removal(user.id);
+    }
+    applier->pos.next++;
+    applier->applied++;
+
+    now = now_ns(CLOCK_REALTIME);
+    if(now > (long long)get_u64(msg + 16))
+    {
+        long long lag_us = (now - (long long)get_u64(msg + 16)) / NSEC_PER_USEC;
+        applier->lag_sum_us += lag_us;
+        applier->lag_max_us = lag_us > applier->lag_max_us ? lag_us : applier->lag_max_us;
+    }
+    applier->last_ns = now_ns(CLOCK_MONOTONIC);
+    if(applier->first_ns == 0)
+    {
+        applier->first_ns = applier->last_ns;
+    }
+    return 0;
+}
+
+static void visit_sweep(const user_obj *user, void *ctx)
+{
+    const repl_applier *applier = (const repl_applier *)ctx;
+    uint32_t            id      = (uint32_t)user->id;
+
+    if(!(applier->seen[id / 64 % REPL_ID_WORDS] & ((uint64_t)1 << (id % 64))))
+    {
+        apply_user_removal(user->id);
+    }
+}
+
+static void save_pos(repl_applier *applier)
+{
+    applier->pos.magic   = REPL_POS_MAGIC;
+    applier->pos.version = REPL_VERSION;
+    if(pwrite(applier->pos_fd, &applier->pos, sizeof(applier->pos), 0) == (ssize_t)sizeof(applier->pos) && repl_sync)
+    {
+        fdatasync(applier->pos_fd);
+    }
+}
+
+static void put_u32(uint8_t buf[], uint32_t value)
+{
+    uint32_t be = htonl(value);
+    memcpy(buf, &be, sizeof(be));
+}
+
+static void put_u64(uint8_t buf[], uint64_t value)
+{
+    put_u32(buf, (uint32_t)(value >> 32));
+    put_u32(buf + 4, (uint32_t)value);
+}
+
+static uint32_t get_u32(const uint8_t buf[])
+{
+    uint32_t be;
+    memcpy(&be, buf, sizeof(be));
+    return ntohl(be);
+}
+
+static uint64_t get_u64(const uint8_t buf[])
+{
+    return ((uint64_t)get_u32(buf) << 32) | get_u32(buf + 4);
+}
+
+static long long now_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void repl_stop(int signum)
+{
+    (void)signum;
+    repl_running = 0;
+}
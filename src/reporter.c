@@ -0,0 +1,447 @@
+/*******************************************************************************
+ * Server Manager Reporting
+ *
+ * Sends the server manager what it needs to watch a server: counters every
+ * report interval and the log lines server_log is given, as ASN packets
+ * (SVR_DIAGNOSTIC, SVR_LOG) carried in BATCH frames.
+ *
+ * - Request handling only touches the reporter through relaxed atomic
+ *   increments on counters mapped MAP_SHARED before any fork, and a
+ *   non-blocking pipe write per log line, so a slow or absent manager
+ *   never holds up a client.
+ * - A reporter process, forked at startup, owns the manager connection. Log
+ *   lines are appended to the frame being built as they arrive. Each interval
+ *   the counters are added too, and the frames go out together; a frame
+ *   filled by a burst of log lines goes out as soon as it is full.
+ * - While the manager is unreachable, frames queue up to REPORT_QUEUE_FRAMES
+ *   and the oldest are dropped. Counters are totals since start, so a lost
+ *   report costs resolution, not accuracy.
+ * - test/manager.c is a stand-in manager that prints what it receives.
+ ******************************************************************************/
+
+#include "../include/reporter.h"
+#include "../include/asn.h"
+#include "../include/logging.h"
+#include "../include/session.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REPORT_ADDR_LEN 32
+#define REPORT_PIPE_CHUNK 4096
+#define REPORT_LOG_HEADER 2 /* level and length ahead of each line in the pipe */
+#define MSEC_PER_SEC 1000
+#define NSEC_PER_MSEC 1000000
+#define BASE_TEN 10
+
+/* Shared with every process; only ever incremented */
+typedef struct report_counters
+{
+    _Atomic uint32_t messages;
+    _Atomic uint32_t logins;
+    _Atomic uint32_t errors[SVR_ERROR_CODES];
+} report_counters;
+
+/* Frames waiting for the manager; the last one is still being built */
+typedef struct report_queue
+{
+    uint8_t frames[REPORT_QUEUE_FRAMES][BATCHPACKETLEN];
+    int     lens[REPORT_QUEUE_FRAMES]; /* end of the messages so far */
+    int     msgs[REPORT_QUEUE_FRAMES];
+    int     head;
+    int     count; /* frames in use, including the one being built */
+} report_queue;
+
+static int  parse_addr(const char *text, struct sockaddr_in *addr);
+static void reporter_run(const struct sockaddr_in *addr, unsigned int interval_ms);
+static void queue_packet(report_queue *queue, const uint8_t packet[], int len);
+static void queue_report(report_queue *queue);
+static void send_frames(report_queue *queue, int *fd);
+static int  dial(const struct sockaddr_in *addr);
+static int  read_logs(report_queue *queue, uint8_t chunk[], size_t *held);
+static long now_ms(void);
+static void reporter_stop(int signum);
+
+static report_counters *counters     = NULL;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int              logs[2]      = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t            reporter_pid = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static long             started_ms   = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Reporter process only */
+static volatile sig_atomic_t reporter_running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         frames_sent      = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned long         frames_dropped   = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: reporter_init
+ * Description: Maps the shared counters and forks the process that reports
+ *              them to the manager at manager (ip:port) every interval_ms.
+ *              Must run before the listener exists.
+ * Returns: 0 on success, -1 if the address is malformed or the process could
+ *          not be started.
+ */
+int reporter_init(const char *manager, unsigned int interval_ms)
+{
+    struct sockaddr_in addr;
+    void              *mem;
+
+    if(parse_addr(manager, &addr) < 0)
+    {
+        return -1;
+    }
+    mem = mmap(NULL, sizeof(report_counters), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("reporter_init::mmap");
+        return -1;
+    }
+    counters   = (report_counters *)mem;
+    started_ms = now_ms();
+
+    if(pipe(logs) == -1)
+    {
+        perror("reporter_init::pipe");
+        return -1;
+    }
+    fcntl(logs[0], F_SETFL, O_NONBLOCK);
+    fcntl(logs[1], F_SETFL, O_NONBLOCK);
+    fcntl(logs[1], F_SETFD, FD_CLOEXEC);
+
+    fflush(stdout);
+    reporter_pid = fork();
+    if(reporter_pid == -1)
+    {
+        perror("reporter_init::fork");
+        return -1;
+    }
+    if(reporter_pid == 0)
+    {
+        reporter_run(&addr, interval_ms);
+        _exit(EXIT_SUCCESS);
+    }
+    close(logs[0]);
+    logs[0] = -1;
+    return 0;
+}
+
+/* A CHT_SEND was accepted */
+void reporter_count_message(void)
+{
+    if(counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->messages, 1, memory_order_relaxed);
+    }
+}
+
+/* A login or resume succeeded */
+void reporter_count_login(void)
+{
+    if(counters != NULL)
+    {
+        atomic_fetch_add_explicit(&counters->logins, 1, memory_order_relaxed);
+    }
+}
+
+/* A SYS_ERROR was sent for err, one of the negative codes in asn.h */
+void reporter_count_error(int err)
+{
+    if(counters != NULL && err < 0 && -err < SVR_ERROR_CODES)
+    {
+        atomic_fetch_add_explicit(&counters->errors[-err], 1, memory_order_relaxed);
+    }
+}
+
+/* Hands a log line to the reporter; dropped rather than wait if the pipe is full */
+void reporter_log(int level, const char *msg)
+{
+    uint8_t record[REPORT_LOG_HEADER + SVR_LOG_MAX];
+    size_t  len = strnlen(msg, SVR_LOG_MAX);
+
+    if(logs[1] < 0 || len == 0)
+    {
+        return;
+    }
+    record[0] = (uint8_t)level;
+    record[1] = (uint8_t)len;
+    memcpy(record + REPORT_LOG_HEADER, msg, len);
+    // Below PIPE_BUF, so lines from different processes never interleave
+    write(logs[1], record, REPORT_LOG_HEADER + len);
+}
+
+/* Sends a last report and stops the reporter */
+void reporter_shutdown(void)
+{
+    if(reporter_pid <= 0)
+    {
+        return;
+    }
+    close(logs[1]);
+    logs[1] = -1;
+    kill(reporter_pid, SIGTERM);
+    while(waitpid(reporter_pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+    reporter_pid = 0;
+}
+
+static int parse_addr(const char *text, struct sockaddr_in *addr)
+{
+    char          host[REPORT_ADDR_LEN];
+    const char   *colon = strrchr(text, ':');
+    char         *end;
+    unsigned long port;
+
+    memset(addr, 0, sizeof(*addr));
+    if(colon == NULL || (size_t)(colon - text) >= sizeof(host))
+    {
+        fprintf(stderr, "Invalid server manager address '%s'\n", text);
+        return -1;
+    }
+    memcpy(host, text, (size_t)(colon - text));
+    host[colon - text] = '\0';
+    port               = strtoul(colon + 1, &end, BASE_TEN);
+    if(inet_pton(AF_INET, host, &addr->sin_addr) != 1 || *end != '\0' || port == 0 || port > UINT16_MAX)
+    {
+        fprintf(stderr, "Invalid server manager address '%s'\n", text);
+        return -1;
+    }
+    addr->sin_family = AF_INET;
+    addr->sin_port   = htons((uint16_t)port);
+    return 0;
+}
+
+static void reporter_run(const struct sockaddr_in *addr, unsigned int interval_ms)
+{
+    static report_queue queue;
+    static uint8_t      chunk[REPORT_PIPE_CHUNK];
+    size_t              held      = 0;
+    int                 fd        = -1;
+    long                next_dial = 0;
+    long                next_tick = now_ms() + (long)interval_ms;
+    char                line[SVR_LOG_MAX];
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, reporter_stop);
+    signal(SIGPIPE, SIG_IGN);
+    // Our own log lines are not reported, or every failed send would queue another
+    close(logs[1]);
+    logs[1] = -1;
+
+    queue.count   = 1;
+    queue.lens[0] = HEADERLEN;
+
+    while(reporter_running)
+    {
+        struct pollfd fds[2];
+        long          now = now_ms();
+        int           ready;
+
+        if(fd < 0 && now >= next_dial)
+        {
+            fd        = dial(addr);
+            next_dial = now + REPORT_RECONNECT_MS;
+        }
+
+        fds[0].fd     = logs[0];
+        fds[0].events = POLLIN;
+        fds[1].fd     = fd;
+        fds[1].events = POLLIN;
+        ready         = poll(fds, 2, (int)(next_tick > now ? next_tick - now : 0));
+        if(ready < 0 && errno != EINTR)
+        {
+            perror("reporter::poll");
+            break;
+        }
+        if(ready > 0 && (fds[1].revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            // The manager never writes, so readable means it closed
+            close(fd);
+            fd = -1;
+        }
+        if(ready > 0 && (fds[0].revents & (POLLIN | POLLHUP)) && read_logs(&queue, chunk, &held) == 0)
+        {
+            close(logs[0]);
+            logs[0] = -1;
+        }
+        if(now_ms() >= next_tick)
+        {
+            next_tick += (long)interval_ms;
+            queue_report(&queue);
+            send_frames(&queue, &fd);
+        }
+        else if(queue.count > 1)
+        {
+            // A burst of log lines filled a frame; send it rather than let the queue overflow
+            send_frames(&queue, &fd);
+        }
+    }
+
+    queue_report(&queue);
+    send_frames(&queue, &fd);
+    if(fd >= 0)
+    {
+        close(fd);
+    }
+    snprintf(line, sizeof(line), "Server manager reports: %lu frames sent, %lu dropped", frames_sent, frames_dropped);
+    printf("%s\n", line);
+    fflush(stdout);
+    server_log(1, line, LOG_INFO);
+}
+
+/* Adds a packet to the frame being built, starting another when it is full */
+static void queue_packet(report_queue *queue, const uint8_t packet[], int len)
+{
+    int last = (queue->head + queue->count - 1) % REPORT_QUEUE_FRAMES;
+    int pos  = (queue->msgs[last] < BATCH_MAX_MSGS) ? encode_batch_append(queue->frames[last], queue->lens[last], packet, len) : -1;
+
+    if(pos < 0)
+    {
+        encode_batch_header(queue->frames[last], queue->lens[last]);
+        if(queue->count == REPORT_QUEUE_FRAMES)
+        {
+            queue->head = (queue->head + 1) % REPORT_QUEUE_FRAMES;
+            queue->count--;
+            frames_dropped++;
+        }
+        last               = (queue->head + queue->count) % REPORT_QUEUE_FRAMES;
+        queue->lens[last]  = HEADERLEN;
+        queue->msgs[last]  = 0;
+        queue->count++;
+        pos = encode_batch_append(queue->frames[last], HEADERLEN, packet, len);
+    }
+    queue->lens[last] = pos;
+    queue->msgs[last]++;
+}
+
+static void queue_report(report_queue *queue)
+{
+    uint8_t        packet[PACKETLEN];
+    svr_diagnostic diag;
+
+    diag.uptime_sec   = (uint32_t)((now_ms() - started_ms) / MSEC_PER_SEC);
+    diag.users_online = session_count_online();
+    diag.messages     = atomic_load_explicit(&counters->messages, memory_order_relaxed);
+    diag.logins       = atomic_load_explicit(&counters->logins, memory_order_relaxed);
+    for(int code = 0; code < SVR_ERROR_CODES; code++)
+    {
+        diag.errors[code] = atomic_load_explicit(&counters->errors[code], memory_order_relaxed);
+    }
+    queue_packet(queue, packet, encode_svr_diagnostic(packet, &diag));
+}
+
+/* Writes every queued frame; one that cannot be written in full is dropped with the connection */
+static void send_frames(report_queue *queue, int *fd)
+{
+    while(*fd >= 0 && queue->count > 0)
+    {
+        int first = queue->head;
+        int len   = queue->lens[first];
+
+        if(queue->msgs[first] > 0)
+        {
+            encode_batch_header(queue->frames[first], len);
+            if(write(*fd, queue->frames[first], (size_t)len) != len)
+            {
+                close(*fd);
+                *fd = -1;
+                frames_dropped++;
+            }
+            else
+            {
+                frames_sent++;
+            }
+        }
+        if(queue->count == 1)
+        {
+            queue->lens[first] = HEADERLEN;
+            queue->msgs[first] = 0;
+            break;
+        }
+        queue->head = (queue->head + 1) % REPORT_QUEUE_FRAMES;
+        queue->count--;
+    }
+}
+
+/* Connects with a bounded wait; writes block from then on, bounded by the send timeout */
+static int dial(const struct sockaddr_in *addr)
+{
+    struct timeval send_timeout = {REPORT_SEND_TIMEOUT_SEC, 0};
+    struct pollfd  pfd;
+    int            err = 0;
+    socklen_t      len = sizeof(err);
+    int            fd  = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(fd == -1)
+    {
+        return -1;
+    }
+    if(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    pfd.fd     = fd;
+    pfd.events = POLLOUT;
+    if(poll(&pfd, 1, REPORT_SEND_TIMEOUT_SEC * MSEC_PER_SEC) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+    return fd;
+}
+
+/* Turns the log lines waiting in the pipe into SVR_LOG packets; returns 0 once every writer is gone */
+static int read_logs(report_queue *queue, uint8_t chunk[], size_t *held)
+{
+    uint8_t packet[PACKETLEN];
+    char    line[SVR_LOG_MAX + 1];
+    size_t  pos   = 0;
+    ssize_t nread = read(logs[0], chunk + *held, REPORT_PIPE_CHUNK - *held);
+
+    if(nread <= 0)
+    {
+        return (nread == 0) ? 0 : 1;
+    }
+    *held += (size_t)nread;
+    while(*held - pos >= REPORT_LOG_HEADER && *held - pos >= REPORT_LOG_HEADER + (size_t)chunk[pos + 1])
+    {
+        size_t len = chunk[pos + 1];
+
+        memcpy(line, chunk + pos + REPORT_LOG_HEADER, len);
+        line[len] = '\0';
+        queue_packet(queue, packet, encode_svr_log(packet, chunk[pos], line));
+        pos += REPORT_LOG_HEADER + len;
+    }
+    memmove(chunk, chunk + pos, *held - pos);
+    *held -= pos;
+    return 1;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / NSEC_PER_MSEC;
+}
+
+static void reporter_stop(int signum)
+{
+    (void)signum;
+    reporter_running = 0;
+}
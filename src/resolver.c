@@ -0,0 +1,278 @@
+/*******************************************************************************
+ * Client Hostname Resolver
+ *
+ * Reverse DNS for the connection log, kept off the accept path. The listener
+ * formats addresses numerically; when hostnames are wanted (-R) it also hands
+ * the address to this process and moves on.
+ *
+ * - One process, forked at startup, reads fixed size requests from a pipe.
+ *   The listener writes without blocking and drops the request if the pipe
+ *   is full, so a slow resolver can only cost log lines.
+ * - Results, failures included, are cached for RESOLVER_CACHE_TTL_SEC in an
+ *   LRU of RESOLVER_CACHE_SLOTS addresses that is private to the resolver, so
+ *   a client reconnecting in a loop costs one lookup.
+ ******************************************************************************/
+
+#include "../include/resolver.h"
+#include "../include/logging.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_LINE_LEN (NI_MAXHOST * 2 + 48)
+#define NO_ENTRY (-1)
+
+/* One request on the pipe; small enough that the write is atomic */
+typedef struct resolve_req
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+} resolve_req;
+
+/* A cached lookup, linked into the recency list by index */
+typedef struct cache_entry
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    char                    host[NI_MAXHOST]; /* empty when the address has no name */
+    time_t                  expires;
+    int                     prev;
+    int                     next;
+} cache_entry;
+
+static void resolver_run(void);
+static int  cache_find(const resolve_req *req);
+static int  cache_insert(const resolve_req *req);
+static void cache_unlink(int slot);
+static void cache_push_front(int slot);
+
+static int   requests[2]  = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t resolver_pid = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Resolver process only */
+static cache_entry cache[RESOLVER_CACHE_SLOTS];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int         cache_used = 0;                 // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int         cache_head = NO_ENTRY;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int         cache_tail = NO_ENTRY;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: resolver_init
+ * Description: Forks the resolver process. Must run before the listener
+ *              exists so the resolver never holds client-facing sockets.
+ * Returns: 0 on success, -1 on failure.
+ */
+int resolver_init(void)
+{
+    if(pipe(requests) == -1)
+    {
+        perror("resolver_init::pipe");
+        return -1;
+    }
+    fcntl(requests[1], F_SETFL, O_NONBLOCK);
+    fcntl(requests[1], F_SETFD, FD_CLOEXEC);
+
+    resolver_pid = fork();
+    if(resolver_pid == -1)
+    {
+        perror("resolver_init::fork");
+        return -1;
+    }
+    if(resolver_pid == 0)
+    {
+        resolver_run();
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(requests[0]);
+    requests[0] = -1;
+    return 0;
+}
+
+/* Queues addr to have its hostname logged; never blocks, does nothing if the resolver is off */
+void resolver_submit(const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+    resolve_req req;
+
+    if(requests[1] < 0)
+    {
+        return;
+    }
+    memset(&req, 0, sizeof(req));
+    memcpy(&req.addr, addr, (size_t)addr_len < sizeof(req.addr) ? (size_t)addr_len : sizeof(req.addr));
+    req.addr_len = addr_len;
+
+    // Names belong to the address, so the client's port is left out of the cache key
+    if(req.addr.ss_family == AF_INET)
+    {
+        ((struct sockaddr_in *)&req.addr)->sin_port = 0;
+    }
+    else if(req.addr.ss_family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)&req.addr)->sin6_port = 0;
+    }
+    write(requests[1], &req, sizeof(req));
+}
+
+/* Drops the listener's end of the request pipe in a forked client process */
+void resolver_detach(void)
+{
+    if(requests[1] >= 0)
+    {
+        close(requests[1]);
+        requests[1] = -1;
+    }
+}
+
+/* Stops the resolver; a lookup still waiting on DNS is abandoned */
+void resolver_shutdown(void)
+{
+    if(resolver_pid <= 0)
+    {
+        return;
+    }
+    resolver_detach();
+    kill(resolver_pid, SIGTERM);
+    while(waitpid(resolver_pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
+    resolver_pid = 0;
+}
+
+static void resolver_run(void)
+{
+    resolve_req req;
+    char        numeric[NI_MAXHOST];
+    char        line[LOG_LINE_LEN];
+
+    /* Interrupts are for the listener; shutdown arrives as SIGTERM or end of file */
+    signal(SIGINT, SIG_IGN);
+    close(requests[1]);
+
+    for(;;)
+    {
+        ssize_t nread;
+        int     slot;
+        int     cached;
+
+        nread = read(requests[0], &req, sizeof(req));
+        if(nread < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread <= 0)
+        {
+            return;
+        }
+        if(nread != (ssize_t)sizeof(req))
+        {
+            continue;
+        }
+
+        if(getnameinfo((const struct sockaddr *)&req.addr, req.addr_len, numeric, sizeof(numeric), NULL, 0, NI_NUMERICHOST) != 0)
+        {
+            continue;
+        }
+
+        slot   = cache_find(&req);
+        cached = slot != NO_ENTRY && time(NULL) < cache[slot].expires;
+        if(!cached)
+        {
+            if(slot == NO_ENTRY)
+            {
+                slot = cache_insert(&req);
+            }
+            cache[slot].expires = time(NULL) + RESOLVER_CACHE_TTL_SEC;
+            if(getnameinfo((const struct sockaddr *)&req.addr, req.addr_len, cache[slot].host, sizeof(cache[slot].host), NULL, 0, NI_NAMEREQD) != 0)
+            {
+                cache[slot].host[0] = '\0';
+            }
+        }
+
+        if(cache[slot].host[0] != '\0')
+        {
+            snprintf(line, sizeof(line), "Client %s is %s%s", numeric, cache[slot].host, cached ? " (cached)" : "");
+            printf("%s\n", line);
+            fflush(stdout);
+            server_log(1, line, LOG_INFO);
+        }
+    }
+}
+
+/* Returns the entry for the request's address, moved to the front, or NO_ENTRY */
+static int cache_find(const resolve_req *req)
+{
+    for(int slot = cache_head; slot != NO_ENTRY; slot = cache[slot].next)
+    {
+        if(cache[slot].addr_len == req->addr_len && memcmp(&cache[slot].addr, &req->addr, (size_t)req->addr_len) == 0)
+        {
+            cache_unlink(slot);
+            cache_push_front(slot);
+            return slot;
+        }
+    }
+    return NO_ENTRY;
+}
+
+/* Takes a free entry, or the least recently used one, for the request's address */
+static int cache_insert(const resolve_req *req)
+{
+    int slot;
+
+    if(cache_used < RESOLVER_CACHE_SLOTS)
+    {
+        slot = cache_used++;
+    }
+    else
+    {
+        slot = cache_tail;
+        cache_unlink(slot);
+    }
+    cache[slot].addr     = req->addr;
+    cache[slot].addr_len = req->addr_len;
+    cache_push_front(slot);
+    return slot;
+}
+
+static void cache_unlink(int slot)
+{
+    if(cache[slot].prev != NO_ENTRY)
+    {
+        cache[cache[slot].prev].next = cache[slot].next;
+    }
+    else
+    {
+        cache_head = cache[slot].next;
+    }
+    if(cache[slot].next != NO_ENTRY)
+    {
+        cache[cache[slot].next].prev = cache[slot].prev;
+    }
+    else
+    {
+        cache_tail = cache[slot].prev;
+    }
+}
+
+static void cache_push_front(int slot)
+{
+    cache[slot].prev = NO_ENTRY;
+    cache[slot].next = cache_head;
+    if(cache_head != NO_ENTRY)
+    {
+        cache[cache_head].prev = slot;
+    }
+    cache_head = slot;
+    if(cache_tail == NO_ENTRY)
+    {
+        cache_tail = slot;
+    }
+}
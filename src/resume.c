@@ -0,0 +1,250 @@
+/*******************************************************************************
+ * Session Resumption
+ *
+ * Lets a client that lost its connection log back in without its password,
+ * so a network blip or a restart does not turn into a storm of ACC_LOGINs,
+ * each costing a user store lookup and a password hash.
+ *
+ * - ACC_LOGIN_SUCCESS carries a random token for clients at RESUMEVER and up.
+ *   ACC_RESUME presents it with the user id in sender_id, and a good one
+ *   restores the session and is replaced by a fresh token: tokens are single
+ *   use and last RESUME_TTL_SEC.
+ * - Tokens live in one slot per user id in user_db.resume, mapped MAP_SHARED
+ *   before any fork, so checking one is an array index plus one SHA-256 and
+ *   works in any process and across a restart.
+ * - Only a salted hash of the token is stored, so the file is no more useful
+ *   to a reader than the password hashes are.
+ * - Each slot has its own spin lock, holding the pid of its holder. Another
+ *   server may be using the table (the old generation of a hot upgrade), so
+ *   a held lock is only taken over once its holder is found to have died,
+ *   whether when the file is opened or by a process waiting on it.
+ ******************************************************************************/
+
+#include "../include/resume.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RESUME_FILE "user_db.resume"
+#define RESUME_FILE_MODE 0600
+#define RESUME_HEADER_SPACE 64
+#define RESUME_MAP_LEN (RESUME_HEADER_SPACE + RESUME_SLOTS * sizeof(resume_slot))
+
+/* Layout of the start of the backing file, followed by the slots */
+typedef struct resume_header
+{
+    uint32_t magic;
+    uint32_t version;
+} resume_header;
+
+static void slot_lock(resume_slot *slot);
+static void slot_unlock(resume_slot *slot);
+static int  slot_recover(resume_slot *slot, uint32_t holder, uint32_t self);
+static void token_hash(const char *token, const uint8_t salt[SALT_LEN], uint8_t out[HASH_LEN]);
+
+static resume_header *resume_file  = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static resume_slot   *resume_slots = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: resume_open
+ * Description: Maps the token table, creating it when missing or from another
+ *              format. Must run before the first fork.
+ * Returns: 0 on success, -1 on failure.
+ */
+int resume_open(void)
+{
+    struct stat st;
+    void       *mem;
+    int         fd;
+    int         stale;
+
+    fd = open(RESUME_FILE, O_RDWR | O_CREAT | O_CLOEXEC, RESUME_FILE_MODE);
+    if(fd == -1)
+    {
+        perror("resume_open::open");
+        return -1;
+    }
+    if(fstat(fd, &st) == -1)
+    {
+        perror("resume_open::fstat");
+        close(fd);
+        return -1;
+    }
+
+    stale = (size_t)st.st_size != RESUME_MAP_LEN;
+    if(stale && (ftruncate(fd, 0) == -1 || ftruncate(fd, (off_t)RESUME_MAP_LEN) == -1))
+    {
+        perror("resume_open::ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    mem = mmap(NULL, RESUME_MAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED)
+    {
+        perror("resume_open::mmap");
+        return -1;
+    }
+
+    resume_file  = (resume_header *)mem;
+    resume_slots = (resume_slot *)((char *)mem + RESUME_HEADER_SPACE);
+    if(!stale && (resume_file->magic != RESUME_MAGIC || resume_file->version != RESUME_VERSION))
+    {
+        memset(mem, 0, RESUME_MAP_LEN);
+    }
+    resume_file->magic   = RESUME_MAGIC;
+    resume_file->version = RESUME_VERSION;
+
+    // Locks held by live processes are left alone: they may belong to a server still running
+    for(size_t i = 0; i < RESUME_SLOTS; i++)
+    {
+        uint32_t holder = atomic_load_explicit(&resume_slots[i].lock, memory_order_relaxed);
+
+        if(holder != 0)
+        {
+            slot_recover(&resume_slots[i], holder, 0);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function: resume_issue
+ * Description: Creates a new token for user_id, replacing any earlier one, and
+ *              writes it to token as hex.
+ * Returns: 0 on success, -1 if no random bytes could be read.
+ */
+int resume_issue(uint16_t user_id, char token[RESUME_TOKEN_LEN + 1])
+{
+    static const char hex[] = "0123456789abcdef";
+    resume_slot      *slot  = &resume_slots[user_id];
+    uint8_t           secret[SALT_LEN];
+    uint8_t           salt[SALT_LEN];
+    uint8_t           hash[HASH_LEN];
+
+    if(password_salt(secret) < 0 || password_salt(salt) < 0)
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < SALT_LEN; i++)
+    {
+        token[2 * i]     = hex[secret[i] >> 4];
+        token[2 * i + 1] = hex[secret[i] & 0x0f];    // NOLINT(readability-magic-numbers)
+    }
+    token[RESUME_TOKEN_LEN] = '\0';
+    memset(secret, 0, sizeof(secret));
+    token_hash(token, salt, hash);
+
+    slot_lock(slot);
+    memcpy(slot->salt, salt, SALT_LEN);
+    memcpy(slot->hash, hash, HASH_LEN);
+    slot->expires = (int64_t)time(NULL) + RESUME_TTL_SEC;
+    slot_unlock(slot);
+    return 0;
+}
+
+/*
+ * Function: resume_redeem
+ * Description: Checks token against the one issued to user_id and, if it
+ *              matches and has not expired, consumes it.
+ * Returns: 1 if the session may be resumed, 0 otherwise.
+ */
+int resume_redeem(uint16_t user_id, const char *token)
+{
+    resume_slot *slot = &resume_slots[user_id];
+    uint8_t      hash[HASH_LEN];
+    int          valid;
+
+    if(strlen(token) != RESUME_TOKEN_LEN)
+    {
+        return 0;
+    }
+
+    slot_lock(slot);
+    valid = slot->expires > (int64_t)time(NULL);
+    if(valid)
+    {
+        token_hash(token, slot->salt, hash);
+        valid = password_equal(hash, slot->hash);
+    }
+    if(valid)
+    {
+        slot->expires = 0;
+    }
+    slot_unlock(slot);
+    return valid;
+}
+
+/* Invalidates the user's token, on logout or when the account is removed */
+void resume_revoke(uint16_t user_id)
+{
+    resume_slot *slot = &resume_slots[user_id];
+
+    slot_lock(slot);
+    slot->expires = 0;
+    slot_unlock(slot);
+}
+
+/* Flushes the table so tokens survive the restart */
+void resume_close(void)
+{
+    if(resume_file == NULL)
+    {
+        return;
+    }
+    msync(resume_file, RESUME_MAP_LEN, MS_SYNC);
+    munmap(resume_file, RESUME_MAP_LEN);
+    resume_file  = NULL;
+    resume_slots = NULL;
+}
+
+static void slot_lock(resume_slot *slot)
+{
+    uint32_t self     = (uint32_t)getpid();
+    uint32_t expected = 0;
+
+    while(!atomic_compare_exchange_weak_explicit(&slot->lock, &expected, self, memory_order_acquire, memory_order_relaxed))
+    {
+        if(expected != 0 && slot_recover(slot, expected, self))
+        {
+            return;
+        }
+        expected = 0;
+        sched_yield();
+    }
+}
+
+static void slot_unlock(resume_slot *slot)
+{
+    atomic_store_explicit(&slot->lock, 0, memory_order_release);
+}
+
+/*
+ * Takes the slot from holder, for self (0 to free it), if holder has died.
+ * A slot is only written with its lock held, so the worst a dead holder left
+ * behind is a half-written token, which then fails to match.
+ * Returns 1 if the slot was taken, 0 if holder is alive or another process
+ * got there first.
+ */
+static int slot_recover(resume_slot *slot, uint32_t holder, uint32_t self)
+{
+    if(kill((pid_t)holder, 0) == 0 || errno != ESRCH)
+    {
+        return 0;
+    }
+    return atomic_compare_exchange_strong_explicit(&slot->lock, &holder, self, memory_order_acquire, memory_order_relaxed);
+}
+
+/* One PBKDF2 round is enough: the token is random, not a password that could be guessed */
+static void token_hash(const char *token, const uint8_t salt[SALT_LEN], uint8_t out[HASH_LEN])
+{
+    password_hash(token, RESUME_TOKEN_LEN, salt, 1, out);
+}
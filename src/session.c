@@ -0,0 +1,176 @@
+/*******************************************************************************
+ * Session Table
+ *
+ * Maps connections to the user they authenticated as, and users back to the
+ * connection that owns them, without touching the user database.
+ *
+ * - connection -> user id: the session struct held by the child serving the
+ *   connection
+ * - user id -> connection: a shared array indexed by user id holding the owning
+ *   connection id, mapped before any child is forked so every child sees it
+ *
+ * Every operation is a single array access, so validating the sender_id of
+ * each packet costs one load.
+ *
+ * Each slot also carries the user's rate limit bucket (see ratelimit.c), so
+ * a user is limited the same however many connections it spreads packets
+ * over.
+ *
+ * Both arrays live in user_db.sessions. Every server holds a shared flock on
+ * it until its last process exits: one that locks it alone at startup clears
+ * it, and one started while another runs (a hot upgrade) maps the same copy,
+ * so users logged in on the old generation stay online for the new one.
+ ******************************************************************************/
+
+#include "../include/session.h"
+#include "../include/ratelimit.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SESSION_FILE "user_db.sessions"
+#define SESSION_FILE_MODE 0644
+
+/* user id -> owning conn_id, 0 when nobody is logged in as that user */
+static _Atomic int32_t *session_owners = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Per-user buckets, indexed by user id like the owners */
+typedef struct session_limits
+{
+    rate_bucket packets; /* authenticated requests */
+} session_limits;
+
+static session_limits *session_buckets = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int             session_fd      = -1;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: session_table_init
+ * Description: Maps the shared reverse index and per-user buckets: the ones
+ *              a running server is using, or else a cleared copy. Must run
+ *              before the first fork.
+ * Returns: 0 on success, -1 on failure.
+ */
+int session_table_init(void)
+{
+    struct stat st;
+    size_t      owners_size = SESSION_SLOTS * sizeof(*session_owners);
+    size_t      size        = owners_size + (SESSION_SLOTS * sizeof(*session_buckets));
+    uint8_t    *mem;
+    int         in_use;
+
+    session_fd = open(SESSION_FILE, O_RDWR | O_CREAT | O_CLOEXEC, SESSION_FILE_MODE);
+    if(session_fd == -1)
+    {
+        perror("session_table_init::open");
+        return -1;
+    }
+
+    // Alone, whatever an earlier run left is stale; otherwise wait for whoever is clearing it to finish
+    in_use = flock(session_fd, LOCK_EX | LOCK_NB) == -1;
+    if((in_use && (errno != EWOULDBLOCK || flock(session_fd, LOCK_SH) == -1)) || fstat(session_fd, &st) == -1)
+    {
+        perror("session_table_init::flock");
+        goto fail;
+    }
+    /* Truncating to zero and back zero fills it, which is the "no owner" state; pages stay unbacked until a user id is first seen */
+    if(in_use ? (size_t)st.st_size != size : (ftruncate(session_fd, 0) == -1 || ftruncate(session_fd, (off_t)size) == -1))
+    {
+        fprintf(stderr, "Cannot size %s\n", SESSION_FILE);
+        goto fail;
+    }
+
+    mem = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, session_fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("session_table_init::mmap");
+        goto fail;
+    }
+    session_owners  = (_Atomic int32_t *)mem;
+    session_buckets = (session_limits *)(mem + owners_size);
+    if(!in_use)
+    {
+        // Inherited by every child, so it is held until the last of them exits
+        flock(session_fd, LOCK_SH);
+    }
+    return 0;
+
+fail:
+    close(session_fd);
+    session_fd = -1;
+    return -1;
+}
+
+/* Start an unauthenticated session for a new connection */
+void session_open(session *sess, int32_t conn_id)
+{
+    sess->conn_id       = conn_id;
+    sess->user_id       = 0;
+    sess->authenticated = 0;
+}
+
+/*
+ * Function: session_login
+ * Description: Binds the connection to user_id. A newer login for the same user
+ *              takes the reverse index over, so the older connection stops
+ *              validating.
+ */
+void session_login(session *sess, uint16_t user_id)
+{
+    if(sess->authenticated && sess->user_id != user_id)
+    {
+        session_logout(sess);
+    }
+    atomic_store_explicit(&session_owners[user_id], sess->conn_id, memory_order_release);
+    sess->user_id       = user_id;
+    sess->authenticated = 1;
+}
+
+/* Unbind the connection; leaves the reverse index alone if another connection took the user over */
+void session_logout(session *sess)
+{
+    int32_t expected;
+
+    if(!sess->authenticated)
+    {
+        return;
+    }
+    expected = sess->conn_id;
+    atomic_compare_exchange_strong_explicit(&session_owners[sess->user_id], &expected, 0, memory_order_acq_rel, memory_order_relaxed);
+    sess->user_id       = 0;
+    sess->authenticated = 0;
+}
+
+/* Returns 1 if sender_id is the user this connection is currently logged in as */
+int session_validate(const session *sess, uint16_t sender_id)
+{
+    return sess->authenticated && sess->user_id == sender_id && atomic_load_explicit(&session_owners[sender_id], memory_order_acquire) == sess->conn_id;
+}
+
+/* Returns 1 if the user may send another authenticated request, 0 if it is over its limit */
+int session_admit(uint16_t user_id, uint64_t now)
+{
+    return ratelimit_take(&session_buckets[user_id].packets, RATE_USER, now);
+}
+
+/* Returns the conn_id logged in as user_id, or 0 if the user is offline */
+int32_t session_owner(uint16_t user_id)
+{
+    return atomic_load_explicit(&session_owners[user_id], memory_order_acquire);
+}
+
+/* Users logged in right now; a scan of the reverse index, cheap enough for periodic reports */
+uint32_t session_count_online(void)
+{
+    uint32_t online = 0;
+
+    for(uint32_t id = 0; id < SESSION_SLOTS; id++)
+    {
+        online += atomic_load_explicit(&session_owners[id], memory_order_relaxed) != 0;
+    }
+    return online;
+}
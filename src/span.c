@@ -0,0 +1,275 @@
+/*******************************************************************************
+ * Request Spans
+ *
+ * Records where individual requests spent their time (see span.h), so a slow
+ * one can be told apart as slow to arrive, to decode, in the user store, on
+ * the password hash or writing its replies.
+ *
+ * - Stages are stamped with the CPU's cycle counter, read without a system
+ *   call or a fence; it runs at a constant rate and in step on every core of
+ *   the CPUs this is run on. Ticks are turned into time only when spans are
+ *   printed, against the monotonic clock over the whole run, so nothing is
+ *   converted on the request path.
+ * - Each connection process decides at the start of a request whether to time
+ *   it: every -t'th request is sampled, counting from a point set by its pid
+ *   so connections do not all sample the same request. With -l every request
+ *   is timed, and kept only if sampled or slower than the threshold from
+ *   being readable to being answered.
+ * - Kept spans go to one of SPAN_RINGS rings in a mapping shared with the
+ *   listener, picked by pid, so a connection writes its own ring and usually
+ *   alone. A slot is marked busy while it is written, and the listener skips
+ *   a slot that changed under it rather than locking out the writer.
+ ******************************************************************************/
+
+#include "../include/span.h"
+#include "../include/logging.h"
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <time.h>
+
+#define SPAN_RINGS 64       /* connections share a ring when their pids collide modulo this */
+#define SPAN_RING_SLOTS 256 /* most recent spans kept per ring */
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000.0
+#define CALIBRATE_NS 2000000L /* ticks are counted against the clock this long to convert -l */
+
+typedef struct span_slot
+{
+    _Atomic uint64_t seq; /* its position in the ring + 1, 0 while being written */
+    span             span;
+} span_slot;
+
+typedef struct span_ring
+{
+    _Atomic uint64_t head; /* spans ever written to the ring */
+    span_slot        slots[SPAN_RING_SLOTS];
+} span_ring;
+
+static int    compare_ready(const void *a, const void *b);
+static double stage_us(uint64_t from, uint64_t to, double ticks_per_us);
+
+/* Written only before the first fork */
+static span_ring   *rings       = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned int every       = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t     slow_ticks  = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t     start_ticks = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint64_t     start_clock = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Connection process only */
+static span_ring   *ring      = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned int countdown = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: span_init
+ * Description: Maps the rings when spans are wanted: one request in
+ *              sample_every, or any taking slow_us or longer, 0 for neither.
+ *              Must run before the first fork.
+ * Returns: 0 on success, -1 on failure.
+ */
+int span_init(unsigned int sample_every, unsigned int slow_us)
+{
+    struct timespec pause = {0, CALIBRATE_NS};
+    void           *mem;
+    uint64_t        ticks;
+    uint64_t        elapsed;
+
+    if(sample_every == 0 && slow_us == 0)
+    {
+        return 0;
+    }
+    mem = mmap(NULL, sizeof(span_ring) * SPAN_RINGS, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("span_init::mmap");
+        return -1;
+    }
+    rings = (span_ring *)mem;
+    every = sample_every;
+
+    start_ticks = SPAN_NOW();
+    start_clock = span_clock();
+    nanosleep(&pause, NULL);
+    ticks       = SPAN_NOW() - start_ticks;
+    elapsed     = span_clock() - start_clock;
+    slow_ticks  = (uint64_t)((double)slow_us * NSEC_PER_USEC * (double)ticks / (double)elapsed);
+
+    printf("Recording request spans: one in %u, and any over %u us (0 for none); SIGUSR2 prints them\n", sample_every, slow_us);
+    return 0;
+}
+
+/* Readies the span of the connection this process serves */
+void span_attach(span *sp, uint32_t conn_id)
+{
+    memset(sp, 0, sizeof(*sp));
+    sp->conn_id = conn_id;
+    if(rings == NULL)
+    {
+        return;
+    }
+    ring      = &rings[conn_id % SPAN_RINGS];
+    countdown = (every > 0) ? 1 + conn_id % every : 0;
+}
+
+/*
+ * Starts the span of the next request as the connection begins waiting for
+ * it, unless one is still open because its login is being hashed.
+ */
+void span_begin(span *sp)
+{
+    if(sp->open || ring == NULL)
+    {
+        return;
+    }
+    sp->open    = 1;
+    sp->sampled = 0;
+    if(countdown > 0 && --countdown == 0)
+    {
+        countdown   = every;
+        sp->sampled = 1;
+    }
+    sp->timed = (uint8_t)(sp->sampled || slow_ticks > 0);
+    if(sp->timed)
+    {
+        memset(sp->at, 0, sizeof(sp->at));
+        sp->db            = 0;
+        sp->send          = 0;
+        sp->result        = 0;
+        sp->at[SPAN_WAIT] = SPAN_NOW();
+    }
+}
+
+/* Ends the span once the request is answered, keeping it if sampled or slow */
+void span_end(span *sp)
+{
+    span_slot *slot;
+    uint64_t   pos;
+
+    sp->open = 0;
+    if(!sp->timed)
+    {
+        return;
+    }
+    sp->timed         = 0;
+    sp->at[SPAN_DONE] = SPAN_NOW();
+    if(!sp->sampled && sp->at[SPAN_DONE] - sp->at[SPAN_READY] < slow_ticks)
+    {
+        return;
+    }
+
+    pos  = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    slot = &ring->slots[pos % SPAN_RING_SLOTS];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->span, sp, sizeof(*sp));
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/*
+ * Function: span_dump
+ * Description: Prints every span still in the rings, oldest first, with its
+ *              stages in microseconds. Listener only.
+ */
+void span_dump(void)
+{
+    span    *spans;
+    size_t   count = 0;
+    double   ticks_per_us;
+    uint64_t elapsed;
+
+    if(rings == NULL)
+    {
+        printf("No request spans recorded: start the server with -t or -l\n");
+        fflush(stdout);
+        return;
+    }
+    spans = (span *)malloc(sizeof(span) * SPAN_RINGS * SPAN_RING_SLOTS);
+    if(spans == NULL)
+    {
+        perror("span_dump::malloc");
+        return;
+    }
+
+    // Over the whole run, so the rate is as exact as the clock
+    elapsed      = span_clock() - start_clock;
+    ticks_per_us = (double)(SPAN_NOW() - start_ticks) * NSEC_PER_USEC / (double)(elapsed > 0 ? elapsed : 1);
+
+    for(size_t r = 0; r < SPAN_RINGS; r++)
+    {
+        uint64_t head  = atomic_load_explicit(&rings[r].head, memory_order_acquire);
+        uint64_t first = (head > SPAN_RING_SLOTS) ? head - SPAN_RING_SLOTS : 0;
+
+        for(uint64_t pos = first; pos < head; pos++)
+        {
+            span_slot *slot = &rings[r].slots[pos % SPAN_RING_SLOTS];
+            uint64_t   seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+            memcpy(&spans[count], &slot->span, sizeof(span));
+            atomic_thread_fence(memory_order_acquire);
+            // Unwritten, overwritten or being written as it was copied
+            if(seq != pos + 1 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            {
+                continue;
+            }
+            count++;
+        }
+    }
+    qsort(spans, count, sizeof(span), compare_ready);
+
+    printf("%zu request spans (us; db and send are part of serve and hash):\n", count);
+    printf("%8s %4s %5s %6s %10s %10s %8s %8s %9s %9s %8s %8s %7s\n", "conn", "type", "len", "result", "total", "wait", "read", "decode", "serve", "hash", "db", "send", "kept");
+    for(size_t i = 0; i < count; i++)
+    {
+        const span *sp     = &spans[i];
+        uint64_t    served = sp->at[SPAN_DECODED] ? sp->at[SPAN_DECODED] : sp->at[SPAN_READ];
+
+        printf("%8u %4u %5u %6d %10.1f %10.1f %8.1f %8.1f %9.1f %9.1f %8.1f %8.1f %7s\n",
+               (unsigned int)sp->conn_id,
+               (unsigned int)sp->packet_type,
+               (unsigned int)sp->payload_len,
+               (int)sp->result,
+               stage_us(sp->at[SPAN_READY], sp->at[SPAN_DONE], ticks_per_us),
+               stage_us(sp->at[SPAN_WAIT], sp->at[SPAN_READY], ticks_per_us),
+               stage_us(sp->at[SPAN_READY], sp->at[SPAN_READ], ticks_per_us),
+               stage_us(sp->at[SPAN_READ], sp->at[SPAN_DECODED], ticks_per_us),
+               stage_us(served, sp->at[SPAN_SERVED], ticks_per_us),
+               stage_us(sp->at[SPAN_SERVED], sp->at[SPAN_DONE], ticks_per_us),
+               (double)sp->db / ticks_per_us,
+               (double)sp->send / ticks_per_us,
+               sp->sampled ? "sampled" : "slow");
+    }
+    fflush(stdout);
+    free(spans);
+    server_log(1, "Request spans printed", LOG_NOTICE);
+}
+
+/* Monotonic ns; the tick source where there is no cycle counter to read */
+uint64_t span_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+/* Orders spans by when their requests became readable */
+static int compare_ready(const void *a, const void *b)
+{
+    uint64_t ready_a = ((const span *)a)->at[SPAN_READY];
+    uint64_t ready_b = ((const span *)b)->at[SPAN_READY];
+
+    return (ready_a > ready_b) - (ready_a < ready_b);
+}
+
+/* Time between two marks, 0 when either was not passed */
+static double stage_us(uint64_t from, uint64_t to, double ticks_per_us)
+{
+    if(from == 0 || to < from)
+    {
+        return 0.0;
+    }
+    return (double)(to - from) / ticks_per_us;
+}
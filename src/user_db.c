@@ -1,20 +1,36 @@
 /*******************************************************************************
  * User Database Management System
  *
- * This module provides a persistent storage interface for user management using
- * DBM (Database Manager) for data storage. It supports basic CRUD operations:
+ * This module provides a persistent storage interface for user management. It
+ * supports basic CRUD operations:
  * - Creating new users
  * - Retrieving user information
  * - Updating user records
  * - Deleting users
  * - Listing all users
  *
- * The implementation uses GDBM on Linux/FreeBSD and NDBM on macOS, providing
- * cross-platform compatibility through conditional compilation.
+ * Storage is pluggable (see user_store.h), chosen by name at startup:
+ * - "dbm": GDBM on Linux/FreeBSD and NDBM on macOS (user_store_dbm.c)
+ * - "log": an append-only, checksummed record log with a shared in-memory
+ *   index and background compaction (user_store_log.c)
  *
- * Data Storage:
- * - Keys: User IDs stored as strings
- * - Values: Binary serialized user_obj structures
+ * Username Filter:
+ * - A persisted Bloom filter over every stored username sits in front of the
+ *   store. A name the filter has never seen is answered without touching the
+ *   store, which is the common case for ACC_CREATE.
+ * - The filter cannot forget names, so removed users only cost a wasted
+ *   probe. It is rebuilt from a full scan when it is missing or was not
+ *   closed cleanly.
+ *
+ * Replication:
+ * - add_user and remove_user journal each change for standbys
+ *   (replication.c). A standby applies the primary's changes with apply_user
+ *   and apply_user_removal, which keep the filter and ids in step but are not
+ *   journaled again.
+ *
+ * User IDs:
+ * - Allocated by id_alloc.c from a persisted counter, leased to each process
+ *   in blocks. Ids of removed users are reused only once the counter runs out.
  *
  * Dependencies:
  * - GDBM/NDBM library
@@ -25,56 +41,116 @@
  ******************************************************************************/
 
 #include "../include/user_db.h"
-#include <fcntl.h>
+#include "../include/bloom.h"
+#include "../include/id_alloc.h"
+#include "../include/mailbox.h"
+#include "../include/replication.h"
+#include "../include/resume.h"
+#include "../include/trace.h"
+#include "../include/user_store.h"
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-
-#ifdef __APPLE__
-    #include <ndbm.h>
-typedef size_t datum_size;
-#elif defined(__FreeBSD__)
-    #include <gdbm.h>
-typedef int datum_size;
-#else
-    /* Assume Linux/Ubuntu; using gdbm_compat which provides an ndbm-like interface */
-    #include <ndbm.h>
-typedef int datum_size;
-#endif
+#include <time.h>
 
 /* Named constants */
-#define USER_DB_MODE 0644
-#define KEY_STR_SIZE 16
+#define USER_NAMES_BLOOM_BITS_LOG2 20 /* 16 bits per name at the full 16-bit id space */
+#define USER_NAMES_BLOOM_HASHES 7
+#define MSEC_PER_SEC 1000
+#define NSEC_PER_MSEC 1000000
+
+/* What a startup scan has to rebuild */
+typedef struct rebuild_ctx
+{
+    int names; /* username filter */
+    int ids;   /* free id bitmap */
+} rebuild_ctx;
 
-/* Prototypes for functions missing in header */
-void        list_all_users(void);
-void        close_user_list(void);
-static void safe_dbm_fetch(DBM *db, datum key, datum *result);
+static void visit_rebuild(const user_obj *user, void *ctx);
+static void visit_print(const user_obj *user, void *ctx);
 
-/*
- * Global DBM pointer for the user database.
- * This global variable is mutable because it is updated at runtime.
- * NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
- */
-static DBM *user_db = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+/* Backend selected by init_user_list */
+static const user_store *store = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
-/* Define a constant character array for the DB filename */
-static char user_db_filename[] = "user_db";    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const char user_names_bloom[] = "user_db_names.bloom";
+static const char user_ids_file[]    = "user_db.ids";
+
+/* Names that may be stored, shared with every child through the file mapping */
+static bloom user_names_filter = {NULL, NULL, 0};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 /* Function: init_user_list
-   Description: Initializes the DBM database for user management.
-                Opens the database for reading and writing; creates it if it does not exist.
+   Description: Opens the configured storage backend, creating the database if it
+                does not exist, and loads the username filter and id allocator,
+                rebuilding them from one scan of the store if needed.
    Returns: void */
-void init_user_list(void)
+void init_user_list(const user_db_config *config)
 {
-    user_db = dbm_open((char *)user_db_filename, O_RDWR | O_CREAT, USER_DB_MODE);
-    if(user_db == NULL)
+    struct timespec start;
+    struct timespec end;
+    rebuild_ctx     rebuild;
+    int             max_id;
+    int             scanned;
+
+    store = user_store_find(config->store);
+    if(store == NULL)
+    {
+        fprintf(stderr, "Unknown user store '%s'\n", config->store);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(store->open(config) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    max_id = store->max_id();
+    if(max_id == -1)
     {
-        perror("Failed to open DBM database");
         exit(EXIT_FAILURE);
     }
-    printf("DBM database '%s' opened successfully.\n", user_db_filename);
+
+    /* Both mapped before any fork so every child shares them */
+    rebuild.names = bloom_open(&user_names_filter, user_names_bloom, USER_NAMES_BLOOM_BITS_LOG2, USER_NAMES_BLOOM_HASHES);
+    rebuild.ids   = id_alloc_open(user_ids_file, (uint32_t)max_id);
+    if(rebuild.names == -1 || rebuild.ids == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    if(rebuild.ids)
+    {
+        id_alloc_reset_free();
+    }
+    if(rebuild.names || rebuild.ids)
+    {
+        scanned = store->scan(visit_rebuild, &rebuild);
+        if(scanned == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        printf("Rebuilt %s for %d users.\n", rebuild.names ? (rebuild.ids ? "username filter and free ids" : "username filter") : "free ids", scanned);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("User store '%s' opened in %ld ms.\n", store->name, (long)(end.tv_sec - start.tv_sec) * MSEC_PER_SEC + (end.tv_nsec - start.tv_nsec) / NSEC_PER_MSEC);
+}
+
+/* Function: allocate_user_id
+   Description: Hands out an unused user id.
+   Returns: The new id, or -1 once every id the protocol's 16-bit sender_id can carry is in use */
+int allocate_user_id(void)
+{
+    return id_alloc_take();
+}
+
+/* Function: release_user_ids
+   Description: Returns the ids this process leased but did not use. Called by
+                each client process before it exits.
+   Returns: void */
+void release_user_ids(void)
+{
+    id_alloc_release_lease();
 }
 
 /* Function: new_user
@@ -94,139 +170,223 @@ user_obj *new_user(void)
 }
 
 /* Function: add_user
-   Description: Adds a user object to the DBM database.
-                Uses the user's id as a key (converted to a string) and stores the binary data.
-   Returns: 0 on success, -1 on failure */
+   Description: Adds a user object with a freshly allocated id to the store.
+                The store claims the username atomically with the insert, so two
+                processes creating the same name cannot both succeed.
+   Returns: 0 on success, USER_DB_NAME_TAKEN if the username is in use, -1 on failure */
 int add_user(user_obj *user)
 {
-    datum key;
-    datum data;
-    char  key_str[KEY_STR_SIZE];
+    int result;
 
-    /* Create a key string based on the user's ID */
-    sprintf(key_str, "%d", user->id);
-    key.dptr  = key_str;
-    key.dsize = (datum_size)(strlen(key_str) + 1);
-
-    /* Prepare the data as the binary representation of the user_obj */
-    data.dptr  = (char *)user;
-    data.dsize = sizeof(user_obj);
-
-    if(dbm_store(user_db, key, data, DBM_REPLACE) != 0)
+    TRACE2(db_start, TRACE_DB_ADD, user->id);
+    /* Set before the name becomes visible so a lookup never misses a stored name */
+    bloom_add(&user_names_filter, user->username, strnlen(user->username, USERNAME_MAX_LEN));
+    result = store->insert(user);
+    TRACE2(db_done, TRACE_DB_ADD, result);
+    if(result == 0)
     {
-        perror("dbm_store failed");
-        return -1;
+        replication_journal(REPL_PUT, user);
+        printf("User added with ID: %d\n", user->id);
     }
-    printf("User added with ID: %d\n", user->id);
-    return 0;
+    else
+    {
+        // The id was allocated for this account and nothing else refers to it
+        id_alloc_free((uint32_t)user->id);
+    }
+    return result;
 }
 
 /* Function: remove_user
-   Description: Removes a user from the DBM database by user ID.
+   Description: Removes a user from the store by user ID.
    Returns: void */
 void remove_user(int user_id)
 {
-    datum key;
-    char  key_str[KEY_STR_SIZE];
-
-    sprintf(key_str, "%d", user_id);
-    key.dptr  = key_str;
-    key.dsize = (datum_size)(strlen(key_str) + 1);
-
-    if(dbm_delete(user_db, key) != 0)
+    if(store->remove(user_id) != 0)
     {
         printf("User with ID %d not found or deletion failed\n", user_id);
     }
     else
     {
+        user_obj removed;
+
+        memset(&removed, 0, sizeof(removed));
+        removed.id = user_id;
+        replication_journal(REPL_DEL, &removed);
+        resume_revoke((uint16_t)user_id);
+        mailbox_discard((uint16_t)user_id);
+        id_alloc_free((uint32_t)user_id);
         printf("Removed user with ID: %d\n", user_id);
     }
 }
 
+/* Function: apply_user
+   Description: Stores a user as the replication primary has it, replacing any
+                account with the same id or username. Changes applied here are
+                not journaled.
+   Returns: 0 on success, -1 on failure */
+int apply_user(const user_obj *user)
+{
+    user_obj existing;
+
+    if(store->find(user->id, &existing) == 1)
+    {
+        store->remove(user->id);
+    }
+    if(store->find_by_name(user->username, &existing) == 1)
+    {
+        // The primary reused the name after removing an account we have not heard about
+        apply_user_removal(existing.id);
+    }
+    bloom_add(&user_names_filter, user->username, strnlen(user->username, USERNAME_MAX_LEN));
+    if(store->insert(user) != 0)
+    {
+        return -1;
+    }
+    id_alloc_claim((uint32_t)user->id);
+    return 0;
+}
+
+/* Function: apply_user_removal
+   Description: Removes a user the replication primary removed. A user that is
+                already gone is not an error: replay after a restart repeats changes.
+   Returns: void */
+void apply_user_removal(int user_id)
+{
+    if(store->remove(user_id) == 0)
+    {
+        resume_revoke((uint16_t)user_id);
+        mailbox_discard((uint16_t)user_id);
+        id_alloc_free((uint32_t)user_id);
+    }
+}
+
 /* Function: find_user
-   Description: Finds a user in the DBM database by their user ID.
+   Description: Finds a user in the store by their user ID.
                 Returns a dynamically allocated copy of the user_obj if found; otherwise, NULL.
                 The caller is responsible for freeing the returned memory.
    Returns: user_obj * */
 user_obj *find_user(int user_id)
 {
-    datum     key;
-    datum     data;
-    char      key_str[KEY_STR_SIZE];
     user_obj *user;
+    int       found;
+
+    TRACE2(db_start, TRACE_DB_FIND, user_id);
+    user = new_user();
+    if(user == NULL)
+    {
+        TRACE2(db_done, TRACE_DB_FIND, -1);
+        return NULL;
+    }
+    found = store->find(user_id, user);
+    TRACE2(db_done, TRACE_DB_FIND, found);
+    if(found != 1)
+    {
+        free(user);
+        return NULL;
+    }
+    return user;
+}
 
-    sprintf(key_str, "%d", user_id);
-    key.dptr  = key_str;
-    key.dsize = (datum_size)(strlen(key_str) + 1);
+/* Function: find_user_by_name
+   Description: Finds a user by username. Names the Bloom filter has never seen are
+                rejected without touching the store.
+                The caller is responsible for freeing the returned memory.
+   Returns: user_obj *, or NULL if no user has that name */
+user_obj *find_user_by_name(const char *username)
+{
+    user_obj *user;
+    int       found;
 
-    safe_dbm_fetch(user_db, key, &data);
-    if(data.dptr == NULL)
+    TRACE2(db_start, TRACE_DB_FIND_BY_NAME, -1);
+    if(!bloom_may_contain(&user_names_filter, username, strnlen(username, USERNAME_MAX_LEN)))
     {
+        TRACE2(db_done, TRACE_DB_FIND_BY_NAME, 0);
         return NULL;
     }
-    user = (user_obj *)malloc(sizeof(user_obj));
+
+    user = new_user();
     if(user == NULL)
     {
-        perror("Failed to allocate memory for user fetch");
+        TRACE2(db_done, TRACE_DB_FIND_BY_NAME, -1);
+        return NULL;
+    }
+    found = store->find_by_name(username, user);
+    TRACE2(db_done, TRACE_DB_FIND_BY_NAME, found);
+    if(found != 1)
+    {
+        free(user);
         return NULL;
     }
-    memcpy(user, data.dptr, sizeof(user_obj));
     return user;
 }
 
 /* Function: list_all_users
-   Description: Lists all users stored in the DBM database.
+   Description: Lists all users in the store.
                 Used to support user list queries and server feedback.
    Returns: void */
 void list_all_users(void)
 {
-    datum key;
-    datum data;
-    /* Temporary user object */
-    user_obj temp_user;
+    printf("Listing all users in %s store:\n", store->name);
+    store->scan(visit_print, NULL);
+}
+
+/* Function: scan_users
+   Description: Calls visit with every stored user, for replication snapshots.
+   Returns: The number of users visited, or -1 on failure */
+int scan_users(user_visit_fn visit, void *ctx)
+{
+    return store->scan(visit, ctx);
+}
 
-    printf("Listing all users in DBM:\n");
-    key = dbm_firstkey(user_db);
-    while(key.dptr != NULL)
+/* Function: close_user_list
+   Description: Closes the store and flushes the username filter and id allocator.
+   Returns: void */
+void close_user_list(void)
+{
+    bloom_close(&user_names_filter);
+    id_alloc_close();
+    if(store != NULL)
     {
-        safe_dbm_fetch(user_db, key, &data);
-        if(data.dptr != NULL)
+        store->close();
+        store = NULL;
+        printf("User store closed.\n");
+    }
+}
+
+/* Function: user_store_find
+   Description: Looks a storage backend up by the name given on the command line.
+   Returns: The backend, or NULL if there is none by that name */
+const user_store *user_store_find(const char *name)
+{
+    static const user_store *const stores[] = {&user_store_dbm, &user_store_log};
+
+    for(size_t i = 0; i < sizeof(stores) / sizeof(stores[0]); i++)
+    {
+        if(strcmp(stores[i]->name, name) == 0)
         {
-            memcpy(&temp_user, data.dptr, sizeof(user_obj));
-            /* Print only the user ID as user_obj currently lacks a 'username' field */
-            printf("User ID: %d\n", temp_user.id);
+            return stores[i];
         }
-        key = dbm_nextkey(user_db);
     }
+    return NULL;
 }
 
-/* Function: close_user_list
-   Description: Closes the DBM database.
-   Returns: void */
-void close_user_list(void)
+/* Scan visitors */
+static void visit_rebuild(const user_obj *user, void *ctx)
 {
-    if(user_db != NULL)
+    const rebuild_ctx *rebuild = (const rebuild_ctx *)ctx;
+
+    if(rebuild->names)
+    {
+        bloom_add(&user_names_filter, user->username, strnlen(user->username, USERNAME_MAX_LEN));
+    }
+    if(rebuild->ids)
     {
-        dbm_close(user_db);
-        user_db = NULL;
-        printf("DBM database closed.\n");
+        id_alloc_mark_used((uint32_t)user->id);
     }
 }
 
-/* Helper function: safe_dbm_fetch
-   Description: Wraps dbm_fetch to avoid aggregate return issues.
-   Parameters:
-       db     - the DBM pointer
-       key    - the key datum to fetch
-       result - pointer to a datum that will be populated with the result
-   Returns: void */
-static void safe_dbm_fetch(DBM *db, datum key, datum *result)
-{
-    datum temp;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Waggregate-return"
-    temp = dbm_fetch(db, key);
-#pragma GCC diagnostic pop
-    result->dptr  = temp.dptr;
-    result->dsize = temp.dsize;
+static void visit_print(const user_obj *user, void *ctx)
+{
+    (void)ctx;
+    printf("User ID: %d, username: %s\n", user->id, user->username);
 }
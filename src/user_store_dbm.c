@@ -0,0 +1,896 @@
+/*******************************************************************************
+ * DBM User Store
+ *
+ * Stores users through the ndbm interface: GDBM (via gdbm_compat) on
+ * Linux/FreeBSD and NDBM on macOS, selected by conditional compilation.
+ *
+ * Data Storage:
+ * - Records: user IDs stored as strings -> binary serialized user_obj
+ *   structures (id, username, salt and PBKDF2 password hash)
+ * - Names: username -> user ID, so logins resolve a name with one hash lookup
+ *   instead of a scan. Rebuilt from the records when every name file is
+ *   empty, which covers databases written before the index existed.
+ *
+ * Sharding:
+ * - The store is split into N shards (-S), each with its own record file,
+ *   name file and lock. A record lives in the shard picked by a hash of its
+ *   user ID, a name entry in the shard picked by a hash of the name, so
+ *   logins and account creations for different users rarely share a lock.
+ * - With one shard the files keep their historical names (user_db,
+ *   user_db_names, user_db.lock). With more they are suffixed ".<i>of<n>".
+ * - The count in use is kept in user_db.shards. Starting with a different
+ *   count rebalances every record into the new layout before serving, then
+ *   removes the old files. Change it with a full restart, not a hot upgrade:
+ *   the old server would keep writing to the old layout. Every server holds
+ *   a shared lock on user_db.shards.lock for as long as it or any of its
+ *   processes runs, and a server that cannot have it exclusively refuses to
+ *   start with a different count.
+ *
+ * Concurrency:
+ * - Every client is served by its own forked process, so no DBM handle is kept
+ *   open across fork; a handle inherited from the parent caches stale buckets
+ *   and never sees records written by a sibling. Each operation opens the
+ *   shards it needs under flock on their lock files instead: shared for
+ *   lookups, exclusive for writes.
+ * - An insert holds its name shard and record shard together, locked in
+ *   ascending shard order, so two inserts can never deadlock. Nothing else
+ *   holds more than one shard at a time.
+ * - The library gives no control over fsync; writes reach the disk when the
+ *   handle is closed at the end of each operation.
+ ******************************************************************************/
+
+#include "../include/user_store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+    #include <ndbm.h>
+typedef size_t datum_size;
+#elif defined(__FreeBSD__)
+    #include <gdbm.h>
+typedef int datum_size;
+#else
+    /* Assume Linux/Ubuntu; using gdbm_compat which provides an ndbm-like interface */
+    #include <ndbm.h>
+typedef int datum_size;
+#endif
+
+/* Named constants */
+#define USER_DB_MODE 0644
+#define KEY_STR_SIZE 16
+#define SHARD_NAME_LEN 64
+#define SHARD_COUNT_LEN 16
+#define SHARDS_MAX 256
+#define SHARD_RECORDS 1
+#define SHARD_NAMES 2
+#define ID_HASH_MULTIPLIER 2654435761U /* Knuth's multiplicative hash */
+#define FNV32_OFFSET_BASIS 0x811c9dc5U
+#define FNV32_PRIME 0x01000193U
+#define MSEC_PER_SEC 1000
+#define NSEC_PER_MSEC 1000000
+#define BASE_TEN 10
+
+/* Files making up one shard */
+typedef struct dbm_shard
+{
+    char records[SHARD_NAME_LEN];
+    char names[SHARD_NAME_LEN];
+    char lock[SHARD_NAME_LEN];
+} dbm_shard;
+
+/* The shard files an operation opened, together with the lock that guards them */
+typedef struct shard_handle
+{
+    DBM *records;
+    DBM *names;
+    int  lock_fd;
+} shard_handle;
+
+/* Target layout handed to the copying visitors */
+typedef struct rebalance_ctx
+{
+    const dbm_shard *layout;
+    unsigned int     count;
+    int              failed;
+} rebalance_ctx;
+
+static int        dbm_store_open(const user_db_config *config);
+static void       dbm_store_close(void);
+static int        dbm_store_insert(const user_obj *user);
+static int        dbm_store_remove(int user_id);
+static int        dbm_store_find(int user_id, user_obj *user);
+static int        dbm_store_find_by_name(const char *username, user_obj *user);
+static int        dbm_store_scan(user_visit_fn visit, void *ctx);
+static int        dbm_store_max_id(void);
+static void       visit_max_id(const user_obj *user, void *ctx);
+static dbm_shard *shard_layout(unsigned int count);
+static unsigned   id_shard(int user_id, unsigned int count);
+static unsigned   name_shard(const char *username, unsigned int count);
+static int        shard_open(const dbm_shard *shard, int lock_op, int files, shard_handle *handle);
+static void       shard_close(shard_handle *handle);
+static int        scan_layout(const dbm_shard *layout, unsigned int count, user_visit_fn visit, void *ctx);
+static unsigned   read_shard_count(void);
+static int        write_shard_count(unsigned int count);
+static int        rebalance(unsigned int from, unsigned int to);
+static int        copy_user(const dbm_shard *layout, unsigned int count, const user_obj *user);
+static void       visit_copy_user(const user_obj *user, void *ctx);
+static void       remove_layout(const dbm_shard *layout, unsigned int count);
+static void       remove_dbm_files(const char *name);
+static int        names_missing(void);
+static int        rebuild_name_index(void);
+static void       visit_index_name(const user_obj *user, void *ctx);
+static void       safe_dbm_fetch(DBM *db, datum key, datum *result);
+static void       safe_dbm_firstkey(DBM *db, datum *result);
+static void       safe_dbm_nextkey(DBM *db, datum *result);
+static void       id_key(int user_id, char key_str[KEY_STR_SIZE], datum *key);
+static void       name_key(const char *username, datum *key);
+
+const user_store user_store_dbm = {
+    "dbm", dbm_store_open, dbm_store_close, dbm_store_insert, dbm_store_remove, dbm_store_find, dbm_store_find_by_name, dbm_store_scan, dbm_store_max_id,
+};
+
+static const char user_db_filename[]     = "user_db";
+static const char user_names_filename[]  = "user_db_names";
+static const char user_shards_filename[] = "user_db.shards";
+static const char user_servers_filename[] = "user_db.shards.lock";
+
+/* Set before the first fork and only read afterwards */
+static dbm_shard *shards      = NULL;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned   shard_count = 0;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int        servers_fd  = -1;      // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Settles the shard layout, rebalancing into it if the count changed, and indexes any unnamed users */
+static int dbm_store_open(const user_db_config *config)
+{
+    unsigned int previous;
+    int          rebuilt;
+    int          alone;
+
+    if(config->shards == 0 || config->shards > SHARDS_MAX)
+    {
+        fprintf(stderr, "Shard count must be between 1 and %d\n", SHARDS_MAX);
+        return -1;
+    }
+
+    /* Held shared by this server and every process it forks, so it is only free once none of them runs */
+    servers_fd = open(user_servers_filename, O_RDWR | O_CREAT | O_CLOEXEC, USER_DB_MODE);
+    if(servers_fd == -1)
+    {
+        perror("Failed to open store lock");
+        return -1;
+    }
+    alone = flock(servers_fd, LOCK_EX | LOCK_NB) == 0;
+    if(!alone && (errno != EWOULDBLOCK || flock(servers_fd, LOCK_SH) == -1))
+    {
+        perror("Failed to lock store");
+        return -1;
+    }
+
+    previous = read_shard_count();
+    if(previous == 0)
+    {
+        return -1;
+    }
+    if(previous != config->shards && !alone)
+    {
+        fprintf(stderr, "Another server is using the store with %u shards; stop it before changing to %u\n", previous, config->shards);
+        return -1;
+    }
+    if(previous != config->shards && rebalance(previous, config->shards) == -1)
+    {
+        return -1;
+    }
+    if(alone && flock(servers_fd, LOCK_SH) == -1)
+    {
+        perror("Failed to lock store");
+        return -1;
+    }
+
+    shard_count = config->shards;
+    shards      = shard_layout(shard_count);
+    if(shards == NULL)
+    {
+        return -1;
+    }
+
+    rebuilt = names_missing();
+    if(rebuilt == 1)
+    {
+        rebuilt = rebuild_name_index();
+        printf("Rebuilt username index for %d users.\n", rebuilt);
+    }
+    printf("DBM store using %u shards.\n", shard_count);
+    return rebuilt == -1 ? -1 : 0;
+}
+
+/* Nothing stays open between operations but the lock marking this server as running */
+static void dbm_store_close(void)
+{
+    if(servers_fd >= 0)
+    {
+        close(servers_fd);
+        servers_fd = -1;
+    }
+    free(shards);
+    shards      = NULL;
+    shard_count = 0;
+}
+
+/* Claims the name and stores the record while holding both shards, so two
+   processes creating the same name cannot both succeed */
+static int dbm_store_insert(const user_obj *user)
+{
+    shard_handle held[2];
+    DBM         *names;
+    DBM         *records;
+    datum        key;
+    datum        data;
+    datum        name;
+    datum        id;
+    char         key_str[KEY_STR_SIZE];
+    unsigned     ns;
+    unsigned     rs;
+    int          nheld;
+    int          result;
+
+    id_key(user->id, key_str, &key);
+
+    /* Prepare the data as the binary representation of the user_obj */
+    data.dptr  = (char *)user;
+    data.dsize = sizeof(user_obj);
+
+    name_key(user->username, &name);
+    id.dptr  = (char *)&user->id;
+    id.dsize = sizeof(user->id);
+
+    ns = name_shard(user->username, shard_count);
+    rs = id_shard(user->id, shard_count);
+
+    /* Lock in ascending shard order */
+    if(ns == rs)
+    {
+        if(shard_open(&shards[ns], LOCK_EX, SHARD_NAMES | SHARD_RECORDS, &held[0]) == -1)
+        {
+            return -1;
+        }
+        names   = held[0].names;
+        records = held[0].records;
+        nheld   = 1;
+    }
+    else
+    {
+        unsigned first  = ns < rs ? ns : rs;
+        unsigned second = ns < rs ? rs : ns;
+
+        if(shard_open(&shards[first], LOCK_EX, first == ns ? SHARD_NAMES : SHARD_RECORDS, &held[0]) == -1)
+        {
+            return -1;
+        }
+        if(shard_open(&shards[second], LOCK_EX, second == ns ? SHARD_NAMES : SHARD_RECORDS, &held[1]) == -1)
+        {
+            shard_close(&held[0]);
+            return -1;
+        }
+        names   = first == ns ? held[0].names : held[1].names;
+        records = first == rs ? held[0].records : held[1].records;
+        nheld   = 2;
+    }
+
+    result = dbm_store(names, name, id, DBM_INSERT);
+    if(result == 0)
+    {
+        result = dbm_store(records, key, data, DBM_REPLACE);
+        if(result != 0)
+        {
+            dbm_delete(names, name);
+        }
+    }
+    while(nheld > 0)
+    {
+        shard_close(&held[--nheld]);
+    }
+
+    if(result == 1)
+    {
+        return USER_DB_NAME_TAKEN;
+    }
+    if(result != 0)
+    {
+        perror("dbm_store failed");
+        return -1;
+    }
+    return 0;
+}
+
+/* Deletes the record, then the name entry unless the name has since been
+   claimed by another id. The shards are taken one after the other. */
+static int dbm_store_remove(int user_id)
+{
+    shard_handle handle;
+    datum        key;
+    datum        data;
+    datum        name;
+    datum        indexed;
+    user_obj     temp_user;
+    int          indexed_id;
+    char         key_str[KEY_STR_SIZE];
+    int          found;
+    int          result;
+
+    id_key(user_id, key_str, &key);
+
+    if(shard_open(&shards[id_shard(user_id, shard_count)], LOCK_EX, SHARD_RECORDS, &handle) == -1)
+    {
+        return -1;
+    }
+    safe_dbm_fetch(handle.records, key, &data);
+    found = data.dptr != NULL;
+    if(found)
+    {
+        memcpy(&temp_user, data.dptr, sizeof(user_obj));
+    }
+    result = dbm_delete(handle.records, key);
+    shard_close(&handle);
+
+    if(result != 0 || !found)
+    {
+        return -1;
+    }
+
+    name_key(temp_user.username, &name);
+    if(shard_open(&shards[name_shard(temp_user.username, shard_count)], LOCK_EX, SHARD_NAMES, &handle) == -1)
+    {
+        return -1;
+    }
+    safe_dbm_fetch(handle.names, name, &indexed);
+    if(indexed.dptr != NULL && (size_t)indexed.dsize == sizeof(indexed_id))
+    {
+        memcpy(&indexed_id, indexed.dptr, sizeof(indexed_id));
+        if(indexed_id == user_id)
+        {
+            dbm_delete(handle.names, name);
+        }
+    }
+    shard_close(&handle);
+    return 0;
+}
+
+static int dbm_store_find(int user_id, user_obj *user)
+{
+    shard_handle handle;
+    datum        key;
+    datum        data;
+    char         key_str[KEY_STR_SIZE];
+
+    id_key(user_id, key_str, &key);
+
+    if(shard_open(&shards[id_shard(user_id, shard_count)], LOCK_SH, SHARD_RECORDS, &handle) == -1)
+    {
+        return -1;
+    }
+    safe_dbm_fetch(handle.records, key, &data);
+    if(data.dptr != NULL)
+    {
+        memcpy(user, data.dptr, sizeof(user_obj));
+    }
+    shard_close(&handle);
+    return data.dptr != NULL;
+}
+
+/* One index lookup in the name's shard, then one record fetch in the id's shard */
+static int dbm_store_find_by_name(const char *username, user_obj *user)
+{
+    shard_handle handle;
+    datum        name;
+    datum        indexed;
+    int          user_id;
+
+    name_key(username, &name);
+
+    if(shard_open(&shards[name_shard(username, shard_count)], LOCK_SH, SHARD_NAMES, &handle) == -1)
+    {
+        return -1;
+    }
+    safe_dbm_fetch(handle.names, name, &indexed);
+    user_id = -1;
+    if(indexed.dptr != NULL && (size_t)indexed.dsize == sizeof(user_id))
+    {
+        memcpy(&user_id, indexed.dptr, sizeof(user_id));
+    }
+    shard_close(&handle);
+
+    if(user_id < 0)
+    {
+        return 0;
+    }
+    return dbm_store_find(user_id, user);
+}
+
+static int dbm_store_scan(user_visit_fn visit, void *ctx)
+{
+    return scan_layout(shards, shard_count, visit, ctx);
+}
+
+/* The ids are only reachable through a full scan */
+static int dbm_store_max_id(void)
+{
+    int max_id = 0;
+
+    if(dbm_store_scan(visit_max_id, &max_id) == -1)
+    {
+        return -1;
+    }
+    return max_id;
+}
+
+static void visit_max_id(const user_obj *user, void *ctx)
+{
+    int *max_id = (int *)ctx;
+    if(user->id > *max_id)
+    {
+        *max_id = user->id;
+    }
+}
+
+/* Helper function: shard_layout
+   Description: Names the files of every shard for the given count.
+   Returns: A calloc'd array of count shards, or NULL on failure */
+static dbm_shard *shard_layout(unsigned int count)
+{
+    dbm_shard *layout;
+
+    layout = (dbm_shard *)calloc(count, sizeof(dbm_shard));
+    if(layout == NULL)
+    {
+        perror("Failed to allocate DBM shards");
+        return NULL;
+    }
+
+    for(unsigned int i = 0; i < count; i++)
+    {
+        if(count == 1)
+        {
+            snprintf(layout[i].records, SHARD_NAME_LEN, "%s", user_db_filename);
+            snprintf(layout[i].names, SHARD_NAME_LEN, "%s", user_names_filename);
+            snprintf(layout[i].lock, SHARD_NAME_LEN, "%s.lock", user_db_filename);
+        }
+        else
+        {
+            snprintf(layout[i].records, SHARD_NAME_LEN, "%s.%uof%u", user_db_filename, i, count);
+            snprintf(layout[i].names, SHARD_NAME_LEN, "%s.%uof%u", user_names_filename, i, count);
+            snprintf(layout[i].lock, SHARD_NAME_LEN, "%s.%uof%u.lock", user_db_filename, i, count);
+        }
+    }
+    return layout;
+}
+
+/* Sequential ids would otherwise stride through the shards in lockstep */
+static unsigned id_shard(int user_id, unsigned int count)
+{
+    return ((uint32_t)user_id * ID_HASH_MULTIPLIER) % count;
+}
+
+/* FNV-1a over the name */
+static unsigned name_shard(const char *username, unsigned int count)
+{
+    uint32_t hash = FNV32_OFFSET_BASIS;
+    size_t   len  = strnlen(username, USERNAME_MAX_LEN);
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)username[i];
+        hash *= FNV32_PRIME;
+    }
+    return hash % count;
+}
+
+/* Helper function: shard_open
+   Description: Takes the shard's lock (LOCK_SH or LOCK_EX) and opens private
+                handles to the requested files (SHARD_RECORDS, SHARD_NAMES) under it.
+   Returns: 0 on success, -1 on failure */
+static int shard_open(const dbm_shard *shard, int lock_op, int files, shard_handle *handle)
+{
+    handle->records = NULL;
+    handle->names   = NULL;
+
+    handle->lock_fd = open(shard->lock, O_RDWR | O_CREAT | O_CLOEXEC, USER_DB_MODE);
+    if(handle->lock_fd == -1)
+    {
+        perror("Failed to open DBM lock file");
+        return -1;
+    }
+    if(flock(handle->lock_fd, lock_op) == -1)
+    {
+        perror("Failed to lock DBM database");
+        close(handle->lock_fd);
+        return -1;
+    }
+
+    if(files & SHARD_RECORDS)
+    {
+        handle->records = dbm_open((char *)shard->records, O_RDWR | O_CREAT, USER_DB_MODE);
+        if(handle->records == NULL)
+        {
+            perror("Failed to open DBM database");
+            shard_close(handle);
+            return -1;
+        }
+    }
+    if(files & SHARD_NAMES)
+    {
+        handle->names = dbm_open((char *)shard->names, O_RDWR | O_CREAT, USER_DB_MODE);
+        if(handle->names == NULL)
+        {
+            perror("Failed to open DBM username index");
+            shard_close(handle);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Helper function: shard_close
+   Description: Closes the handles, flushing writes, then drops the lock.
+   Returns: void */
+static void shard_close(shard_handle *handle)
+{
+    if(handle->names != NULL)
+    {
+        dbm_close(handle->names);
+    }
+    if(handle->records != NULL)
+    {
+        dbm_close(handle->records);
+    }
+    close(handle->lock_fd);
+}
+
+/* Helper function: scan_layout
+   Description: Visits every record, one shard at a time.
+   Returns: The number of users visited, or -1 on failure */
+static int scan_layout(const dbm_shard *layout, unsigned int count, user_visit_fn visit, void *ctx)
+{
+    shard_handle handle;
+    datum        key;
+    datum        data;
+    /* Temporary user object */
+    user_obj temp_user;
+    int      visited;
+
+    visited = 0;
+    for(unsigned int i = 0; i < count; i++)
+    {
+        if(shard_open(&layout[i], LOCK_SH, SHARD_RECORDS, &handle) == -1)
+        {
+            return -1;
+        }
+        safe_dbm_firstkey(handle.records, &key);
+        while(key.dptr != NULL)
+        {
+            safe_dbm_fetch(handle.records, key, &data);
+            if(data.dptr != NULL)
+            {
+                memcpy(&temp_user, data.dptr, sizeof(user_obj));
+                visit(&temp_user, ctx);
+                visited++;
+            }
+            safe_dbm_nextkey(handle.records, &key);
+        }
+        shard_close(&handle);
+    }
+    return visited;
+}
+
+/* Helper function: read_shard_count
+   Description: Reads the shard count the files on disk were written with.
+   Returns: The count, 1 if it was never recorded, or 0 on failure */
+static unsigned read_shard_count(void)
+{
+    char          buf[SHARD_COUNT_LEN];
+    FILE         *file;
+    unsigned long count;
+
+    file = fopen(user_shards_filename, "r");
+    if(file == NULL)
+    {
+        return 1;
+    }
+    if(fgets(buf, sizeof(buf), file) == NULL)
+    {
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    count = strtoul(buf, NULL, BASE_TEN);
+    if(count == 0 || count > SHARDS_MAX)
+    {
+        fprintf(stderr, "%s holds an invalid shard count\n", user_shards_filename);
+        return 0;
+    }
+    return (unsigned)count;
+}
+
+/* Helper function: write_shard_count
+   Description: Records the shard count, replacing the file atomically.
+   Returns: 0 on success, -1 on failure */
+static int write_shard_count(unsigned int count)
+{
+    char  tmp[SHARD_NAME_LEN];
+    FILE *file;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", user_shards_filename);
+    file = fopen(tmp, "w");
+    if(file == NULL)
+    {
+        perror("Failed to write shard count");
+        return -1;
+    }
+    fprintf(file, "%u\n", count);
+    if(fflush(file) != 0 || fsync(fileno(file)) == -1)
+    {
+        perror("Failed to write shard count");
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    if(rename(tmp, user_shards_filename) == -1)
+    {
+        perror("Failed to write shard count");
+        return -1;
+    }
+    return 0;
+}
+
+static void visit_copy_user(const user_obj *user, void *ctx)
+{
+    rebalance_ctx *target = (rebalance_ctx *)ctx;
+
+    if(!target->failed && copy_user(target->layout, target->count, user) == -1)
+    {
+        target->failed = 1;
+    }
+}
+
+/* Helper function: rebalance
+   Description: Copies every record and name entry from the layout with `from`
+                shards into a fresh layout with `to` shards. The recorded count
+                only changes once the copy is complete, so a crash part way
+                leaves the old layout in charge and the copy is redone.
+   Returns: 0 on success, -1 on failure */
+static int rebalance(unsigned int from, unsigned int to)
+{
+    struct timespec start;
+    struct timespec end;
+    rebalance_ctx   target;
+    dbm_shard      *old_layout;
+    dbm_shard      *new_layout;
+    int             moved;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    old_layout = shard_layout(from);
+    new_layout = shard_layout(to);
+    if(old_layout == NULL || new_layout == NULL)
+    {
+        free(old_layout);
+        free(new_layout);
+        return -1;
+    }
+
+    /* Leftovers of an interrupted rebalance */
+    remove_layout(new_layout, to);
+
+    target.layout = new_layout;
+    target.count  = to;
+    target.failed = 0;
+    moved         = scan_layout(old_layout, from, visit_copy_user, &target);
+    if(moved == -1 || target.failed || write_shard_count(to) == -1)
+    {
+        fprintf(stderr, "Rebalancing from %u to %u shards failed, keeping %u\n", from, to, from);
+        free(old_layout);
+        free(new_layout);
+        return -1;
+    }
+    remove_layout(old_layout, from);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Rebalanced %d users from %u to %u shards in %ld ms.\n",
+           moved,
+           from,
+           to,
+           (long)(end.tv_sec - start.tv_sec) * MSEC_PER_SEC + (end.tv_nsec - start.tv_nsec) / NSEC_PER_MSEC);
+    free(old_layout);
+    free(new_layout);
+    return 0;
+}
+
+/* Helper function: copy_user
+   Description: Stores a record and its name entry in the given layout.
+   Returns: 0 on success, -1 on failure */
+static int copy_user(const dbm_shard *layout, unsigned int count, const user_obj *user)
+{
+    shard_handle handle;
+    datum        key;
+    datum        data;
+    datum        name;
+    datum        id;
+    char         key_str[KEY_STR_SIZE];
+    int          result;
+
+    id_key(user->id, key_str, &key);
+    data.dptr  = (char *)user;
+    data.dsize = sizeof(user_obj);
+    name_key(user->username, &name);
+    id.dptr  = (char *)&user->id;
+    id.dsize = sizeof(user->id);
+
+    if(shard_open(&layout[id_shard(user->id, count)], LOCK_EX, SHARD_RECORDS, &handle) == -1)
+    {
+        return -1;
+    }
+    result = dbm_store(handle.records, key, data, DBM_REPLACE);
+    shard_close(&handle);
+    if(result != 0)
+    {
+        return -1;
+    }
+
+    if(shard_open(&layout[name_shard(user->username, count)], LOCK_EX, SHARD_NAMES, &handle) == -1)
+    {
+        return -1;
+    }
+    result = dbm_store(handle.names, name, id, DBM_REPLACE);
+    shard_close(&handle);
+    return result == 0 ? 0 : -1;
+}
+
+/* Helper function: remove_layout
+   Description: Deletes every file of a layout.
+   Returns: void */
+static void remove_layout(const dbm_shard *layout, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++)
+    {
+        remove_dbm_files(layout[i].records);
+        remove_dbm_files(layout[i].names);
+        unlink(layout[i].lock);
+    }
+}
+
+/* The files the ndbm implementations create for a database name */
+static void remove_dbm_files(const char *name)
+{
+    static const char *const suffixes[] = {".dir", ".pag", ".db"};
+    char                     path[SHARD_NAME_LEN + SHARD_COUNT_LEN];
+
+    for(size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s%s", name, suffixes[i]);
+        unlink(path);
+    }
+}
+
+/* Helper function: names_missing
+   Description: Checks for records stored while every name file is empty.
+   Returns: 1 if the name index must be rebuilt, 0 if not, -1 on failure */
+static int names_missing(void)
+{
+    shard_handle handle;
+    datum        key;
+    int          have_records = 0;
+
+    for(unsigned int i = 0; i < shard_count; i++)
+    {
+        if(shard_open(&shards[i], LOCK_SH, SHARD_RECORDS | SHARD_NAMES, &handle) == -1)
+        {
+            return -1;
+        }
+        safe_dbm_firstkey(handle.names, &key);
+        if(key.dptr != NULL)
+        {
+            shard_close(&handle);
+            return 0;
+        }
+        safe_dbm_firstkey(handle.records, &key);
+        have_records |= key.dptr != NULL;
+        shard_close(&handle);
+    }
+    return have_records;
+}
+
+static void visit_index_name(const user_obj *user, void *ctx)
+{
+    int *failed = (int *)ctx;
+
+    if(!*failed && copy_user(shards, shard_count, user) == -1)
+    {
+        *failed = 1;
+    }
+}
+
+/* Helper function: rebuild_name_index
+   Description: Indexes every stored user by name. Runs before any fork.
+   Returns: The number of users indexed, or -1 on failure */
+static int rebuild_name_index(void)
+{
+    int failed = 0;
+    int count;
+
+    count = dbm_store_scan(visit_index_name, &failed);
+    if(failed)
+    {
+        perror("Failed to rebuild username index");
+        return -1;
+    }
+    return count;
+}
+
+/* Helper function: safe_dbm_fetch
+   Description: Wraps dbm_fetch to avoid aggregate return issues.
+   Parameters:
+       db     - the DBM pointer
+       key    - the key datum to fetch
+       result - pointer to a datum that will be populated with the result
+   Returns: void */
+static void safe_dbm_fetch(DBM *db, datum key, datum *result)
+{
+    datum temp;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    temp = dbm_fetch(db, key);
+#pragma GCC diagnostic pop
+    result->dptr  = temp.dptr;
+    result->dsize = temp.dsize;
+}
+
+/* Helper functions: safe_dbm_firstkey / safe_dbm_nextkey
+   Description: Wrap the key iterators to avoid aggregate return issues.
+   Returns: void */
+static void safe_dbm_firstkey(DBM *db, datum *result)
+{
+    datum temp;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    temp = dbm_firstkey(db);
+#pragma GCC diagnostic pop
+    result->dptr  = temp.dptr;
+    result->dsize = temp.dsize;
+}
+
+static void safe_dbm_nextkey(DBM *db, datum *result)
+{
+    datum temp;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Waggregate-return"
+    temp = dbm_nextkey(db);
+#pragma GCC diagnostic pop
+    result->dptr  = temp.dptr;
+    result->dsize = temp.dsize;
+}
+
+/* Helper function: id_key
+   Description: Builds the record key, the user's id as a terminated decimal string.
+   Returns: void */
+static void id_key(int user_id, char key_str[KEY_STR_SIZE], datum *key)
+{
+    snprintf(key_str, KEY_STR_SIZE, "%d", user_id);
+    key->dptr  = key_str;
+    key->dsize = (datum_size)(strlen(key_str) + 1);
+}
+
+/* Helper function: name_key
+   Description: Builds the username index key, the name without its terminator.
+   Returns: void */
+static void name_key(const char *username, datum *key)
+{
+    key->dptr  = (char *)username;
+    key->dsize = (datum_size)strnlen(username, USERNAME_MAX_LEN);
+}
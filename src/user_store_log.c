@@ -0,0 +1,1121 @@
+/*******************************************************************************
+ * Log-Structured User Store
+ *
+ * Stores users as an append-only log of checksummed records in user_db.log,
+ * with the index that locates them kept in memory.
+ *
+ * Data Storage:
+ * - A file header, then records: a fixed header (magic, type, payload length,
+ *   user id, CRC-32) followed by the payload. PUT carries the user_obj, DEL
+ *   carries nothing. Fields are in host byte order; the log is local state.
+ * - Writing a user appends a PUT and removing one appends a DEL, so no record
+ *   is ever rewritten in place. fsync after every append is optional (-F).
+ *
+ * Index:
+ * - One log offset per possible user id, plus an open addressing table of
+ *   username hash -> user id, kept in user_db.log.index and mapped MAP_SHARED
+ *   before any fork, so every child reads and updates the same copy.
+ * - The index remembers which file (inode) and how many bytes of it it has
+ *   applied. Whoever takes the lock and finds the file longer replays the new
+ *   records first, so appends by another server sharing the directory (during
+ *   a hot upgrade) are picked up too.
+ *
+ * Snapshots:
+ * - The index file is its own snapshot. The compactor checkpoints it every
+ *   LOG_CHECKPOINT_MS while it is changing, and the server does on close:
+ *   sync the pages, then set the clean flag. The first writer afterwards
+ *   clears the flag and syncs that page before changing anything.
+ * - At startup a clean index is used in place and only the log written after
+ *   its checkpoint is replayed. A dirty one is discarded and the whole log is
+ *   replayed, unless another server still maps it (the old generation during
+ *   a hot upgrade): that one is current, since it only changes under the lock.
+ * - Every server holds a shared flock on the index file until its last process
+ *   exits, so one that can lock it exclusively knows nobody else maps it. The
+ *   decision is made under the exclusive store lock, and a file in use is
+ *   never resized or cleared; one laid out by another build is unlinked, and
+ *   each server follows the log with its own.
+ *
+ * Crash Recovery:
+ * - Replay stops at the first record that is truncated or fails its checksum
+ *   and cuts the file there. Only the write that was in progress is lost.
+ *
+ * Compaction:
+ * - Superseded PUTs and all DELs are dead bytes. Once they outweigh the live
+ *   records, the writer rings a doorbell and a compactor process forked at
+ *   open copies the live records to a new file, syncs it and renames it over
+ *   the log. Other processes notice the new inode and reopen.
+ *
+ * Concurrency:
+ * - flock on user_db.log.lock, opened separately by every process: shared for
+ *   lookups, exclusive for appends, replay and compaction.
+ ******************************************************************************/
+
+#include "../include/user_store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LOG_FILE_MODE 0644
+#define LOG_MAGIC 0x474f4c55        /* "ULOG" */
+#define LOG_RECORD_MAGIC 0x52455355 /* "USER" */
+#define LOG_INDEX_MAGIC 0x58444955  /* "UIDX" */
+#define LOG_VERSION 1
+#define LOG_PUT 1
+#define LOG_DEL 2
+#define LOG_ID_SLOTS (UINT16_MAX + 1)
+#define LOG_NAME_SLOTS (2 * LOG_ID_SLOTS)
+#define LOG_NAME_EMPTY 0
+#define LOG_NAME_TOMBSTONE UINT32_MAX
+#define LOG_PUT_SIZE (sizeof(log_record) + sizeof(user_obj))
+#define LOG_COMPACT_MIN_BYTES (64 * 1024)
+#define LOG_COPY_RECORDS 512
+#define LOG_BELL_DRAIN 64
+#define LOG_CHECKPOINT_MS 30000
+#define CRC32_POLY 0xedb88320U
+#define CRC32_TABLE_SIZE 256
+#define FNV32_OFFSET_BASIS 0x811c9dc5U
+#define FNV32_PRIME 0x01000193U
+
+typedef struct log_file_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+} log_file_header;
+
+typedef struct log_record
+{
+    uint32_t magic;
+    uint16_t type;
+    uint16_t length;
+    uint32_t user_id;
+    uint32_t checksum; /* over type, length, user_id and the payload */
+} log_record;
+
+typedef struct log_name_slot
+{
+    uint32_t hash;
+    uint32_t id; /* user id + 1, or LOG_NAME_EMPTY / LOG_NAME_TOMBSTONE */
+} log_name_slot;
+
+/* Shared by every process; only changed under the exclusive lock */
+typedef struct log_index
+{
+    uint32_t         magic;
+    uint32_t         version;
+    _Atomic uint32_t clean;      /* set by a checkpoint, cleared before the next change */
+    ino_t            ino;        /* log file the index describes */
+    uint64_t         applied;    /* bytes of that file replayed into the index */
+    uint64_t         live_bytes; /* bytes of records still referenced */
+    uint64_t         compactions;
+    uint64_t         offsets[LOG_ID_SLOTS]; /* 0 when the id is unused */
+    log_name_slot    names[LOG_NAME_SLOTS];
+} log_index;
+
+static int      log_store_open(const user_db_config *config);
+static void     log_store_close(void);
+static int      log_store_insert(const user_obj *user);
+static int      log_store_remove(int user_id);
+static int      log_store_find(int user_id, user_obj *user);
+static int      log_store_find_by_name(const char *username, user_obj *user);
+static int      log_store_scan(user_visit_fn visit, void *ctx);
+static int      log_store_max_id(void);
+static int      log_index_map(void);
+static int      log_index_open(void);
+static void     log_mark_dirty(void);
+static void     log_checkpoint(void);
+static int      log_attach(void);
+static int      log_lock(int lock_op);
+static void     log_unlock(void);
+static int      log_catch_up(void);
+static int      log_replay(uint64_t from, uint64_t to);
+static void     log_apply(const log_record *rec, const uint8_t *payload, uint64_t offset);
+static int64_t  log_append(uint16_t type, uint32_t user_id, const void *payload, uint16_t length);
+static int      log_read_user(int fd, uint64_t offset, user_obj *user);
+static void     log_maybe_compact(void);
+static void     log_compactor_run(void);
+static int      log_compact(void);
+static int      name_lookup(const char *username, user_obj *user);
+static void     name_insert(uint32_t hash, uint32_t id);
+static void     name_remove(uint32_t hash, uint32_t id);
+static uint32_t name_hash(const char *username);
+static void     crc32_init(void);
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+static uint32_t record_checksum(const log_record *rec, const uint8_t *payload);
+
+const user_store user_store_log = {
+    "log", log_store_open, log_store_close, log_store_insert, log_store_remove, log_store_find, log_store_find_by_name, log_store_scan, log_store_max_id,
+};
+
+static const char log_path[]         = "user_db.log";
+static const char log_compact_path[] = "user_db.log.compact";
+static const char log_lock_path[]    = "user_db.log.lock";
+static const char log_index_path[]   = "user_db.log.index";
+
+/* Set before the first fork */
+static log_index *log_idx         = NULL;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int        log_index_fd    = -1;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int        log_sync        = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int        compact_bell[2] = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t      compactor_pid   = -1;          // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static uint32_t   crc32_table[CRC32_TABLE_SIZE];    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Per process: descriptors shared across fork would share their flock and file offset */
+static pid_t log_owner   = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int   log_fd      = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static ino_t log_fd_ino  = 0;     // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int   log_lock_fd = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/* Maps the shared index, brings it up to date with the log and starts the compactor */
+static int log_store_open(const user_db_config *config)
+{
+    uint64_t snapshot;
+    size_t   live;
+    pid_t    pid;
+
+    crc32_init();
+    log_sync = config->sync_writes;
+    if(config->shards > 1)
+    {
+        printf("The log store is not sharded; ignoring a shard count of %u.\n", config->shards);
+    }
+
+    if(log_index_map() == -1)
+    {
+        return -1;
+    }
+    snapshot = log_idx->applied;
+
+    if(log_lock(LOCK_EX) == -1)
+    {
+        return -1;
+    }
+    live = 0;
+    for(size_t id = 0; id < LOG_ID_SLOTS; id++)
+    {
+        live += log_idx->offsets[id] != 0;
+    }
+    printf("Loaded user log: %zu users, %llu of %llu bytes live, %llu bytes replayed after the snapshot.\n",
+           live,
+           (unsigned long long)log_idx->live_bytes,
+           (unsigned long long)log_idx->applied,
+           (unsigned long long)(log_idx->applied - snapshot));
+    log_unlock();
+
+    if(pipe(compact_bell) == -1)
+    {
+        perror("log_store_open::pipe");
+        return -1;
+    }
+    fcntl(compact_bell[1], F_SETFL, O_NONBLOCK);
+
+    fflush(stdout);
+    pid = fork();
+    if(pid == -1)
+    {
+        perror("log_store_open::fork");
+        return -1;
+    }
+    if(pid == 0)
+    {
+        log_compactor_run();
+        _exit(EXIT_SUCCESS);
+    }
+    compactor_pid = pid;
+
+    /* Only processes that write need the doorbell */
+    close(compact_bell[0]);
+    compact_bell[0] = -1;
+    return 0;
+}
+
+/* Stops the compactor and unmaps the index */
+static void log_store_close(void)
+{
+    if(compactor_pid > 0)
+    {
+        close(compact_bell[1]);
+        compact_bell[1] = -1;
+        kill(compactor_pid, SIGTERM);
+        while(waitpid(compactor_pid, NULL, 0) == -1 && errno == EINTR)
+        {
+        }
+        compactor_pid = -1;
+    }
+    if(log_idx != NULL)
+    {
+        log_checkpoint();
+        printf("User log closed after %llu compactions.\n", (unsigned long long)log_idx->compactions);
+        munmap(log_idx, sizeof(log_index));
+        log_idx = NULL;
+    }
+    if(log_index_fd >= 0)
+    {
+        close(log_index_fd);
+        log_index_fd = -1;
+    }
+    if(log_fd >= 0)
+    {
+        close(log_fd);
+        log_fd     = -1;
+        log_fd_ino = 0;
+    }
+    if(log_lock_fd >= 0)
+    {
+        close(log_lock_fd);
+        log_lock_fd = -1;
+    }
+    log_owner = 0;
+}
+
+static int log_store_insert(const user_obj *user)
+{
+    user_obj existing;
+    int64_t  offset;
+    int      result;
+
+    if(user->id < 0 || user->id >= LOG_ID_SLOTS)
+    {
+        return -1;
+    }
+    if(log_lock(LOCK_EX) == -1)
+    {
+        return -1;
+    }
+
+    result = name_lookup(user->username, &existing);
+    if(result == 1)
+    {
+        log_unlock();
+        return USER_DB_NAME_TAKEN;
+    }
+
+    offset = -1;
+    if(result == 0)
+    {
+        offset = log_append(LOG_PUT, (uint32_t)user->id, user, sizeof(user_obj));
+    }
+    log_maybe_compact();
+    log_unlock();
+    return offset < 0 ? -1 : 0;
+}
+
+static int log_store_remove(int user_id)
+{
+    int64_t offset;
+
+    if(user_id < 0 || user_id >= LOG_ID_SLOTS)
+    {
+        return -1;
+    }
+    if(log_lock(LOCK_EX) == -1)
+    {
+        return -1;
+    }
+
+    offset = -1;
+    if(log_idx->offsets[user_id] != 0)
+    {
+        offset = log_append(LOG_DEL, (uint32_t)user_id, NULL, 0);
+    }
+    log_maybe_compact();
+    log_unlock();
+    return offset < 0 ? -1 : 0;
+}
+
+static int log_store_find(int user_id, user_obj *user)
+{
+    int result;
+
+    if(user_id < 0 || user_id >= LOG_ID_SLOTS)
+    {
+        return 0;
+    }
+    if(log_lock(LOCK_SH) == -1)
+    {
+        return -1;
+    }
+
+    result = 0;
+    if(log_idx->offsets[user_id] != 0)
+    {
+        result = log_read_user(log_fd, log_idx->offsets[user_id], user) == 0 ? 1 : -1;
+    }
+    log_unlock();
+    return result;
+}
+
+static int log_store_find_by_name(const char *username, user_obj *user)
+{
+    int result;
+
+    if(log_lock(LOCK_SH) == -1)
+    {
+        return -1;
+    }
+    result = name_lookup(username, user);
+    log_unlock();
+    return result;
+}
+
+/* Visits users in id order */
+static int log_store_scan(user_visit_fn visit, void *ctx)
+{
+    user_obj user;
+    int      count;
+
+    if(log_lock(LOCK_SH) == -1)
+    {
+        return -1;
+    }
+
+    count = 0;
+    for(size_t id = 0; id < LOG_ID_SLOTS; id++)
+    {
+        if(log_idx->offsets[id] == 0)
+        {
+            continue;
+        }
+        if(log_read_user(log_fd, log_idx->offsets[id], &user) == -1)
+        {
+            count = -1;
+            break;
+        }
+        visit(&user, ctx);
+        count++;
+    }
+    log_unlock();
+    return count;
+}
+
+/* Answered from the index alone */
+static int log_store_max_id(void)
+{
+    int max_id;
+
+    if(log_lock(LOCK_SH) == -1)
+    {
+        return -1;
+    }
+    max_id = LOG_ID_SLOTS - 1;
+    while(max_id > 0 && log_idx->offsets[max_id] == 0)
+    {
+        max_id--;
+    }
+    log_unlock();
+    return max_id;
+}
+
+/* Opens this process's own lock and log descriptors the first time it touches the store */
+static int log_attach(void)
+{
+    if(log_owner == getpid())
+    {
+        return 0;
+    }
+
+    /* Inherited from the parent; using them would share its lock */
+    if(log_lock_fd >= 0)
+    {
+        close(log_lock_fd);
+    }
+    if(log_fd >= 0)
+    {
+        close(log_fd);
+        log_fd     = -1;
+        log_fd_ino = 0;
+    }
+
+    log_lock_fd = open(log_lock_path, O_RDWR | O_CREAT | O_CLOEXEC, LOG_FILE_MODE);
+    if(log_lock_fd == -1)
+    {
+        perror("Failed to open user log lock file");
+        return -1;
+    }
+    log_owner = getpid();
+    return 0;
+}
+
+/*
+ * Takes the store lock and brings the index and this process's descriptor up
+ * to date with the file. A shared holder that finds the index behind retakes
+ * the lock exclusively to replay, since replay writes the shared index.
+ */
+static int log_lock(int lock_op)
+{
+    struct stat st;
+
+    if(log_attach() == -1)
+    {
+        return -1;
+    }
+    if(flock(log_lock_fd, lock_op) == -1)
+    {
+        perror("Failed to lock user log");
+        return -1;
+    }
+
+    if(lock_op == LOCK_EX)
+    {
+        log_mark_dirty();
+    }
+    if(stat(log_path, &st) == 0 && st.st_ino == log_idx->ino && (uint64_t)st.st_size == log_idx->applied && st.st_ino == log_fd_ino)
+    {
+        return 0;
+    }
+
+    if(lock_op == LOCK_SH && flock(log_lock_fd, LOCK_EX) == -1)
+    {
+        perror("Failed to lock user log");
+        log_unlock();
+        return -1;
+    }
+    log_mark_dirty();
+    if(log_catch_up() == -1)
+    {
+        log_unlock();
+        return -1;
+    }
+    if(lock_op == LOCK_SH)
+    {
+        flock(log_lock_fd, LOCK_SH);
+    }
+    return 0;
+}
+
+static void log_unlock(void)
+{
+    flock(log_lock_fd, LOCK_UN);
+}
+
+/* Reopens the log if it was replaced and replays whatever the index has not seen */
+static int log_catch_up(void)
+{
+    struct stat     st;
+    log_file_header header;
+
+    if(log_fd == -1 || stat(log_path, &st) == -1 || st.st_ino != log_fd_ino)
+    {
+        if(log_fd >= 0)
+        {
+            close(log_fd);
+        }
+        log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, LOG_FILE_MODE);
+        if(log_fd == -1)
+        {
+            perror("Failed to open user log");
+            return -1;
+        }
+    }
+    if(fstat(log_fd, &st) == -1)
+    {
+        perror("Failed to stat user log");
+        return -1;
+    }
+    log_fd_ino = st.st_ino;
+
+    if(st.st_ino != log_idx->ino || (uint64_t)st.st_size < log_idx->applied)
+    {
+        /* A file this index has never described: start over from its first record */
+        memset(log_idx->offsets, 0, sizeof(log_idx->offsets));
+        memset(log_idx->names, 0, sizeof(log_idx->names));
+        log_idx->ino        = st.st_ino;
+        log_idx->applied    = 0;
+        log_idx->live_bytes = 0;
+    }
+
+    if(log_idx->applied == 0)
+    {
+        if(st.st_size == 0)
+        {
+            memset(&header, 0, sizeof(header));
+            header.magic   = LOG_MAGIC;
+            header.version = LOG_VERSION;
+            if(write(log_fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+            {
+                perror("Failed to write user log header");
+                return -1;
+            }
+            st.st_size = sizeof(header);
+        }
+        else if(pread(log_fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.magic != LOG_MAGIC || header.version != LOG_VERSION)
+        {
+            fprintf(stderr, "%s is not a version %d user log\n", log_path, LOG_VERSION);
+            return -1;
+        }
+        log_idx->applied = sizeof(header);
+    }
+
+    if((uint64_t)st.st_size > log_idx->applied)
+    {
+        return log_replay(log_idx->applied, (uint64_t)st.st_size);
+    }
+    return 0;
+}
+
+/* Applies records in [from, to), cutting the file at the first damaged one */
+static int log_replay(uint64_t from, uint64_t to)
+{
+    const uint8_t *base;
+    void          *map;
+    log_record     rec;
+    uint64_t       pos;
+
+    map = mmap(NULL, (size_t)to, PROT_READ, MAP_SHARED, log_fd, 0);
+    if(map == MAP_FAILED)
+    {
+        perror("log_replay::mmap");
+        return -1;
+    }
+    base = (const uint8_t *)map;
+
+    pos = from;
+    while(pos + sizeof(log_record) <= to)
+    {
+        memcpy(&rec, base + pos, sizeof(rec));
+        if(rec.magic != LOG_RECORD_MAGIC || pos + sizeof(rec) + rec.length > to)
+        {
+            break;
+        }
+        if(!(rec.type == LOG_PUT && rec.length == sizeof(user_obj)) && !(rec.type == LOG_DEL && rec.length == 0))
+        {
+            break;
+        }
+        if(rec.checksum != record_checksum(&rec, base + pos + sizeof(rec)))
+        {
+            break;
+        }
+        log_apply(&rec, base + pos + sizeof(rec), pos);
+        pos += sizeof(rec) + rec.length;
+    }
+    munmap(map, (size_t)to);
+
+    if(pos != to)
+    {
+        fprintf(stderr, "Discarded %llu bytes of damaged user log tail\n", (unsigned long long)(to - pos));
+        if(ftruncate(log_fd, (off_t)pos) == -1)
+        {
+            perror("log_replay::ftruncate");
+            return -1;
+        }
+    }
+    log_idx->applied = pos;
+    return 0;
+}
+
+/* Points the index at a record that has just been replayed or appended */
+static void log_apply(const log_record *rec, const uint8_t *payload, uint64_t offset)
+{
+    user_obj previous;
+    user_obj user;
+
+    if(rec->user_id >= LOG_ID_SLOTS)
+    {
+        return;
+    }
+
+    if(log_idx->offsets[rec->user_id] != 0)
+    {
+        if(log_read_user(log_fd, log_idx->offsets[rec->user_id], &previous) == 0)
+        {
+            name_remove(name_hash(previous.username), rec->user_id + 1);
+        }
+        log_idx->offsets[rec->user_id] = 0;
+        log_idx->live_bytes -= LOG_PUT_SIZE;
+    }
+
+    if(rec->type == LOG_PUT)
+    {
+        memcpy(&user, payload, sizeof(user));
+        log_idx->offsets[rec->user_id] = offset;
+        log_idx->live_bytes += LOG_PUT_SIZE;
+        name_insert(name_hash(user.username), rec->user_id + 1);
+    }
+}
+
+/*
+ * Appends one record at the end of the log and applies it. A short write is
+ * cut off again so the log never holds a torn record while we are running,
+ * and so is a record that could not be synced under -F, since the caller
+ * treats the write as failed and may hand its user id to someone else. A
+ * record that cannot be cut off is applied, as the next replay would.
+ * Returns: The record's offset, or -1 on failure.
+ */
+static int64_t log_append(uint16_t type, uint32_t user_id, const void *payload, uint16_t length)
+{
+    uint8_t    buf[LOG_PUT_SIZE];
+    log_record rec;
+    uint64_t   offset;
+    size_t     total;
+
+    rec.magic    = LOG_RECORD_MAGIC;
+    rec.type     = type;
+    rec.length   = length;
+    rec.user_id  = user_id;
+    rec.checksum = record_checksum(&rec, (const uint8_t *)payload);
+
+    total = sizeof(rec) + length;
+    memcpy(buf, &rec, sizeof(rec));
+    if(length > 0)
+    {
+        memcpy(buf + sizeof(rec), payload, length);
+    }
+
+    offset = log_idx->applied;
+    if(write(log_fd, buf, total) != (ssize_t)total)
+    {
+        perror("Failed to append to user log");
+        ftruncate(log_fd, (off_t)offset);
+        return -1;
+    }
+    if(log_sync && fdatasync(log_fd) == -1)
+    {
+        perror("Failed to sync user log");
+        if(ftruncate(log_fd, (off_t)offset) == 0)
+        {
+            return -1;
+        }
+        /* Still in the file, so the next start replays it: it has to count as written now too */
+    }
+
+    log_idx->applied = offset + total;
+    log_apply(&rec, buf + sizeof(rec), offset);
+    return (int64_t)offset;
+}
+
+static int log_read_user(int fd, uint64_t offset, user_obj *user)
+{
+    if(pread(fd, user, sizeof(user_obj), (off_t)(offset + sizeof(log_record))) != (ssize_t)sizeof(user_obj))
+    {
+        perror("Failed to read user log record");
+        return -1;
+    }
+    return 0;
+}
+
+/* Called with the exclusive lock held after a write */
+static void log_maybe_compact(void)
+{
+    uint64_t dead = log_idx->applied - sizeof(log_file_header) - log_idx->live_bytes;
+
+    if(compact_bell[1] >= 0 && dead > LOG_COMPACT_MIN_BYTES && dead > log_idx->live_bytes)
+    {
+        /* A full pipe means a request is already pending */
+        write(compact_bell[1], "c", 1);
+    }
+}
+
+/* Compacts when rung, checkpoints the index when idle; exits once every writer is gone */
+static void log_compactor_run(void)
+{
+    struct pollfd pfd;
+    char          bell[LOG_BELL_DRAIN];
+    ssize_t       n;
+    int           ready;
+
+    close(compact_bell[1]);
+    compact_bell[1] = -1;
+
+    pfd.fd     = compact_bell[0];
+    pfd.events = POLLIN;
+    for(;;)
+    {
+        ready = poll(&pfd, 1, LOG_CHECKPOINT_MS);
+        if(ready == -1 && errno != EINTR)
+        {
+            break;
+        }
+        if(ready == 0)
+        {
+            log_checkpoint();
+            continue;
+        }
+        if(ready < 0)
+        {
+            continue;
+        }
+
+        n = read(compact_bell[0], bell, sizeof(bell));
+        if(n == 0)
+        {
+            break;
+        }
+        if(n > 0)
+        {
+            log_compact();
+            log_checkpoint();
+        }
+    }
+}
+
+/* Copies the live records to a new file and swaps it in under the exclusive lock */
+static int log_compact(void)
+{
+    log_file_header header;
+    user_obj        user;
+    uint64_t       *offsets;
+    uint8_t        *buf;
+    uint64_t        before;
+    uint64_t        pos;
+    size_t          used;
+    struct stat     st;
+    int             fd;
+    int             dir_fd;
+
+    offsets = (uint64_t *)calloc(LOG_ID_SLOTS, sizeof(uint64_t));
+    buf     = (uint8_t *)malloc(LOG_COPY_RECORDS * LOG_PUT_SIZE);
+    if(offsets == NULL || buf == NULL)
+    {
+        free(offsets);
+        free(buf);
+        return -1;
+    }
+    if(log_lock(LOCK_EX) == -1)
+    {
+        free(offsets);
+        free(buf);
+        return -1;
+    }
+
+    fd = open(log_compact_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, LOG_FILE_MODE);
+    if(fd == -1)
+    {
+        perror("log_compact::open");
+        goto fail;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic   = LOG_MAGIC;
+    header.version = LOG_VERSION;
+    memcpy(buf, &header, sizeof(header));
+    used = sizeof(header);
+    pos  = sizeof(header);
+
+    for(size_t id = 0; id < LOG_ID_SLOTS; id++)
+    {
+        if(log_idx->offsets[id] == 0)
+        {
+            continue;
+        }
+        if(used + LOG_PUT_SIZE > LOG_COPY_RECORDS * LOG_PUT_SIZE)
+        {
+            if(write(fd, buf, used) != (ssize_t)used)
+            {
+                perror("log_compact::write");
+                goto fail;
+            }
+            used = 0;
+        }
+        if(pread(log_fd, buf + used, LOG_PUT_SIZE, (off_t)log_idx->offsets[id]) != (ssize_t)LOG_PUT_SIZE)
+        {
+            perror("log_compact::pread");
+            goto fail;
+        }
+        offsets[id] = pos;
+        used += LOG_PUT_SIZE;
+        pos += LOG_PUT_SIZE;
+    }
+    if(write(fd, buf, used) != (ssize_t)used || fsync(fd) == -1 || fstat(fd, &st) == -1)
+    {
+        perror("log_compact::write");
+        goto fail;
+    }
+
+    if(rename(log_compact_path, log_path) == -1)
+    {
+        perror("log_compact::rename");
+        goto fail;
+    }
+    dir_fd = open(".", O_RDONLY | O_CLOEXEC);
+    if(dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    /* Record ids and names are unchanged; rebuilding the name table drops its tombstones */
+    before = log_idx->applied;
+    memcpy(log_idx->offsets, offsets, sizeof(log_idx->offsets));
+    memset(log_idx->names, 0, sizeof(log_idx->names));
+    for(size_t id = 0; id < LOG_ID_SLOTS; id++)
+    {
+        if(offsets[id] != 0 && log_read_user(fd, offsets[id], &user) == 0)
+        {
+            name_insert(name_hash(user.username), (uint32_t)id + 1);
+        }
+    }
+    log_idx->ino        = st.st_ino;
+    log_idx->applied    = pos;
+    log_idx->live_bytes = pos - sizeof(header);
+    log_idx->compactions++;
+    log_unlock();
+
+    printf("Compacted user log: %llu -> %llu bytes.\n", (unsigned long long)before, (unsigned long long)pos);
+    fflush(stdout);
+    close(fd);
+    free(offsets);
+    free(buf);
+    return 0;
+
+fail:
+    log_unlock();
+    if(fd >= 0)
+    {
+        close(fd);
+        unlink(log_compact_path);
+    }
+    free(offsets);
+    free(buf);
+    return -1;
+}
+
+/*
+ * Maps user_db.log.index, sizing it on first use. An index that was not
+ * checkpointed cleanly is forgotten so the whole log is replayed into it, but
+ * only when no other server maps it.
+ */
+static int log_index_map(void)
+{
+    log_index   head;
+    struct stat st;
+    void       *mem;
+    int         in_use;
+
+    /* Nobody else may open, size or clear the index while this decides to */
+    if(log_attach() == -1)
+    {
+        return -1;
+    }
+    if(flock(log_lock_fd, LOCK_EX) == -1)
+    {
+        perror("log_index_map::flock");
+        return -1;
+    }
+
+    in_use = log_index_open();
+    if(in_use == 1 && (fstat(log_index_fd, &st) == -1 || (size_t)st.st_size != sizeof(log_index) || pread(log_index_fd, &head, offsetof(log_index, clean), 0) != (ssize_t)offsetof(log_index, clean) || head.magic != LOG_INDEX_MAGIC || head.version != LOG_VERSION))
+    {
+        /* Another build's layout: leave its file to it and start one of our own */
+        close(log_index_fd);
+        unlink(log_index_path);
+        in_use = log_index_open();
+    }
+    if(in_use == -1)
+    {
+        goto fail;
+    }
+    if(fstat(log_index_fd, &st) == -1 || (!in_use && (size_t)st.st_size != sizeof(log_index) && (ftruncate(log_index_fd, 0) == -1 || ftruncate(log_index_fd, sizeof(log_index)) == -1)))
+    {
+        perror("log_index_map::ftruncate");
+        goto fail;
+    }
+
+    mem = mmap(NULL, sizeof(log_index), PROT_READ | PROT_WRITE, MAP_SHARED, log_index_fd, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("log_index_map::mmap");
+        goto fail;
+    }
+    log_idx = (log_index *)mem;
+
+    if(!in_use && (log_idx->magic != LOG_INDEX_MAGIC || log_idx->version != LOG_VERSION || !atomic_load(&log_idx->clean)))
+    {
+        /* A zero inode never matches the log, so the first lock replays it from the start */
+        memset(mem, 0, sizeof(log_index));
+        log_idx->magic   = LOG_INDEX_MAGIC;
+        log_idx->version = LOG_VERSION;
+    }
+
+    /* Inherited by every child, so it is held until the last of them exits */
+    flock(log_index_fd, LOCK_SH);
+    flock(log_lock_fd, LOCK_UN);
+    return 0;
+
+fail:
+    if(log_index_fd >= 0)
+    {
+        close(log_index_fd);
+        log_index_fd = -1;
+    }
+    flock(log_lock_fd, LOCK_UN);
+    return -1;
+}
+
+/* Opens the index file: 1 if another server holds it, 0 if this one now holds it alone, -1 on error */
+static int log_index_open(void)
+{
+    log_index_fd = open(log_index_path, O_RDWR | O_CREAT | O_CLOEXEC, LOG_FILE_MODE);
+    if(log_index_fd == -1)
+    {
+        perror("log_index_map::open");
+        return -1;
+    }
+    if(flock(log_index_fd, LOCK_EX | LOCK_NB) == 0)
+    {
+        return 0;
+    }
+    if(errno == EWOULDBLOCK)
+    {
+        return 1;
+    }
+    perror("log_index_map::flock");
+    close(log_index_fd);
+    log_index_fd = -1;
+    return -1;
+}
+
+/* Called with the exclusive lock held, before the index changes */
+static void log_mark_dirty(void)
+{
+    if(atomic_load(&log_idx->clean))
+    {
+        atomic_store(&log_idx->clean, 0);
+        msync(log_idx, offsetof(log_index, ino), MS_SYNC);
+    }
+}
+
+/* Syncs the index and marks it usable as a snapshot, if it changed since the last checkpoint */
+static void log_checkpoint(void)
+{
+    if(atomic_load(&log_idx->clean) || log_lock(LOCK_SH) == -1)
+    {
+        return;
+    }
+    if(!atomic_load(&log_idx->clean) && msync(log_idx, sizeof(log_index), MS_SYNC) == 0)
+    {
+        atomic_store(&log_idx->clean, 1);
+        msync(log_idx, offsetof(log_index, ino), MS_SYNC);
+    }
+    log_unlock();
+}
+
+/* Probes hash matches against the stored record, since different names can share a hash */
+static int name_lookup(const char *username, user_obj *user)
+{
+    uint32_t hash = name_hash(username);
+    uint32_t mask = LOG_NAME_SLOTS - 1;
+
+    for(uint32_t i = 0, slot = hash & mask; i < LOG_NAME_SLOTS; i++, slot = (slot + 1) & mask)
+    {
+        const log_name_slot *entry = &log_idx->names[slot];
+
+        if(entry->id == LOG_NAME_EMPTY)
+        {
+            return 0;
+        }
+        if(entry->id == LOG_NAME_TOMBSTONE || entry->hash != hash)
+        {
+            continue;
+        }
+        if(log_read_user(log_fd, log_idx->offsets[entry->id - 1], user) == -1)
+        {
+            return -1;
+        }
+        if(strncmp(user->username, username, USERNAME_MAX_LEN) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void name_insert(uint32_t hash, uint32_t id)
+{
+    uint32_t mask = LOG_NAME_SLOTS - 1;
+
+    for(uint32_t i = 0, slot = hash & mask; i < LOG_NAME_SLOTS; i++, slot = (slot + 1) & mask)
+    {
+        log_name_slot *entry = &log_idx->names[slot];
+
+        if(entry->id == LOG_NAME_EMPTY || entry->id == LOG_NAME_TOMBSTONE)
+        {
+            entry->hash = hash;
+            entry->id   = id;
+            return;
+        }
+    }
+}
+
+static void name_remove(uint32_t hash, uint32_t id)
+{
+    uint32_t mask = LOG_NAME_SLOTS - 1;
+
+    for(uint32_t i = 0, slot = hash & mask; i < LOG_NAME_SLOTS; i++, slot = (slot + 1) & mask)
+    {
+        log_name_slot *entry = &log_idx->names[slot];
+
+        if(entry->id == LOG_NAME_EMPTY)
+        {
+            return;
+        }
+        if(entry->id == id)
+        {
+            entry->id = LOG_NAME_TOMBSTONE;
+            return;
+        }
+    }
+}
+
+/* FNV-1a */
+static uint32_t name_hash(const char *username)
+{
+    uint32_t hash = FNV32_OFFSET_BASIS;
+    size_t   len  = strnlen(username, USERNAME_MAX_LEN);
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)username[i];
+        hash *= FNV32_PRIME;
+    }
+    return hash;
+}
+
+static void crc32_init(void)
+{
+    for(uint32_t i = 0; i < CRC32_TABLE_SIZE; i++)
+    {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 1U) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+        }
+        crc32_table[i] = crc;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        crc = crc32_table[(crc ^ bytes[i]) & 0xffU] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static uint32_t record_checksum(const log_record *rec, const uint8_t *payload)
+{
+    uint32_t crc = UINT32_MAX;
+
+    crc = crc32_update(crc, &rec->type, sizeof(rec->type));
+    crc = crc32_update(crc, &rec->length, sizeof(rec->length));
+    crc = crc32_update(crc, &rec->user_id, sizeof(rec->user_id));
+    if(rec->length > 0)
+    {
+        crc = crc32_update(crc, payload, rec->length);
+    }
+    return ~crc;
+}
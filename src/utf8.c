@@ -0,0 +1,404 @@
+/*******************************************************************************
+ * ASN_STR Validation
+ *
+ * Every string a client sends must be well-formed UTF-8 (no overlong forms,
+ * surrogates or code points past U+10FFFF) with no control characters other
+ * than tab, newline and carriage return.
+ *
+ * - Chat content reaches 255 bytes a field, so a per-byte loop would be paid on
+ *   every message. The x86 versions check 16 (SSE4.1) or 32 (AVX2) bytes at a
+ *   time with the nibble lookup tables of Keiser and Lemire, "Validating UTF-8
+ *   In Less Than One Instruction Per Byte": three shuffles classify each pair
+ *   of adjacent bytes, and a saturating subtract covers the third and fourth
+ *   bytes of long sequences.
+ * - The implementation is chosen on the first call from what the CPU
+ *   supports; other architectures use the scalar loop.
+ ******************************************************************************/
+
+#include "../include/utf8.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define UTF8_X86
+    #include <immintrin.h>
+#endif
+
+#define ASCII_LIMIT 0x80
+#define CTRL_LIMIT 0x20
+#define DEL 0x7F
+#define C1_LEAD 0xC2  /* U+0080 to U+009F, the C1 controls, start with this byte */
+#define C1_LIMIT 0xA0 /* and end with a continuation byte below this */
+#define CONT_MASK 0xC0
+#define CONT_BITS 0x80
+#define CONT_PAYLOAD 0x3F
+#define CONT_SHIFT 6
+
+typedef int (*check_fn)(const uint8_t text[], size_t len);
+
+static int check_resolve(const uint8_t text[], size_t len);
+static int check_scalar(const uint8_t text[], size_t len);
+
+static check_fn    check      = check_resolve;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const char *check_name = "scalar";         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: utf8_check
+ * Description: Validates the len bytes of an ASN_STR field.
+ * Returns: 0 if text is well-formed UTF-8 without disallowed control
+ *          characters, -1 otherwise.
+ */
+int utf8_check(const uint8_t text[], size_t len)
+{
+    return check(text, len);
+}
+
+/* Names the implementation in use, resolving it if no string was checked yet */
+const char *utf8_impl(void)
+{
+    if(check == check_resolve)
+    {
+        check_resolve((const uint8_t *)"", 0);
+    }
+    return check_name;
+}
+
+static int is_bad_ascii(uint8_t c)
+{
+    return (c < CTRL_LIMIT && c != '\t' && c != '\n' && c != '\r') || c == DEL;
+}
+
+static int check_scalar(const uint8_t text[], size_t len)
+{
+    size_t pos = 0;
+
+    while(pos < len)
+    {
+        uint8_t  lead = text[pos];
+        uint32_t cp;
+        size_t   follow;
+
+        if(lead < ASCII_LIMIT)
+        {
+            if(is_bad_ascii(lead))
+            {
+                return -1;
+            }
+            pos++;
+            continue;
+        }
+        if(lead >= 0xC2 && lead <= 0xDF)
+        {
+            follow = 1;
+            cp     = lead & 0x1Fu;
+        }
+        else if(lead >= 0xE0 && lead <= 0xEF)
+        {
+            follow = 2;
+            cp     = lead & 0x0Fu;
+        }
+        else if(lead >= 0xF0 && lead <= 0xF4)
+        {
+            follow = 3;
+            cp     = lead & 0x07u;
+        }
+        else
+        {
+            return -1;
+        }
+        if(len - pos <= follow)
+        {
+            return -1;
+        }
+        for(size_t i = 1; i <= follow; i++)
+        {
+            if((text[pos + i] & CONT_MASK) != CONT_BITS)
+            {
+                return -1;
+            }
+            cp = (cp << CONT_SHIFT) | (text[pos + i] & CONT_PAYLOAD);
+        }
+        if((follow == 1 && cp < C1_LIMIT) || (follow == 2 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (follow == 3 && (cp < 0x10000 || cp > 0x10FFFF)))
+        {
+            return -1;
+        }
+        pos += follow + 1;
+    }
+    return 0;
+}
+
+#ifdef UTF8_X86
+
+    /* Error bits of the lookup tables; a pair of bytes is bad when all three lookups share one */
+    #define TOO_SHORT (1 << 0)      /* lead byte not followed by a continuation */
+    #define TOO_LONG (1 << 1)       /* continuation after ASCII */
+    #define OVERLONG_3 (1 << 2)
+    #define TOO_LARGE (1 << 3)
+    #define SURROGATE (1 << 4)
+    #define OVERLONG_2 (1 << 5)
+    #define TOO_LARGE_1000 (1 << 6)
+    #define OVERLONG_4 (1 << 6)
+    #define TWO_CONTS (1 << 7)      /* a continuation after a continuation, unless a long sequence expects it */
+    #define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+    #define BLOCK_SSE 16
+    #define BLOCK_AVX 32
+
+/* Indexed by the high nibble of the first byte of a pair */
+static const uint8_t first_high[BLOCK_SSE] = {
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TOO_LONG,
+    TWO_CONTS,
+    TWO_CONTS,
+    TWO_CONTS,
+    TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+/* Indexed by the low nibble of the first byte */
+static const uint8_t first_low[BLOCK_SSE] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+/* Indexed by the high nibble of the second byte */
+static const uint8_t second_high[BLOCK_SSE] = {
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+    TOO_SHORT,
+};
+
+    /* Bits of the control character tables, one per row of the ASCII chart that has controls */
+    #define CTRL_ROW0 (1 << 0) /* 0x00 to 0x0F, less tab, newline and carriage return */
+    #define CTRL_ROW1 (1 << 1) /* 0x10 to 0x1F */
+    #define CTRL_DEL (1 << 2)  /* 0x7F */
+
+/* Indexed by the high nibble of a byte */
+static const uint8_t ctrl_high[BLOCK_SSE] = {CTRL_ROW0, CTRL_ROW1, 0, 0, 0, 0, 0, CTRL_DEL, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/* Indexed by the low nibble; a byte is a control if both lookups share a bit */
+static const uint8_t ctrl_low[BLOCK_SSE] = {
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW1, /* tab */
+    CTRL_ROW1, /* newline */
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW1, /* carriage return */
+    CTRL_ROW0 | CTRL_ROW1,
+    CTRL_ROW0 | CTRL_ROW1 | CTRL_DEL,
+};
+
+/* A block ending in a lead byte whose sequence it does not finish exceeds these */
+static const uint8_t incomplete_max[BLOCK_AVX] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xEF, 0xDF, 0xBF,
+};
+
+    #define THIRD_BYTE_SUB (0xE0 - 0x80) /* leaves the top bit set two bytes after a 3 or 4 byte lead */
+    #define FOURTH_BYTE_SUB (0xF0 - 0x80)
+    #define NIBBLE 0x0F
+
+/* Nonzero for C0 controls other than tab, newline and carriage return, and for DEL */
+__attribute__((target("sse4.1"))) static __m128i sse_controls(__m128i in)
+{
+    const __m128i nibble = _mm_set1_epi8(NIBBLE);
+
+    return _mm_and_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)ctrl_high), _mm_and_si128(_mm_srli_epi16(in, 4), nibble)),
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)ctrl_low), _mm_and_si128(in, nibble)));
+}
+
+/* Nonzero where a byte of in, read after the 3 last bytes of prev, breaks a sequence or is a C1 control */
+__attribute__((target("sse4.1"))) static __m128i sse_sequences(__m128i in, __m128i prev)
+{
+    const __m128i nibble = _mm_set1_epi8(NIBBLE);
+    __m128i       prev1  = _mm_alignr_epi8(in, prev, BLOCK_SSE - 1);
+    __m128i       prev2  = _mm_alignr_epi8(in, prev, BLOCK_SSE - 2);
+    __m128i       prev3  = _mm_alignr_epi8(in, prev, BLOCK_SSE - 3);
+    __m128i       special;
+    __m128i       must23;
+    __m128i       c1;
+
+    special = _mm_and_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)first_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+                            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)first_low), _mm_and_si128(prev1, nibble)));
+    special = _mm_and_si128(special, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)second_high), _mm_and_si128(_mm_srli_epi16(in, 4), nibble)));
+    must23  = _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8(THIRD_BYTE_SUB)), _mm_subs_epu8(prev3, _mm_set1_epi8(FOURTH_BYTE_SUB)));
+    must23  = _mm_and_si128(must23, _mm_set1_epi8((char)CONT_BITS));
+    c1      = _mm_and_si128(_mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)C1_LEAD)), _mm_cmpeq_epi8(_mm_min_epu8(in, _mm_set1_epi8((char)(C1_LIMIT - 1))), in));
+    return _mm_or_si128(_mm_xor_si128(must23, special), c1);
+}
+
+__attribute__((target("sse4.1"))) static int check_sse4(const uint8_t text[], size_t len)
+{
+    const __m128i max_incomplete = _mm_loadu_si128((const __m128i *)(incomplete_max + BLOCK_SSE));
+    __m128i       error          = _mm_setzero_si128();
+    __m128i       prev           = _mm_setzero_si128();
+    __m128i       incomplete     = _mm_setzero_si128();
+    uint8_t       tail[BLOCK_SSE];
+
+    for(size_t pos = 0; pos < len; pos += BLOCK_SSE)
+    {
+        __m128i in;
+        __m128i other;
+
+        if(len - pos >= BLOCK_SSE)
+        {
+            in = _mm_loadu_si128((const __m128i *)(text + pos));
+        }
+        else
+        {
+            // Spaces are printable and complete, so the padding adds no errors
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, text + pos, len - pos);
+            in = _mm_loadu_si128((const __m128i *)tail);
+        }
+        // Signed compare: below a space is a control character, negative is not ASCII
+        other = _mm_or_si128(_mm_cmpgt_epi8(_mm_set1_epi8(CTRL_LIMIT), in), _mm_cmpeq_epi8(in, _mm_set1_epi8(DEL)));
+        if(_mm_testz_si128(other, other))
+        {
+            // Printable ASCII: only a sequence left open by the previous block can be wrong
+            error      = _mm_or_si128(error, incomplete);
+            incomplete = _mm_setzero_si128();
+        }
+        else
+        {
+            error      = _mm_or_si128(error, _mm_or_si128(sse_controls(in), sse_sequences(in, prev)));
+            incomplete = _mm_subs_epu8(in, max_incomplete);
+        }
+        prev = in;
+    }
+    error = _mm_or_si128(error, incomplete);
+    return _mm_testz_si128(error, error) ? 0 : -1;
+}
+
+__attribute__((target("avx2"))) static __m256i avx_controls(__m256i in)
+{
+    const __m256i nibble = _mm256_set1_epi8(NIBBLE);
+
+    return _mm256_and_si256(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ctrl_high)), _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)),
+                            _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)ctrl_low)), _mm256_and_si256(in, nibble)));
+}
+
+/* As sse_sequences; shuffles and byte shifts stay within 128-bit lanes, so tables are duplicated and prev is spliced in */
+__attribute__((target("avx2"))) static __m256i avx_sequences(__m256i in, __m256i prev)
+{
+    const __m256i nibble  = _mm256_set1_epi8(NIBBLE);
+    __m256i       spliced = _mm256_permute2x128_si256(prev, in, 0x21);
+    __m256i       prev1   = _mm256_alignr_epi8(in, spliced, BLOCK_SSE - 1);
+    __m256i       prev2   = _mm256_alignr_epi8(in, spliced, BLOCK_SSE - 2);
+    __m256i       prev3   = _mm256_alignr_epi8(in, spliced, BLOCK_SSE - 3);
+    __m256i       special;
+    __m256i       must23;
+    __m256i       c1;
+
+    special = _mm256_and_si256(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)first_high)), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                               _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)first_low)), _mm256_and_si256(prev1, nibble)));
+    special = _mm256_and_si256(special, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)second_high)), _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+    must23  = _mm256_or_si256(_mm256_subs_epu8(prev2, _mm256_set1_epi8(THIRD_BYTE_SUB)), _mm256_subs_epu8(prev3, _mm256_set1_epi8(FOURTH_BYTE_SUB)));
+    must23  = _mm256_and_si256(must23, _mm256_set1_epi8((char)CONT_BITS));
+    c1      = _mm256_and_si256(_mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)C1_LEAD)), _mm256_cmpeq_epi8(_mm256_min_epu8(in, _mm256_set1_epi8((char)(C1_LIMIT - 1))), in));
+    return _mm256_or_si256(_mm256_xor_si256(must23, special), c1);
+}
+
+__attribute__((target("avx2"))) static int check_avx2(const uint8_t text[], size_t len)
+{
+    const __m256i max_incomplete = _mm256_loadu_si256((const __m256i *)incomplete_max);
+    __m256i       error          = _mm256_setzero_si256();
+    __m256i       prev           = _mm256_setzero_si256();
+    __m256i       incomplete     = _mm256_setzero_si256();
+    uint8_t       tail[BLOCK_AVX];
+
+    for(size_t pos = 0; pos < len; pos += BLOCK_AVX)
+    {
+        __m256i in;
+        __m256i other;
+
+        if(len - pos >= BLOCK_AVX)
+        {
+            in = _mm256_loadu_si256((const __m256i *)(text + pos));
+        }
+        else
+        {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, text + pos, len - pos);
+            in = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        other = _mm256_or_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(CTRL_LIMIT), in), _mm256_cmpeq_epi8(in, _mm256_set1_epi8(DEL)));
+        if(_mm256_testz_si256(other, other))
+        {
+            error      = _mm256_or_si256(error, incomplete);
+            incomplete = _mm256_setzero_si256();
+        }
+        else
+        {
+            error      = _mm256_or_si256(error, _mm256_or_si256(avx_controls(in), avx_sequences(in, prev)));
+            incomplete = _mm256_subs_epu8(in, max_incomplete);
+        }
+        prev = in;
+    }
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error) ? 0 : -1;
+}
+
+#endif    // UTF8_X86
+
+/* Picks the widest implementation the CPU runs on the first call */
+static int check_resolve(const uint8_t text[], size_t len)
+{
+    check = check_scalar;
+#ifdef UTF8_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        check      = check_avx2;
+        check_name = "avx2";
+    }
+    else if(__builtin_cpu_supports("sse4.1"))
+    {
+        check      = check_sse4;
+        check_name = "sse4.1";
+    }
+#endif
+    return check(text, len);
+}
@@ -0,0 +1,592 @@
+/*******************************************************************************
+ * Password Hashing Worker Pool
+ *
+ * A fixed number of worker processes, forked at startup, run the slow password
+ * hashes so that no connection loop ever blocks on one.
+ *
+ * Shared state lives in one MAP_SHARED mapping created before any fork:
+ * - job slots, one per unit of configured queue depth
+ * - a lock-free ring of free slot indices (admission control: no free slot
+ *   means the server is at capacity and the login is rejected)
+ * - a lock-free ring of submitted slot indices, consumed by the workers
+ *
+ * Both rings are bounded MPMC queues (Vyukov) on C11 atomics, so submitting
+ * never takes a lock. A pipe acts as the doorbell: one byte per submission
+ * wakes exactly one worker.
+ *
+ * Completion is posted back to the owning connection loop with SIGUSR1, which
+ * that loop turns into a readable self-pipe it polls next to its socket. A
+ * loop that dies without collecting its jobs has them reclaimed by the parent
+ * before it is reaped, so a worker never signals a pid that was reused.
+ ******************************************************************************/
+
+#include "../include/workpool.h"
+#include "../include/affinity.h"
+#include "../include/logging.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+#define REPORT_LEN 192
+
+enum job_state
+{
+    JOB_FREE,
+    JOB_INFLIGHT,
+    JOB_SIGNALLING, /* hashed; the worker is between claiming the job and signalling its owner */
+    JOB_DONE,
+    JOB_ABANDONED
+};
+
+typedef struct workpool_job
+{
+    _Atomic int state;
+    pid_t       owner;
+    uint64_t    submitted_ns;
+    uint64_t    started_ns;
+    uint64_t    finished_ns;
+    uint8_t     salt[SALT_LEN];
+    uint8_t     hash[HASH_LEN];
+    size_t      password_len;
+    char        password[WORKPOOL_MAX_PASSWORD];
+} workpool_job;
+
+typedef struct ring_cell
+{
+    _Atomic size_t seq;
+    uint32_t       value;
+} ring_cell;
+
+/* Bounded MPMC queue; head and tail sit on their own cache lines */
+typedef struct ring
+{
+    _Alignas(CACHE_LINE) _Atomic size_t head;
+    _Alignas(CACHE_LINE) _Atomic size_t tail;
+    _Alignas(CACHE_LINE) size_t mask;
+    ring_cell *cells;
+} ring;
+
+/* Counters read by the parent for the shutdown report */
+typedef struct workpool_stats
+{
+    _Atomic uint64_t completed;
+    _Atomic uint64_t rejected;
+    _Atomic uint64_t queue_ns;   /* submit -> worker picks it up */
+    _Atomic uint64_t service_ns; /* time spent hashing */
+    _Atomic uint64_t latency_ns; /* submit -> owning loop collects the result */
+} workpool_stats;
+
+typedef struct workpool
+{
+    ring           free_slots;
+    ring           submitted;
+    workpool_stats stats;
+} workpool;
+
+static void     ring_init(ring *r, ring_cell *cells, size_t capacity);
+static int      ring_push(ring *r, uint32_t value);
+static int      ring_pop(ring *r, uint32_t *value);
+static int      job_settle(const workpool_job *job);
+static void     job_release(uint32_t index);
+static void     worker_run(void);
+static void     notify_handler(int signum);
+static uint64_t now_ns(void);
+
+/* All of these are set before the first fork and only read afterwards */
+static workpool     *pool           = NULL;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static workpool_job *jobs           = NULL;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t        pool_size      = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t        job_count      = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static pid_t        *worker_pids    = NULL;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static unsigned int  worker_count   = 0;           // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int           doorbell[2]    = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static int           notify_pipe[2] = {-1, -1};    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+/*
+ * Function: workpool_init
+ * Description: Maps the shared queues and forks the worker processes.
+ *              Must run before any connection is accepted.
+ * Returns: 0 on success, -1 on failure.
+ */
+int workpool_init(unsigned int workers, unsigned int depth)
+{
+    size_t     capacity;
+    size_t     cells_len;
+    size_t     jobs_len;
+    uint8_t   *mem;
+    ring_cell *cells;
+
+    if(workers == 0 || depth == 0)
+    {
+        fprintf(stderr, "Worker pool needs at least one worker and a queue depth of one\n");
+        return -1;
+    }
+
+    /* Rings need a power of two; the depth itself is enforced by the number of job slots */
+    capacity = 1;
+    while(capacity < depth)
+    {
+        capacity <<= 1;
+    }
+
+    cells_len = 2 * capacity * sizeof(ring_cell);
+    jobs_len  = depth * sizeof(workpool_job);
+    pool_size = sizeof(workpool) + cells_len + jobs_len;
+
+    mem = (uint8_t *)mmap(NULL, pool_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        perror("workpool_init::mmap");
+        return -1;
+    }
+
+    pool      = (workpool *)mem;
+    cells     = (ring_cell *)(mem + sizeof(workpool));
+    jobs      = (workpool_job *)(mem + sizeof(workpool) + cells_len);
+    job_count = depth;
+    ring_init(&pool->free_slots, cells, capacity);
+    ring_init(&pool->submitted, cells + capacity, capacity);
+    for(uint32_t i = 0; i < depth; i++)
+    {
+        ring_push(&pool->free_slots, i);
+    }
+
+    if(pipe(doorbell) == -1)
+    {
+        perror("workpool_init::pipe");
+        return -1;
+    }
+    fcntl(doorbell[1], F_SETFL, O_NONBLOCK);
+
+    worker_pids = (pid_t *)calloc(workers, sizeof(pid_t));
+    if(worker_pids == NULL)
+    {
+        perror("workpool_init::calloc");
+        return -1;
+    }
+
+    for(worker_count = 0; worker_count < workers; worker_count++)
+    {
+        pid_t pid = fork();
+        if(pid == -1)
+        {
+            perror("workpool_init::fork");
+            return -1;
+        }
+        if(pid == 0)
+        {
+            affinity_pin_worker(worker_count);
+            worker_run();
+            _exit(EXIT_SUCCESS);
+        }
+        worker_pids[worker_count] = pid;
+    }
+
+    /* Only children submitting work need the write end of the doorbell */
+    close(doorbell[0]);
+    doorbell[0] = -1;
+    return 0;
+}
+
+/*
+ * Function: workpool_attach
+ * Description: Called by a connection process after fork. Sets up the self-pipe
+ *              that completions are delivered on.
+ * Returns: The read end to poll for completions, or -1 on failure.
+ */
+int workpool_attach(void)
+{
+    struct sigaction sa;
+
+    if(pipe(notify_pipe) == -1)
+    {
+        perror("workpool_attach::pipe");
+        return -1;
+    }
+    fcntl(notify_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(notify_pipe[1], F_SETFL, O_NONBLOCK);
+
+    memset(&sa, 0, sizeof(sa));
+#if defined(__clang__)
+    #pragma clang diagnostic push
+    #pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = notify_handler;
+#if defined(__clang__)
+    #pragma clang diagnostic pop
+#endif
+    sigemptyset(&sa.sa_mask);
+    /* Restart reads on the client socket; poll still wakes up with EINTR */
+    sa.sa_flags = SA_RESTART;
+    if(sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("workpool_attach::sigaction");
+        return -1;
+    }
+    return notify_pipe[0];
+}
+
+/*
+ * Function: workpool_submit
+ * Description: Queues a hash of password with salt for the calling process.
+ * Returns: The job handle, or -1 if the queue is at its configured depth.
+ */
+int workpool_submit(const char *password, size_t password_len, const uint8_t salt[SALT_LEN])
+{
+    uint32_t      index;
+    workpool_job *job;
+
+    if(password_len > WORKPOOL_MAX_PASSWORD || ring_pop(&pool->free_slots, &index) != 0)
+    {
+        atomic_fetch_add_explicit(&pool->stats.rejected, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    job               = &jobs[index];
+    job->owner        = getpid();
+    job->submitted_ns = now_ns();
+    job->password_len = password_len;
+    memcpy(job->password, password, password_len);
+    memcpy(job->salt, salt, SALT_LEN);
+    atomic_store_explicit(&job->state, JOB_INFLIGHT, memory_order_release);
+
+    ring_push(&pool->submitted, index);
+    if(write(doorbell[1], "", 1) != 1)
+    {
+        /* A full doorbell already has more wakeups pending than there are jobs */
+        perror("workpool_submit::write");
+    }
+    return (int)index;
+}
+
+/*
+ * Function: workpool_collect
+ * Description: Fetches the result of a finished job and frees its slot.
+ * Returns: 1 with hash filled in if the job is done, 0 if it is still running.
+ */
+int workpool_collect(int job, uint8_t hash[HASH_LEN])
+{
+    workpool_job *slot = &jobs[job];
+    uint64_t      done;
+
+    if(job_settle(slot) != JOB_DONE)
+    {
+        return 0;
+    }
+
+    done = now_ns();
+    memcpy(hash, slot->hash, HASH_LEN);
+    atomic_fetch_add_explicit(&pool->stats.completed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->stats.queue_ns, slot->started_ns - slot->submitted_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->stats.service_ns, slot->finished_ns - slot->started_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->stats.latency_ns, done - slot->submitted_ns, memory_order_relaxed);
+    job_release((uint32_t)job);
+    return 1;
+}
+
+/* Give up on a job, e.g. because the client went away; whoever finishes last frees the slot */
+void workpool_abandon(int job)
+{
+    int expected = JOB_INFLIGHT;
+
+    while(!atomic_compare_exchange_strong_explicit(&jobs[job].state, &expected, JOB_ABANDONED, memory_order_acq_rel, memory_order_acquire))
+    {
+        if(expected == JOB_DONE)
+        {
+            /* Already done, nobody else will touch it */
+            job_release((uint32_t)job);
+            return;
+        }
+        expected = JOB_INFLIGHT;
+        sched_yield();
+    }
+}
+
+/*
+ * Function: workpool_reclaim
+ * Description: Frees the slots of a connection process that exited without
+ *              collecting or abandoning its jobs, e.g. one killed at shutdown.
+ *              Must be called while the process is still an unreaped zombie:
+ *              its pid cannot be reused until then, and this waits out any
+ *              worker that is signalling it.
+ */
+void workpool_reclaim(pid_t owner)
+{
+    if(pool == NULL)
+    {
+        return;
+    }
+
+    for(size_t i = 0; i < job_count; i++)
+    {
+        workpool_job *job      = &jobs[i];
+        int           expected = JOB_INFLIGHT;
+        int           state    = job_settle(job);
+
+        // A dead owner submits nothing new, so a slot that is not its job now never will be
+        if((state != JOB_INFLIGHT && state != JOB_DONE) || job->owner != owner)
+        {
+            continue;
+        }
+        if(state == JOB_DONE || !atomic_compare_exchange_strong_explicit(&job->state, &expected, JOB_ABANDONED, memory_order_acq_rel, memory_order_acquire))
+        {
+            /* Done, or the worker just finished it: nobody else will collect it */
+            job_settle(job);
+            job_release((uint32_t)i);
+        }
+    }
+}
+
+/* Empty the self-pipe once its wakeups have been seen */
+void workpool_drain_notify(int notify_fd)
+{
+    char buf[CACHE_LINE];
+
+    while(read(notify_fd, buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+/*
+ * Function: workpool_shutdown
+ * Description: Closes the doorbell so idle workers exit, waits for them and
+ *              reports hashing latency separately from end-to-end login latency.
+ */
+void workpool_shutdown(void)
+{
+    char     msg[REPORT_LEN];
+    uint64_t completed;
+
+    if(pool == NULL)
+    {
+        return;
+    }
+
+    close(doorbell[1]);
+    doorbell[1] = -1;
+    for(unsigned int i = 0; i < worker_count; i++)
+    {
+        while(waitpid(worker_pids[i], NULL, 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+
+    completed = atomic_load(&pool->stats.completed);
+    if(completed > 0)
+    {
+        snprintf(msg,
+                 sizeof(msg),
+                 "Password hashes: %llu done, %llu rejected, avg queue %llu us, avg hash %llu us, avg login latency %llu us",
+                 (unsigned long long)completed,
+                 (unsigned long long)atomic_load(&pool->stats.rejected),
+                 (unsigned long long)(atomic_load(&pool->stats.queue_ns) / completed / NSEC_PER_USEC),
+                 (unsigned long long)(atomic_load(&pool->stats.service_ns) / completed / NSEC_PER_USEC),
+                 (unsigned long long)(atomic_load(&pool->stats.latency_ns) / completed / NSEC_PER_USEC));
+        printf("%s\n", msg);
+        server_log(1, msg, LOG_NOTICE);
+    }
+
+    free(worker_pids);
+    worker_pids = NULL;
+    munmap(pool, pool_size);
+    pool = NULL;
+}
+
+static void worker_run(void)
+{
+    char byte;
+
+    /* Shutdown is driven by the parent closing the doorbell, not by terminal signals */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_IGN);
+    close(doorbell[1]);
+
+    for(;;)
+    {
+        uint32_t      index;
+        workpool_job *job;
+        int           expected;
+        ssize_t       nread;
+
+        nread = read(doorbell[0], &byte, 1);
+        if(nread == 0)
+        {
+            return;
+        }
+        if(nread < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        if(ring_pop(&pool->submitted, &index) != 0)
+        {
+            continue;
+        }
+
+        job = &jobs[index];
+        if(atomic_load_explicit(&job->state, memory_order_acquire) == JOB_ABANDONED)
+        {
+            job_release(index);
+            continue;
+        }
+
+        job->started_ns = now_ns();
+        password_hash(job->password, job->password_len, job->salt, PASSWORD_ITERATIONS, job->hash);
+        job->finished_ns = now_ns();
+
+        expected = JOB_INFLIGHT;
+        if(atomic_compare_exchange_strong_explicit(&job->state, &expected, JOB_SIGNALLING, memory_order_acq_rel, memory_order_acquire))
+        {
+            /* The owner cannot be reaped, nor its pid reused, until this is DONE */
+            kill(job->owner, SIGUSR1);
+            atomic_store_explicit(&job->state, JOB_DONE, memory_order_release);
+        }
+        else
+        {
+            job_release(index);
+        }
+    }
+}
+
+/* The job's state once no worker is in the middle of signalling its owner */
+static int job_settle(const workpool_job *job)
+{
+    int state;
+
+    while((state = atomic_load_explicit(&job->state, memory_order_acquire)) == JOB_SIGNALLING)
+    {
+        sched_yield();
+    }
+    return state;
+}
+
+static void job_release(uint32_t index)
+{
+    workpool_job *job = &jobs[index];
+
+    memset(job->password, 0, sizeof(job->password));
+    atomic_store_explicit(&job->state, JOB_FREE, memory_order_release);
+    ring_push(&pool->free_slots, index);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+
+static void notify_handler(int signum)
+{
+    int saved_errno = errno;
+
+    if(write(notify_pipe[1], "", 1) == -1)
+    {
+        /* Pipe already has a wakeup pending */
+    }
+    errno = saved_errno;
+}
+
+#pragma GCC diagnostic pop
+
+static void ring_init(ring *r, ring_cell *cells, size_t capacity)
+{
+    r->cells = cells;
+    r->mask  = capacity - 1;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    for(size_t i = 0; i < capacity; i++)
+    {
+        atomic_init(&cells[i].seq, i);
+    }
+}
+
+static int ring_push(ring *r, uint32_t value)
+{
+    ring_cell *cell;
+    size_t     pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    for(;;)
+    {
+        size_t    seq;
+        ptrdiff_t diff;
+
+        cell = &r->cells[pos & r->mask];
+        seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->value = value;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 0;
+}
+
+static int ring_pop(ring *r, uint32_t *value)
+{
+    ring_cell *cell;
+    size_t     pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    for(;;)
+    {
+        size_t    seq;
+        ptrdiff_t diff;
+
+        cell = &r->cells[pos & r->mask];
+        seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+        if(diff == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+
+    *value = cell->value;
+    atomic_store_explicit(&cell->seq, pos + r->mask + 1, memory_order_release);
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
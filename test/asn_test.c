@@ -0,0 +1,245 @@
+/*
+ * Feeds hand-built frames to decode_packet and checks each is accepted or
+ * refused with the expected code, then checks that COMPRESSED replies expand
+ * back to the replies they wrap. Every frame and block is copied to a heap
+ * block of exactly its length, so code that reads past it is caught when
+ * this is built with -fsanitize=address:
+ *
+ *   gcc -std=c17 -D_GNU_SOURCE -fsanitize=address -g -Iinclude test/asn_test.c \
+ *       src/asn.c src/asn_codec.c src/utf8.c src/compress.c -o asn_test
+ *
+ * Exits non-zero if any case fails.
+ */
+
+#include "../include/asn.h"
+#include "../include/asn_codec.h"
+#include "../include/compress.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A frame under construction */
+typedef struct frame
+{
+    uint8_t bytes[BATCHPACKETLEN];
+    int     len;
+} frame;
+
+static void start_frame(frame *f, uint8_t packet_type, uint8_t version, uint16_t sender_id);
+static void put(frame *f, const uint8_t bytes[], int len);
+static void put_str(frame *f, const char *str, int claimed_len);
+static void put_seq(frame *f, uint8_t packet_type, const frame *fields);
+static int  check(const char *name, const frame *f, int expected);
+static int  check_compressed(const char *name, int replies);
+
+int main(void)
+{
+    frame msg;
+    frame f;
+    int   failed = 0;
+
+    // ACC_EDIT, LST_GET and LST_RESPONSE are walked field by field on their own lengths
+    start_frame(&f, ACC_EDIT, CURRVER, 1);
+    put_str(&f, "name", -1);
+    put_str(&f, "value", -1);
+    failed += check("ACC_EDIT with two strings", &f, 0);
+
+    start_frame(&f, ACC_EDIT, CURRVER, 1);
+    put_str(&f, "name", -1);
+    put_str(&f, "value", UINT8_MAX);
+    failed += check("ACC_EDIT whose last string overruns the frame", &f, FIELDLENGTHOFZERO);
+
+    start_frame(&f, ACC_EDIT, CURRVER, 1);
+    put_str(&f, "name", -1);
+    put(&f, (const uint8_t[]){ASN_STR}, 1);
+    failed += check("ACC_EDIT ending in a bare tag", &f, FIELDLENGTHOFZERO);
+
+    // The same inside a BATCH, where the frame goes on past the message
+    start_frame(&msg, 0, 0, 0);
+    put_str(&msg, "name", -1);
+    put_str(&msg, "value", -1);
+    start_frame(&f, BATCH, BATCHVER, 1);
+    put_seq(&f, ACC_EDIT, &msg);
+    put_seq(&f, ACC_EDIT, &msg);
+    failed += check("BATCH of two ACC_EDITs", &f, 0);
+
+    start_frame(&msg, 0, 0, 0);
+    put_str(&msg, "name", -1);
+    put_str(&msg, "value", UINT8_MAX);
+    start_frame(&f, BATCH, BATCHVER, 1);
+    put_seq(&f, ACC_EDIT, &msg);
+    failed += check("BATCH holding an ACC_EDIT whose last string overruns the frame", &f, FIELDLENGTHOFZERO);
+
+    // Fits the frame, but reads into the next message
+    start_frame(&f, BATCH, BATCHVER, 1);
+    put_seq(&f, ACC_EDIT, &msg);
+    start_frame(&msg, 0, 0, 0);
+    for(int i = 0; i < 5; i++)
+    {
+        put_str(&msg, "padding padding padding padding padding padding padding", -1);
+    }
+    put_seq(&f, LST_GET, &msg);
+    failed += check("BATCH holding an ACC_EDIT whose string overruns its message", &f, FIELDLENGTHOFZERO);
+
+    start_frame(&msg, 0, 0, 0);
+    put(&msg, (const uint8_t[]){ASN_ENUM}, 1);
+    start_frame(&f, BATCH, BATCHVER, 1);
+    put_seq(&f, LST_GET, &msg);
+    put_seq(&f, ACC_EDIT, &msg);
+    failed += check("BATCH holding a LST_GET ending in a bare enum tag", &f, FIELDLENGTHOFZERO);
+
+    // What a COMPRESSVER client gets for a BATCH reply, expanded as it would expand it
+    failed += check_compressed("BATCH of 2 chat replies, too small to compress", 1);
+    failed += check_compressed("BATCH of 16 chat replies through COMPRESSED", 8);
+    failed += check_compressed("BATCH of 64 chat replies through COMPRESSED", 32);
+
+    printf("%d failed\n", failed);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Writes the header; its payload length is filled in by check */
+static void start_frame(frame *f, uint8_t packet_type, uint8_t version, uint16_t sender_id)
+{
+    header_t header = {packet_type, version, sender_id, 0};
+
+    memset(f, 0, sizeof(*f));
+    encode_header(f->bytes, &header);
+    f->len = HEADERLEN;
+}
+
+static void put(frame *f, const uint8_t bytes[], int len)
+{
+    memcpy(f->bytes + f->len, bytes, (size_t)len);
+    f->len += len;
+}
+
+/* An ASN_STR; claimed_len overrides the length octet when not -1 */
+static void put_str(frame *f, const char *str, int claimed_len)
+{
+    size_t len = strlen(str);
+
+    f->bytes[f->len]     = ASN_STR;
+    f->bytes[f->len + 1] = (uint8_t)(claimed_len < 0 ? (int)len : claimed_len);
+    memcpy(f->bytes + f->len + 2, str, len);
+    f->len += 2 + (int)len;
+}
+
+/* A BATCH message: ASN_SEQ, its length, its type and the fields after fields' header */
+static void put_seq(frame *f, uint8_t packet_type, const frame *fields)
+{
+    int len = 1 + fields->len - HEADERLEN;
+
+    f->bytes[f->len++] = ASN_SEQ;
+    if(len >= 0x80)
+    {
+        f->bytes[f->len++] = 0x81;
+    }
+    f->bytes[f->len++] = (uint8_t)len;
+    f->bytes[f->len++] = packet_type;
+    put(f, fields->bytes + HEADERLEN, fields->len - HEADERLEN);
+}
+
+static int check(const char *name, const frame *f, int expected)
+{
+    uint8_t  *exact;
+    header_t  header;
+    asn_batch batch;
+    uint16_t  payload_len = htons((uint16_t)(f->len - HEADERLEN));
+    int       result;
+
+    exact = (uint8_t *)malloc((size_t)f->len);
+    if(exact == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(exact, f->bytes, (size_t)f->len);
+    memcpy(exact + 4, &payload_len, sizeof(payload_len));
+
+    decode_header(exact, &header);
+    result = decode_packet(exact, &header, &batch);
+    free(exact);
+
+    if(result != expected)
+    {
+        fprintf(stderr, "FAIL %s: got %d, expected %d\n", name, result, expected);
+        return 1;
+    }
+    fprintf(stderr, "ok   %s\n", name);
+    return 0;
+}
+
+/*
+ * Builds a BATCH reply of a SYS_SUCCESS and a CHT_SEND per round, as the
+ * server answers a batch of chats, wraps it with encode_compressed, and
+ * expands the block with decompress_block. The expansion must match the
+ * batch's payload, and must be refused, not truncated, when it would not fit.
+ * A batch below COMPRESS_MIN_LEN is expected to be left alone.
+ */
+static int check_compressed(const char *name, int replies)
+{
+    uint8_t  batch[BATCHPACKETLEN];
+    uint8_t  packet[PACKETLEN];
+    uint8_t  wrapped[BATCHPACKETLEN];
+    uint8_t  expanded[BATCHPACKETLEN];
+    uint8_t *block;
+    header_t outer;
+    int      pos = HEADERLEN;
+    int      payload_len;
+    int      wrapped_len;
+    int      block_len;
+    int      expanded_len;
+    int      short_len;
+
+    for(int i = 0; i < replies; i++)
+    {
+        pos = encode_batch_append(batch, pos, packet, encode_sys_success_res(packet, CHT_SEND));
+        pos = encode_batch_append(batch, pos, packet, encode_cht_send(packet));
+    }
+    pos         = encode_batch_header(batch, pos);
+    payload_len = pos - HEADERLEN;
+    wrapped_len = encode_compressed(wrapped, batch, pos);
+    if(payload_len < COMPRESS_MIN_LEN)
+    {
+        if(wrapped_len != -1)
+        {
+            fprintf(stderr, "FAIL %s: a %d byte payload was compressed\n", name, payload_len);
+            return 1;
+        }
+        fprintf(stderr, "ok   %s\n", name);
+        return 0;
+    }
+
+    decode_header(wrapped, &outer);
+    if(wrapped_len <= HEADERLEN + CMPPREFIXLEN || outer.packet_type != COMPRESSED || wrapped[HEADERLEN] != BATCH || outer.payload_len != wrapped_len - HEADERLEN)
+    {
+        fprintf(stderr, "FAIL %s: not wrapped as a COMPRESSED BATCH (%d bytes)\n", name, wrapped_len);
+        return 1;
+    }
+
+    block_len = wrapped_len - HEADERLEN - CMPPREFIXLEN;
+    block     = (uint8_t *)malloc((size_t)block_len);
+    if(block == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(block, wrapped + HEADERLEN + CMPPREFIXLEN, (size_t)block_len);
+    expanded_len = decompress_block(block, block_len, expanded, payload_len);
+    short_len    = decompress_block(block, block_len, expanded + payload_len, payload_len - 1);
+    free(block);
+
+    if(expanded_len != payload_len || memcmp(expanded, batch + HEADERLEN, (size_t)payload_len) != 0)
+    {
+        fprintf(stderr, "FAIL %s: expanded to %d bytes, expected the %d byte payload\n", name, expanded_len, payload_len);
+        return 1;
+    }
+    if(short_len != -1)
+    {
+        fprintf(stderr, "FAIL %s: expanded into a buffer one byte short\n", name);
+        return 1;
+    }
+    fprintf(stderr, "ok   %s (%d -> %d bytes)\n", name, payload_len, block_len);
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Measures the reply compressor: how far it shrinks the payloads it is meant
+ * for and how fast it compresses and expands them. Each payload is also
+ * checked to expand back to itself. Then random input must fail the size
+ * cap, decompress_block is fed random garbage, and random low-entropy blocks
+ * must round-trip; build with -fsanitize=address to catch bad reads there:
+ *
+ *   gcc -std=c17 -D_GNU_SOURCE -O2 -Iinclude test/compress_bench.c \
+ *       src/asn.c src/asn_codec.c src/utf8.c src/compress.c -o compress_bench
+ *
+ * -i sets the timed iterations per payload. Exits non-zero if any check fails.
+ */
+
+#include "../include/asn.h"
+#include "../include/compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 20000
+#define LIST_LEN 3000     /* bytes of list entries, about what LST_RESPONSE carries */
+#define HISTORY_LEN 3800  /* bytes of chat history, about one stored segment */
+#define NAME_LEN 16
+#define RANDOM_LEN 2048
+#define GARBAGE_BLOCKS 200000
+#define GARBAGE_MAX_LEN 64
+#define ROUND_TRIPS 2000
+#define ROUND_TRIP_MAX_LEN 3000
+#define NSEC_PER_SEC 1000000000.0
+#define BYTES_PER_MB 1000000.0
+
+static int    bench(const char *name, const uint8_t src[], int len, int iterations);
+static int    build_batch(uint8_t payload[]);
+static int    build_list(uint8_t payload[]);
+static int    build_history(uint8_t payload[]);
+static int    check_random(void);
+static double now_sec(void);
+
+static const char *const names[] = {"alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi", "ivan", "judy"};
+static const char *const chats[] = {"see you at the meeting", "ok sounds good", "did you push the fix?", "lunch at noon?", "thanks!"};
+
+int main(int argc, char *argv[])
+{
+    uint8_t payload[COMPRESS_MAX_LEN];
+    int     iterations = DEFAULT_ITERATIONS;
+    int     failed     = 0;
+    int     opt;
+
+    while((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if(opt != 'i' || (iterations = atoi(optarg)) <= 0)
+        {
+            fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%-24s %5s    %5s %8s %14s %14s\n", "payload", "bytes", "out", "ratio", "compress MB/s", "expand MB/s");
+    failed += bench("BATCH, 32 chat replies", payload, build_batch(payload), iterations);
+    failed += bench("LST_RESPONSE-like list", payload, build_list(payload), iterations);
+    failed += bench("history-like segment", payload, build_history(payload), iterations);
+    failed += check_random();
+
+    printf("%d failed\n", failed);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Times compress_block and decompress_block over one payload and checks it comes back intact */
+static int bench(const char *name, const uint8_t src[], int len, int iterations)
+{
+    uint8_t packed[COMPRESS_MAX_LEN];
+    uint8_t expanded[COMPRESS_MAX_LEN];
+    int     packed_len   = -1;
+    int     expanded_len = -1;
+    double  start;
+    double  packed_sec;
+    double  expanded_sec;
+
+    start = now_sec();
+    for(int i = 0; i < iterations; i++)
+    {
+        packed_len = compress_block(src, len, packed, len - 1);
+    }
+    packed_sec = now_sec() - start;
+    if(packed_len < 0)
+    {
+        printf("%-24s %5d    does not shrink\n", name, len);
+        return 0;
+    }
+
+    start = now_sec();
+    for(int i = 0; i < iterations; i++)
+    {
+        expanded_len = decompress_block(packed, packed_len, expanded, (int)sizeof(expanded));
+    }
+    expanded_sec = now_sec() - start;
+    if(expanded_len != len || memcmp(expanded, src, (size_t)len) != 0)
+    {
+        printf("FAIL %s: expanded to %d bytes, expected %d\n", name, expanded_len, len);
+        return 1;
+    }
+
+    printf("%-24s %5d -> %5d %7.1f%% %14.0f %14.0f\n",
+           name,
+           len,
+           packed_len,
+           100.0 * packed_len / len,
+           (double)len * iterations / packed_sec / BYTES_PER_MB,
+           (double)len * iterations / expanded_sec / BYTES_PER_MB);
+    return 0;
+}
+
+/* The payload of a BATCH reply to 32 chats: a SYS_SUCCESS and the echoed CHT_SEND for each */
+static int build_batch(uint8_t payload[])
+{
+    uint8_t batch[BATCHPACKETLEN];
+    uint8_t packet[PACKETLEN];
+    int     pos = HEADERLEN;
+
+    for(int i = 0; i < 32; i++)    // NOLINT(readability-magic-numbers)
+    {
+        pos = encode_batch_append(batch, pos, packet, encode_sys_success_res(packet, CHT_SEND));
+        pos = encode_batch_append(batch, pos, packet, encode_cht_send(packet));
+    }
+    memcpy(payload, batch + HEADERLEN, (size_t)(pos - HEADERLEN));
+    return pos - HEADERLEN;
+}
+
+/* User entries as a list reply would carry them: id, name and status */
+static int build_list(uint8_t payload[])
+{
+    int len = 0;
+
+    for(int i = 0; len < LIST_LEN; i++)
+    {
+        char username[NAME_LEN];
+        int  name_len = snprintf(username, sizeof(username), "%s%d", names[i % 10], i / 10);    // NOLINT(readability-magic-numbers)
+
+        payload[len++] = ASN_INT;
+        payload[len++] = 2;
+        payload[len++] = (uint8_t)(i >> 8);    // NOLINT(readability-magic-numbers)
+        payload[len++] = (uint8_t)i;
+        payload[len++] = ASN_STR;
+        payload[len++] = (uint8_t)name_len;
+        memcpy(payload + len, username, (size_t)name_len);
+        len += name_len;
+        payload[len++] = ASN_ENUM;
+        payload[len++] = 1;
+        payload[len++] = (uint8_t)(i % 3);
+    }
+    return len;
+}
+
+/* Stored chats: timestamp, content and sender, a few people repeating themselves */
+static int build_history(uint8_t payload[])
+{
+    int len = 0;
+
+    for(int i = 0; len < HISTORY_LEN; i++)
+    {
+        char        timestamp[TIMESTRLEN + 1];
+        const char *chat     = chats[(i * 7) % 5];    // NOLINT(readability-magic-numbers)
+        const char *name     = names[i % 4];
+        size_t      chat_len = strlen(chat);
+        size_t      name_len = strlen(name);
+
+        snprintf(timestamp, sizeof(timestamp), "202503041%02d%02d0Z", i / 60 % 10, i % 60);    // NOLINT(readability-magic-numbers)
+        payload[len++] = ASN_TIME;
+        payload[len++] = TIMESTRLEN;
+        memcpy(payload + len, timestamp, TIMESTRLEN);
+        len += TIMESTRLEN;
+        payload[len++] = ASN_STR;
+        payload[len++] = (uint8_t)chat_len;
+        memcpy(payload + len, chat, chat_len);
+        len += (int)chat_len;
+        payload[len++] = ASN_STR;
+        payload[len++] = (uint8_t)name_len;
+        memcpy(payload + len, name, name_len);
+        len += (int)name_len;
+    }
+    return len;
+}
+
+/* Random input must not be sent compressed, garbage must not be expanded out of bounds, and low-entropy blocks must round-trip */
+static int check_random(void)
+{
+    uint8_t src[COMPRESS_MAX_LEN];
+    uint8_t packed[COMPRESS_MAX_LEN];
+    uint8_t expanded[COMPRESS_MAX_LEN];
+    int     failed = 0;
+
+    srand(1);
+    for(int i = 0; i < RANDOM_LEN; i++)
+    {
+        src[i] = (uint8_t)rand();
+    }
+    if(compress_block(src, RANDOM_LEN, packed, RANDOM_LEN - 1) != -1)
+    {
+        printf("FAIL random input fit under its own length\n");
+        failed++;
+    }
+
+    for(int block = 0; block < GARBAGE_BLOCKS; block++)
+    {
+        int len = rand() % GARBAGE_MAX_LEN;
+
+        for(int i = 0; i < len; i++)
+        {
+            src[i] = (uint8_t)rand();
+        }
+        decompress_block(src, len, expanded, (int)sizeof(expanded));
+    }
+
+    for(int block = 0; block < ROUND_TRIPS; block++)
+    {
+        int len = 1 + rand() % ROUND_TRIP_MAX_LEN;
+        int packed_len;
+
+        for(int i = 0; i < len; i++)
+        {
+            src[i] = (uint8_t)('a' + rand() % 4);
+        }
+        packed_len = compress_block(src, len, packed, (int)sizeof(packed));
+        if(packed_len < 0 || decompress_block(packed, packed_len, expanded, (int)sizeof(expanded)) != len || memcmp(expanded, src, (size_t)len) != 0)
+        {
+            printf("FAIL a %d byte block did not round-trip\n", len);
+            failed++;
+        }
+    }
+    printf("random input refused, %d garbage blocks expanded safely, %d blocks round-tripped\n", GARBAGE_BLOCKS, ROUND_TRIPS - failed);
+    return failed;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / NSEC_PER_SEC;
+}
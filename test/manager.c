@@ -0,0 +1,307 @@
+/*
+ * Stand-in server manager: accepts servers started with -m and prints the
+ * SVR_DIAGNOSTIC and SVR_LOG packets they report, with message rates worked
+ * out from successive reports.
+ */
+
+#include "../include/asn.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SERVERS 16
+#define BACKLOG 8
+#define BASE_TEN 10
+#define DEFAULT_PORT 9700
+#define ADDR_STR_LEN 32
+#define MSEC_PER_SEC 1000
+#define NSEC_PER_MSEC 1000000
+
+typedef struct server_link
+{
+    int            fd;
+    char           name[ADDR_STR_LEN];
+    size_t         held;
+    uint8_t        buf[BATCHPACKETLEN];
+    int            reported;
+    long           last_ms; /* when last arrived, for the message rate */
+    svr_diagnostic last;
+} server_link;
+
+static void           on_frame(server_link *link, const uint8_t frame[], const header_t *header);
+static void           on_message(server_link *link, uint8_t packet_type, const uint8_t frame[], int pos, int len);
+static void           read_link(server_link *link);
+static int            open_listener(const char *address, in_port_t port);
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static long           now_ms(void);
+static void           stop(int signum);
+
+static volatile sig_atomic_t running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+int main(int argc, char *argv[])
+{
+    static server_link links[MAX_SERVERS];
+    struct pollfd      fds[1 + MAX_SERVERS];
+    const char        *address = "127.0.0.1";
+    in_port_t          port    = DEFAULT_PORT;
+    int                listener;
+    int                opt;
+
+    while((opt = getopt(argc, argv, "ha:p:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+                address = optarg;
+                break;
+            case 'p':
+            {
+                char         *end;
+                unsigned long value = strtoul(optarg, &end, BASE_TEN);
+                if(*end != '\0' || value == 0 || value > UINT16_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Invalid port.");
+                }
+                port = (in_port_t)value;
+                break;
+            }
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            default:
+                usage(argv[0], EXIT_FAILURE, NULL);
+        }
+    }
+
+    listener = open_listener(address, port);
+    if(listener < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    for(size_t i = 0; i < MAX_SERVERS; i++)
+    {
+        links[i].fd = -1;
+    }
+    printf("Server manager listening on %s:%u\n", address, (unsigned int)port);
+    fflush(stdout);
+
+    while(running)
+    {
+        fds[0].fd     = listener;
+        fds[0].events = POLLIN;
+        for(size_t i = 0; i < MAX_SERVERS; i++)
+        {
+            fds[1 + i].fd     = links[i].fd;
+            fds[1 + i].events = POLLIN;
+        }
+        if(poll(fds, 1 + MAX_SERVERS, -1) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            struct sockaddr_in from;
+            socklen_t          from_len = sizeof(from);
+            int                fd       = accept(listener, (struct sockaddr *)&from, &from_len);
+            size_t             slot     = 0;
+
+            while(slot < MAX_SERVERS && links[slot].fd >= 0)
+            {
+                slot++;
+            }
+            if(fd >= 0 && slot == MAX_SERVERS)
+            {
+                close(fd);
+            }
+            else if(fd >= 0)
+            {
+                memset(&links[slot], 0, sizeof(links[slot]));
+                links[slot].fd = fd;
+                snprintf(links[slot].name, sizeof(links[slot].name), "%s:%u", inet_ntoa(from.sin_addr), (unsigned int)ntohs(from.sin_port));
+                printf("[%s] connected\n", links[slot].name);
+                fflush(stdout);
+            }
+        }
+
+        for(size_t i = 0; i < MAX_SERVERS; i++)
+        {
+            if(links[i].fd >= 0 && (fds[1 + i].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                read_link(&links[i]);
+            }
+        }
+    }
+
+    close(listener);
+    return EXIT_SUCCESS;
+}
+
+/* Reads what a server sent and handles each complete frame */
+static void read_link(server_link *link)
+{
+    ssize_t nread = read(link->fd, link->buf + link->held, sizeof(link->buf) - link->held);
+    size_t  pos   = 0;
+
+    if(nread <= 0)
+    {
+        printf("[%s] disconnected\n", link->name);
+        fflush(stdout);
+        close(link->fd);
+        link->fd = -1;
+        return;
+    }
+    link->held += (size_t)nread;
+
+    while(link->held - pos >= HEADERLEN)
+    {
+        header_t header;
+        size_t   len;
+
+        decode_header(link->buf + pos, &header);
+        len = HEADERLEN + (size_t)header.payload_len;
+        if(len > sizeof(link->buf))
+        {
+            fprintf(stderr, "[%s] frame too large, dropping the connection\n", link->name);
+            close(link->fd);
+            link->fd = -1;
+            return;
+        }
+        if(link->held - pos < len)
+        {
+            break;
+        }
+        on_frame(link, link->buf + pos, &header);
+        pos += len;
+    }
+    memmove(link->buf, link->buf + pos, link->held - pos);
+    link->held -= pos;
+}
+
+static void on_frame(server_link *link, const uint8_t frame[], const header_t *header)
+{
+    asn_batch batch;
+
+    if(decode_packet(frame, header, &batch) < 0)
+    {
+        fprintf(stderr, "[%s] undecodable packet type %u\n", link->name, header->packet_type);
+        return;
+    }
+    if(header->packet_type != BATCH)
+    {
+        on_message(link, header->packet_type, frame, HEADERLEN, header->payload_len);
+        return;
+    }
+    for(int i = 0; i < batch.count; i++)
+    {
+        on_message(link, batch.msgs[i].packet_type, frame, batch.msgs[i].offset, batch.msgs[i].len);
+    }
+}
+
+static void on_message(server_link *link, uint8_t packet_type, const uint8_t frame[], int pos, int len)
+{
+    if(packet_type == SVR_DIAGNOSTIC)
+    {
+        svr_diagnostic diag;
+        double         rate = 0;
+        long           now  = now_ms();
+
+        if(decode_svr_diagnostic(frame, pos, len, &diag) < 0)
+        {
+            return;
+        }
+        if(link->reported && now > link->last_ms)
+        {
+            rate = (double)(diag.messages - link->last.messages) * MSEC_PER_SEC / (double)(now - link->last_ms);
+        }
+        printf("[%s] up %us: %u online, %u messages (%.1f/s), %u logins, errors:", link->name, diag.uptime_sec, diag.users_online, diag.messages, rate, diag.logins);
+        for(int code = 1; code < SVR_ERROR_CODES; code++)
+        {
+            if(diag.errors[code] != 0)
+            {
+                printf(" %d x%u", -code, diag.errors[code]);
+            }
+        }
+        printf("\n");
+        link->last     = diag;
+        link->last_ms  = now;
+        link->reported = 1;
+    }
+    else if(packet_type == SVR_LOG)
+    {
+        char line[SVR_LOG_MAX + 1];
+        int  level;
+
+        if(decode_svr_log(frame, pos, len, &level, line, sizeof(line)) == 0)
+        {
+            printf("[%s] log %d: %s\n", link->name, level, line);
+        }
+    }
+    fflush(stdout);
+}
+
+static int open_listener(const char *address, in_port_t port)
+{
+    struct sockaddr_in addr;
+    int                optval = 1;
+    int                fd     = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if(fd == -1 || inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid address %s\n", address);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, BACKLOG) == -1)
+    {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+    fprintf(stderr, "Usage: %s [-h] [-a <address>] [-p <port>]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h            Display this help message\n", stderr);
+    fputs("  -a <address>  Address to listen on (default 127.0.0.1).\n", stderr);
+    fputs("  -p <port>     Port servers report to with -m (default 9700).\n", stderr);
+    exit(exit_code);
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * MSEC_PER_SEC + ts.tv_nsec / NSEC_PER_MSEC;
+}
+
+static void stop(int signum)
+{
+    (void)signum;
+    running = 0;
+}
@@ -0,0 +1,473 @@
+/*
+ * Replays a file recorded with the server's -k option against a server: one
+ * connection per recorded connection, opened, fed and closed in the order
+ * recorded, either at the recorded pace or with -F as fast as the server
+ * takes it. Replies are read and counted but not checked.
+ *
+ * Sender ids and logins are replayed as recorded, so the server under test
+ * should start from a copy of the user store the capture was taken against.
+ * The server records every password as CAPTURE_PASSWORD, so logins succeed
+ * only for accounts whose password that is, or that given with -W, which is
+ * sent in its place.
+ * Accounts created during the capture may get other ids when several are
+ * hashed at once, and resume tokens are not in the store, so requests that
+ * depend on them can be refused where they were served.
+ */
+
+#include "../include/asn.h"
+#include "../include/capture.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNS 1024
+#define BASE_TEN 10
+#define DEFAULT_PORT 8000
+#define LINGER_MS 1000 /* quiet allowed once everything is sent before giving up on replies */
+#define READ_CHUNK 4096
+#define USEC_PER_SEC 1000000L
+#define NSEC_PER_USEC 1000L
+#define USEC_PER_MSEC 1000L
+
+/* A recorded connection and the socket replaying it */
+typedef struct replay_conn
+{
+    uint32_t id; /* 0 once its close is replayed and it only awaits the server's */
+    int      fd;
+} replay_conn;
+
+/* What the run did, printed at the end */
+typedef struct replay_stats
+{
+    unsigned long packets;
+    unsigned long skipped; /* for connections the server had already closed */
+    unsigned long conns;
+    unsigned long reply_bytes;
+    unsigned long late;    /* packets sent more than a millisecond behind the recording */
+    uint64_t      last_usec; /* when the last reply or close came in */
+} replay_stats;
+
+static int            read_record(FILE *file, uint8_t *kind, uint32_t *id, uint64_t *usec, uint8_t frame[], size_t *len);
+static replay_conn   *find_conn(replay_conn conns[], uint32_t id);
+static int            find_conn_open(const replay_conn conns[]);
+static int            open_conn(const struct sockaddr_in *addr);
+static size_t         restore_password(uint8_t frame[], size_t len, const char *password);
+static int            send_frame(replay_conn conns[], replay_conn *conn, const uint8_t frame[], size_t len, replay_stats *stats);
+static int            drain(replay_conn conns[], int timeout_ms, const replay_conn *writer, replay_stats *stats);
+static void           wait_until(replay_conn conns[], uint64_t due_usec, replay_stats *stats);
+static uint64_t       now_usec(void);
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+
+int main(int argc, char *argv[])
+{
+    static replay_conn conns[MAX_CONNS];
+    static uint8_t     frame[BATCHPACKETLEN];
+    struct sockaddr_in addr;
+    replay_stats       stats;
+    const char        *address  = "127.0.0.1";
+    in_port_t          port     = DEFAULT_PORT;
+    int                fast     = 0;
+    const char        *password = NULL;
+    int                first    = 1;
+    uint64_t           offset   = 0; /* recorded time of the first record, against our clock */
+    uint64_t           started;
+    double             sent; /* seconds spent sending */
+    double             done; /* until the last reply, which is what a benchmark wants */
+    char               magic[CAPTURE_MAGIC_LEN];
+    FILE              *file;
+    int                opt;
+
+    while((opt = getopt(argc, argv, "ha:p:FW:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+                address = optarg;
+                break;
+            case 'p':
+            {
+                char         *end;
+                unsigned long value = strtoul(optarg, &end, BASE_TEN);
+                if(*end != '\0' || value == 0 || value > UINT16_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Invalid port.");
+                }
+                port = (in_port_t)value;
+                break;
+            }
+            case 'F':
+                fast = 1;
+                break;
+            case 'W':
+                if(optarg[0] == '\0' || strlen(optarg) > UINT8_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Invalid password.");
+                }
+                password = optarg;
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            default:
+                usage(argv[0], EXIT_FAILURE, NULL);
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0], EXIT_FAILURE, "Expected one capture file.");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if(inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    {
+        usage(argv[0], EXIT_FAILURE, "Invalid address.");
+    }
+
+    file = fopen(argv[optind], "rb");
+    if(file == NULL)
+    {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    if(fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0)
+    {
+        fprintf(stderr, "%s is not a capture file\n", argv[optind]);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    for(size_t i = 0; i < MAX_CONNS; i++)
+    {
+        conns[i].fd = -1;
+    }
+    started = now_usec();
+
+    for(;;)
+    {
+        uint8_t      kind;
+        uint32_t     id;
+        uint64_t     usec;
+        size_t       len;
+        replay_conn *conn;
+        int          res = read_record(file, &kind, &id, &usec, frame, &len);
+
+        if(res <= 0)
+        {
+            if(res < 0)
+            {
+                fprintf(stderr, "Capture ends mid-record, replayed what came before\n");
+            }
+            break;
+        }
+
+        // Records from different connections may be a few microseconds out of order; none is sent early
+        if(first)
+        {
+            offset = started - usec;
+            first  = 0;
+        }
+        if(!fast)
+        {
+            wait_until(conns, usec + offset, &stats);
+            if(now_usec() > usec + offset + USEC_PER_MSEC)
+            {
+                stats.late += (kind == CAPTURE_PACKET);
+            }
+        }
+
+        conn = find_conn(conns, id);
+        if(kind == CAPTURE_OPEN)
+        {
+            if(conn != NULL)
+            {
+                shutdown(conn->fd, SHUT_WR);    // the pid came round again without its close being recorded
+                conn->id = 0;
+            }
+            conn = find_conn(conns, 0);
+            if(conn == NULL)
+            {
+                fprintf(stderr, "More than %d connections open at once\n", MAX_CONNS);
+                break;
+            }
+            conn->fd = open_conn(&addr);
+            conn->id = id;
+            if(conn->fd < 0)
+            {
+                break;
+            }
+            stats.conns++;
+        }
+        else if(kind == CAPTURE_PACKET)
+        {
+            if(password != NULL)
+            {
+                len = restore_password(frame, len, password);
+            }
+            if(conn == NULL || send_frame(conns, conn, frame, len, &stats) < 0)
+            {
+                stats.skipped++;
+                continue;
+            }
+            stats.packets++;
+        }
+        else if(conn != NULL)
+        {
+            // Closing with replies unread would reset the connection and lose requests the server has yet to read
+            shutdown(conn->fd, SHUT_WR);
+            conn->id = 0;
+        }
+
+        // Keeps the replies moving so the server never blocks writing to a connection we are not reading
+        drain(conns, 0, NULL, &stats);
+    }
+    fclose(file);
+    sent = (double)(now_usec() - started) / USEC_PER_SEC;
+
+    // Until the server has closed every connection, or gone quiet on those it keeps
+    while(find_conn_open(conns) && drain(conns, LINGER_MS, NULL, &stats) > 0)
+    {
+    }
+    done = (stats.last_usec > started) ? (double)(stats.last_usec - started) / USEC_PER_SEC : sent;
+    printf("Replayed %lu packets on %lu connections: sent in %.3f s, answered in %.3f s (%.0f packets/s)\n", stats.packets, stats.conns, sent, done, (done > 0) ? (double)stats.packets / done : 0);
+    printf("%lu skipped, %lu late, %lu reply bytes\n", stats.skipped, stats.late, stats.reply_bytes);
+    for(size_t i = 0; i < MAX_CONNS; i++)
+    {
+        if(conns[i].fd >= 0)
+        {
+            close(conns[i].fd);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Returns 1 with the next record, 0 at the end of the file, -1 if it is cut short */
+static int read_record(FILE *file, uint8_t *kind, uint32_t *id, uint64_t *usec, uint8_t frame[], size_t *len)
+{
+    uint8_t  record[CAPTURE_RECORD_LEN];
+    uint32_t word;
+    size_t   got = fread(record, 1, sizeof(record), file);
+    header_t header;
+
+    if(got == 0)
+    {
+        return 0;
+    }
+    if(got != sizeof(record))
+    {
+        return -1;
+    }
+    *kind = record[0];
+    memcpy(&word, record + 1, sizeof(word));
+    *id = ntohl(word);
+    memcpy(&word, record + 1 + sizeof(word), sizeof(word));
+    *usec = (uint64_t)ntohl(word) << 32;
+    memcpy(&word, record + 1 + 2 * sizeof(word), sizeof(word));
+    *usec |= ntohl(word);
+    *len = 0;
+    if(*kind != CAPTURE_PACKET)
+    {
+        return 1;
+    }
+
+    if(fread(frame, 1, HEADERLEN, file) != HEADERLEN)
+    {
+        return -1;
+    }
+    decode_header(frame, &header);
+    if(header.payload_len > MAXBATCHPAYLOADLEN || fread(frame + HEADERLEN, 1, header.payload_len, file) != header.payload_len)
+    {
+        return -1;
+    }
+    *len = HEADERLEN + (size_t)header.payload_len;
+    return 1;
+}
+
+/* The open connection replaying id; id 0 finds a free slot */
+static replay_conn *find_conn(replay_conn conns[], uint32_t id)
+{
+    for(size_t i = 0; i < MAX_CONNS; i++)
+    {
+        if((id == 0) ? conns[i].fd < 0 : (conns[i].fd >= 0 && conns[i].id == id))
+        {
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+static int find_conn_open(const replay_conn conns[])
+{
+    for(size_t i = 0; i < MAX_CONNS; i++)
+    {
+        if(conns[i].fd >= 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int open_conn(const struct sockaddr_in *addr)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(fd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    if(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1)
+    {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Puts password in place of the placeholder a login or account creation was recorded with */
+static size_t restore_password(uint8_t frame[], size_t len, const char *password)
+{
+    header_t header;
+    size_t   pass_pos;
+    size_t   pass_len = strlen(password);
+
+    if((frame[0] != ACC_LOGIN && frame[0] != ACC_CREATE) || len < HEADERLEN + 2)
+    {
+        return len;
+    }
+    pass_pos = HEADERLEN + 2 + (size_t)frame[HEADERLEN + 1];
+    if(pass_pos + 2 + CAPTURE_PASSWORD_LEN != len || frame[pass_pos + 1] != CAPTURE_PASSWORD_LEN || memcmp(frame + pass_pos + 2, CAPTURE_PASSWORD, CAPTURE_PASSWORD_LEN) != 0)
+    {
+        return len;
+    }
+    decode_header(frame, &header);
+    frame[pass_pos + 1] = (uint8_t)pass_len;
+    memcpy(frame + pass_pos + 2, password, pass_len);
+    header.payload_len = (uint16_t)(pass_pos + 2 + pass_len - HEADERLEN);
+    encode_header(frame, &header);
+    return HEADERLEN + header.payload_len;
+}
+
+/* Sends without blocking, reading replies on every connection while conn's socket is full */
+static int send_frame(replay_conn conns[], replay_conn *conn, const uint8_t frame[], size_t len, replay_stats *stats)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t sent = send(conn->fd, frame + done, len - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if(sent > 0)
+        {
+            done += (size_t)sent;
+        }
+        else if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            drain(conns, -1, conn, stats);
+        }
+        else
+        {
+            return -1;
+        }
+        if(conn->fd < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads whatever replies have arrived, waiting up to timeout_ms (-1 for no
+ * limit) for the first. Also returns once writer, when given, can be written.
+ * A connection the server closed is closed here too, and the rest of its
+ * packets are skipped. Returns the number of sockets that were ready.
+ */
+static int drain(replay_conn conns[], int timeout_ms, const replay_conn *writer, replay_stats *stats)
+{
+    struct pollfd fds[MAX_CONNS];
+    uint8_t       chunk[READ_CHUNK];
+    int           ready;
+
+    for(size_t i = 0; i < MAX_CONNS; i++)
+    {
+        fds[i].fd      = conns[i].fd;
+        fds[i].events  = (short)((&conns[i] == writer) ? POLLIN | POLLOUT : POLLIN);
+        fds[i].revents = 0;
+    }
+    ready = poll(fds, MAX_CONNS, timeout_ms);
+    if(ready <= 0)
+    {
+        return 0;
+    }
+
+    for(size_t i = 0; i < MAX_CONNS; i++)
+    {
+        if(fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+        {
+            ssize_t got = recv(conns[i].fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+
+            if(got > 0)
+            {
+                stats->reply_bytes += (unsigned long)got;
+                stats->last_usec = now_usec();
+            }
+            else if(got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            {
+                close(conns[i].fd);
+                conns[i].fd      = -1;
+                stats->last_usec = now_usec();
+            }
+        }
+    }
+    return ready;
+}
+
+/* Keeps reading replies until due_usec on our clock */
+static void wait_until(replay_conn conns[], uint64_t due_usec, replay_stats *stats)
+{
+    uint64_t now = now_usec();
+
+    while(now < due_usec)
+    {
+        // poll sleeps in milliseconds; the last one is spun off so packets go out on time
+        uint64_t left = due_usec - now;
+
+        drain(conns, (left > USEC_PER_MSEC) ? (int)(left / USEC_PER_MSEC) - 1 : 0, NULL, stats);
+        now = now_usec();
+    }
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * USEC_PER_SEC + (uint64_t)ts.tv_nsec / NSEC_PER_USEC;
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+    fprintf(stderr, "Usage: %s [-h] [-a <address>] [-p <port>] [-F] [-W <password>] <capture>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h            Display this help message\n", stderr);
+    fputs("  -a <address>  Address of the server under test (default 127.0.0.1).\n", stderr);
+    fputs("  -p <port>     Its port (default 8000).\n", stderr);
+    fputs("  -F            Send as fast as the server takes it instead of at the recorded pace.\n", stderr);
+    fputs("  -W <password> Send this wherever the capture has the password placeholder.\n", stderr);
+    exit(exit_code);
+}
@@ -0,0 +1,213 @@
+/*
+ * Times the user store backends through their interface, without a server:
+ * inserting users, finding each by id and by name, then closing, reopening
+ * and scanning the store. With -j the inserts and lookups are split across
+ * that many forked processes, as the server's clients would make them, so
+ * the dbm backend's shard locks are contended. Run it in an empty directory,
+ * since it creates the store's files there and removes nothing:
+ *
+ *   gcc -std=c17 -D_GNU_SOURCE -O2 -Iinclude test/store_bench.c \
+ *       src/user_store_dbm.c src/user_store_log.c -lgdbm_compat -lgdbm -o store_bench
+ *   mkdir bench && cd bench && ../store_bench -s log -n 3000
+ *
+ * -s picks the backend (dbm or log) and -n the number of users; -F makes
+ * every write reach the disk before it returns, as the server's -F does.
+ * -S sets the dbm shard count, and -R reopens the store with another count
+ * at the end, timing the rebalance into it.
+ */
+
+#include "../include/user_store.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_USERS 3000
+#define MAX_WORKERS 64
+#define NSEC_PER_MSEC 1000000.0
+#define MSEC_PER_SEC 1000.0
+
+static int    run_workers(const user_store *store, int users, int workers, int (*work)(const user_store *store, int user_id));
+static int    insert_one(const user_store *store, int user_id);
+static int    lookup_one(const user_store *store, int user_id);
+static void   make_user(int user_id, user_obj *user);
+static void   visit_count(const user_obj *user, void *ctx);
+static double elapsed_ms(const struct timespec *start);
+
+int main(int argc, char *argv[])
+{
+    const user_store *store;
+    user_db_config    config = {"dbm", 0, 1};
+    struct timespec   start;
+    double            ms;
+    int               users     = DEFAULT_USERS;
+    int               workers   = 1;
+    int               rebalance = 0;
+    int               misses;
+    int               visited;
+    int               opt;
+
+    while((opt = getopt(argc, argv, "s:n:j:S:R:F")) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                config.store = optarg;
+                break;
+            case 'n':
+                users = atoi(optarg);
+                break;
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'S':
+                config.shards = (unsigned int)atoi(optarg);
+                break;
+            case 'R':
+                rebalance = atoi(optarg);
+                break;
+            case 'F':
+                config.sync_writes = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s dbm|log] [-n users] [-j processes] [-S shards] [-R shards] [-F]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    store = strcmp(config.store, "log") == 0 ? &user_store_log : &user_store_dbm;
+    if(users <= 0 || users > UINT16_MAX || workers <= 0 || workers > MAX_WORKERS || store->open(&config) == -1)
+    {
+        fprintf(stderr, "Cannot open the %s store for %d users\n", store->name, users);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(run_workers(store, users, workers, insert_one) != 0)
+    {
+        fprintf(stderr, "Inserts failed\n");
+        return EXIT_FAILURE;
+    }
+    ms = elapsed_ms(&start);
+    printf("%s: %d inserts       %8.1f ms %8.0f ops/s\n", store->name, users, ms, users * MSEC_PER_SEC / ms);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    misses = run_workers(store, users, workers, lookup_one);
+    ms     = elapsed_ms(&start);
+    printf("%s: %d lookups       %8.1f ms %8.0f ops/s (%d missed)\n", store->name, 2 * users, ms, 2 * users * MSEC_PER_SEC / ms, misses);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    store->close();
+    if(store->open(&config) == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    visited = 0;
+    store->scan(visit_count, &visited);
+    printf("%s: open and scan     %8.1f ms (%d users)\n", store->name, elapsed_ms(&start), visited);
+    store->close();
+
+    if(rebalance > 0)
+    {
+        config.shards = (unsigned int)rebalance;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(store->open(&config) == -1)
+        {
+            return EXIT_FAILURE;
+        }
+        printf("%s: reopen with %d shards %8.1f ms\n", store->name, rebalance, elapsed_ms(&start));
+        store->close();
+    }
+    return misses == 0 && visited == users ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Runs work for every user id, each worker process taking every workers'th
+ * one, and returns the failures. Only the workers are waited for: the log
+ * store's compactor is a child too.
+ */
+static int run_workers(const user_store *store, int users, int workers, int (*work)(const user_store *store, int user_id))
+{
+    pid_t pids[MAX_WORKERS];
+    int   failed = 0;
+    int   status;
+
+    for(int w = 0; w < workers; w++)
+    {
+        pid_t pid = fork();
+
+        if(pid == -1)
+        {
+            perror("fork");
+            return users;
+        }
+        if(pid == 0)
+        {
+            int own = 0;
+
+            for(int i = 1 + w; i <= users; i += workers)
+            {
+                own += work(store, i);
+            }
+            _exit(own > UINT8_MAX ? UINT8_MAX : own);
+        }
+        pids[w] = pid;
+    }
+    for(int w = 0; w < workers; w++)
+    {
+        if(waitpid(pids[w], &status, 0) == -1 || !WIFEXITED(status))
+        {
+            failed++;
+            continue;
+        }
+        failed += WEXITSTATUS(status);
+    }
+    return failed;
+}
+
+static int insert_one(const user_store *store, int user_id)
+{
+    user_obj user;
+
+    make_user(user_id, &user);
+    return store->insert(&user) != 0;
+}
+
+/* Finds the user by id and by name, as a login would */
+static int lookup_one(const user_store *store, int user_id)
+{
+    user_obj user;
+    user_obj found;
+    int      missed;
+
+    make_user(user_id, &user);
+    missed = store->find(user_id, &found) != 1;
+    missed += store->find_by_name(user.username, &found) != 1 || found.id != user_id;
+    return missed;
+}
+
+/* The same user every time for a given id; the hash is filler, nothing logs in */
+static void make_user(int user_id, user_obj *user)
+{
+    memset(user, 0, sizeof(*user));
+    user->id = user_id;
+    snprintf(user->username, sizeof(user->username), "bench%d", user_id);
+    memset(user->salt, user_id & 0xff, sizeof(user->salt));    // NOLINT(readability-magic-numbers)
+    memset(user->hash, user_id >> 8, sizeof(user->hash));      // NOLINT(readability-magic-numbers)
+}
+
+static void visit_count(const user_obj *user, void *ctx)
+{
+    (void)user;
+    (*(int *)ctx)++;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * MSEC_PER_SEC + (double)(now.tv_nsec - start->tv_nsec) / NSEC_PER_MSEC;
+}
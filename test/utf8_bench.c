@@ -0,0 +1,250 @@
+/*
+ * Measures what ASN_STR validation costs a maximum-length CHT_SEND: three
+ * 255 byte fields of mostly non-ASCII text, decoded whole and validated by
+ * each implementation the CPU supports, plus one field of plain ASCII. Every
+ * implementation is first checked to agree with the scalar loop on random
+ * strings, valid and not.
+ *
+ * The implementations are static, so this includes src/utf8.c rather than
+ * linking it:
+ *
+ *   gcc -std=c17 -D_GNU_SOURCE -O2 -Iinclude test/utf8_bench.c \
+ *       src/asn.c src/asn_codec.c src/compress.c -o utf8_bench
+ *
+ * -i sets the timed iterations. Exits non-zero if an implementation disagrees.
+ */
+
+#include "../src/utf8.c"
+#include "../include/asn.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 200000
+#define FIELD_LEN UINT8_MAX
+#define FIELDS 3
+#define AGREE_STRINGS 200000
+#define AGREE_MAX_LEN 300
+#define NSEC_PER_SEC 1000000000.0
+
+/* An implementation to time, and whether this CPU can run it */
+typedef struct impl
+{
+    const char *name;
+    check_fn    fn;
+    int         usable;
+} impl;
+
+static void   fill_field(uint8_t field[], const char *text);
+static int    random_string(uint8_t text[]);
+static int    check_agree(const impl impls[], size_t count);
+static double time_decode(const uint8_t frame[], int iterations);
+static double time_check(check_fn fn, uint8_t fields[][FIELD_LEN], int fields_len, int iterations);
+static double now_ns(void);
+
+/* Mixed scripts, so most bytes belong to two and three byte sequences */
+static const char phrase[] = "Grüße aus München, привет из Москвы, 日本語のテキスト, ";
+
+int main(int argc, char *argv[])
+{
+    impl         impls[] = {
+        {"scalar", check_scalar, 1},
+#ifdef UTF8_X86
+        {"sse4.1", check_sse4,   0},
+        {"avx2",   check_avx2,   0},
+#endif
+    };
+    const size_t count = sizeof(impls) / sizeof(impls[0]);
+    uint8_t      fields[FIELDS][FIELD_LEN];
+    uint8_t      ascii[1][FIELD_LEN];
+    uint8_t      frame[PACKETLEN];
+    asn_cht_send msg;
+    int          iterations = DEFAULT_ITERATIONS;
+    int          failed;
+    int          opt;
+
+    while((opt = getopt(argc, argv, "i:")) != -1)
+    {
+        if(opt != 'i' || (iterations = atoi(optarg)) <= 0)
+        {
+            fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+#ifdef UTF8_X86
+    __builtin_cpu_init();
+    impls[1].usable = __builtin_cpu_supports("sse4.1");
+    impls[2].usable = __builtin_cpu_supports("avx2");
+#endif
+
+    failed = check_agree(impls, count);
+
+    fill_field(fields[0], "20250304160000Z");
+    fill_field(fields[1], phrase);
+    fill_field(fields[2], phrase);
+    fill_field(ascii[0], "The quick brown fox jumps over the lazy dog. ");
+    msg.timestamp.text = fields[0];
+    msg.timestamp.len  = TIMESTRLEN;
+    msg.content.text   = fields[1];
+    msg.content.len    = FIELD_LEN;
+    msg.username.text  = fields[2];
+    msg.username.len   = FIELD_LEN;
+    asn_encode_cht_send(frame, CURRVER, 1, &msg);
+
+    // The frame must be accepted, or decode_packet would be timed up to its first error
+    if(check_scalar(fields[1], FIELD_LEN) != 0 || time_decode(frame, 1) < 0)
+    {
+        fprintf(stderr, "FAIL the CHT_SEND is not accepted\n");
+        return EXIT_FAILURE;
+    }
+
+    // Only the two text fields are long; the timestamp is left out of the validation timings
+    printf("Validating with %s\n", utf8_impl());
+    printf("%-44s %8.1f ns\n", "decode_packet, maximum-length CHT_SEND", time_decode(frame, iterations));
+    for(size_t i = 0; i < count; i++)
+    {
+        if(impls[i].usable)
+        {
+            printf("validation only, %-27s %8.1f ns\n", impls[i].name, time_check(impls[i].fn, fields + 1, FIELDS - 1, iterations));
+        }
+    }
+    printf("%-44s %8.1f ns\n", "validation only, one ASCII field", time_check(check, ascii, 1, iterations));
+
+    printf("%d failed\n", failed);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Repeats text to fill the field, blanking a character the end cuts through */
+static void fill_field(uint8_t field[], const char *text)
+{
+    size_t text_len = strlen(text);
+    size_t last     = FIELD_LEN - 1;
+    size_t seq;
+
+    for(size_t i = 0; i < FIELD_LEN; i++)
+    {
+        field[i] = (uint8_t)text[i % text_len];
+    }
+    while(last > 0 && (field[last] & CONT_MASK) == CONT_BITS)
+    {
+        last--;
+    }
+    seq = field[last] < ASCII_LIMIT ? 1 : (size_t)__builtin_clz((unsigned int)(uint8_t)~field[last] << 24);    // NOLINT(readability-magic-numbers)
+    if(last + seq > FIELD_LEN)
+    {
+        memset(field + last, ' ', FIELD_LEN - last);
+    }
+}
+
+/* Mostly well-formed text with the odd control, overlong, surrogate, out of range or cut sequence; returns the length */
+static int random_string(uint8_t text[])
+{
+    static const char *const good[] = {"a", "Z", " ", "\t", "é", "€", "😀"};
+    static const char *const bad[]  = {"\x01", "\x7f", "\xc2\x85", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82", "\x80", "\xff"};
+    int                      target = rand() % AGREE_MAX_LEN;
+    int                      len    = 0;
+
+    while(len < target)
+    {
+        // Rare enough that most strings are checked to the end, not just to their first error
+        const char *piece     = (rand() % 64 == 0) ? bad[rand() % (int)(sizeof(bad) / sizeof(bad[0]))] : good[rand() % (int)(sizeof(good) / sizeof(good[0]))];    // NOLINT(readability-magic-numbers)
+        size_t      piece_len = strlen(piece);
+
+        if(len + (int)piece_len > AGREE_MAX_LEN)
+        {
+            break;
+        }
+        memcpy(text + len, piece, piece_len);
+        len += (int)piece_len;
+    }
+    return len;
+}
+
+/* Every usable implementation must give the scalar loop's answer; returns the disagreements */
+static int check_agree(const impl impls[], size_t count)
+{
+    uint8_t text[AGREE_MAX_LEN];
+    int     failed = 0;
+    int     valid  = 0;
+
+    srand(1);
+    for(int n = 0; n < AGREE_STRINGS; n++)
+    {
+        int len      = random_string(text);
+        int expected = check_scalar(text, (size_t)len);
+
+        valid += expected == 0;
+        for(size_t i = 1; i < count; i++)
+        {
+            if(impls[i].usable && impls[i].fn(text, (size_t)len) != expected)
+            {
+                fprintf(stderr, "FAIL %s disagrees with scalar on a %d byte string\n", impls[i].name, len);
+                failed++;
+            }
+        }
+    }
+    printf("%d random strings (%d valid) checked against scalar\n", AGREE_STRINGS, valid);
+    return failed;
+}
+
+/* decode_packet prints what it decodes, so stdout goes to /dev/null while it is timed; -1 if the frame is refused */
+static double time_decode(const uint8_t frame[], int iterations)
+{
+    header_t  header;
+    asn_batch batch;
+    double    start;
+    double    elapsed;
+    int       saved;
+    int       null_fd;
+    int       result = 0;
+
+    fflush(stdout);
+    saved   = dup(STDOUT_FILENO);
+    null_fd = open("/dev/null", O_WRONLY);
+    if(saved == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1)
+    {
+        perror("time_decode");
+        exit(EXIT_FAILURE);
+    }
+    close(null_fd);
+
+    decode_header(frame, &header);
+    start = now_ns();
+    for(int i = 0; i < iterations; i++)
+    {
+        result |= decode_packet(frame, &header, &batch);
+    }
+    elapsed = now_ns() - start;
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return result == 0 ? elapsed / iterations : -1.0;
+}
+
+static double time_check(check_fn fn, uint8_t fields[][FIELD_LEN], int fields_len, int iterations)
+{
+    volatile int sink = 0;
+    double       start;
+
+    start = now_ns();
+    for(int i = 0; i < iterations; i++)
+    {
+        for(int f = 0; f < fields_len; f++)
+        {
+            sink += fn(fields[f], FIELD_LEN);
+        }
+    }
+    (void)sink;
+    return (now_ns() - start) / iterations;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * NSEC_PER_SEC + (double)ts.tv_nsec;
+}